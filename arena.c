@@ -0,0 +1,154 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* region allocation.  Objects which live until the end of the assembly
+ * are allocated from the global arena of the context.  Every stack level
+ * has an arena as well, for local labels and macro arguments, which is
+ * released when the level is popped off.  Memory in an arena is never
+ * freed separately.  Released blocks are kept by their arena, so pushing
+ * and popping stack levels doesn't call malloc and free all the time.  */
+
+/* size of normal blocks.  Larger allocations get a block of their own. */
+#define ARENA_BLOCK_SIZE 0x10000
+
+struct arena_block
+{
+  struct arena_block *next;
+  size_t size;			/* usable size */
+};
+
+/* alignment for all allocations */
+union arena_align
+{
+  long l;
+  double d;
+  void *p;
+};
+
+#define ARENA_ALIGN(n) (((n) + sizeof (union arena_align) - 1) \
+			& ~(sizeof (union arena_align) - 1))
+
+/* size of the block header, rounded up so the data is aligned */
+#define ARENA_HEADER ARENA_ALIGN (sizeof (struct arena_block))
+
+static struct arena_block *
+new_block (struct arena *a, size_t size)
+{
+  struct arena_block *b;
+  if (size == ARENA_BLOCK_SIZE && a->spare)
+    {
+      b = a->spare;
+      a->spare = b->next;
+      return b;
+    }
+  b = malloc (ARENA_HEADER + size);
+  if (!b)
+    return NULL;
+  b->size = size;
+  return b;
+}
+
+/* allocate size bytes from an arena.  Returns NULL if there is no memory. */
+void *
+arena_alloc (struct arena *a, size_t size)
+{
+  struct arena_block *b;
+  char *ret;
+  size = ARENA_ALIGN (size);
+  if (size <= a->left)
+    {
+      ret = a->ptr;
+      a->ptr += size;
+      a->left -= size;
+      return ret;
+    }
+  if (size > ARENA_BLOCK_SIZE / 4)
+    {
+      /* give it a block of its own, and keep using the current block */
+      if (!(b = new_block (a, size)))
+	return NULL;
+      if (a->blocks)
+	{
+	  b->next = a->blocks->next;
+	  a->blocks->next = b;
+	}
+      else
+	{
+	  b->next = NULL;
+	  a->blocks = b;
+	}
+      return (char *) b + ARENA_HEADER;
+    }
+  if (!(b = new_block (a, ARENA_BLOCK_SIZE)))
+    return NULL;
+  b->next = a->blocks;
+  a->blocks = b;
+  ret = (char *) b + ARENA_HEADER;
+  a->ptr = ret + size;
+  a->left = ARENA_BLOCK_SIZE - size;
+  return ret;
+}
+
+/* copy a string into an arena */
+char *
+arena_strdup (struct arena *a, const char *s)
+{
+  size_t len = strlen (s) + 1;
+  char *ret = arena_alloc (a, len);
+  if (ret)
+    memcpy (ret, s, len);
+  return ret;
+}
+
+/* release everything which was allocated from an arena */
+void
+arena_release (struct arena *a)
+{
+  struct arena_block *b, *next;
+  for (b = a->blocks; b; b = next)
+    {
+      next = b->next;
+      if (b->size == ARENA_BLOCK_SIZE)
+	{
+	  b->next = a->spare;
+	  a->spare = b;
+	}
+      else
+	free (b);
+    }
+  a->blocks = NULL;
+  a->ptr = NULL;
+  a->left = 0;
+}
+
+/* release an arena, and give all its memory back to the system */
+void
+arena_free_all (struct arena *a)
+{
+  struct arena_block *next;
+  arena_release (a);
+  for (; a->spare; a->spare = next)
+    {
+      next = a->spare->next;
+      free (a->spare);
+    }
+}
@@ -0,0 +1,415 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Generator of the benchmark corpus.  Every case is a large synthetic
+ * source which stresses one part of the assembler.  The sources only
+ * depend on the scale and the seed, so results of different versions
+ * and machines can be compared.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* lines per case at scale 1 */
+#define LINES 100000
+/* depth of the include chain; the assembler allows 200 levels */
+#define INCLUDE_DEPTH 150
+
+static const char *dir;
+static unsigned long seed;
+
+/* the random generator is part of the corpus, so it is not the one of
+ * the C library */
+static unsigned long
+next_random (void)
+{
+  seed = (seed * 1103515245UL + 12345UL) & 0xffffffffUL;
+  return seed >> 8;
+}
+
+static unsigned
+random_below (unsigned n)
+{
+  return next_random () % n;
+}
+
+static FILE *
+create (const char *name)
+{
+  char *path = malloc (strlen (dir) + strlen (name) + 2);
+  FILE *f;
+  if (!path)
+    {
+      fprintf (stderr, "gen: out of memory\n");
+      exit (1);
+    }
+  sprintf (path, "%s/%s", dir, name);
+  if (!(f = fopen (path, "w")))
+    {
+      fprintf (stderr, "gen: unable to create %s: %s\n", path,
+	       strerror (errno));
+      exit (1);
+    }
+  free (path);
+  return f;
+}
+
+static void
+finish (FILE * f)
+{
+  if (ferror (f) || fclose (f))
+    {
+      fprintf (stderr, "gen: error writing corpus: %s\n", strerror (errno));
+      exit (1);
+    }
+}
+
+/* instructions with all kinds of operands.  %b is a byte, %w a word and
+ * %d an index displacement.  */
+static const char *const instructions[] = {
+  "ld a,%b", "ld b,c", "ld hl,%w", "ld de,%w", "ld (%w),hl", "ld sp,(%w)",
+  "ld (ix+%d),%b", "ld e,(iy+%d)", "ld ixh,%b", "ld (hl),%b", "ld r,a",
+  "add a,(iy+%d)", "adc a,%b", "sub (hl)", "sbc hl,de", "and %b",
+  "xor %b", "or c", "cp (ix+%d)", "inc (hl)", "dec ix", "ex de,hl",
+  "ex (sp),iy", "exx", "push bc", "pop af", "rlc (ix+%d)", "sla d",
+  "srl (hl)", "bit 3,(hl)", "set 7,a", "res 0,(iy+%d)", "out (%b),a",
+  "in a,(%b)", "im 1", "ldir", "cpdr", "neg", "daa", "rrd", "nop",
+  "jr nz,$+2", "djnz $+2", "jp (hl)", "call z,%w", "ret nc", "rst 38h"
+};
+
+/* write an instruction with random operands */
+static void
+instruction (FILE * f)
+{
+  const char *p;
+  p = instructions[random_below (sizeof (instructions)
+				 / sizeof (instructions[0]))];
+  putc ('\t', f);
+  for (; *p; ++p)
+    {
+      if (*p != '%')
+	{
+	  putc (*p, f);
+	  continue;
+	}
+      switch (*++p)
+	{
+	case 'b':
+	  fprintf (f, "%u", random_below (256));
+	  break;
+	case 'w':
+	  fprintf (f, "0x%04x", random_below (0x10000));
+	  break;
+	case 'd':
+	  fprintf (f, "%d", (int) random_below (256) - 128);
+	  break;
+	}
+    }
+  putc ('\n', f);
+}
+
+/* instruction-dense code, with comments like real sources have */
+static void
+gen_insn (unsigned long lines)
+{
+  FILE *f = create ("insn.asm");
+  unsigned long i;
+  for (i = 0; i < lines; ++i)
+    {
+      /* keep addresses below 64k */
+      if (!(i % 16384))
+	fputs ("\torg 0\n", f);
+      if (!random_below (8))
+	fputs ("; a comment line\n", f);
+      instruction (f);
+    }
+  finish (f);
+}
+
+/* the name of label n.  The names are not in order, like in real
+ * sources, so they don't all hash alike.  */
+static void
+label (FILE * f, const char *prefix, unsigned long n)
+{
+  fprintf (f, "%s%04lx_%lu", prefix, (n * 2654435761UL >> 12) & 0xffff, n);
+}
+
+/* many labels, used after they are defined */
+static void
+gen_labels (unsigned long lines)
+{
+  FILE *f = create ("labels.asm");
+  unsigned long i;
+  for (i = 0; i < lines; ++i)
+    {
+      if (!(i % 16384))
+	fputs ("\torg 0\n", f);
+      label (f, "l", i);
+      switch (i ? random_below (4) : 0)
+	{
+	case 0:
+	  fputs (":\tnop\n", f);
+	  break;
+	case 1:
+	  fputs (":\tld hl,", f);
+	  label (f, "l", random_below (i));
+	  putc ('\n', f);
+	  break;
+	case 2:
+	  fputs (":\tdw ", f);
+	  label (f, "l", random_below (i));
+	  fputs (" - ", f);
+	  label (f, "l", random_below (i));
+	  putc ('\n', f);
+	  break;
+	default:
+	  fputs (":\tequ ", f);
+	  label (f, "l", random_below (i));
+	  fputs (" + 1\n", f);
+	  break;
+	}
+    }
+  finish (f);
+}
+
+/* code which uses labels before they are defined, so everything is a
+ * reference */
+static void
+gen_forward (unsigned long lines)
+{
+  FILE *f = create ("forward.asm");
+  unsigned long i;
+  unsigned kind;
+  for (i = 0; i < lines; ++i)
+    {
+      unsigned long to = i + 1 + random_below (1000);
+      if (!(i % 16384))
+	fputs ("\torg 0\n", f);
+      label (f, "f", i);
+      kind = random_below (4);
+      /* a relative jump can't cross an org */
+      if (kind == 3 && i % 16384 + 9 >= 16384)
+	kind = 0;
+      switch (kind)
+	{
+	case 0:
+	  fputs (":\tjp ", f);
+	  break;
+	case 1:
+	  fputs (":\tld bc,", f);
+	  break;
+	case 2:
+	  fputs (":\tdw ", f);
+	  break;
+	default:
+	  /* close, so it is in range of a relative jump */
+	  to = i + 1 + random_below (8);
+	  fputs (":\tjr ", f);
+	  break;
+	}
+      label (f, "f", to < lines ? to : lines);
+      putc ('\n', f);
+    }
+  label (f, "f", lines);
+  fputs (":\tnop\n", f);
+  finish (f);
+}
+
+/* macros with local labels, which are used many times */
+static void
+gen_macro (unsigned long lines)
+{
+  FILE *f = create ("macro.asm");
+  unsigned long i;
+  /* the addresses are labels, so every macro has one argument */
+  fputs ("copy:\tmacro COUNT\n"
+	 "\tld hl,source\n"
+	 "\tld de,target\n"
+	 "\tld bc,COUNT\n"
+	 ".loop:\tldi\n"
+	 "\tjp pe,.loop\n"
+	 "\tendm\n"
+	 "wait:\tmacro DELAY\n"
+	 "\tld b,DELAY\n"
+	 ".again:\tdjnz .again\n"
+	 "\tjr .done\n"
+	 "\tnop\n"
+	 ".done:\tnop\n"
+	 "\tendm\n"
+	 "fill:\tmacro VALUE\n"
+	 "\tld hl,target\n"
+	 "\tld (hl),VALUE\n"
+	 "\tcopy 255\n"
+	 "\tendm\n"
+	 "source:\tequ 0x4000\n"
+	 "target:\tequ 0x8000\n", f);
+  /* every use expands to about 5 lines */
+  for (i = 0; i < lines / 5; ++i)
+    {
+      if (!(i % 2048))
+	fputs ("\torg 0\n", f);
+      switch (random_below (3))
+	{
+	case 0:
+	  fprintf (f, "\tcopy %u\n", random_below (0x1000));
+	  break;
+	case 1:
+	  fprintf (f, "\twait %u\n", random_below (256));
+	  break;
+	default:
+	  fprintf (f, "\tfill %u\n", random_below (256));
+	  break;
+	}
+    }
+  finish (f);
+}
+
+/* a deep chain of include files, which is included many times */
+static void
+gen_include (unsigned long lines)
+{
+  FILE *f = create ("include.asm");
+  unsigned long i, j, reps = lines / (INCLUDE_DEPTH * 10);
+  char name[32];
+  for (i = 0; i < (reps ? reps : 1); ++i)
+    fputs ("\torg 0\n\tinclude \"include_0.asm\"\n", f);
+  finish (f);
+  for (i = 0; i < INCLUDE_DEPTH; ++i)
+    {
+      sprintf (name, "include_%lu.asm", i);
+      f = create (name);
+      /* the local labels of the including files are visible */
+      fprintf (f, ".here%lu:\tjr .here%lu\n", i, i);
+      for (j = 0; j < 8; ++j)
+	instruction (f);
+      if (i + 1 < INCLUDE_DEPTH)
+	fprintf (f, "\tinclude \"include_%lu.asm\"\n", i + 1);
+      finish (f);
+    }
+}
+
+/* large tables of bytes, words and strings */
+static void
+gen_data (unsigned long lines)
+{
+  FILE *f = create ("data.asm");
+  unsigned long i;
+  unsigned j;
+  fputs ("table:\n", f);
+  for (i = 0; i < lines; ++i)
+    {
+      switch (random_below (4))
+	{
+	case 0:
+	case 1:
+	  fputs ("\tdb ", f);
+	  for (j = 0; j < 16; ++j)
+	    fprintf (f, j ? ", 0x%02x" : "0x%02x", random_below (256));
+	  break;
+	case 2:
+	  fputs ("\tdw ", f);
+	  for (j = 0; j < 8; ++j)
+	    fprintf (f, j ? ", %u" : "%u", random_below (0x10000));
+	  break;
+	default:
+	  fputs ("\tdb \"", f);
+	  for (j = 0; j < 24; ++j)
+	    putc ('a' + random_below (26), f);
+	  fputs ("\", 13, 10, 0, table & 0xff, table >> 8", f);
+	  break;
+	}
+      putc ('\n', f);
+    }
+  finish (f);
+}
+
+/* a few lines of megabytes each, like generated data tables.  The time
+ * to assemble them must grow linearly with the scale.  */
+static void
+gen_longline (unsigned long lines)
+{
+  FILE *f = create ("longline.asm");
+  unsigned long i;
+  fputs ("\tdb ", f);
+  for (i = 0; i < lines * 5; ++i)
+    fprintf (f, i ? ", 0x%02x" : "0x%02x", random_below (256));
+  fputs ("\n\tdw ", f);
+  for (i = 0; i < lines * 2; ++i)
+    fprintf (f, i ? ", %u" : "%u", random_below (0x10000));
+  fputs ("\n\tdb \"", f);
+  for (i = 0; i < lines * 20; ++i)
+    putc ('a' + random_below (26), f);
+  /* every item is a reference */
+  fputs ("\"\n\tdw ", f);
+  for (i = 0; i < lines; ++i)
+    fprintf (f, i ? ", later + %u" : "later + %u", random_below (256));
+  fputs ("\nlater:\tequ 0x1234\n", f);
+  finish (f);
+}
+
+static const struct
+{
+  const char *name;
+  void (*generate) (unsigned long lines);
+} cases[] = {
+  {"insn", gen_insn},
+  {"labels", gen_labels},
+  {"forward", gen_forward},
+  {"macro", gen_macro},
+  {"include", gen_include},
+  {"data", gen_data},
+  {"longline", gen_longline}
+};
+
+int
+main (int argc, char **argv)
+{
+  unsigned long scale = 1, start;
+  unsigned i;
+  int a;
+  seed = 1;
+  for (a = 1; a + 1 < argc && argv[a][0] == '-'; a += 2)
+    {
+      if (!strcmp (argv[a], "-s"))
+	scale = strtoul (argv[a + 1], NULL, 0);
+      else if (!strcmp (argv[a], "-r"))
+	seed = strtoul (argv[a + 1], NULL, 0);
+      else
+	break;
+    }
+  if (a + 1 != argc || !scale)
+    {
+      fprintf (stderr, "Usage: %s [-s scale] [-r seed] directory\n"
+	       "Write the benchmark corpus to directory.\n", argv[0]);
+      return 1;
+    }
+  dir = argv[a];
+  start = seed;
+  for (i = 0; i < sizeof (cases) / sizeof (cases[0]); ++i)
+    {
+      /* every case has its own sequence, so they don't change when a
+       * case is changed or added */
+      seed = start + i;
+      cases[i].generate (LINES * scale);
+      printf ("%s\n", cases[i].name);
+    }
+  return 0;
+}
@@ -0,0 +1,207 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Benchmark harness.  It runs the assembler on every case of the
+ * corpus a number of times, and writes the median and 95th percentile
+ * of the wall and cpu time, and the peak memory, as JSON on stdout.  */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/* the result of one run */
+struct sample
+{
+  double wall, cpu;		/* milliseconds */
+  long rss;			/* peak resident memory in kilobytes */
+  int status;			/* exit code, or -1 if it was killed */
+};
+
+static double
+milliseconds (const struct timeval *tv)
+{
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+/* run the assembler once, with its output thrown away */
+static void
+run_once (char **argv, struct sample *s)
+{
+  struct timeval start, end;
+  struct rusage usage;
+  int status, null;
+  pid_t pid;
+  gettimeofday (&start, NULL);
+  pid = fork ();
+  if (pid < 0)
+    {
+      fprintf (stderr, "run: unable to fork: %s\n", strerror (errno));
+      exit (1);
+    }
+  if (!pid)
+    {
+      null = open ("/dev/null", O_WRONLY);
+      if (null >= 0)
+	{
+	  dup2 (null, 1);
+	  dup2 (null, 2);
+	}
+      execv (argv[0], argv);
+      _exit (127);
+    }
+  /* this is the only child, so wait3 gives its usage */
+  if (wait3 (&status, 0, &usage) != pid)
+    {
+      fprintf (stderr, "run: unable to wait: %s\n", strerror (errno));
+      exit (1);
+    }
+  gettimeofday (&end, NULL);
+  s->wall = milliseconds (&end) - milliseconds (&start);
+  s->cpu = milliseconds (&usage.ru_utime) + milliseconds (&usage.ru_stime);
+  s->rss = usage.ru_maxrss;
+  s->status = WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+}
+
+static int
+compare_double (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* sort n values, and write their median and 95th percentile (nearest
+ * rank) */
+static void
+write_stats (const char *name, double *values, unsigned n)
+{
+  unsigned p95 = (95 * n + 99) / 100;
+  qsort (values, n, sizeof (double), compare_double);
+  printf ("\"%s\": {\"median\": %.3f, \"p95\": %.3f, \"min\": %.3f, "
+	  "\"max\": %.3f}", name, n % 2 ? values[n / 2]
+	  : (values[n / 2 - 1] + values[n / 2]) / 2, values[p95 - 1],
+	  values[0], values[n - 1]);
+}
+
+static long
+file_size (const char *name)
+{
+  struct stat st;
+  return stat (name, &st) ? -1 : (long) st.st_size;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned runs = 10, warmup = 1, i, r;
+  static char include_option[] = "-I", output_option[] = "-o";
+  char *assembler, *corpus;
+  double *wall, *cpu;
+  struct sample s;
+  int a;
+  for (a = 1; a + 1 < argc && argv[a][0] == '-'; a += 2)
+    {
+      if (!strcmp (argv[a], "-n"))
+	runs = strtoul (argv[a + 1], NULL, 0);
+      else if (!strcmp (argv[a], "-w"))
+	warmup = strtoul (argv[a + 1], NULL, 0);
+      else
+	break;
+    }
+  if (a + 3 > argc || !runs)
+    {
+      fprintf (stderr, "Usage: %s [-n runs] [-w warmup runs] assembler "
+	       "corpus case...\n"
+	       "Time the assembler on the cases of the corpus, which was "
+	       "written by gen.\n", argv[0]);
+      return 1;
+    }
+  assembler = argv[a++];
+  corpus = argv[a++];
+  wall = malloc (runs * sizeof (double));
+  cpu = malloc (runs * sizeof (double));
+  if (!wall || !cpu)
+    {
+      fprintf (stderr, "run: out of memory\n");
+      return 1;
+    }
+  printf ("{\n  \"assembler\": \"%s\",\n  \"runs\": %u,\n  \"cases\": [",
+	  assembler, runs);
+  for (i = 0; a < argc; ++a, ++i)
+    {
+      char *args[7], *input, *output;
+      long rss = 0;
+      int status = 0;
+      input = malloc (strlen (corpus) + strlen (argv[a]) + 6);
+      output = malloc (strlen (corpus) + strlen (argv[a]) + 6);
+      if (!input || !output)
+	{
+	  fprintf (stderr, "run: out of memory\n");
+	  return 1;
+	}
+      sprintf (input, "%s/%s.asm", corpus, argv[a]);
+      sprintf (output, "%s/%s.bin", corpus, argv[a]);
+      args[0] = assembler;
+      args[1] = include_option;
+      args[2] = corpus;
+      args[3] = input;
+      args[4] = output_option;
+      args[5] = output;
+      args[6] = NULL;
+      for (r = 0; r < warmup + runs; ++r)
+	{
+	  run_once (args, &s);
+	  if (s.status)
+	    status = s.status;
+	  if (r < warmup)
+	    continue;
+	  wall[r - warmup] = s.wall;
+	  cpu[r - warmup] = s.cpu;
+	  if (s.rss > rss)
+	    rss = s.rss;
+	}
+      if (status)
+	fprintf (stderr, "run: %s failed with status %d\n", argv[a],
+		 status);
+      printf ("%s\n    {\"name\": \"%s\", \"status\": %d, "
+	      "\"input_bytes\": %ld, \"output_bytes\": %ld,\n     ",
+	      i ? "," : "", argv[a], status, file_size (input),
+	      file_size (output));
+      write_stats ("wall_ms", wall, runs);
+      printf (",\n     ");
+      write_stats ("cpu_ms", cpu, runs);
+      printf (",\n     \"peak_rss_kb\": %ld}", rss);
+      free (input);
+      free (output);
+    }
+  printf ("\n  ]\n}\n");
+  free (wall);
+  free (cpu);
+  return 0;
+}
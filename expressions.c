@@ -35,52 +35,44 @@
  * ~ + - (unary)  rd_factor
  */
 
-static int do_rd_expr (const char **p, char delimiter, int *valid, int level,
-		       int *check, int print_errors);
+static int do_rd_expr (struct z80asm *z, const char **p, char delimiter,
+		       int *valid, int level, int *check, int print_errors,
+		       struct expr_code *code);
 
 static int
-rd_number (const char **p, const char **endp, int base)
+rd_number (struct z80asm *z, const char **p, const char **endp, int base)
 {
-  int result = 0, i;
+  /* unsigned, so long numbers wrap instead of overflowing */
+  unsigned result = 0;
+  int i;
   char *c, num[] = "0123456789abcdefghijklmnopqrstuvwxyz";
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read number of base %d"
-	     "(string=%s).\n", stack[sp].line, addr, base, *p);
   num[base] = '\0';
   *p = delspc (*p);
   while (**p && (c = strchr (num, tolower (**p))))
     {
       i = c - num;
-      if (verbose >= 7)
-	fprintf (stderr, "%5d (0x%04x): Digit found:%1x.\n", stack[sp].line,
-		 addr, i);
       result = result * base + i;
       (*p)++;
     }
   if (endp)
     *endp = *p;
   *p = delspc (*p);
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_number returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
+  TRACE (z, Z80ASM_TRACE_LEXER, TRACE_NUMBER, result, base, NULL);
   return result;
 }
 
 static int
-rd_otherbasenumber (const char **p, int *valid, int print_errors)
+rd_otherbasenumber (struct z80asm *z, const char **p, int *valid,
+		    int print_errors)
 {
   char c;
-  if (verbose >= 6)
-    fprintf (stderr,
-	     "%5d (0x%04x): Starting to read basenumber (string=%s).\n",
-	     stack[sp].line, addr, *p);
   (*p)++;
   if (!**p)
     {
       if (valid)
 	*valid = 0;
       else if (print_errors)
-	printerr (1, "unexpected end of line after `@'\n");
+	printerr (z, 1, "unexpected end of line after `@'\n");
       return 0;
     }
   if (**p == '0' || !isalnum (**p))
@@ -88,31 +80,28 @@ rd_otherbasenumber (const char **p, int *valid, int print_errors)
       if (valid)
 	*valid = 0;
       else if (print_errors)
-	printerr (1, "base must be between 1 and z\n");
+	printerr (z, 1, "base must be between 1 and z\n");
       return 0;
     }
+  /* c is the highest digit, so @9 is decimal and @f hexadecimal */
   c = **p;
   (*p)++;
-  if (isalpha (**p))
-    return rd_number (p, NULL, tolower (c) - 'a' + 1);
-  return rd_number (p, NULL, c - '0' + 1);
+  if (isalpha ((unsigned char) c))
+    return rd_number (z, p, NULL, tolower (c) - 'a' + 11);
+  return rd_number (z, p, NULL, c - '0' + 1);
 }
 
 int
-rd_character (const char **p, int *valid, int print_errors)
+rd_character (struct z80asm *z, const char **p, int *valid, int print_errors)
 {
   int i;
-  if (verbose >= 6)
-    fprintf (stderr,
-	     "%5d (0x%04x): Starting to read character (string=%s).\n",
-	     stack[sp].line, addr, *p);
   i = **p;
   if (!i)
     {
       if (valid)
 	*valid = 0;
       else if (print_errors)
-	printerr (1, "unexpected end of line in string constant\n");
+	printerr (z, 1, "unexpected end of line in string constant\n");
       return 0;
     }
   if (i == '\\')
@@ -158,13 +147,13 @@ rd_character (const char **p, int *valid, int print_errors)
 	      if (valid)
 		*valid = 0;
 	      else if (print_errors)
-		printerr (1, "empty literal character\n");
+		printerr (z, 1, "empty literal character\n");
 	      return 0;
 	    case 0:
 	      if (valid)
 		*valid = 0;
 	      else if (print_errors)
-		printerr (1, "unexpected end of line after "
+		printerr (z, 1, "unexpected end of line after "
 			  "backslash in string constant\n");
 	      return 0;
 	    default:
@@ -175,119 +164,183 @@ rd_character (const char **p, int *valid, int print_errors)
     }
   else
     (*p)++;
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_character returned %d (%c).\n",
-	     stack[sp].line, addr, i, i);
+  TRACE (z, Z80ASM_TRACE_LEXER, TRACE_CHARACTER, i, 0, NULL);
   return i;
 }
 
+/* try to compute the value of a label which was defined with equ.  If
+ * it is already being computed, it is used in its own definition, and
+ * it stays invalid.  */
+static void
+compute_label (struct z80asm *z, struct label *l)
+{
+  if (l->busy)
+    return;
+  l->busy = 1;
+  compute_ref (z, l->ref, 1);
+  l->busy = 0;
+}
+
+/* look for a label in a table.  If it is found, but its value cannot be
+ * computed (yet), it is returned in *ret, but 0 is returned. */
 static int
-check_label (struct label *labels, const char **p, struct label **ret,
-	     struct label **previous, int force_skip)
+check_label (struct z80asm *z, struct label_table *table, const char *name,
+	     unsigned len, unsigned hash, struct label **ret)
 {
   struct label *l;
-  const char *c;
-  unsigned s2;
-  *p = delspc (*p);
-  for (c = *p; isalnum (*c) || *c == '_' || *c == '.'; ++c)
+  l = find_label (z, table, name, len, hash);
+  if (!l)
+    return 0;
+  *ret = l;
+  /* if label is not valid, compute it */
+  if (l->ref)
     {
-    }
-  s2 = c - *p;
-  for (l = labels; l; l = l->next)
-    {
-      unsigned s1, s;
-      int cmp;
-      s1 = strlen (l->name);
-      s = s1 < s2 ? s1 : s2;
-      cmp = strncmp (l->name, *p, s);
-      if (cmp > 0 || (cmp == 0 && s1 > s))
+      compute_label (z, l);
+      if (!l->ref->done)
 	{
-	  if (force_skip)
-	    *p = c;
+	  /* label was not valid, and isn't computable.  tell the
+	   * caller that it doesn't exist, so it will try again later.
+	   * Set ret to show actual existence.  */
 	  return 0;
 	}
-      if (cmp < 0 || s2 > s)
-	{
-	  if (previous)
-	    *previous = l;
-	  continue;
-	}
-      *p = c;
-      /* if label is not valid, compute it */
-      if (l->ref)
-	{
-	  compute_ref (l->ref, 1);
-	  if (!l->ref->done)
-	    {
-	      /* label was not valid, and isn't computable.  tell the
-	       * caller that it doesn't exist, so it will try again later.
-	       * Set ret to show actual existence.  */
-	      if (verbose >= 6)
-		fprintf (stderr,
-			 "%5d (0x%04x): returning invalid label %s.\n",
-			 stack[sp].line, addr, l->name);
-	      *ret = l;
-	      return 0;
-	    }
-	}
-      *ret = l;
-      return 1;
     }
-  if (force_skip)
-    *p = c;
-  return 0;
+  return 1;
 }
 
 int
-rd_label (const char **p, int *exists, struct label **previous, int level,
+rd_label (struct z80asm *z, const char **p, int *exists, int level,
 	  int print_errors)
 {
   struct label *l = NULL;
-  int s;
+  const char *name, *c;
+  unsigned len, hash;
+  int s, found;
   if (exists)
     *exists = 0;
-  if (previous)
-    *previous = NULL;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read label (string=%s).\n",
-	     stack[sp].line, addr, *p);
-  for (s = level; s >= 0; --s)
-    {
-      if (check_label (stack[s].labels, p, &l,
-		       (**p == '.' && s == sp) ? previous : NULL, 0))
-	break;
-    }
-  if (s < 0)
-    {
-      /* not yet found */
-      const char *old_p = *p;
-      if (!check_label (firstlabel, p, &l, **p != '.' ? previous : NULL, 1))
-	{
-	  /* label does not exist, or is invalid.  This is an error if there
-	   * is no existance check.  */
-	  if (!exists && print_errors)
-	    printerr (1, "using undefined label %.*s\n", *p - old_p, old_p);
-	  /* Return a value to discriminate between non-existing and invalid */
-	  if (verbose >= 7)
-	    fprintf (stderr, "rd_label returns invalid value\n");
-	  return l != NULL;
-	}
+  name = delspc (*p);
+  for (c = name; IS_LABEL_CHAR (*c); ++c)
+    {
+    }
+  *p = c;
+  len = c - name;
+  hash = hash_label (name, len);
+  /* local labels are searched from the innermost level out, then the
+   * global labels.  The first label with the name is used, even if its
+   * value isn't known yet.  */
+  found = 0;
+  for (s = level; s >= 0 && !l; --s)
+    found = check_label (z, &z->stack[s].labels, name, len, hash, &l);
+  if (!l)
+    found = check_label (z, &z->globallabels, name, len, hash, &l);
+  if (!found)
+    {
+      /* label does not exist, or is invalid.  This is an error if there
+       * is no existance check.  */
+      if (!exists && print_errors)
+	printerr (z, 1, "using undefined label %.*s\n", (int) len, name);
+      /* Return a value to discriminate between non-existing and invalid */
+      TRACE (z, Z80ASM_TRACE_LABELS, TRACE_LOOKUP, 0, l ? 0 : -1,
+	     l ? l->name : name);
+      return l != NULL;
     }
   if (exists)
     *exists = 1;
-  if (verbose >= 7)
-    fprintf (stderr, "rd_label returns valid value 0x%x\n", l->value);
+  if (l->reloc)
+    ++z->num_relocs;
+  TRACE (z, Z80ASM_TRACE_LABELS, TRACE_LOOKUP, l->value, 1, l->name);
   return l->value;
 }
 
+/* add an operation to the compiled code, if code is being compiled */
+static void
+emit (struct expr_code *code, enum expr_opcode op, int arg, int pops,
+      int pushes)
+{
+  if (!code || code->failed)
+    return;
+  if (code->num_ops == code->max_ops)
+    {
+      unsigned size = code->max_ops ? 2 * code->max_ops : 16;
+      struct expr_op *ops = realloc (code->ops, size * sizeof (*ops));
+      if (!ops)
+	{
+	  code->failed = 1;
+	  return;
+	}
+      code->ops = ops;
+      code->max_ops = size;
+    }
+  code->ops[code->num_ops].op = op;
+  code->ops[code->num_ops].arg = arg;
+  code->num_ops++;
+  code->depth += pushes - pops;
+  if (code->depth > code->max_depth)
+    code->max_depth = code->depth;
+  if (code->max_depth > MAX_EXPR_DEPTH)
+    code->failed = 1;
+}
+
+/* return a constant, and emit it */
+static int
+emit_const (struct expr_code *code, int value)
+{
+  emit (code, OP_CONST, value, 0, 1);
+  return value;
+}
+
+/* emit an operation which uses the label at name, of length len */
+static void
+emit_label (struct expr_code *code, enum expr_opcode op, const char *name,
+	    unsigned len)
+{
+  struct expr_slot *slot;
+  if (!code || code->failed)
+    return;
+  if (code->num_slots == code->max_slots)
+    {
+      unsigned size = code->max_slots ? 2 * code->max_slots : 4;
+      struct expr_slot *slots = realloc (code->slots,
+					 size * sizeof (*slots));
+      if (!slots)
+	{
+	  code->failed = 1;
+	  return;
+	}
+      code->slots = slots;
+      code->max_slots = size;
+    }
+  slot = &code->slots[code->num_slots];
+  slot->offset = name - code->input;
+  slot->len = len;
+  slot->hash = hash_label (name, len);
+  slot->label = NULL;
+  emit (code, op, code->num_slots++, 0, 1);
+}
+
+/* emit unary operators which were read before a value */
+static void
+emit_unary (struct expr_code *code, int sign, int not)
+{
+  if (sign < 0)
+    emit (code, OP_NEG, 0, 1, 1);
+  if (not)
+    emit (code, OP_NOT, 0, 1, 1);
+}
+
+/* the expression can not be compiled, so it must be read from its text */
+static void
+fail_code (struct expr_code *code)
+{
+  if (code)
+    code->failed = 1;
+}
+
 static int
-rd_value (const char **p, int *valid, int level, int *check, int print_errors)
+rd_value (struct z80asm *z, const char **p, int *valid, int level, int *check,
+	  int print_errors, struct expr_code *code)
 {
   int sign = 1, not = 0, base, v;
   const char *p0, *p1, *p2;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read value (string=%s).\n",
-	     stack[sp].line, addr, *p);
   *p = delspc (*p);
   while (**p && strchr ("+-~", **p))
     {
@@ -306,21 +359,33 @@ rd_value (const char **p, int *valid, int level, int *check, int print_errors)
 
   switch (**p)
     {
-      int exist, retval;
+      int exist, retval, char_valid;
       char quote;
       int dummy_check;
     case '(':
       (*p)++;
       dummy_check = 0;
-      retval = not ^ (sign * do_rd_expr (p, ')', valid, level, &dummy_check,
-					 print_errors));
-      ++*p;
+      retval = not ^ (sign * do_rd_expr (z, p, ')', valid, level, &dummy_check,
+					 print_errors, code));
+      if (**p != ')')
+	{
+	  /* the value and code are used as if it was there, so a
+	   * reference doesn't report it again */
+	  *check = 0;
+	  if (print_errors)
+	    printerr (z, 1, "missing closing parenthesis\n");
+	}
+      emit_unary (code, sign, not);
+      /* don't go past the end of an unterminated line */
+      if (**p)
+	++*p;
       return retval;
     case '0':
       if ((*p)[1] == 'x')
 	{
 	  (*p) += 2;
-	  return not ^ (sign * rd_number (p, NULL, 0x10));
+	  return emit_const (code, not ^ (sign * rd_number (z, p, NULL,
+							    0x10)));
 	}
       base = 8;		/* If first digit it 0, assume octal unless suffix */
       /* fall through */
@@ -334,7 +399,7 @@ rd_value (const char **p, int *valid, int level, int *check, int print_errors)
     case '8':
     case '9':
       p0 = *p;
-      rd_number (p, &p1, 36);	/* Advance to end of numeric string */
+      rd_number (z, p, &p1, 36);	/* Advance to end of numeric string */
       p1--;			/* Last character in numeric string */
       switch (*p1)
 	{
@@ -360,49 +425,73 @@ rd_value (const char **p, int *valid, int level, int *check, int print_errors)
 	  p1++;
 	  break;
 	}
-      v = rd_number (&p0, &p2, base);
+      v = rd_number (z, &p0, &p2, base);
       if (p1 != p2)
 	{
+	  fail_code (code);
 	  if (valid)
 	    *valid = 0;
 	  else if (print_errors)
-	    printerr (1, "invalid character in number: \'%c\'\n", *p2);
+	    printerr (z, 1, "invalid character in number: \'%c\'\n", *p2);
 	}
-      return not ^ (sign * v);
+      return emit_const (code, not ^ (sign * v));
     case '$':
       ++*p;
       *p = delspc (*p);
       p0 = *p;
-      v = rd_number (&p0, &p2, 0x10);
-      if (p2 == *p)
+      v = rd_number (z, &p0, &p2, 0x10);
+      if (p2 != *p)
 	{
-	  v = baseaddr;
+	  *p = p2;
+	  return emit_const (code, not ^ (sign * v));
 	}
-      else
-	*p = p2;
-      return not ^ (sign * v);
+      /* the address moves with the object */
+      if (z->addr_reloc)
+	++z->num_relocs;
+      emit (code, OP_ADDR, 0, 0, 1);
+      emit_unary (code, sign, not);
+      return not ^ (sign * z->baseaddr);
     case '%':
       (*p)++;
-      return not ^ (sign * rd_number (p, NULL, 2));
+      return emit_const (code, not ^ (sign * rd_number (z, p, NULL, 2)));
     case '\'':
     case '"':
       quote = **p;
       ++*p;
-      retval = not ^ (sign * rd_character (p, valid, print_errors));
+      char_valid = 1;
+      retval = not ^ (sign * rd_character (z, p, valid ? &char_valid : NULL,
+					   print_errors));
+      if (!char_valid)
+	{
+	  fail_code (code);
+	  *valid = 0;
+	}
       if (**p != quote)
 	{
+	  fail_code (code);
 	  if (valid)
 	    *valid = 0;
 	  else if (print_errors)
-	    printerr (1, "missing closing quote (%c)\n", quote);
+	    printerr (z, 1, "missing closing quote (%c)\n", quote);
 	  return 0;
 	}
       ++*p;
-      return retval;
+      return emit_const (code, retval);
     case '@':
-      return not ^ (sign * rd_otherbasenumber (p, valid, print_errors));
+      char_valid = 1;
+      retval = not ^ (sign * rd_otherbasenumber (z, p, valid ? &char_valid
+						  : NULL, print_errors));
+      if (!char_valid)
+	{
+	  fail_code (code);
+	  *valid = 0;
+	}
+      return emit_const (code, retval);
     case '?':
-      rd_label (p, &exist, NULL, level, 0);
+      p0 = delspc (*p);
+      rd_label (z, p, &exist, level, 0);
+      emit_label (code, OP_EXISTS, p0, *p - p0);
+      emit_unary (code, sign, not);
       return not ^ (sign * exist);
     case '&':
       {
@@ -422,67 +511,89 @@ rd_value (const char **p, int *valid, int level, int *check, int print_errors)
 	    base = 2;
 	    break;
 	  default:
+	    fail_code (code);
 	    if (valid)
 	      *valid = 0;
 	    else if (print_errors)
-	      printerr (1, "invalid literal starting with &%c\n", **p);
+	      printerr (z, 1, "invalid literal starting with &%c\n", **p);
 	    return 0;
 	  }
 	++*p;
-	return not ^ (sign * rd_number (p, NULL, base));
+	return emit_const (code, not ^ (sign * rd_number (z, p, NULL, base)));
       }
     default:
       {
 	int value;
 	exist = 1;
-	value = rd_label (p, valid ? &exist : NULL, NULL, level, print_errors);
+	p0 = delspc (*p);
+	value = rd_label (z, p, valid ? &exist : NULL, level, print_errors);
 	if (!exist)
 	  *valid = 0;
+	emit_label (code, OP_LABEL, p0, *p - p0);
+	emit_unary (code, sign, not);
 	return not ^ (sign * value);
       }
     }
 }
 
+/* compute a / b, or a % b if modulo is set.  Dividing by zero is an
+ * error, unless *valid is already cleared by a label which is not known
+ * yet; without print_errors it is left to the next time it is computed.
+ * INT_MIN / -1 doesn't fit, and traps on most machines.  */
 static int
-rd_factor (const char **p, int *valid, int level, int *check, int print_errors)
+divide (struct z80asm *z, int a, int b, int modulo, int *valid,
+	int print_errors)
+{
+  if (!b)
+    {
+      if (valid && (!*valid || !print_errors))
+	*valid = 0;
+      else if (print_errors)
+	printerr (z, 1, "division by zero\n");
+      return 0;
+    }
+  if (b == -1)
+    return modulo ? 0 : (int) -(unsigned) a;
+  return modulo ? a % b : a / b;
+}
+
+static int
+rd_factor (struct z80asm *z, const char **p, int *valid, int level, int *check,
+	   int print_errors, struct expr_code *code)
 {
   /* read a factor of an expression */
-  int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read factor (string=%s).\n",
-	     stack[sp].line, addr, *p);
-  result = rd_value (p, valid, level, check, print_errors);
+  int result, divisor, modulo;
+  result = rd_value (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
-  while (**p == '*' || **p == '/')
+  while (**p == '*' || **p == '/' || **p == '%')
     {
       *check = 0;
       if (**p == '*')
 	{
 	  (*p)++;
-	  result *= rd_value (p, valid, level, check, print_errors);
+	  result *= rd_value (z, p, valid, level, check, print_errors, code);
+	  emit (code, OP_MUL, 0, 2, 1);
 	}
-      else if (**p == '/')
+      else
 	{
+	  modulo = **p == '%';
 	  (*p)++;
-	  result /= rd_value (p, valid, level, check, print_errors);
+	  divisor = rd_value (z, p, valid, level, check, print_errors, code);
+	  emit (code, modulo ? OP_MOD : OP_DIV, 0, 2, 1);
+	  result = divide (z, result, divisor, modulo, valid, print_errors);
 	}
       *p = delspc (*p);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_factor returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_term (const char **p, int *valid, int level, int *check, int print_errors)
+rd_term (struct z80asm *z, const char **p, int *valid, int level, int *check,
+	 int print_errors, struct expr_code *code)
 {
   /* read a term of an expression */
   int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read term (string=%s).\n",
-	     stack[sp].line, addr, *p);
-  result = rd_factor (p, valid, level, check, print_errors);
+  result = rd_factor (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   while (**p == '+' || **p == '-')
     {
@@ -490,30 +601,26 @@ rd_term (const char **p, int *valid, int level, int *check, int print_errors)
       if (**p == '+')
 	{
 	  (*p)++;
-	  result += rd_factor (p, valid, level, check, print_errors);
+	  result += rd_factor (z, p, valid, level, check, print_errors, code);
+	  emit (code, OP_ADD, 0, 2, 1);
 	}
       else if (**p == '-')
 	{
 	  (*p)++;
-	  result -= rd_factor (p, valid, level, check, print_errors);
+	  result -= rd_factor (z, p, valid, level, check, print_errors, code);
+	  emit (code, OP_SUB, 0, 2, 1);
 	}
       *p = delspc (*p);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_term returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_shift (const char **p, int *valid, int level, int *check,
-	       int print_errors)
+rd_expr_shift (struct z80asm *z, const char **p, int *valid, int level,
+	       int *check, int print_errors, struct expr_code *code)
 {
   int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read shift expression "
-	     "(string=%s).\n", stack[sp].line, addr, *p);
-  result = rd_term (p, valid, level, check, print_errors);
+  result = rd_term (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   while ((**p == '<' || **p == '>') && (*p)[1] == **p)
     {
@@ -521,71 +628,68 @@ rd_expr_shift (const char **p, int *valid, int level, int *check,
       if (**p == '<')
 	{
 	  (*p) += 2;
-	  result <<= rd_term (p, valid, level, check, print_errors);
+	  result <<= rd_term (z, p, valid, level, check, print_errors, code);
+	  emit (code, OP_SHL, 0, 2, 1);
 	}
       else if (**p == '>')
 	{
 	  (*p) += 2;
-	  result >>= rd_term (p, valid, level, check, print_errors);
+	  result >>= rd_term (z, p, valid, level, check, print_errors, code);
+	  emit (code, OP_SHR, 0, 2, 1);
 	}
       *p = delspc (*p);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_shift returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_unequal (const char **p, int *valid, int level, int *check,
-		 int print_errors)
+rd_expr_unequal (struct z80asm *z, const char **p, int *valid, int level,
+		 int *check, int print_errors, struct expr_code *code)
 {
-  int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read "
-	     "unequality expression (string=%s).\n", stack[sp].line, addr,
-	     *p);
-  result = rd_expr_shift (p, valid, level, check, print_errors);
+  int result, other;
+  result = rd_expr_shift (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '<' && (*p)[1] == '=')
     {
       *check = 0;
       (*p) += 2;
-      return result <= rd_expr_unequal (p, valid, level, check, print_errors);
+      other = rd_expr_unequal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_LE, 0, 2, 1);
+      return result <= other;
     }
   else if (**p == '>' && (*p)[1] == '=')
     {
       *check = 0;
       (*p) += 2;
-      return result >= rd_expr_unequal (p, valid, level, check, print_errors);
+      other = rd_expr_unequal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_GE, 0, 2, 1);
+      return result >= other;
     }
   if (**p == '<' && (*p)[1] != '<')
     {
       *check = 0;
       (*p)++;
-      return result < rd_expr_unequal (p, valid, level, check, print_errors);
+      other = rd_expr_unequal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_LT, 0, 2, 1);
+      return result < other;
     }
   else if (**p == '>' && (*p)[1] != '>')
     {
       *check = 0;
       (*p)++;
-      return result > rd_expr_unequal (p, valid, level, check, print_errors);
+      other = rd_expr_unequal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_GT, 0, 2, 1);
+      return result > other;
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_shift returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_equal (const char **p, int *valid, int level, int *check,
-	       int print_errors)
+rd_expr_equal (struct z80asm *z, const char **p, int *valid, int level,
+	       int *check, int print_errors, struct expr_code *code)
 {
-  int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read equality epression "
-	     "(string=%s).\n", stack[sp].line, addr, *p);
-  result = rd_expr_unequal (p, valid, level, check, print_errors);
+  int result, other;
+  result = rd_expr_unequal (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '=')
     {
@@ -593,163 +697,472 @@ rd_expr_equal (const char **p, int *valid, int level, int *check,
       ++*p;
       if (**p == '=')
 	++ * p;
-      return result == rd_expr_equal (p, valid, level, check, print_errors);
+      other = rd_expr_equal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_EQ, 0, 2, 1);
+      return result == other;
     }
   else if (**p == '!' && (*p)[1] == '=')
     {
       *check = 0;
       (*p) += 2;
-      return result != rd_expr_equal (p, valid, level, check, print_errors);
+      other = rd_expr_equal (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_NE, 0, 2, 1);
+      return result != other;
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_equal returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_and (const char **p, int *valid, int level, int *check,
-	     int print_errors)
+rd_expr_and (struct z80asm *z, const char **p, int *valid, int level,
+	     int *check, int print_errors, struct expr_code *code)
 {
   int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read and expression "
-	     "(string=%s).\n", stack[sp].line, addr, *p);
-  result = rd_expr_equal (p, valid, level, check, print_errors);
+  result = rd_expr_equal (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '&')
     {
       *check = 0;
       (*p)++;
-      result &= rd_expr_and (p, valid, level, check, print_errors);
+      result &= rd_expr_and (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_AND, 0, 2, 1);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_expr_and returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_xor (const char **p, int *valid, int level, int *check,
-	     int print_errors)
+rd_expr_xor (struct z80asm *z, const char **p, int *valid, int level,
+	     int *check, int print_errors, struct expr_code *code)
 {
   int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read xor expression "
-	     "(string=%s).\n", stack[sp].line, addr, *p);
-  result = rd_expr_and (p, valid, level, check, print_errors);
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_expr_xor: rd_expr_and returned %d "
-	     "(%04x).\n", stack[sp].line, addr, result, result);
+  result = rd_expr_and (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '^')
     {
       *check = 0;
       (*p)++;
-      result ^= rd_expr_xor (p, valid, level, check, print_errors);
+      result ^= rd_expr_xor (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_XOR, 0, 2, 1);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_expr_xor returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-rd_expr_or (const char **p, int *valid, int level, int *check,
-	    int print_errors)
+rd_expr_or (struct z80asm *z, const char **p, int *valid, int level,
+	    int *check, int print_errors, struct expr_code *code)
 {
   int result;
-  if (verbose >= 6)
-    fprintf (stderr, "%5d (0x%04x): Starting to read or expression "
-	     "(string=%s).\n", stack[sp].line, addr, *p);
-  result = rd_expr_xor (p, valid, level, check, print_errors);
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_expr_or: rd_expr_xor returned %d "
-	     "(%04x).\n", stack[sp].line, addr, result, result);
+  result = rd_expr_xor (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '|')
     {
       *check = 0;
       (*p)++;
-      result |= rd_expr_or (p, valid, level, check, print_errors);
+      result |= rd_expr_or (z, p, valid, level, check, print_errors, code);
+      emit (code, OP_OR, 0, 2, 1);
     }
-  if (verbose >= 7)
-    fprintf (stderr, "%5d (0x%04x): rd_expr_or returned %d (%04x).\n",
-	     stack[sp].line, addr, result, result);
   return result;
 }
 
 static int
-do_rd_expr (const char **p, char delimiter, int *valid, int level, int *check,
-	    int print_errors)
+do_rd_expr (struct z80asm *z, const char **p, char delimiter, int *valid,
+	    int level, int *check, int print_errors, struct expr_code *code)
 {
   /* read an expression. delimiter can _not_ be '?' */
   int result = 0;
-  if (verbose >= 6)
-    fprintf (stderr,
-	     "%5d (0x%04x): Starting to read expression "
-	     "(string=%s, delimiter=%c).\n", stack[sp].line, addr, *p,
-	     delimiter ? delimiter : ' ');
+  const char *start = *p;
   *p = delspc (*p);
   if (!**p || **p == delimiter)
     {
+      fail_code (code);
       if (valid)
 	*valid = 0;
       else if (print_errors)
-	printerr (1, "expression expected (not %s)\n", *p);
+	printerr (z, 1, "expression expected (not %s)\n", *p);
       return 0;
     }
-  result = rd_expr_or (p, valid, level, check, print_errors);
+  result = rd_expr_or (z, p, valid, level, check, print_errors, code);
   *p = delspc (*p);
   if (**p == '?')
     {
       *check = 0;
       (*p)++;
+      /* both alternatives are read; the condition selects one */
       if (result)
 	{
-	  result = do_rd_expr (p, ':', valid, level, check, print_errors);
+	  result = do_rd_expr (z, p, ':', valid, level, check, print_errors,
+			       code);
 	  if (**p)
 	    (*p)++;
-	  do_rd_expr (p, delimiter, valid, level, check, print_errors);
+	  do_rd_expr (z, p, delimiter, valid, level, check, print_errors,
+		      code);
 	}
       else
 	{
-	  do_rd_expr (p, ':', valid, level, check, print_errors);
+	  do_rd_expr (z, p, ':', valid, level, check, print_errors, code);
 	  if (**p)
 	    (*p)++;
-	  result = do_rd_expr (p, delimiter, valid, level, check,
-			       print_errors);
+	  result = do_rd_expr (z, p, delimiter, valid, level, check,
+			       print_errors, code);
 	}
+      emit (code, OP_SELECT, 0, 3, 1);
     }
   *p = delspc (*p);
   if (**p && **p != delimiter)
     {
+      fail_code (code);
       if (valid)
 	*valid = 0;
       else if (print_errors)
-	printerr (1, "junk at end of expression: %s\n", *p);
-    }
-  if (verbose >= 7)
-    {
-      fprintf (stderr, "%5d (0x%04x): rd_expr returned %d (%04x).\n",
-	       stack[sp].line, addr, result, result);
-      if (valid && !*valid)
-	fprintf (stderr, "%5d (0x%04x): Returning invalid result.\n",
-		 stack[sp].line, addr);
+	printerr (z, 1, "junk at end of expression: %s\n", *p);
     }
+  TRACE (z, Z80ASM_TRACE_LEXER, TRACE_EXPRESSION, result, !valid || *valid,
+	 start);
+  return result;
+}
+
+/* a value which is used while assembling an object can't depend on the
+ * address of the object, unless that cancels out (like in end - start).
+ * Find out by compiling it.  */
+static void
+check_absolute (struct z80asm *z, const char *p, char delimiter, int level)
+{
+  struct expr_code code;
+  memset (&code, 0, sizeof (code));
+  rd_expr_code (z, &p, delimiter, NULL, level, 0, &code);
+  if (!code.failed)
+    eval_expr_code (z, &code, level, NULL, 0);
+  if (code.failed || z->expr_reloc)
+    printerr (z, 1, "expression depends on the address of the object\n");
+  free (code.ops);
+  free (code.slots);
+}
+
+int
+rd_expr (struct z80asm *z, const char **p, char delimiter, int *valid,
+	 int level, int print_errors)
+{
+  int check = 1;
+  int result;
+  unsigned long relocs = z->num_relocs;
+  const char *start = *p;
+  int errors = z->errors;
+  if (valid)
+    *valid = 1;
+  result = do_rd_expr (z, p, delimiter, valid, level, &check, print_errors,
+		       NULL);
+  if (print_errors && (!valid || *valid) && check)
+    printerr (z, 0, "expression fully enclosed in parenthesis\n");
+  /* an expression which can't be computed has an error already */
+  if (print_errors && !valid && z->num_relocs != relocs
+      && z->errors == errors)
+    check_absolute (z, start, delimiter, level);
   return result;
 }
 
+/* like rd_expr, but also compile the expression into code.  The old
+ * contents of code are discarded, but its buffers are reused.  If
+ * code->failed is set afterwards, the expression can only be computed
+ * from its text.  */
 int
-rd_expr (const char **p, char delimiter, int *valid, int level,
-	 int print_errors)
+rd_expr_code (struct z80asm *z, const char **p, char delimiter, int *valid,
+	      int level, int print_errors, struct expr_code *code)
 {
   int check = 1;
   int result;
   if (valid)
     *valid = 1;
-  result = do_rd_expr (p, delimiter, valid, level, &check, print_errors);
+  code->failed = 0;
+  code->num_ops = 0;
+  code->num_slots = 0;
+  code->depth = 0;
+  code->max_depth = 0;
+  code->input = delspc (*p);
+  result = do_rd_expr (z, p, delimiter, valid, level, &check, print_errors,
+		       code);
+  code->check = check;
   if (print_errors && (!valid || *valid) && check)
-    printerr (0, "expression fully enclosed in parenthesis\n");
+    printerr (z, 0, "expression fully enclosed in parenthesis\n");
   return result;
 }
+
+/* make a copy of compiled code in arena, which can be used with text as
+ * its input.  text must start with the same expression which the code was
+ * compiled from.  Returns NULL if that is impossible.  */
+struct expr_code *
+copy_expr_code (const struct expr_code *code, const char *text,
+		struct arena *arena)
+{
+  struct expr_code *ret;
+  unsigned i;
+  if (code->failed)
+    return NULL;
+  ret = arena_alloc (arena, sizeof (struct expr_code)
+		+ code->num_slots * sizeof (struct expr_slot)
+		+ code->num_ops * sizeof (struct expr_op));
+  if (!ret)
+    return NULL;
+  *ret = *code;
+  ret->input = delspc (text);
+  ret->slots = (struct expr_slot *) &ret[1];
+  ret->ops = (struct expr_op *) &ret->slots[code->num_slots];
+  ret->max_slots = code->num_slots;
+  ret->max_ops = code->num_ops;
+  for (i = 0; i < code->num_slots; ++i)
+    ret->slots[i] = code->slots[i];
+  for (i = 0; i < code->num_ops; ++i)
+    ret->ops[i] = code->ops[i];
+  return ret;
+}
+
+/* compute the value of a label slot, in the same way as rd_label.  In
+ * an object, *reloc is set as well.  */
+static int
+slot_value (struct z80asm *z, struct expr_slot *slot, const char *input,
+	    int level, int *exists, int *reloc, int print_errors)
+{
+  struct label *l = slot->label;
+  const char *name = input + slot->offset;
+  int s, found;
+  *exists = 0;
+  *reloc = 0;
+  if (l)
+    {
+      /* this is a global label which was found before */
+      found = 1;
+      if (l->ref)
+	{
+	  compute_label (z, l);
+	  found = l->ref->done;
+	}
+    }
+  else
+    {
+      found = 0;
+      for (s = level; s >= 0 && !l; --s)
+	found = check_label (z, &z->stack[s].labels, name, slot->len,
+			     slot->hash, &l);
+      if (!l)
+	{
+	  found = check_label (z, &z->globallabels, name, slot->len,
+			       slot->hash, &l);
+	  /* global labels are never removed, so they can be remembered */
+	  if (*name != '.')
+	    slot->label = l;
+	}
+    }
+  if (!found)
+    {
+      if (print_errors)
+	printerr (z, 1, "using undefined label %.*s\n", (int) slot->len, name);
+      return l != NULL;
+    }
+  *exists = 1;
+  *reloc = l->reloc;
+  return l->value;
+}
+
+/* in an object, find out how the result of an operation depends on the
+ * address of the object, before it is done.  The reloc of a value is
+ * the number of times the address is in it.  The reloc of OP_LABEL is
+ * set by slot_value.  */
+static void
+track_reloc (struct z80asm *z, enum expr_opcode op, const int *values,
+	     int *relocs, unsigned n)
+{
+  int a, b;
+  switch (op)
+    {
+    case OP_CONST:
+    case OP_EXISTS:
+      relocs[n] = 0;
+      return;
+    case OP_ADDR:
+      relocs[n] = z->addr_reloc;
+      return;
+    case OP_LABEL:
+      return;
+    case OP_NEG:
+      if (relocs[n - 1] != RELOC_EXPR)
+	relocs[n - 1] = -relocs[n - 1];
+      return;
+    case OP_NOT:
+      if (relocs[n - 1])
+	relocs[n - 1] = RELOC_EXPR;
+      return;
+    case OP_SELECT:
+      relocs[n - 3] = relocs[n - 3] ? RELOC_EXPR
+	: values[n - 3] ? relocs[n - 2] : relocs[n - 1];
+      return;
+    default:
+      break;
+    }
+  a = relocs[n - 2];
+  b = relocs[n - 1];
+  if (a == RELOC_EXPR || b == RELOC_EXPR)
+    relocs[n - 2] = RELOC_EXPR;
+  else if (op == OP_ADD)
+    relocs[n - 2] = a + b;
+  else if (op == OP_SUB)
+    relocs[n - 2] = a - b;
+  else if (op == OP_MUL && (!a || !b))
+    relocs[n - 2] = a * values[n - 1] + b * values[n - 2];
+  else if (a || b)
+    relocs[n - 2] = RELOC_EXPR;
+}
+
+/* compute the value of compiled code.  This is the same as what rd_expr
+ * would return for the text it was compiled from, except that errors in
+ * the text itself are not possible.  In an object, z->expr_reloc is set
+ * to the reloc of the value.  */
+int
+eval_expr_code (struct z80asm *z, struct expr_code *code, int level,
+		int *valid, int print_errors)
+{
+  int values[MAX_EXPR_DEPTH], relocs[MAX_EXPR_DEPTH];
+  unsigned i, n = 0;
+  int exists, reloc;
+  if (valid)
+    *valid = 1;
+  for (i = 0; i < code->num_ops; ++i)
+    {
+      int arg = code->ops[i].arg;
+      if (z->object)
+	track_reloc (z, code->ops[i].op, values, relocs, n);
+      switch (code->ops[i].op)
+	{
+	case OP_CONST:
+	  values[n++] = arg;
+	  break;
+	case OP_ADDR:
+	  values[n++] = z->baseaddr;
+	  break;
+	case OP_LABEL:
+	  values[n] = slot_value (z, &code->slots[arg], code->input, level,
+				  &exists, &relocs[n],
+				  valid ? 0 : print_errors);
+	  ++n;
+	  if (!exists && valid)
+	    *valid = 0;
+	  break;
+	case OP_EXISTS:
+	  /* the result depends on when this is computed */
+	  ++z->num_unstable;
+	  slot_value (z, &code->slots[arg], code->input, level, &exists,
+		      &reloc, 0);
+	  values[n++] = exists;
+	  break;
+	case OP_NEG:
+	  values[n - 1] = -values[n - 1];
+	  break;
+	case OP_NOT:
+	  values[n - 1] = ~values[n - 1];
+	  break;
+	case OP_MUL:
+	  --n;
+	  values[n - 1] *= values[n];
+	  break;
+	case OP_DIV:
+	case OP_MOD:
+	  --n;
+	  values[n - 1] = divide (z, values[n - 1], values[n],
+				  code->ops[i].op == OP_MOD, valid,
+				  print_errors);
+	  break;
+	case OP_ADD:
+	  --n;
+	  values[n - 1] += values[n];
+	  break;
+	case OP_SUB:
+	  --n;
+	  values[n - 1] -= values[n];
+	  break;
+	case OP_SHL:
+	  --n;
+	  values[n - 1] <<= values[n];
+	  break;
+	case OP_SHR:
+	  --n;
+	  values[n - 1] >>= values[n];
+	  break;
+	case OP_LE:
+	  --n;
+	  values[n - 1] = values[n - 1] <= values[n];
+	  break;
+	case OP_GE:
+	  --n;
+	  values[n - 1] = values[n - 1] >= values[n];
+	  break;
+	case OP_LT:
+	  --n;
+	  values[n - 1] = values[n - 1] < values[n];
+	  break;
+	case OP_GT:
+	  --n;
+	  values[n - 1] = values[n - 1] > values[n];
+	  break;
+	case OP_EQ:
+	  --n;
+	  values[n - 1] = values[n - 1] == values[n];
+	  break;
+	case OP_NE:
+	  --n;
+	  values[n - 1] = values[n - 1] != values[n];
+	  break;
+	case OP_AND:
+	  --n;
+	  values[n - 1] &= values[n];
+	  break;
+	case OP_XOR:
+	  --n;
+	  values[n - 1] ^= values[n];
+	  break;
+	case OP_OR:
+	  --n;
+	  values[n - 1] |= values[n];
+	  break;
+	case OP_SELECT:
+	  n -= 2;
+	  values[n - 1] = values[n - 1] ? values[n] : values[n + 1];
+	  break;
+	}
+    }
+  if (z->object)
+    z->expr_reloc = relocs[0];
+  return values[0];
+}
+
+/* in an object, the local labels which compiled code uses are bound to
+ * copies of them, so the linker can compute it after they went out of
+ * scope.  Labels which can't be computed are left alone.  */
+void
+bind_local_labels (struct z80asm *z, struct expr_code *code, int level)
+{
+  unsigned i;
+  for (i = 0; i < code->num_slots; ++i)
+    {
+      struct expr_slot *slot = &code->slots[i];
+      const char *name = code->input + slot->offset;
+      struct label *l = NULL, *copy;
+      int s;
+      if (slot->label || *name != '.')
+	continue;
+      for (s = level; s >= 0 && !l; --s)
+	l = find_label (z, &z->stack[s].labels, name, slot->len,
+			slot->hash);
+      if (l && l->ref)
+	compute_label (z, l);
+      if (!l || !l->valid)
+	continue;
+      copy = arena_alloc (&z->globalarena, sizeof (struct label) + l->len);
+      if (!copy)
+	{
+	  printerr (z, 1, "not enough memory to store label %s\n", l->name);
+	  continue;
+	}
+      memcpy (copy, l, sizeof (struct label) + l->len);
+      copy->busy = 0;
+      copy->ref = NULL;
+      copy->table = NULL;
+      slot->label = copy;
+    }
+}
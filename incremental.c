@@ -0,0 +1,1382 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* incremental assembly.  What an include does depends only on its own
+ * contents, the contents of the files it includes, and the state in
+ * which it starts: the address, the position in the output, the labels
+ * and macros which are visible, the if level and the include path.  All
+ * of that is put in a digest, the key.
+ *
+ * While an include is assembled, a frame records what it does: the parts
+ * of the image it writes, the global labels it defines and the files it
+ * includes.  When it ends, a record is made of that, together with the
+ * references it made.  The next time the same include starts with the
+ * same key, and none of the files it includes has changed, the record is
+ * replayed: the bytes are written, the labels are defined and the
+ * references are made again.  Computed references only need to be
+ * written at the end; the others wait for their labels like they did
+ * before.  The references which are tried when the include ends are
+ * tried at the end of the replay as well.
+ *
+ * Only includes which can be replayed exactly get a record.  Those which
+ * give errors or warnings, define macros, use incbin or ?label, or
+ * change labels which were defined before (which happens when an equ is
+ * computed late) are assembled every time.
+ *
+ * An input file is treated like an include at the bottom of the stack:
+ * it starts in the state which the files before it left.  */
+
+/* a reference which was made in an include */
+struct record_ref
+{
+  enum reftype type;
+  int done;
+  int count, value, line;
+  unsigned long seq;		/* number of references made in the include
+				   before it */
+  long oseekpos;
+  char *file;
+  char *dir;			/* directory of file, or NULL */
+  /* the rest is only used if the reference is not done */
+  char *input;
+  int delimiter, addr, baseaddr, comma, level;
+  int has_code, check;		/* compiled code, see struct expr_code */
+  unsigned num_ops, num_slots;
+  struct expr_op *ops;
+  struct expr_slot *slots;	/* without the labels */
+};
+
+/* a global label which was defined by an include */
+struct record_label
+{
+  char *name;
+  int value, valid;
+  struct record_ref *ref;	/* to compute it, if it isn't valid */
+};
+
+/* what a stack level which was used by an include is left with.  Error
+ * messages about references at that level use it.  */
+struct record_level
+{
+  char *name;
+  char *dir;			/* or NULL */
+  int line;
+};
+
+/* a part of the image which was written by an include */
+struct record_write
+{
+  unsigned long pos, size;
+  unsigned char *data;
+};
+
+struct include_record
+{
+  struct include_record *next;	/* in the same list of z->records */
+  struct digest key;
+  unsigned long run;		/* the last run which used it */
+  int addr;			/* address at the end */
+  unsigned long pos;		/* position in the image at the end */
+  unsigned long references;	/* number of references made */
+  unsigned num_deps, num_labels, num_writes, num_refs, num_wakes;
+  unsigned num_levels;
+  struct include_dep *deps;	/* included files (not the include itself) */
+  struct record_label *labels;	/* in the order they were defined */
+  struct record_write *writes;	/* sorted, and not overlapping */
+  struct record_ref *refs;	/* in the order they were made */
+  unsigned *wakes;		/* hashes of the local labels at the end */
+  struct record_level *levels;	/* from the level of the include up */
+};
+
+/* digests use two independent hashes of 32 bits: FNV-1a (like
+ * hash_label) and Jenkins' one-at-a-time hash */
+void
+digest_init (struct digest *d)
+{
+  d->a = 2166136261UL;
+  d->b = 0;
+}
+
+void
+digest_add (struct digest *d, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+  unsigned long a = d->a, b = d->b;
+  size_t i;
+  for (i = 0; i < size; ++i)
+    {
+      a = ((a ^ p[i]) * 16777619UL) & 0xffffffffUL;
+      b = (b + p[i]) & 0xffffffffUL;
+      b = (b + (b << 10)) & 0xffffffffUL;
+      b ^= b >> 6;
+    }
+  d->a = a;
+  d->b = b;
+}
+
+/* add the low 32 bits of a number */
+void
+digest_add_int (struct digest *d, unsigned long value)
+{
+  unsigned char buf[4];
+  buf[0] = value & 0xff;
+  buf[1] = (value >> 8) & 0xff;
+  buf[2] = (value >> 16) & 0xff;
+  buf[3] = (value >> 24) & 0xff;
+  digest_add (d, buf, 4);
+}
+
+static int
+same_digest (const struct digest *d1, const struct digest *d2)
+{
+  return d1->a == d2->a && d1->b == d2->b;
+}
+
+/* make room for one more element in a log.  Returns the (possibly moved)
+ * array, or NULL if there is no memory.  */
+static void *
+grow_log (struct z80asm *z, void *array, unsigned *max, size_t size)
+{
+  unsigned new_max = *max ? 2 * *max : 64;
+  void *ret = realloc (array, new_max * size);
+  if (!ret)
+    {
+      printerr (z, 1, "not enough memory for incremental assembly\n");
+      return NULL;
+    }
+  *max = new_max;
+  return ret;
+}
+
+/* remember that the image was written, for the frames which are open */
+void
+log_write (struct z80asm *z, unsigned long pos, unsigned long size)
+{
+  struct image_write *w;
+  /* extend the last write, if it belongs to the innermost frame */
+  if (z->num_writes > z->frames[z->num_frames - 1].num_writes)
+    {
+      w = &z->writes[z->num_writes - 1];
+      if (w->pos + w->size == pos)
+	{
+	  w->size += size;
+	  return;
+	}
+    }
+  if (z->num_writes == z->max_writes)
+    {
+      w = grow_log (z, z->writes, &z->max_writes, sizeof (*w));
+      if (!w)
+	return;
+      z->writes = w;
+    }
+  w = &z->writes[z->num_writes++];
+  w->pos = pos;
+  w->size = size;
+}
+
+/* remember that a global label was defined */
+void
+log_label (struct z80asm *z, struct label *l)
+{
+  if (z->num_new_labels == z->max_new_labels)
+    {
+      struct label **n = grow_log (z, z->new_labels, &z->max_new_labels,
+				   sizeof (*n));
+      if (!n)
+	return;
+      z->new_labels = n;
+    }
+  z->new_labels[z->num_new_labels++] = l;
+}
+
+/* remember that a file was included.  The strings are not copied.  */
+static void
+log_dep (struct z80asm *z, const struct include_dep *dep)
+{
+  if (z->num_deps == z->max_deps)
+    {
+      struct include_dep *d = grow_log (z, z->deps, &z->max_deps,
+					sizeof (*d));
+      if (!d)
+	return;
+      z->deps = d;
+    }
+  z->deps[z->num_deps++] = *dep;
+}
+
+/* the digest of all macros.  It is computed again only when they have
+ * changed.  */
+static const struct digest *
+macro_digest (struct z80asm *z)
+{
+  unsigned i, j;
+  if (z->macro_digest_generation == z->macro_generation)
+    return &z->macro_digest;
+  z->macro_digest.a = 0;
+  z->macro_digest.b = 0;
+  for (i = 0; i < z->macro_slots_size; ++i)
+    {
+      struct macro *m = z->macro_slots[i];
+      struct macro_line *ml;
+      struct digest d;
+      if (!m)
+	continue;
+      digest_init (&d);
+      digest_add (&d, m->name, m->len + 1);
+      digest_add_int (&d, m->numargs);
+      for (ml = m->lines; ml; ml = ml->next)
+	{
+	  digest_add (&d, ml->line, ml->len + 1);
+	  for (j = 0; j < ml->numargs; ++j)
+	    {
+	      digest_add_int (&d, ml->args[j].pos);
+	      digest_add_int (&d, ml->args[j].which);
+	    }
+	}
+      z->macro_digest.a ^= d.a;
+      z->macro_digest.b ^= d.b;
+    }
+  z->macro_digest_generation = z->macro_generation;
+  return &z->macro_digest;
+}
+
+/* the digest of the local labels of the stack levels below level */
+static void
+outer_labels (struct z80asm *z, int level, struct digest *d)
+{
+  int i;
+  digest_init (d);
+  for (i = 0; i < level; ++i)
+    {
+      digest_add_int (d, z->stack[i].labels.digest.a);
+      digest_add_int (d, z->stack[i].labels.digest.b);
+    }
+}
+
+/* compute the key of the include at the top of the stack */
+static void
+include_key (struct z80asm *z, const struct include_dep *dep, int ifcount,
+	     const struct digest *locals, struct digest *key)
+{
+  struct includedir *i;
+  const struct digest *macros = macro_digest (z);
+  digest_init (key);
+  digest_add (key, dep->name, strlen (dep->name) + 1);
+  if (dep->dir)
+    digest_add (key, dep->dir, strlen (dep->dir) + 1);
+  else
+    digest_add (key, "", 1);
+  digest_add_int (key, dep->id.a);
+  digest_add_int (key, dep->id.b);
+  for (i = z->firstincludedir; i; i = i->next)
+    digest_add (key, i->name, strlen (i->name) + 1);
+  digest_add_int (key, z->addr);
+  digest_add_int (key, z->image_pos);
+  digest_add_int (key, ifcount);
+  digest_add_int (key, z->sp);
+  digest_add_int (key, z->globallabels.digest.a);
+  digest_add_int (key, z->globallabels.digest.b);
+  digest_add_int (key, locals->a);
+  digest_add_int (key, locals->b);
+  digest_add_int (key, macros->a);
+  digest_add_int (key, macros->b);
+}
+
+/* check that the files which a record includes are still the same */
+static int
+deps_unchanged (struct z80asm *z, const struct include_record *r)
+{
+  unsigned i;
+  for (i = 0; i < r->num_deps; ++i)
+    {
+      const struct include_dep *d = &r->deps[i];
+      struct includedir *dir;
+      struct source src;
+      int same;
+      if (!open_include_source (z, d->name, &dir, &src))
+	return 0;
+      same = (dir ? d->dir && !strcmp (dir->name, d->dir) : !d->dir)
+	&& same_digest (source_digest (src.file), &d->id);
+      close_source (&src);
+      if (!same)
+	return 0;
+    }
+  return 1;
+}
+
+/* make a reference again */
+static struct reference *
+replay_ref (struct z80asm *z, const struct record_ref *rr, unsigned long seq)
+{
+  const char *input = rr->done ? "" : rr->input;
+  struct reference *ref = arena_alloc (&z->globalarena,
+				       sizeof (struct reference));
+  if (!ref || !(ref->file = arena_strdup (&z->globalarena, rr->file))
+      || !(ref->input = arena_strdup (&z->globalarena, input)))
+    {
+      printerr (z, 1, "unable to allocate memory for reference\n");
+      return NULL;
+    }
+  ref->dir = NULL;
+  if (rr->dir)
+    {
+      ref->dir = arena_alloc (&z->globalarena, sizeof (struct includedir)
+			      + strlen (rr->dir));
+      if (!ref->dir)
+	{
+	  printerr (z, 1, "unable to allocate memory for reference dir\n");
+	  return NULL;
+	}
+      strcpy (ref->dir->name, rr->dir);
+    }
+  ref->code = NULL;
+  if (rr->has_code)
+    {
+      struct expr_code code;
+      memset (&code, 0, sizeof (code));
+      code.check = rr->check;
+      code.num_ops = code.max_ops = rr->num_ops;
+      code.ops = rr->ops;
+      code.num_slots = code.max_slots = rr->num_slots;
+      code.slots = rr->slots;
+      /* without memory, the reference is tried at every pop */
+      ref->code = copy_expr_code (&code, ref->input, &z->globalarena);
+    }
+  ref->waits = NULL;
+  ref->label = NULL;
+  ref->type = rr->type;
+  ref->count = rr->count;
+  ref->computed_value = rr->value;
+  ref->reloc = 0;
+  ref->addr_reloc = 0;
+  ref->done = rr->done;
+  ref->line = rr->line;
+  ref->oseekpos = rr->oseekpos;
+  ref->lseekpos = 0;
+  ref->delimiter = rr->delimiter;
+  ref->addr = rr->addr;
+  ref->baseaddr = rr->baseaddr;
+  ref->comma = rr->comma;
+  ref->infile = z->file;
+  ref->seq = seq + rr->seq;
+  ref->level = rr->level;
+  ref->woken = 0;
+  ref->next_woken = NULL;
+  ref->level_next = NULL;
+  ref->level_prev = NULL;
+  ref->next = NULL;
+  ref->prev = NULL;
+  return ref;
+}
+
+static void
+replay_label (struct z80asm *z, const struct record_label *rl,
+	      unsigned long seq)
+{
+  size_t len = strlen (rl->name);
+  struct label *l = arena_alloc (&z->globalarena, sizeof (struct label)
+				 + len);
+  if (!l)
+    {
+      printerr (z, 1, "not enough memory to store label %s\n", rl->name);
+      return;
+    }
+  memcpy (l->name, rl->name, len + 1);
+  l->len = len;
+  l->value = rl->value;
+  l->valid = rl->valid;
+  l->busy = 0;
+  l->ref = NULL;
+  l->table = NULL;
+  l->reloc = 0;
+  l->hash = hash_label (l->name, len);
+  if (!add_label (&z->globallabels, l))
+    {
+      printerr (z, 1, "not enough memory to store label %s\n", l->name);
+      return;
+    }
+  if (z->num_frames)
+    log_label (z, l);
+  wake_references (z, l->hash);
+  if (rl->ref && (l->ref = replay_ref (z, rl->ref, seq)))
+    {
+      l->ref->label = l;
+      restore_reference (z, l->ref, &z->globalarena);
+    }
+}
+
+/* leave the stack levels which the include used like it did */
+static void
+restore_levels (struct z80asm *z, const struct include_record *r)
+{
+  unsigned i;
+  for (i = 0; i < r->num_levels && z->sp + (int) i < MAX_INCLUDE; ++i)
+    {
+      struct stack *s = &z->stack[z->sp + i];
+      const struct record_level *l = &r->levels[i];
+      struct includedir *dir;
+      for (dir = z->firstincludedir; dir && l->dir; dir = dir->next)
+	{
+	  if (!strcmp (dir->name, l->dir))
+	    break;
+	}
+      s->dir = l->dir ? dir : NULL;
+      s->line = l->line;
+      /* the name of the include itself is still there */
+      if (i && !(s->name = arena_strdup (&z->globalarena, l->name)))
+	s->name = "";
+    }
+  if (z->sp + (int) r->num_levels - 1 > z->max_sp)
+    z->max_sp = z->sp + (int) r->num_levels - 1;
+}
+
+/* replay a record instead of the include at the top of the stack */
+static void
+replay (struct z80asm *z, struct include_record *r)
+{
+  unsigned long seq = z->num_references;
+  unsigned i;
+  if (z->verbose >= 4)
+    fprintf (stderr, "Replaying file %s\n", z->stack[z->sp].name);
+  close_source (z->stack[z->sp].file);
+  r->run = z->run;
+  for (i = 0; i < r->num_writes; ++i)
+    {
+      z->image_pos = r->writes[i].pos;
+      write_image (z, r->writes[i].data, r->writes[i].size);
+    }
+  z->image_pos = r->pos;
+  z->addr = r->addr;
+  for (i = 0; i < r->num_labels; ++i)
+    replay_label (z, &r->labels[i], seq);
+  for (i = 0; i < r->num_refs; ++i)
+    {
+      struct reference *ref = replay_ref (z, &r->refs[i], seq);
+      if (!ref)
+	continue;
+      ref->next = z->firstreference;
+      if (ref->next)
+	ref->next->prev = ref;
+      z->firstreference = ref;
+      if (!ref->done)
+	restore_reference (z, ref, &z->globalarena);
+    }
+  z->num_references = seq + r->references;
+  /* the include ends like it did before: the references which were
+   * woken are tried, and its local labels go out of scope */
+  resolve_references (z);
+  for (i = 0; i < r->num_wakes; ++i)
+    wake_references (z, r->wakes[i]);
+  restore_levels (z, r);
+  --z->sp;
+  for (i = 0; z->num_frames && i < r->num_deps; ++i)
+    log_dep (z, &r->deps[i]);
+}
+
+/* an include or input file was opened at the top of the stack.  Replay
+ * it if there is a record for it, and return 1.  Otherwise start
+ * recording it.  */
+int
+begin_include (struct z80asm *z, char *name, int ifcount)
+{
+  struct stack *s = &z->stack[z->sp];
+  struct include_dep dep;
+  struct include_frame *f;
+  struct include_record *r = NULL;
+  struct digest key, locals;
+  dep.name = name;
+  dep.dir = s->dir ? s->dir->name : NULL;
+  dep.id = *source_digest (s->file->file);
+  if (z->num_frames)
+    log_dep (z, &dep);
+  outer_labels (z, z->sp, &locals);
+  include_key (z, &dep, ifcount, &locals, &key);
+  if (z->records)
+    r = z->records[key.a % RECORD_TABLE_SIZE];
+  for (; r; r = r->next)
+    {
+      if (same_digest (&r->key, &key))
+	break;
+    }
+  if (r && deps_unchanged (z, r))
+    {
+      replay (z, r);
+      return 1;
+    }
+  if (z->num_frames == z->max_frames)
+    {
+      f = grow_log (z, z->frames, &z->max_frames, sizeof (*f));
+      if (!f)
+	return 0;
+      z->frames = f;
+    }
+  f = &z->frames[z->num_frames++];
+  f->level = z->sp;
+  f->key = key;
+  f->globals = z->globallabels.digest;
+  f->locals = locals;
+  f->ifcount = ifcount;
+  f->max_sp = z->max_sp;
+  z->max_sp = z->sp;
+  f->references = z->num_references;
+  f->messages = z->num_messages;
+  f->macros = z->macro_generation;
+  f->incbins = z->num_incbins;
+  f->unstable = z->num_unstable;
+  f->num_writes = z->num_writes;
+  f->num_labels = z->num_new_labels;
+  f->num_deps = z->num_deps;
+  return 0;
+}
+
+/* check if an include which has just ended can be replayed */
+static int
+replayable (struct z80asm *z, const struct include_frame *f, int ifcount,
+	    int noifcount)
+{
+  struct digest globals = f->globals, locals;
+  struct reference *ref;
+  unsigned i;
+  if (z->num_messages != f->messages || z->macro_generation != f->macros
+      || z->num_incbins != f->incbins || z->num_unstable != f->unstable
+      || z->define_macro || ifcount != f->ifcount || noifcount)
+    return 0;
+  /* references which are not computed yet have moved to the level below
+   * the include */
+  for (ref = z->firstreference; ref && ref->seq >= f->references;
+       ref = ref->next)
+    {
+      if (!ref->done && ref->level != f->level - 1)
+	return 0;
+    }
+  /* no label which existed before may have changed */
+  for (i = f->num_labels; i < z->num_new_labels; ++i)
+    {
+      struct label *l = z->new_labels[i];
+      struct digest d;
+      if (l->table != &z->globallabels
+	  || (!l->valid && (!l->ref || l->ref->done)))
+	return 0;
+      label_digest (l, &d);
+      globals.a ^= d.a;
+      globals.b ^= d.b;
+    }
+  outer_labels (z, f->level, &locals);
+  return same_digest (&globals, &z->globallabels.digest)
+    && same_digest (&locals, &f->locals);
+}
+
+static char *
+copy_string (const char *s)
+{
+  char *ret;
+  if (!s)
+    return NULL;
+  if ((ret = malloc (strlen (s) + 1)))
+    strcpy (ret, s);
+  return ret;
+}
+
+static void
+free_ref (struct record_ref *rr)
+{
+  free (rr->file);
+  free (rr->dir);
+  free (rr->input);
+  free (rr->ops);
+  free (rr->slots);
+}
+
+static void
+free_record (struct include_record *r)
+{
+  unsigned i;
+  for (i = 0; r->deps && i < r->num_deps; ++i)
+    {
+      free (r->deps[i].name);
+      free (r->deps[i].dir);
+    }
+  for (i = 0; r->labels && i < r->num_labels; ++i)
+    {
+      free (r->labels[i].name);
+      if (r->labels[i].ref)
+	free_ref (r->labels[i].ref);
+      free (r->labels[i].ref);
+    }
+  for (i = 0; r->writes && i < r->num_writes; ++i)
+    free (r->writes[i].data);
+  for (i = 0; r->refs && i < r->num_refs; ++i)
+    free_ref (&r->refs[i]);
+  free (r->deps);
+  free (r->labels);
+  free (r->writes);
+  free (r->refs);
+  free (r->wakes);
+  for (i = 0; r->levels && i < r->num_levels; ++i)
+    {
+      free (r->levels[i].name);
+      free (r->levels[i].dir);
+    }
+  free (r->levels);
+  free (r);
+}
+
+/* add a record to the table.  A record with the same key is replaced,
+ * unless it was used in this run.  Returns 0 if there is no memory.  */
+static int
+add_record (struct z80asm *z, struct include_record *r)
+{
+  struct include_record **p;
+  if (!z->records && !(z->records = calloc (RECORD_TABLE_SIZE,
+					    sizeof (struct include_record *))))
+    return 0;
+  for (p = &z->records[r->key.a % RECORD_TABLE_SIZE]; *p; p = &(*p)->next)
+    {
+      if (!same_digest (&(*p)->key, &r->key))
+	continue;
+      if ((*p)->run == z->run)
+	{
+	  free_record (r);
+	  return 1;
+	}
+      r->next = (*p)->next;
+      free_record (*p);
+      *p = r;
+      return 1;
+    }
+  r->next = NULL;
+  *p = r;
+  return 1;
+}
+
+static int
+compare_writes (const void *a, const void *b)
+{
+  const struct image_write *wa = a, *wb = b;
+  return wa->pos < wb->pos ? -1 : wa->pos > wb->pos;
+}
+
+/* fill the writes of a record from the log, merging the parts which
+ * overlap.  The data is what is in the image now.  */
+static int
+record_writes (struct z80asm *z, const struct include_frame *f,
+	       struct include_record *r)
+{
+  unsigned n = z->num_writes - f->num_writes, i = 0;
+  struct image_write *w = z->writes + f->num_writes;
+  if (!n)
+    return 1;
+  qsort (w, n, sizeof (struct image_write), compare_writes);
+  if (!(r->writes = malloc (n * sizeof (struct record_write))))
+    return 0;
+  while (i < n)
+    {
+      struct record_write *rw = &r->writes[r->num_writes];
+      unsigned long end = w[i].pos + w[i].size;
+      rw->pos = w[i].pos;
+      for (++i; i < n && w[i].pos <= end; ++i)
+	{
+	  if (w[i].pos + w[i].size > end)
+	    end = w[i].pos + w[i].size;
+	}
+      rw->size = end - rw->pos;
+      if (!(rw->data = malloc (rw->size)))
+	return 0;
+      memcpy (rw->data, z->image + rw->pos, rw->size);
+      ++r->num_writes;
+    }
+  return 1;
+}
+
+/* copy a reference into a record.  Returns 0 if there is no memory; the
+ * record_ref must be freed anyway.  */
+static int
+record_ref (const struct include_frame *f, const struct reference *ref,
+	    struct record_ref *rr)
+{
+  unsigned i;
+  memset (rr, 0, sizeof (struct record_ref));
+  rr->type = ref->type;
+  rr->done = ref->done;
+  rr->count = ref->count;
+  rr->value = ref->computed_value;
+  rr->line = ref->line;
+  rr->seq = ref->seq - f->references;
+  rr->oseekpos = ref->oseekpos;
+  if (!(rr->file = copy_string (ref->file))
+      || (ref->dir && !(rr->dir = copy_string (ref->dir->name))))
+    return 0;
+  if (ref->done)
+    return 1;
+  rr->delimiter = ref->delimiter;
+  rr->addr = ref->addr;
+  rr->baseaddr = ref->baseaddr;
+  rr->comma = ref->comma;
+  rr->level = ref->level;
+  if (!(rr->input = copy_string (ref->input)))
+    return 0;
+  if (!ref->code)
+    return 1;
+  rr->has_code = 1;
+  rr->check = ref->code->check;
+  rr->num_ops = ref->code->num_ops;
+  rr->num_slots = ref->code->num_slots;
+  if ((rr->num_ops && !(rr->ops = malloc (rr->num_ops
+					  * sizeof (struct expr_op))))
+      || (rr->num_slots && !(rr->slots = malloc (rr->num_slots
+						 * sizeof (struct expr_slot)))))
+    return 0;
+  for (i = 0; i < rr->num_ops; ++i)
+    rr->ops[i] = ref->code->ops[i];
+  for (i = 0; i < rr->num_slots; ++i)
+    {
+      rr->slots[i] = ref->code->slots[i];
+      rr->slots[i].label = NULL;
+    }
+  return 1;
+}
+
+/* fill the other parts of a record */
+static int
+record_rest (struct z80asm *z, const struct include_frame *f,
+	     struct include_record *r)
+{
+  struct reference *ref;
+  struct label_table *table;
+  unsigned i, n;
+  n = z->num_deps - f->num_deps;
+  if (n && !(r->deps = malloc (n * sizeof (struct include_dep))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      const struct include_dep *d = &z->deps[f->num_deps + i];
+      r->deps[i].id = d->id;
+      r->deps[i].name = copy_string (d->name);
+      r->deps[i].dir = copy_string (d->dir);
+      ++r->num_deps;
+      if (!r->deps[i].name || (d->dir && !r->deps[i].dir))
+	return 0;
+    }
+  n = z->num_new_labels - f->num_labels;
+  if (n && !(r->labels = malloc (n * sizeof (struct record_label))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      const struct label *l = z->new_labels[f->num_labels + i];
+      struct record_label *rl = &r->labels[i];
+      rl->value = l->value;
+      rl->valid = l->valid;
+      rl->ref = NULL;
+      rl->name = copy_string (l->name);
+      ++r->num_labels;
+      if (!rl->name)
+	return 0;
+      if (!l->valid)
+	{
+	  if (!(rl->ref = malloc (sizeof (struct record_ref))))
+	    return 0;
+	  if (!record_ref (f, l->ref, rl->ref))
+	    return 0;
+	}
+    }
+  /* the references are the newest ones in the list */
+  n = 0;
+  for (ref = z->firstreference; ref && ref->seq >= f->references;
+       ref = ref->next)
+    ++n;
+  if (n && !(r->refs = calloc (n, sizeof (struct record_ref))))
+    return 0;
+  r->num_refs = n;
+  for (ref = z->firstreference, i = n; i > 0; ref = ref->next)
+    {
+      if (!record_ref (f, ref, &r->refs[--i]))
+	return 0;
+    }
+  /* the local labels of the include wake references when they go out of
+   * scope */
+  table = &z->stack[f->level].labels;
+  if (table->count && !(r->wakes = malloc (table->count
+					   * sizeof (unsigned))))
+    return 0;
+  for (i = 0; i < table->size; ++i)
+    {
+      if (table->slots[i])
+	r->wakes[r->num_wakes++] = table->slots[i]->hash;
+    }
+  n = z->max_sp - f->level + 1;
+  if (!(r->levels = calloc (n, sizeof (struct record_level))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      const struct stack *s = &z->stack[f->level + i];
+      r->levels[i].line = s->line;
+      r->levels[i].name = copy_string (s->name);
+      r->levels[i].dir = copy_string (s->dir ? s->dir->name : NULL);
+      ++r->num_levels;
+      if (!r->levels[i].name || (s->dir && !r->levels[i].dir))
+	return 0;
+    }
+  return 1;
+}
+
+/* an include has ended.  Make a record of it, if it can be replayed.  */
+void
+end_include (struct z80asm *z, int ifcount, int noifcount)
+{
+  struct include_frame *f = &z->frames[--z->num_frames];
+  struct include_record *r;
+  int max_sp = z->max_sp;
+  if (replayable (z, f, ifcount, noifcount)
+      && (r = calloc (1, sizeof (struct include_record))))
+    {
+      r->key = f->key;
+      r->run = z->run;
+      r->addr = z->addr;
+      r->pos = z->image_pos;
+      r->references = z->num_references - f->references;
+      /* without memory there is no record, which is not an error */
+      if (!record_writes (z, f, r) || !record_rest (z, f, r)
+	  || !add_record (z, r))
+	free_record (r);
+    }
+  z->max_sp = max_sp > f->max_sp ? max_sp : f->max_sp;
+  if (!z->num_frames)
+    {
+      z->num_writes = 0;
+      z->num_new_labels = 0;
+      z->num_deps = 0;
+    }
+}
+
+/* drop the records which were not used in the last run */
+void
+finish_incremental (struct z80asm *z)
+{
+  unsigned i;
+  for (i = 0; z->records && i < RECORD_TABLE_SIZE; ++i)
+    {
+      struct include_record **p = &z->records[i];
+      while (*p)
+	{
+	  struct include_record *next = (*p)->next;
+	  if ((*p)->run == z->run)
+	    {
+	      p = &(*p)->next;
+	      continue;
+	    }
+	  free_record (*p);
+	  *p = next;
+	}
+    }
+}
+
+/* free the logs of a run */
+void
+free_incremental_run (struct z80asm *z)
+{
+  free (z->frames);
+  free (z->writes);
+  free (z->new_labels);
+  free (z->deps);
+}
+
+/* free all records */
+void
+free_records (struct z80asm *z)
+{
+  unsigned i;
+  for (i = 0; z->records && i < RECORD_TABLE_SIZE; ++i)
+    {
+      while (z->records[i])
+	{
+	  struct include_record *next = z->records[i]->next;
+	  free_record (z->records[i]);
+	  z->records[i] = next;
+	}
+    }
+  free (z->records);
+  z->records = NULL;
+}
+
+/* the library interface, see libz80asm.h */
+
+void
+z80asm_set_incremental (struct z80asm *z, int incremental)
+{
+  z->incremental = incremental;
+}
+
+/* The records are saved as text, with the contents of the image in
+ * binary.  Strings are written as their length, a colon and the string,
+ * or as a minus for NULL.  The first line contains the version, because
+ * the records are only valid for the assembler which made them.  Every
+ * record ends with a digest of what it contains, so one which was
+ * damaged is not replayed.  */
+#define INCREMENTAL_HEADER "z80asm incremental " VERSION "\n"
+
+/* add a string, or NULL, to a digest */
+static void
+digest_string (struct digest *d, const char *s)
+{
+  if (s)
+    digest_add (d, s, strlen (s) + 1);
+  else
+    digest_add_int (d, 0xffffffffUL);
+}
+
+static void
+digest_ref (struct digest *d, const struct record_ref *rr)
+{
+  unsigned i;
+  digest_add_int (d, rr->type);
+  digest_add_int (d, rr->done);
+  digest_add_int (d, rr->count);
+  digest_add_int (d, rr->value);
+  digest_add_int (d, rr->line);
+  digest_add_int (d, rr->seq);
+  digest_add_int (d, rr->oseekpos);
+  digest_string (d, rr->file);
+  digest_string (d, rr->dir);
+  if (rr->done)
+    return;
+  digest_add_int (d, rr->delimiter);
+  digest_add_int (d, rr->addr);
+  digest_add_int (d, rr->baseaddr);
+  digest_add_int (d, rr->comma);
+  digest_add_int (d, rr->level);
+  digest_string (d, rr->input);
+  digest_add_int (d, rr->has_code);
+  digest_add_int (d, rr->check);
+  for (i = 0; i < rr->num_ops; ++i)
+    {
+      digest_add_int (d, rr->ops[i].op);
+      digest_add_int (d, rr->ops[i].arg);
+    }
+  for (i = 0; i < rr->num_slots; ++i)
+    {
+      digest_add_int (d, rr->slots[i].offset);
+      digest_add_int (d, rr->slots[i].len);
+      digest_add_int (d, rr->slots[i].hash);
+    }
+}
+
+/* the digest of everything in a record, which is saved after it */
+static void
+digest_record (struct digest *d, const struct include_record *r)
+{
+  unsigned i;
+  digest_init (d);
+  digest_add_int (d, r->key.a);
+  digest_add_int (d, r->key.b);
+  digest_add_int (d, r->addr);
+  digest_add_int (d, r->pos);
+  digest_add_int (d, r->references);
+  for (i = 0; i < r->num_deps; ++i)
+    {
+      digest_add_int (d, r->deps[i].id.a);
+      digest_add_int (d, r->deps[i].id.b);
+      digest_string (d, r->deps[i].name);
+      digest_string (d, r->deps[i].dir);
+    }
+  for (i = 0; i < r->num_labels; ++i)
+    {
+      digest_add_int (d, r->labels[i].value);
+      digest_add_int (d, r->labels[i].valid);
+      digest_string (d, r->labels[i].name);
+      if (r->labels[i].ref)
+	digest_ref (d, r->labels[i].ref);
+    }
+  for (i = 0; i < r->num_writes; ++i)
+    {
+      digest_add_int (d, r->writes[i].pos);
+      digest_add_int (d, r->writes[i].size);
+      digest_add (d, r->writes[i].data, r->writes[i].size);
+    }
+  for (i = 0; i < r->num_refs; ++i)
+    digest_ref (d, &r->refs[i]);
+  for (i = 0; i < r->num_wakes; ++i)
+    digest_add_int (d, r->wakes[i]);
+  for (i = 0; i < r->num_levels; ++i)
+    {
+      digest_add_int (d, r->levels[i].line);
+      digest_string (d, r->levels[i].name);
+      digest_string (d, r->levels[i].dir);
+    }
+}
+
+void
+save_string (FILE * f, const char *s)
+{
+  if (s)
+    fprintf (f, " %lu:%s", (unsigned long) strlen (s), s);
+  else
+    fputs (" -", f);
+}
+
+static void
+save_ref (FILE * f, const struct record_ref *rr)
+{
+  unsigned i;
+  fprintf (f, "ref %d %d %d %d %d %lu %ld", (int) rr->type, rr->done,
+	   rr->count, rr->value, rr->line, rr->seq, rr->oseekpos);
+  save_string (f, rr->file);
+  save_string (f, rr->dir);
+  if (!rr->done)
+    {
+      fprintf (f, " %d %d %d %d %d", rr->delimiter, rr->addr, rr->baseaddr,
+	       rr->comma, rr->level);
+      save_string (f, rr->input);
+      fprintf (f, " %d %d %u %u", rr->has_code, rr->check, rr->num_ops,
+	       rr->num_slots);
+      for (i = 0; i < rr->num_ops; ++i)
+	fprintf (f, " %d %d", (int) rr->ops[i].op, rr->ops[i].arg);
+      for (i = 0; i < rr->num_slots; ++i)
+	fprintf (f, " %u %u %u", rr->slots[i].offset, rr->slots[i].len,
+		 rr->slots[i].hash);
+    }
+  fputc ('\n', f);
+}
+
+int
+z80asm_save_incremental (struct z80asm *z, FILE * f)
+{
+  unsigned i, j;
+  struct digest sum;
+  fputs (INCREMENTAL_HEADER, f);
+  for (i = 0; z->records && i < RECORD_TABLE_SIZE; ++i)
+    {
+      const struct include_record *r;
+      for (r = z->records[i]; r; r = r->next)
+	{
+	  fprintf (f, "record %lx %lx %d %lu %lu %u %u %u %u %u %u\n",
+		   r->key.a, r->key.b, r->addr, r->pos, r->references,
+		   r->num_deps, r->num_labels, r->num_writes, r->num_refs,
+		   r->num_wakes, r->num_levels);
+	  for (j = 0; j < r->num_deps; ++j)
+	    {
+	      fprintf (f, "dep %lx %lx", r->deps[j].id.a, r->deps[j].id.b);
+	      save_string (f, r->deps[j].name);
+	      save_string (f, r->deps[j].dir);
+	      fputc ('\n', f);
+	    }
+	  for (j = 0; j < r->num_labels; ++j)
+	    {
+	      fprintf (f, "label %d %d", r->labels[j].value,
+		       r->labels[j].valid);
+	      save_string (f, r->labels[j].name);
+	      fputc ('\n', f);
+	      if (r->labels[j].ref)
+		save_ref (f, r->labels[j].ref);
+	    }
+	  for (j = 0; j < r->num_writes; ++j)
+	    {
+	      fprintf (f, "write %lu %lu\n", r->writes[j].pos,
+		       r->writes[j].size);
+	      fwrite (r->writes[j].data, 1, r->writes[j].size, f);
+	      fputc ('\n', f);
+	    }
+	  for (j = 0; j < r->num_refs; ++j)
+	    save_ref (f, &r->refs[j]);
+	  fputs ("wakes", f);
+	  for (j = 0; j < r->num_wakes; ++j)
+	    fprintf (f, " %u", r->wakes[j]);
+	  fputc ('\n', f);
+	  for (j = 0; j < r->num_levels; ++j)
+	    {
+	      fprintf (f, "level %d", r->levels[j].line);
+	      save_string (f, r->levels[j].name);
+	      save_string (f, r->levels[j].dir);
+	      fputc ('\n', f);
+	    }
+	  digest_record (&sum, r);
+	  fprintf (f, "sum %lx %lx\n", sum.a, sum.b);
+	}
+    }
+  return !ferror (f);
+}
+
+/* read a string which was written by save_string.  Returns 0 if it
+ * can't.  */
+int
+load_string (FILE * f, char **s)
+{
+  unsigned long len;
+  int c;
+  *s = NULL;
+  if (getc (f) != ' ')
+    return 0;
+  if ((c = getc (f)) == '-')
+    return 1;
+  ungetc (c, f);
+  if (fscanf (f, "%lu:", &len) != 1 || !(*s = malloc (len + 1)))
+    return 0;
+  if (fread (*s, 1, len, f) != len)
+    return 0;
+  (*s)[len] = 0;
+  return strlen (*s) == len;
+}
+
+/* read the end of a line, which must be there */
+int
+load_newline (FILE * f)
+{
+  return getc (f) == '\n';
+}
+
+/* check that compiled code can be evaluated, so a damaged file can't
+ * break the assembler.  This is used for objects as well.  */
+int
+valid_code (const struct expr_op *ops, unsigned num_ops,
+	    const struct expr_slot *slots, unsigned num_slots,
+	    const char *input)
+{
+  unsigned i;
+  int depth = 0;
+  size_t len = strlen (input);
+  for (i = 0; i < num_slots; ++i)
+    {
+      if (slots[i].offset > len || slots[i].len > len - slots[i].offset)
+	return 0;
+    }
+  for (i = 0; i < num_ops; ++i)
+    {
+      switch (ops[i].op)
+	{
+	case OP_LABEL:
+	case OP_EXISTS:
+	  if (ops[i].arg < 0 || (unsigned) ops[i].arg >= num_slots)
+	    return 0;
+	  /* fall through */
+	case OP_CONST:
+	case OP_ADDR:
+	  ++depth;
+	  break;
+	case OP_NEG:
+	case OP_NOT:
+	  break;
+	case OP_SELECT:
+	  depth -= 2;
+	  break;
+	default:
+	  if (ops[i].op > OP_MOD)
+	    return 0;
+	  --depth;
+	}
+      if (depth < 1 || depth > MAX_EXPR_DEPTH)
+	return 0;
+    }
+  return depth == 1;
+}
+
+static int
+load_ref (FILE * f, struct record_ref *rr)
+{
+  unsigned i;
+  int type, op;
+  memset (rr, 0, sizeof (struct record_ref));
+  if (fscanf (f, "ref %d %d %d %d %d %lu %ld", &type, &rr->done, &rr->count,
+	      &rr->value, &rr->line, &rr->seq, &rr->oseekpos) != 7
+      || type < TYPE_BSR || type > TYPE_LABEL
+      || !load_string (f, &rr->file) || !rr->file
+      || !load_string (f, &rr->dir))
+    return 0;
+  rr->type = type;
+  if (rr->done)
+    return load_newline (f);
+  if (fscanf (f, " %d %d %d %d %d", &rr->delimiter, &rr->addr,
+	      &rr->baseaddr, &rr->comma, &rr->level) != 5
+      || rr->level < 0 || rr->level >= MAX_INCLUDE
+      || !load_string (f, &rr->input) || !rr->input
+      || fscanf (f, " %d %d %u %u", &rr->has_code, &rr->check,
+		 &rr->num_ops, &rr->num_slots) != 4)
+    return 0;
+  if (!rr->has_code)
+    {
+      rr->num_ops = rr->num_slots = 0;
+      return load_newline (f);
+    }
+  if (rr->num_ops > 0x10000 || rr->num_slots > 0x10000
+      || !(rr->ops = malloc ((rr->num_ops + 1) * sizeof (struct expr_op)))
+      || !(rr->slots = malloc ((rr->num_slots + 1)
+			       * sizeof (struct expr_slot))))
+    return 0;
+  for (i = 0; i < rr->num_ops; ++i)
+    {
+      if (fscanf (f, " %d %d", &op, &rr->ops[i].arg) != 2)
+	return 0;
+      rr->ops[i].op = op < 0 ? OP_MOD + 1 : op;
+    }
+  for (i = 0; i < rr->num_slots; ++i)
+    {
+      rr->slots[i].label = NULL;
+      if (fscanf (f, " %u %u %u", &rr->slots[i].offset, &rr->slots[i].len,
+		  &rr->slots[i].hash) != 3)
+	return 0;
+    }
+  return valid_code (rr->ops, rr->num_ops, rr->slots, rr->num_slots,
+		     rr->input) && load_newline (f);
+}
+
+/* read the rest of a record, and the digest after it into sum */
+static int
+load_record (FILE * f, struct include_record *r, struct digest *sum)
+{
+  unsigned i, n;
+  int end = 0;
+  n = r->num_deps;
+  r->num_deps = 0;
+  if (n && !(r->deps = calloc (n, sizeof (struct include_dep))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      struct include_dep *d = &r->deps[i];
+      ++r->num_deps;
+      if (fscanf (f, "dep %lx %lx", &d->id.a, &d->id.b) != 2
+	  || !load_string (f, &d->name) || !load_string (f, &d->dir)
+	  || !d->name || !load_newline (f))
+	return 0;
+    }
+  n = r->num_labels;
+  r->num_labels = 0;
+  if (n && !(r->labels = calloc (n, sizeof (struct record_label))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      struct record_label *l = &r->labels[i];
+      ++r->num_labels;
+      if (fscanf (f, "label %d %d", &l->value, &l->valid) != 2
+	  || !load_string (f, &l->name) || !l->name || !load_newline (f))
+	return 0;
+      if (!l->valid
+	  && (!(l->ref = malloc (sizeof (struct record_ref)))
+	      || !load_ref (f, l->ref) || l->ref->type != TYPE_LABEL
+	      || l->ref->done))
+	return 0;
+    }
+  n = r->num_writes;
+  r->num_writes = 0;
+  if (n && !(r->writes = calloc (n, sizeof (struct record_write))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      struct record_write *w = &r->writes[i];
+      ++r->num_writes;
+      if (fscanf (f, "write %lu %lu", &w->pos, &w->size) != 2
+	  || !load_newline (f) || !(w->data = malloc (w->size ? w->size : 1))
+	  || fread (w->data, 1, w->size, f) != w->size || !load_newline (f))
+	return 0;
+    }
+  n = r->num_refs;
+  r->num_refs = 0;
+  if (n && !(r->refs = calloc (n, sizeof (struct record_ref))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      ++r->num_refs;
+      if (!load_ref (f, &r->refs[i]) || r->refs[i].type == TYPE_LABEL)
+	return 0;
+    }
+  n = r->num_wakes;
+  r->num_wakes = 0;
+  if (n && !(r->wakes = malloc (n * sizeof (unsigned))))
+    return 0;
+  if (getc (f) != 'w' || fscanf (f, "akes%n", &end) != 0 || end != 4)
+    return 0;
+  for (i = 0; i < n; ++i, ++r->num_wakes)
+    {
+      if (fscanf (f, " %u", &r->wakes[i]) != 1)
+	return 0;
+    }
+  if (!load_newline (f))
+    return 0;
+  /* at least the level of the include itself */
+  n = r->num_levels;
+  r->num_levels = 0;
+  if (!n || n > MAX_INCLUDE
+      || !(r->levels = calloc (n, sizeof (struct record_level))))
+    return 0;
+  for (i = 0; i < n; ++i)
+    {
+      struct record_level *l = &r->levels[i];
+      ++r->num_levels;
+      if (fscanf (f, "level %d", &l->line) != 1
+	  || !load_string (f, &l->name) || !load_string (f, &l->dir)
+	  || !l->name || !load_newline (f))
+	return 0;
+    }
+  return fscanf (f, "sum %lx %lx", &sum->a, &sum->b) == 2
+    && load_newline (f);
+}
+
+int
+z80asm_load_incremental (struct z80asm *z, FILE * f)
+{
+  char header[sizeof (INCREMENTAL_HEADER)];
+  free_records (z);
+  if (!fgets (header, sizeof (header), f)
+      || strcmp (header, INCREMENTAL_HEADER))
+    return 0;
+  while (1)
+    {
+      struct include_record *r;
+      struct digest sum, check;
+      int n, c = getc (f);
+      if (c == EOF)
+	break;
+      ungetc (c, f);
+      if (!(r = calloc (1, sizeof (struct include_record))))
+	{
+	  free_records (z);
+	  return 0;
+	}
+      n = fscanf (f, "record %lx %lx %d %lu %lu %u %u %u %u %u %u",
+		  &r->key.a, &r->key.b, &r->addr, &r->pos, &r->references,
+		  &r->num_deps, &r->num_labels, &r->num_writes,
+		  &r->num_refs, &r->num_wakes, &r->num_levels);
+      if (n != 11 || !load_newline (f))
+	r->num_deps = r->num_labels = r->num_writes = r->num_refs =
+	  r->num_wakes = r->num_levels = 0;
+      /* the records are used by the next run */
+      r->run = z->run + 1;
+      if (n != 11 || !load_record (f, r, &sum))
+	{
+	  free_record (r);
+	  free_records (z);
+	  return 0;
+	}
+      /* a damaged record is dropped; its include is assembled again */
+      digest_record (&check, r);
+      if (!same_digest (&sum, &check))
+	{
+	  free_record (r);
+	  continue;
+	}
+      if (!add_record (z, r))
+	{
+	  free_record (r);
+	  free_records (z);
+	  return 0;
+	}
+    }
+  return !ferror (f);
+}
@@ -0,0 +1,214 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2002-2009 Bas Wijnen <wijnen@debian.org>
+   Copyright (C) 2005 Jan Wilmans <jw@dds.nl>
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* label tables.  Labels are stored in hash tables with open addressing
+ * and linear probing.  The size of a table is always a power of two, and
+ * it is kept at most half full, so lookups need few probes.  */
+
+/* compute the hash of a label name (FNV-1a) */
+unsigned
+hash_label (const char *name, unsigned len)
+{
+  unsigned long h = 2166136261UL;
+  unsigned i;
+  for (i = 0; i < len; ++i)
+    h = ((h ^ (unsigned char) name[i]) * 16777619UL) & 0xffffffffUL;
+  return h;
+}
+
+/* find a label in a table, return NULL if it isn't there */
+struct label *
+find_label (struct z80asm *z, struct label_table *table, const char *name,
+	    unsigned len, unsigned hash)
+{
+  unsigned mask, i;
+  struct label *l;
+  ++z->stats.label_lookups;
+  if (!table->count)
+    return NULL;
+  mask = table->size - 1;
+  for (i = hash & mask; (l = table->slots[i]); i = (i + 1) & mask)
+    {
+      ++z->stats.label_probes;
+      if (l->hash == hash && l->len == len && !memcmp (l->name, name, len))
+	return l;
+    }
+  return NULL;
+}
+
+/* compute the digest of the state of a label */
+void
+label_digest (const struct label *l, struct digest *d)
+{
+  digest_init (d);
+  digest_add (d, l->name, l->len);
+  digest_add_int (d, (unsigned long) l->value);
+  digest_add_int (d, l->valid);
+}
+
+/* add or remove the state of a label to or from the digest of its
+ * table.  The digest doesn't depend on the order of the labels.  */
+static void
+toggle_digest (struct label_table *table, const struct label *l)
+{
+  struct digest d;
+  label_digest (l, &d);
+  table->digest.a ^= d.a;
+  table->digest.b ^= d.b;
+}
+
+/* double the size of a table (or create it) */
+static int
+grow_label_table (struct label_table *table)
+{
+  struct label **slots;
+  unsigned size = table->size ? table->size * 2 : 16;
+  unsigned i;
+  slots = calloc (size, sizeof (struct label *));
+  if (!slots)
+    return 0;
+  for (i = 0; i < table->size; ++i)
+    {
+      struct label *l = table->slots[i];
+      unsigned j;
+      if (!l)
+	continue;
+      for (j = l->hash & (size - 1); slots[j]; j = (j + 1) & (size - 1))
+	{
+	}
+      slots[j] = l;
+    }
+  free (table->slots);
+  table->slots = slots;
+  table->size = size;
+  return 1;
+}
+
+/* add a label to a table.  Its hash and len must be filled in, and it
+ * must not be in the table yet.  Returns 0 if there is no memory.  */
+int
+add_label (struct label_table *table, struct label *l)
+{
+  unsigned mask, i;
+  if (2 * (table->count + 1) > table->size && !grow_label_table (table))
+    return 0;
+  mask = table->size - 1;
+  for (i = l->hash & mask; table->slots[i]; i = (i + 1) & mask)
+    {
+    }
+  table->slots[i] = l;
+  table->count++;
+  l->table = table;
+  toggle_digest (table, l);
+  return 1;
+}
+
+/* change the value of a label */
+void
+set_label (struct label *l, int valid, int value)
+{
+  if (l->table)
+    toggle_digest (l->table, l);
+  l->valid = valid;
+  l->value = value;
+  if (l->table)
+    toggle_digest (l->table, l);
+}
+
+/* remove a label from a table.  The label itself is not freed.  */
+void
+remove_label (struct label_table *table, struct label *l)
+{
+  unsigned mask, i, j;
+  if (!table->count)
+    return;
+  mask = table->size - 1;
+  for (i = l->hash & mask; table->slots[i] != l; i = (i + 1) & mask)
+    {
+      if (!table->slots[i])
+	return;
+    }
+  table->slots[i] = NULL;
+  table->count--;
+  toggle_digest (table, l);
+  l->table = NULL;
+  /* move following entries back, so no lookup stops at the hole */
+  for (j = (i + 1) & mask; table->slots[j]; j = (j + 1) & mask)
+    {
+      unsigned k = table->slots[j]->hash & mask;
+      if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+	continue;
+      table->slots[i] = table->slots[j];
+      table->slots[j] = NULL;
+      i = j;
+    }
+}
+
+/* empty a table.  The labels are in an arena, but their references must
+ * stop waiting for other labels.  */
+void
+free_labels (struct z80asm *z, struct label_table *table)
+{
+  unsigned i;
+  for (i = 0; i < table->size; ++i)
+    {
+      struct label *l = table->slots[i];
+      if (l && l->ref)
+	forget_reference (z, l->ref);
+    }
+  free (table->slots);
+  table->slots = NULL;
+  table->size = 0;
+  table->count = 0;
+  table->digest.a = 0;
+  table->digest.b = 0;
+}
+
+static int
+compare_labels (const void *a, const void *b)
+{
+  return strcmp ((*(struct label *const *) a)->name,
+		 (*(struct label *const *) b)->name);
+}
+
+/* return a mallocced array with all labels of a table, sorted by name.
+ * The number of labels is table->count.  Returns NULL if the table is
+ * empty or there is no memory.  */
+struct label **
+sort_labels (struct label_table *table)
+{
+  struct label **ret;
+  unsigned i, n = 0;
+  if (!table->count)
+    return NULL;
+  ret = malloc (table->count * sizeof (struct label *));
+  if (!ret)
+    return NULL;
+  for (i = 0; i < table->size; ++i)
+    {
+      if (table->slots[i])
+	ret[n++] = table->slots[i];
+    }
+  qsort (ret, n, sizeof (struct label *), compare_labels);
+  return ret;
+}
@@ -0,0 +1,256 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2002-2009 Bas Wijnen <wijnen@debian.org>
+   Copyright (C) 2005 Jan Wilmans <jw@dds.nl>
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LIBZ80ASM_H
+#define LIBZ80ASM_H
+
+#include <stdio.h>
+
+/* The assembler as a library.  All state of an assembly is kept in a
+ * context, so a program can assemble many times, and several contexts can
+ * be used at the same time (one per thread).  A context is used like this:
+ *
+ *   struct z80asm *z = z80asm_create ();
+ *   z80asm_add_source (z, "main.asm");
+ *   if (z80asm_assemble (z) == 0)
+ *     image = z80asm_get_image (z, &size);
+ *   z80asm_destroy (z);
+ *
+ * Errors and warnings are printed on stderr, unless they are captured
+ * with z80asm_set_capture.  Functions which return an int return 0 on
+ * failure, unless documented otherwise.  */
+
+struct z80asm;
+
+/* a function which gives the contents of a file, see z80asm_set_reader.
+ * If the file exists, it sets *data and *size and returns nonzero.  The
+ * data must stay valid and unchanged until z80asm_assemble returns.  */
+typedef int z80asm_read_file (void *user, const char *name,
+			      const char **data, unsigned long *size);
+
+/* a label of the assembled program */
+struct z80asm_symbol
+{
+  const char *name;
+  int value;
+};
+
+/* an error or warning */
+struct z80asm_diagnostic
+{
+  const char *file;		/* NULL if it is not about a source line */
+  int line;
+  int error;			/* 0 for a warning */
+  const char *message;		/* without a trailing newline */
+};
+
+/* the phases of an assembly, which z80asm_get_stats times */
+enum z80asm_phase
+{
+  Z80ASM_PHASE_READ,		/* reading source lines */
+  Z80ASM_PHASE_PARSE,		/* everything else of a line */
+  Z80ASM_PHASE_ENCODE,		/* computing and writing operands */
+  Z80ASM_PHASE_RESOLVE,		/* computing references */
+  Z80ASM_PHASE_LIST,		/* making and writing the listing */
+  Z80ASM_PHASE_OUTPUT,		/* writing the other files */
+  Z80ASM_NUM_PHASES
+};
+
+/* what the last run did.  The times are in seconds; they are only kept
+ * if z80asm_set_stats was called, the counters always.  The time of
+ * reading, parsing and encoding lines is estimated from samples.  */
+struct z80asm_stats
+{
+  double wall[Z80ASM_NUM_PHASES];
+  /* of the calling thread, divided over the phases like wall */
+  double cpu[Z80ASM_NUM_PHASES];
+  unsigned long lines;		/* source and macro lines read */
+  unsigned long macro_expansions;
+  unsigned long indx_calls;	/* operand pattern matches */
+  unsigned long operand_reads;	/* operand expressions which were read */
+  unsigned long operand_reuses;	/* times one of them was used again */
+  unsigned long label_lookups;
+  unsigned long label_probes;	/* hash table entries which were tried */
+  unsigned long operands;	/* values which new_reference wrote */
+  unsigned long immediate;	/* of them, computed at once */
+  unsigned long deferred;	/* of them, made into references */
+  unsigned long compute_refs;	/* times a reference was computed */
+  unsigned long bytes;		/* bytes written to the output */
+};
+
+/* categories of trace points, for z80asm_set_trace */
+enum z80asm_trace_category
+{
+  Z80ASM_TRACE_LEXER = 1,	/* lines, mnemonics, numbers, expressions */
+  Z80ASM_TRACE_LABELS = 2,	/* definitions and lookups */
+  Z80ASM_TRACE_REFS = 4,	/* operands and references */
+  Z80ASM_TRACE_MACROS = 8,	/* definitions and expansions */
+  Z80ASM_TRACE_OUTPUT = 16,	/* bytes written */
+  Z80ASM_TRACE_ALL = 31
+};
+
+/* create a context.  Returns NULL if there is no memory.  It may be
+ * called from several threads at once.  */
+struct z80asm *z80asm_create (void);
+
+/* free a context and everything which belongs to it */
+void z80asm_destroy (struct z80asm *z);
+
+/* forget the sources, the include path, the files which were added with
+ * z80asm_add_file and all settings, so the context can be used for an
+ * unrelated assembly.  Files which were read and memory which was
+ * allocated are kept, so the next run is faster.  */
+void z80asm_reset (struct z80asm *z);
+
+/* set the level of debugging output on stderr (the number of -v) */
+void z80asm_set_verbose (struct z80asm *z, int level);
+
+/* if nonzero, the output is used even if there were errors */
+void z80asm_set_force (struct z80asm *z, int force);
+
+/* if nonzero, a listing is collected for z80asm_write_listing */
+void z80asm_set_listing (struct z80asm *z, int listing);
+
+/* read all files (sources, includes and incbin files) through read_file
+ * instead of the file system.  The names it is called with are the same
+ * which would be opened otherwise, including the include path.  If
+ * read_file is NULL, the file system is used again.  */
+void z80asm_set_reader (struct z80asm *z, z80asm_read_file *read_file,
+			void *user);
+
+/* if nonzero, errors and warnings are collected for
+ * z80asm_get_diagnostics instead of printed */
+void z80asm_set_capture (struct z80asm *z, int capture);
+
+/* if nonzero, every include file which is assembled is recorded, and when
+ * it is included again in the same state (the same contents of it and the
+ * files it includes, the same address and the same labels and macros) it
+ * is replayed from the record instead of assembled.  The output is the
+ * same.  The records are kept in the context for the next run; those
+ * which were not used in a run are dropped at its end.  Nothing is
+ * replayed while a listing is collected.  */
+void z80asm_set_incremental (struct z80asm *z, int incremental);
+
+/* if nonzero, the sources are assembled into a relocatable object for
+ * z80asm_write_object.  Addresses before the first org are relative to
+ * the place where the object is linked.  Incremental assembly is not
+ * used for it.  */
+void z80asm_set_object (struct z80asm *z, int object);
+
+/* if nonzero, the time of every phase is measured for
+ * z80asm_get_stats.  This makes assembly a little slower.  */
+void z80asm_set_stats (struct z80asm *z, int stats);
+
+/* the largest number of trace records which is kept */
+#define Z80ASM_MAX_TRACE_SIZE (1UL << 24)
+
+/* record the trace points of categories (a mask of
+ * z80asm_trace_category) in a ring buffer, which keeps the last size
+ * records of a run.  A larger size than Z80ASM_MAX_TRACE_SIZE is
+ * reduced to it.  Returns 0 if there is no memory, or if the library
+ * was built without tracing.  0 categories turns tracing off.  The
+ * buffer belongs to the context and has no lock, so, like everything
+ * else in a context, it must only be used by one thread at a time.
+ * Contexts on other threads have their own buffers.  */
+int z80asm_set_trace (struct z80asm *z, unsigned categories,
+		      unsigned long size);
+
+/* add a directory to the include path.  Directories which are added
+ * later are searched first.  */
+int z80asm_add_include (struct z80asm *z, const char *dir);
+
+/* add a source file to assemble; "-" means standard input.  The files
+ * are assembled in the order they are added.  */
+int z80asm_add_source (struct z80asm *z, const char *name);
+
+/* add an object which z80asm_write_object wrote.  It is placed where the
+ * previous input ended, and its references are resolved with the labels
+ * of all inputs, so linking objects gives the same output as assembling
+ * their sources together.  */
+int z80asm_add_object (struct z80asm *z, const char *name);
+
+/* add a source which is in memory.  name is used in messages.  The data
+ * is not copied; it must stay valid until the context is destroyed.  */
+int z80asm_add_source_buffer (struct z80asm *z, const char *name,
+			      const char *data, unsigned long size);
+
+/* use data as the contents of the file name, instead of reading it.  This
+ * works for sources, includes and incbin files.  name must be the name
+ * which would be opened, so for a file from the include path it starts
+ * with the directory.  The data is not copied; it must stay valid until
+ * the context is reset or destroyed.  */
+int z80asm_add_file (struct z80asm *z, const char *name, const char *data,
+		     unsigned long size);
+
+/* assemble all source files.  Returns the number of errors.  This may be
+ * called again, for example after the files have changed; the results of
+ * the previous run are then freed.  */
+int z80asm_assemble (struct z80asm *z);
+
+/* the output of the last run.  It belongs to the context.  */
+const unsigned char *z80asm_get_image (struct z80asm *z,
+				       unsigned long *size);
+
+/* the global labels of the last run, sorted by name.  Returns NULL if
+ * there are none, or if there is no memory; *count is set to the number
+ * of labels.  The array belongs to the context.  */
+const struct z80asm_symbol *z80asm_get_symbols (struct z80asm *z,
+						unsigned *count);
+
+/* the errors and warnings of the last run, in the order in which they
+ * were found, if they were captured.  The array belongs to the
+ * context.  */
+const struct z80asm_diagnostic *z80asm_get_diagnostics (struct z80asm *z,
+							unsigned *count);
+
+/* the statistics of the last run.  They belong to the context.  The
+ * writing functions below add their time to the output or list phase,
+ * so this can be called after them.  */
+const struct z80asm_stats *z80asm_get_stats (struct z80asm *z);
+
+/* write the output of the last run to f.  It is flushed, and the image
+ * is written to its file descriptor.  */
+int z80asm_write_image (struct z80asm *z, FILE * f);
+
+/* write the listing of the last run to f */
+int z80asm_write_listing (struct z80asm *z, FILE * f);
+
+/* write all global labels of the last run to f, as equ statements with
+ * prefix before every name */
+int z80asm_write_labels (struct z80asm *z, FILE * f, const char *prefix);
+
+/* write the object of the last run to f.  Returns 0 on failure, or if
+ * no object was assembled.  */
+int z80asm_write_object (struct z80asm *z, FILE * f);
+
+/* write the trace of the last run to f, as JSON if json is nonzero and
+ * in the binary format which is described in trace.c otherwise.  Returns
+ * 0 on failure, or if there was no trace.  */
+int z80asm_write_trace (struct z80asm *z, FILE * f, int json);
+
+/* write the records of incremental assembly to f, or read them from f,
+ * so they can be used in another process.  Reading replaces the records
+ * of the context.  Both return 0 on failure; a file which can't be
+ * parsed leaves no records.  */
+int z80asm_save_incremental (struct z80asm *z, FILE * f);
+int z80asm_load_incremental (struct z80asm *z, FILE * f);
+
+#endif
@@ -0,0 +1,338 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2002-2009 Bas Wijnen <wijnen@debian.org>
+   Copyright (C) 2005 Jan Wilmans <jw@dds.nl>
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* the list file.  While assembling, the listing is collected as records:
+ * literal text (such as file headers), and source lines with their
+ * address and the items which were written for them (bytes, or markers
+ * for strings and ds).  Items can be changed when references are
+ * resolved.  After assembling, everything is formatted in one pass.  */
+
+enum list_record_type
+{
+  RECORD_TEXT,			/* literal text */
+  RECORD_LINE			/* source line */
+};
+
+struct list_record
+{
+  enum list_record_type type;
+  int addr;			/* address at start of line */
+  unsigned long first, last;	/* items of the line */
+  unsigned long text, len;	/* text, or source of line, in chars */
+  int has_source;		/* if the source of the line is known */
+};
+
+struct listing
+{
+  struct list_record *records;
+  unsigned long num_records, max_records;
+  /* items are stored as (type << 8) | value */
+  unsigned short *items;
+  unsigned long num_items, max_items;
+  /* position where the next item is written, see list_seek */
+  unsigned long item_pos;
+  char *chars;
+  unsigned long num_chars, max_chars;
+  int failed;			/* if memory ran out */
+};
+
+/* make sure there is room for more elements in an array.  Returns 0 if
+ * there is no memory; the listing is then incomplete.  */
+static int
+grow (struct listing *l, void *array, unsigned long *max,
+      unsigned long needed, size_t size)
+{
+  unsigned long new_max = *max ? *max : 256;
+  void *ret;
+  if (needed <= *max)
+    return 1;
+  while (new_max < needed)
+    new_max *= 2;
+  if (!(ret = realloc (*(void **) array, new_max * size)))
+    {
+      l->failed = 1;
+      return 0;
+    }
+  *(void **) array = ret;
+  *max = new_max;
+  return 1;
+}
+
+/* create an empty listing.  Returns NULL if there is no memory.  */
+struct listing *
+new_listing (void)
+{
+  return calloc (1, sizeof (struct listing));
+}
+
+static struct list_record *
+new_record (struct listing *l, enum list_record_type type)
+{
+  struct list_record *r;
+  if (!grow (l, &l->records, &l->max_records, l->num_records + 1,
+	     sizeof (struct list_record)))
+    return NULL;
+  r = &l->records[l->num_records++];
+  r->type = type;
+  r->addr = 0;
+  r->first = r->last = l->num_items;
+  r->text = r->len = 0;
+  r->has_source = 0;
+  return r;
+}
+
+static int
+store_chars (struct listing *l, const char *text, unsigned long len)
+{
+  if (!grow (l, &l->chars, &l->max_chars, l->num_chars + len, 1))
+    return 0;
+  memcpy (l->chars + l->num_chars, text, len);
+  l->num_chars += len;
+  return 1;
+}
+
+/* add literal text to the listing */
+void
+list_text (struct listing *l, const char *text)
+{
+  struct list_record *r;
+  unsigned long len = strlen (text);
+  /* extend the previous record if it is text as well */
+  if (l->num_records && l->records[l->num_records - 1].type == RECORD_TEXT)
+    r = &l->records[l->num_records - 1];
+  else
+    {
+      if (!(r = new_record (l, RECORD_TEXT)))
+	return;
+      r->text = l->num_chars;
+    }
+  if (store_chars (l, text, len))
+    r->len += len;
+}
+
+/* start a new line in the listing, at address */
+void
+list_line (struct listing *l, int address)
+{
+  struct list_record *r = new_record (l, RECORD_LINE);
+  if (r)
+    r->addr = address;
+}
+
+/* end the current line with its source */
+void
+list_source (struct listing *l, const char *source)
+{
+  struct list_record *r;
+  unsigned long len = strlen (source);
+  if (!l->num_records || l->records[l->num_records - 1].type != RECORD_LINE)
+    return;
+  r = &l->records[l->num_records - 1];
+  r->text = l->num_chars;
+  if (!store_chars (l, source, len))
+    return;
+  r->len = len;
+  r->has_source = 1;
+}
+
+/* add an item to the current line, or change it, if list_seek was used */
+void
+list_item (struct listing *l, enum list_item_type type, int value)
+{
+  if (l->item_pos == l->num_items)
+    {
+      if (!grow (l, &l->items, &l->max_items, l->num_items + 1,
+		 sizeof (unsigned short)))
+	return;
+      ++l->num_items;
+      if (l->num_records
+	  && l->records[l->num_records - 1].type == RECORD_LINE)
+	l->records[l->num_records - 1].last = l->num_items;
+    }
+  l->items[l->item_pos++] = (type << 8) | (value & 0xff);
+}
+
+/* position of the next item, to be used with list_seek */
+unsigned long
+list_tell (struct listing *l)
+{
+  return l->item_pos;
+}
+
+/* make list_item change items from pos on */
+void
+list_seek (struct listing *l, unsigned long pos)
+{
+  l->item_pos = pos;
+}
+
+static const char hex[] = "0123456789abcdef";
+
+/* buffer for formatting the listing */
+struct list_out
+{
+  FILE *f;
+  int failed;			/* if writing failed */
+  unsigned len;
+  char buf[0x10000];
+};
+
+static void
+flush_out (struct list_out *o)
+{
+  if (o->len && !o->failed && fwrite (o->buf, 1, o->len, o->f) != o->len)
+    o->failed = 1;
+  o->len = 0;
+}
+
+static void
+put_chars (struct list_out *o, const char *text, unsigned long len)
+{
+  while (len)
+    {
+      unsigned long n = sizeof (o->buf) - o->len;
+      if (n > len)
+	n = len;
+      memcpy (o->buf + o->len, text, n);
+      o->len += n;
+      text += n;
+      len -= n;
+      if (o->len == sizeof (o->buf))
+	flush_out (o);
+    }
+}
+
+/* format a number like printf ("%04x") */
+static void
+put_addr (struct list_out *o, int value)
+{
+  char buf[16];
+  unsigned v = value, i = sizeof (buf);
+  do
+    {
+      buf[--i] = hex[v & 0xf];
+      v >>= 4;
+    }
+  while (v || sizeof (buf) - i < 4);
+  put_chars (o, &buf[i], sizeof (buf) - i);
+}
+
+/* format the items of a line, return the width in the same way as it
+ * was counted before: 3 for bytes and strings, 6 for ds.  */
+static int
+put_items (struct list_out *o, const struct listing *l, unsigned long first,
+	   unsigned long last)
+{
+  char buf[10];
+  int width = 0;
+  unsigned long i;
+  for (i = first; i < last; ++i)
+    {
+      int value = l->items[i] & 0xff;
+      switch (l->items[i] >> 8)
+	{
+	case LIST_BYTE:
+	  buf[0] = ' ';
+	  buf[1] = hex[value >> 4];
+	  buf[2] = hex[value & 0xf];
+	  put_chars (o, buf, 3);
+	  width += 3;
+	  break;
+	case LIST_STRING:
+	  put_chars (o, " ..", 3);
+	  width += 3;
+	  break;
+	case LIST_DS:
+	  memcpy (buf, " 0x", 3);
+	  buf[3] = hex[value >> 4];
+	  buf[4] = hex[value & 0xf];
+	  memcpy (&buf[5], "...", 3);
+	  put_chars (o, buf, 8);
+	  width += 6;
+	  break;
+	case LIST_DS0:
+	  put_chars (o, " 00...", 6);
+	  width += 6;
+	  break;
+	}
+    }
+  return width;
+}
+
+/* format the listing and write it to f.  Returns 0 and sets errno if
+ * the listing is incomplete or can't be written.  */
+int
+write_listing (const struct listing *l, FILE * f)
+{
+  struct list_out *o;
+  unsigned long i;
+  int ret;
+  if (l->failed)
+    {
+      errno = ENOMEM;
+      return 0;
+    }
+  if (!(o = malloc (sizeof (struct list_out))))
+    return 0;
+  o->f = f;
+  o->failed = 0;
+  o->len = 0;
+  for (i = 0; i < l->num_records; ++i)
+    {
+      const struct list_record *r = &l->records[i];
+      int depth;
+      if (r->type == RECORD_TEXT)
+	{
+	  put_chars (o, l->chars + r->text, r->len);
+	  continue;
+	}
+      put_addr (o, r->addr);
+      depth = 4 + put_items (o, l, r->first, r->last);
+      if (!r->has_source)
+	continue;
+      if (depth < 8)
+	put_chars (o, "\t\t\t", 3);
+      else if (depth < 16)
+	put_chars (o, "\t\t", 2);
+      else
+	put_chars (o, "\t", 1);
+      put_chars (o, l->chars + r->text, r->len);
+      put_chars (o, "\n", 1);
+    }
+  flush_out (o);
+  ret = !o->failed;
+  free (o);
+  return ret;
+}
+
+/* free a listing */
+void
+free_listing (struct listing *l)
+{
+  if (!l)
+    return;
+  free (l->records);
+  free (l->items);
+  free (l->chars);
+  free (l);
+}
@@ -0,0 +1,1347 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2002-2009 Bas Wijnen <wijnen@debian.org>
+   Copyright (C) 2005 Jan Wilmans <jw@dds.nl>
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The z80asm program.  It parses the command line and writes the files;
+ * the assembling is done by the library, see libz80asm.h.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <getopt.h>
+#include "libz80asm.h"
+
+/* default include file location */
+#define DEFAULT_INCLUDE "/usr/share/z80asm/headers/"
+
+/* files */
+static FILE *realoutputfile, *reallistfile, *labelfile;
+static const char *realoutputfilename;
+static const char *labelfilename;
+/* prefix for labels in labelfile */
+static const char *labelprefix = "";
+/* bools to see if files are opened */
+static int havelist = 0, label = 0;
+/* increased for every -v option on the command line */
+static int verbose = 0;
+/* Produce output even with errors.  */
+static int use_force = 0;
+/* manifest for batch mode, and the number of threads to use for it */
+static const char *batchname;
+static int num_threads;
+/* socket for server mode; it is removed when the server is killed */
+static const char *servename;
+/* file with the records of incremental assembly */
+static const char *incrementalname;
+/* write a relocatable object, or link objects */
+static int object = 0, linking = 0;
+/* print statistics at the end */
+static int stats = 0;
+/* categories of trace points, the number of records which are kept, and
+ * where and how they are written */
+static unsigned trace = 0;
+static unsigned long trace_size = 1 << 20;
+static FILE *tracefile;
+static int havetrace = 0, trace_json = 1;
+
+static const struct option opts[] = {
+  {"help", no_argument, NULL, 'h'},
+  {"version", no_argument, NULL, 'V'},
+  {"verbose", no_argument, NULL, 'v'},
+  {"list", optional_argument, NULL, 'l'},
+  {"label", optional_argument, NULL, 'L'},
+  {"input", required_argument, NULL, 'i'},
+  {"output", required_argument, NULL, 'o'},
+  {"label-prefix", required_argument, NULL, 'p'},
+  {"includepath", required_argument, NULL, 'I'},
+  {"force", no_argument, NULL, 'f'},
+  {"batch", required_argument, NULL, 'b'},
+  {"jobs", required_argument, NULL, 'j'},
+  {"serve", required_argument, NULL, 's'},
+  {"incremental", required_argument, NULL, 'r'},
+  {"compile", no_argument, NULL, 'c'},
+  {"link", no_argument, NULL, 'k'},
+  {"stats", no_argument, NULL, 'S'},
+  {"trace", required_argument, NULL, 'T'},
+  {"trace-size", required_argument, NULL, 'Z'},
+  {"trace-json", required_argument, NULL, 'J'},
+  {"trace-binary", required_argument, NULL, 'B'},
+  {NULL, 0, NULL, 0}
+};
+static const char short_opts[] = "hVvl::L::i:o:p:I:fb:j:s:r:c";
+
+static void
+out_of_memory (void)
+{
+  fprintf (stderr, "Error: insufficient memory\n");
+  exit (1);
+}
+
+static void
+add_source (struct z80asm *z, const char *name)
+{
+  if (!z80asm_add_source (z, name))
+    out_of_memory ();
+}
+
+static void
+add_object (struct z80asm *z, const char *name)
+{
+  if (!z80asm_add_object (z, name))
+    out_of_memory ();
+}
+
+static void
+add_include (struct z80asm *z, const char *name)
+{
+  if (!z80asm_add_include (z, name))
+    out_of_memory ();
+}
+
+/* parse the categories of --trace, separated by commas */
+static unsigned
+parse_trace (const char *arg)
+{
+  static const char *const names[] = {
+    "lexer", "labels", "refs", "macros", "output"
+  };
+  unsigned categories = 0, i, len;
+  while (*arg)
+    {
+      len = strcspn (arg, ",");
+      if (len == 3 && !strncmp (arg, "all", 3))
+	categories |= Z80ASM_TRACE_ALL;
+      else
+	{
+	  for (i = 0; i < sizeof (names) / sizeof (names[0]); ++i)
+	    if (strlen (names[i]) == len && !strncmp (arg, names[i], len))
+	      break;
+	  if (i == sizeof (names) / sizeof (names[0]))
+	    {
+	      fprintf (stderr, "Error: unknown trace category: %.*s\n",
+		       (int) len, arg);
+	      exit (1);
+	    }
+	  categories |= 1 << i;
+	}
+      arg += len;
+      if (*arg)
+	++arg;
+    }
+  if (!categories)
+    {
+      fprintf (stderr, "Error: no trace categories\n");
+      exit (1);
+    }
+  return categories;
+}
+
+/* callback function for argument parser, used to open output files. */
+static FILE *
+openfile (int *done,		/* flag to check that a file is opened only once. */
+	  const char *type,	/* name of filetype for error message */
+	  FILE * def,		/* default value, in case "-" is specified */
+	  const char *name,	/* filename to open */
+	  const char *flags)	/* open flags */
+{
+  FILE *retval;
+  if (*done)
+    {
+      fprintf (stderr, "Error: more than one %s specified\n", type);
+      exit (1);
+    }
+  *done = 1;
+  if (def && (!name || (name[0] == '-' && name[1] == 0)))
+    {
+      return def;
+    }
+  if (!name || !name[0])
+    {
+      fprintf (stderr, "Error: no %s specified\n", type);
+      exit (1);
+    }
+  if (!(retval = fopen (name, flags)))
+    {
+      fprintf (stderr, "Unable to open %s %s: %s\n",
+	       type, name, strerror (errno));
+      exit (1);
+    }
+  return retval;
+}
+
+/* parse commandline arguments */
+static void
+parse_commandline (struct z80asm *z, int argc, char **argv)
+{
+  int done = 0, i, out = 0, sources = 0;
+  char *end;
+  /* the inputs are added when it is known if they are objects */
+  const char **inputs = malloc (argc * sizeof (char *));
+  if (!inputs)
+    out_of_memory ();
+  while (!done)
+    {
+      switch (getopt_long (argc, argv, short_opts, opts, NULL))
+	{
+	case 'h':
+	  /* split in parts, to avoid too long string constants */
+	  printf ("Usage: %s [options] [input files]\n"
+		  "\n"
+		  "Possible options are:\n"
+		  "-h\t--help\t\tDisplay this help text and exit.\n"
+		  "-V\t--version\tDisplay version information and exit.\n"
+		  "-v\t--verbose\tBe verbose.  "
+		  "Specify again to be more verbose.\n"
+		  "-l\t--list\t\tWrite a list file.\n"
+		  "-L\t--label\t\tWrite a label file.\n", argv[0]);
+	  printf ("-p\t--label-prefix\tprefix all labels with this prefix.\n"
+		  "-i\t--input\t\tSpecify an input file (-i may be omitted).\n"
+		  "-o\t--output\tSpecify the output file.\n"
+		  "-I\t--includepath\tAdd a directory to the include path.\n"
+		  "-b\t--batch\t\tAssemble every line of this manifest "
+		  "as a separate job.\n"
+		  "-j\t--jobs\t\tNumber of threads for --batch.\n");
+	  printf ("-s\t--serve\t\tAnswer requests on this UNIX socket.\n"
+		  "-r\t--incremental\tKeep results in this file, to only "
+		  "assemble\n\t\t\tchanged files next time.\n"
+		  "-c\t--compile\tWrite a relocatable object.\n"
+		  "\t--link\t\tLink objects instead of assembling "
+		  "sources.\n"
+		  "\t--stats\t\tPrint where the time went at the end.\n");
+	  printf ("\t--trace\t\tRecord these trace points (lexer, labels,"
+		  "\n\t\t\trefs, macros, output or all).\n"
+		  "\t--trace-size\tNumber of trace records which are kept.\n"
+		  "\t--trace-json\tWrite the trace to this file as JSON.\n"
+		  "\t--trace-binary\tWrite the trace to this file as binary.\n"
+		  "Please send bug reports and feature requests to "
+		  "<shevek@fmf.nl>\n");
+	  exit (0);
+	case 'V':
+	  printf ("Z80 assembler version " VERSION "\n"
+		  "Copyright (C) 2002-2007 Bas Wijnen "
+		  "<shevek@fmf.nl>.\n"
+		  "Copyright (C) 2005 Jan Wilmans "
+		  "<jw@dds.nl>.\n"
+		  "This program comes with ABSOLUTELY NO WARRANTY.\n"
+		  "You may distribute copies of the program under the terms\n"
+		  "of the GNU General Public License as published by\n"
+		  "the Free Software Foundation; either version 2 of the\n"
+		  "License, or (at your option) any later version.\n\n"
+		  "The complete text of the GPL can be found in\n"
+		  "/usr/share/common-licenses/GPL.\n");
+	  exit (0);
+	case 'v':
+	  z80asm_set_verbose (z, ++verbose);
+	  if (verbose >= 5)
+	    fprintf (stderr, "Verbosity increased to level %d\n", verbose);
+	  break;
+	case 'o':
+	  realoutputfile
+	    = openfile (&out, "output file", stdout, optarg, "wb");
+	  realoutputfilename = optarg;
+	  if (verbose >= 5)
+	    fprintf (stderr, "Opened outputfile\n");
+	  break;
+	case 'i':
+	  inputs[sources++] = optarg;
+	  break;
+	case 'l':
+	  reallistfile
+	    = openfile (&havelist, "list file", stderr, optarg, "w");
+	  if (verbose >= 5)
+	    fprintf (stderr, "Opened list file\n");
+	  break;
+	case 'L':
+	  labelfile = openfile (&label, "label file", stderr, optarg, "w");
+	  labelfilename = optarg;
+	  if (verbose >= 5)
+	    fprintf (stderr, "Opened label file\n");
+	  break;
+	case 'p':
+	  labelprefix = optarg;
+	  break;
+	case 'I':
+	  add_include (z, optarg);
+	  break;
+	case 'f':
+	  use_force = 1;
+	  z80asm_set_force (z, 1);
+	  break;
+	case 'b':
+	  batchname = optarg;
+	  break;
+	case 's':
+	  servename = optarg;
+	  break;
+	case 'r':
+	  incrementalname = optarg;
+	  break;
+	case 'c':
+	  object = 1;
+	  break;
+	case 'k':
+	  linking = 1;
+	  break;
+	case 'S':
+	  stats = 1;
+	  z80asm_set_stats (z, 1);
+	  break;
+	case 'T':
+	  trace = parse_trace (optarg);
+	  break;
+	case 'Z':
+	  trace_size = strtoul (optarg, &end, 0);
+	  if (!trace_size || *end || trace_size > Z80ASM_MAX_TRACE_SIZE)
+	    {
+	      fprintf (stderr, "Error: invalid trace size: %s\n", optarg);
+	      exit (1);
+	    }
+	  break;
+	case 'J':
+	  tracefile = openfile (&havetrace, "trace file", stderr, optarg,
+				"w");
+	  break;
+	case 'B':
+	  tracefile = openfile (&havetrace, "trace file", stderr, optarg,
+				"wb");
+	  trace_json = 0;
+	  break;
+	case 'j':
+	  num_threads = atoi (optarg);
+	  if (num_threads < 1)
+	    {
+	      fprintf (stderr, "Error: invalid number of jobs: %s\n", optarg);
+	      exit (1);
+	    }
+	  break;
+	case -1:
+	  done = 1;
+	  break;
+	default:
+	  /* errors are handled by getopt_long */
+	  break;
+	}
+    }
+  for (i = optind; i < argc; ++i)
+    inputs[sources++] = argv[i];
+  for (i = 0; i < sources; ++i)
+    {
+      if (linking)
+	add_object (z, inputs[i]);
+      else
+	add_source (z, inputs[i]);
+    }
+  free (inputs);
+  if (object && (linking || havelist || label || incrementalname))
+    {
+      fprintf (stderr, "Error: --compile can't be used with --link, --list, "
+	       "--label or --incremental\n");
+      exit (1);
+    }
+  if (batchname || servename)
+    {
+      if (sources || out || havelist || label || incrementalname || object
+	  || linking || stats || trace || havetrace
+	  || (batchname && servename))
+	{
+	  fprintf (stderr, "Error: --batch and --serve can't be used "
+		   "together or with other files\n");
+	  exit (1);
+	}
+      return;
+    }
+  if (!sources && linking)
+    {
+      fprintf (stderr, "Error: no objects to link\n");
+      exit (1);
+    }
+  if (!sources)
+    add_source (z, "-");
+  z80asm_set_listing (z, havelist);
+  z80asm_set_object (z, object);
+  if (havetrace && !trace)
+    {
+      fprintf (stderr, "Error: a trace file needs --trace\n");
+      exit (1);
+    }
+  if (trace && !z80asm_set_trace (z, trace, trace_size))
+    {
+      fprintf (stderr, "Error: unable to trace; tracing must be built in "
+	       "with make TRACE=1\n");
+      exit (1);
+    }
+  if (trace && !havetrace)
+    tracefile = stderr;
+  if (!out)
+    {
+      realoutputfile = openfile (&out, "output file", stdout,
+				 object ? "a.o" : "a.bin", "wb");
+    }
+}
+
+/* batch mode.  Every line of the manifest is the command line of one
+ * assembly, without the program name.  The jobs are run by a pool of
+ * threads, each with its own context; a thread takes the next job from
+ * the manifest when it is done with one.  The messages of a job are
+ * collected, and printed in the order of the manifest.  */
+
+/* a file which is given in memory */
+struct override
+{
+  struct override *next;
+  char *name;
+  char *data;
+  unsigned long size;
+};
+
+struct job
+{
+  char **argv;			/* words of the manifest line */
+  int argc;
+  int line;			/* line number in the manifest */
+  const char *output, *list, *labels, *prefix;
+  int force;
+  const char **sources, **includes;
+  int num_sources, num_includes;
+  struct override *overrides;	/* files in memory (for --serve) */
+  char *messages;		/* everything which is printed on stderr */
+  size_t messages_len, messages_size;
+  int incremental;		/* if files may be replayed */
+  int assembled;		/* if the assembler has run */
+  int errors;			/* number of errors, if it has */
+  int failed;
+  int done;
+};
+
+static struct job *jobs;
+static int num_jobs, next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+
+/* add text to the messages of a job.  If there is no memory, the text
+ * is lost.  */
+static void
+add_text (struct job *j, const char *text)
+{
+  size_t len = strlen (text);
+  if (j->messages_len + len + 1 > j->messages_size)
+    {
+      size_t size = 2 * (j->messages_len + len + 1);
+      char *m = realloc (j->messages, size);
+      if (!m)
+	return;
+      j->messages = m;
+      j->messages_size = size;
+    }
+  memcpy (j->messages + j->messages_len, text, len + 1);
+  j->messages_len += len;
+}
+
+/* add a message like those of openfile */
+static void
+add_error (struct job *j, const char *what, const char *name, int err)
+{
+  add_text (j, what);
+  add_text (j, " ");
+  add_text (j, name);
+  add_text (j, ": ");
+  add_text (j, strerror (err));
+  add_text (j, "\n");
+  j->failed = 1;
+}
+
+/* split a manifest line into words, in place.  Words are separated by
+ * white space; a part of a word in double quotes may contain white
+ * space.  */
+static int
+split_words (char *line, char **words)
+{
+  int n = 0;
+  char *src = line, *dst;
+  while (1)
+    {
+      char end;
+      while (isspace ((unsigned char) *src))
+	++src;
+      if (!*src)
+	return n;
+      words[n++] = dst = src;
+      while (*src && !isspace ((unsigned char) *src))
+	{
+	  if (*src != '"')
+	    {
+	      *dst++ = *src++;
+	      continue;
+	    }
+	  for (++src; *src && *src != '"'; ++src)
+	    *dst++ = *src;
+	  if (*src)
+	    ++src;
+	}
+      end = *src;
+      *dst = 0;
+      if (!end)
+	return n;
+      ++src;
+    }
+}
+
+/* parse the options of a job, in the same way as parse_commandline.
+ * Returns an error message, or NULL.  */
+static const char *
+parse_job (struct job *j)
+{
+  int c;
+  optind = 0;
+  while ((c = getopt_long (j->argc, j->argv, short_opts, opts, NULL)) != -1)
+    {
+      switch (c)
+	{
+	case 'v':
+	  /* ignored: debugging output of jobs can't be kept in order */
+	  break;
+	case 'o':
+	  j->output = optarg;
+	  break;
+	case 'i':
+	  j->sources[j->num_sources++] = optarg;
+	  break;
+	case 'l':
+	  if (!optarg)
+	    return "a list file must have a name";
+	  j->list = optarg;
+	  break;
+	case 'L':
+	  if (!optarg)
+	    return "a label file must have a name";
+	  j->labels = optarg;
+	  break;
+	case 'p':
+	  j->prefix = optarg;
+	  break;
+	case 'I':
+	  j->includes[j->num_includes++] = optarg;
+	  break;
+	case 'f':
+	  j->force = 1;
+	  break;
+	default:
+	  return "invalid option for a job";
+	}
+    }
+  while (optind < j->argc)
+    j->sources[j->num_sources++] = j->argv[optind++];
+  if (!j->num_sources)
+    return "no input files";
+  if ((j->output && !strcmp (j->output, "-"))
+      || (j->list && !strcmp (j->list, "-"))
+      || (j->labels && !strcmp (j->labels, "-")))
+    return "standard streams can't be used for the files of a job";
+  if (!j->prefix)
+    j->prefix = "";
+  return NULL;
+}
+
+/* read the manifest and parse all jobs.  The words of the jobs point
+ * into the returned buffer.  */
+static char *
+read_manifest (char *progname)
+{
+  FILE *f = fopen (batchname, "r");
+  size_t size = 0, max = 0x1000, n;
+  char *buffer = malloc (max), *line, *next;
+  int lineno = 0, max_jobs = 0;
+  if (!f)
+    {
+      fprintf (stderr, "Unable to open manifest %s: %s\n", batchname,
+	       strerror (errno));
+      exit (1);
+    }
+  while (buffer)
+    {
+      if (size + 1 >= max)
+	{
+	  char *b = realloc (buffer, max *= 2);
+	  if (!b)
+	    free (buffer);
+	  buffer = b;
+	  continue;
+	}
+      if (!(n = fread (buffer + size, 1, max - size - 1, f)))
+	break;
+      size += n;
+    }
+  if (!buffer)
+    out_of_memory ();
+  if (ferror (f))
+    {
+      fprintf (stderr, "Unable to read manifest %s: %s\n", batchname,
+	       strerror (errno));
+      exit (1);
+    }
+  fclose (f);
+  buffer[size] = 0;
+  for (line = buffer; line; line = next)
+    {
+      struct job *j;
+      const char *error;
+      size_t len;
+      ++lineno;
+      if ((next = strchr (line, '\n')))
+	*next++ = 0;
+      len = strlen (line);
+      while (isspace ((unsigned char) *line))
+	++line;
+      if (!*line || *line == '#')
+	continue;
+      if (num_jobs == max_jobs)
+	{
+	  max_jobs = max_jobs ? max_jobs * 2 : 64;
+	  if (!(jobs = realloc (jobs, max_jobs * sizeof (struct job))))
+	    out_of_memory ();
+	}
+      j = &jobs[num_jobs++];
+      memset (j, 0, sizeof (struct job));
+      j->line = lineno;
+      /* there are at most len / 2 + 1 words */
+      j->argv = malloc ((len / 2 + 3) * sizeof (char *));
+      j->sources = malloc ((len / 2 + 1) * sizeof (char *));
+      j->includes = malloc ((len / 2 + 1) * sizeof (char *));
+      if (!j->argv || !j->sources || !j->includes)
+	out_of_memory ();
+      j->argv[0] = progname;
+      j->argc = split_words (line, j->argv + 1) + 1;
+      j->argv[j->argc] = NULL;
+      if ((error = parse_job (j)))
+	{
+	  fprintf (stderr, "%s:%d: %s\n", batchname, j->line, error);
+	  exit (1);
+	}
+      if (!j->output)
+	j->output = "a.bin";
+    }
+  return buffer;
+}
+
+/* run one job with a context of this thread */
+static void
+run_job (struct z80asm *z, struct job *j)
+{
+  const struct z80asm_diagnostic *d;
+  unsigned num, n;
+  int errors, i, ok = 1;
+  FILE *out = NULL, *list = NULL, *labels = NULL;
+  struct override *o;
+  z80asm_reset (z);
+  z80asm_set_capture (z, 1);
+  z80asm_set_force (z, j->force);
+  z80asm_set_listing (z, j->list != NULL);
+  z80asm_set_incremental (z, j->incremental);
+  ok = z80asm_add_include (z, DEFAULT_INCLUDE);
+  for (i = 0; i < j->num_includes; ++i)
+    ok = ok && z80asm_add_include (z, j->includes[i]);
+  for (i = 0; i < j->num_sources; ++i)
+    ok = ok && z80asm_add_source (z, j->sources[i]);
+  for (o = j->overrides; o; o = o->next)
+    ok = ok && z80asm_add_file (z, o->name, o->data, o->size);
+  if (!ok)
+    {
+      add_text (j, "Error: insufficient memory\n");
+      j->failed = 1;
+      return;
+    }
+  if (j->output && !(out = fopen (j->output, "wb")))
+    {
+      add_error (j, "Unable to open output file", j->output, errno);
+      return;
+    }
+  if (j->list && !(list = fopen (j->list, "w")))
+    {
+      add_error (j, "Unable to open list file", j->list, errno);
+      if (out)
+	fclose (out);
+      return;
+    }
+  if (j->labels && !(labels = fopen (j->labels, "w")))
+    {
+      add_error (j, "Unable to open label file", j->labels, errno);
+      if (list)
+	fclose (list);
+      if (out)
+	fclose (out);
+      return;
+    }
+  j->errors = errors = z80asm_assemble (z);
+  j->assembled = 1;
+  d = z80asm_get_diagnostics (z, &num);
+  for (n = 0; n < num; ++n)
+    {
+      char number[32];
+      if (d[n].file)
+	{
+	  sprintf (number, ":%d: ", d[n].line);
+	  add_text (j, d[n].file);
+	  add_text (j, number);
+	}
+      add_text (j, d[n].error ? "error: " : "warning: ");
+      add_text (j, d[n].message);
+      add_text (j, "\n");
+    }
+  if (out && (!errors || j->force) && !z80asm_write_image (z, out))
+    add_error (j, "error writing final file", j->output, errno);
+  if (list && !z80asm_write_listing (z, list))
+    add_error (j, "error writing list file", j->list, errno);
+  if (labels && !z80asm_write_labels (z, labels, j->prefix))
+    add_error (j, "error writing label file", j->labels, errno);
+  if (out && fclose (out) && !j->failed)
+    add_error (j, "error writing final file", j->output, errno);
+  if (list && fclose (list) && !j->failed)
+    add_error (j, "error writing list file", j->list, errno);
+  if (labels && fclose (labels) && !j->failed)
+    add_error (j, "error writing label file", j->labels, errno);
+  if (errors)
+    {
+      char summary[64];
+      if (errors == 1)
+	strcpy (summary, "*** 1 error found ***\n");
+      else
+	sprintf (summary, "*** %d errors found ***\n", errors);
+      add_text (j, summary);
+      j->failed = 1;
+      if (!j->force)
+	{
+	  if (j->output)
+	    unlink (j->output);
+	  if (j->labels)
+	    unlink (j->labels);
+	}
+    }
+}
+
+static void *
+worker (void *data)
+{
+  struct z80asm *z = data;
+  while (1)
+    {
+      struct job *j;
+      pthread_mutex_lock (&job_lock);
+      j = next_job < num_jobs ? &jobs[next_job++] : NULL;
+      pthread_mutex_unlock (&job_lock);
+      if (!j)
+	return NULL;
+      run_job (z, j);
+      pthread_mutex_lock (&job_lock);
+      j->done = 1;
+      pthread_cond_broadcast (&job_done);
+      pthread_mutex_unlock (&job_lock);
+    }
+}
+
+/* run all jobs of the manifest.  Returns the exit code.  */
+static int
+run_batch (char *progname)
+{
+  char *buffer = read_manifest (progname);
+  struct z80asm **contexts;
+  pthread_t *threads;
+  int i, ret = 0;
+  if (!num_threads)
+    {
+      long n = sysconf (_SC_NPROCESSORS_ONLN);
+      num_threads = n > 0 ? n : 1;
+    }
+  if (num_threads > num_jobs)
+    num_threads = num_jobs ? num_jobs : 1;
+  contexts = malloc (num_threads * sizeof (struct z80asm *));
+  threads = malloc (num_threads * sizeof (pthread_t));
+  if (!contexts || !threads)
+    out_of_memory ();
+  /* the contexts are created before any thread runs, see
+   * z80asm_create */
+  for (i = 0; i < num_threads; ++i)
+    if (!(contexts[i] = z80asm_create ()))
+      out_of_memory ();
+  for (i = 0; i < num_threads; ++i)
+    {
+      if (pthread_create (&threads[i], NULL, worker, contexts[i]))
+	{
+	  fprintf (stderr, "Error: unable to start thread\n");
+	  exit (1);
+	}
+    }
+  for (i = 0; i < num_jobs; ++i)
+    {
+      struct job *j = &jobs[i];
+      pthread_mutex_lock (&job_lock);
+      while (!j->done)
+	pthread_cond_wait (&job_done, &job_lock);
+      pthread_mutex_unlock (&job_lock);
+      if (j->messages)
+	fputs (j->messages, stderr);
+      if (j->failed)
+	ret = 1;
+      free (j->messages);
+      free (j->argv);
+      free (j->sources);
+      free (j->includes);
+    }
+  for (i = 0; i < num_threads; ++i)
+    {
+      pthread_join (threads[i], NULL);
+      z80asm_destroy (contexts[i]);
+    }
+  free (threads);
+  free (contexts);
+  free (jobs);
+  free (buffer);
+  return ret;
+}
+
+/* server mode.  z80asm --serve socket listens on a UNIX socket, and
+ * assembles what clients ask for.  A client sends requests over a
+ * connection, and gets a reply to every request.  Every record is a line
+ * with a keyword and numbers, followed by data of the given lengths.  A
+ * request is:
+ *
+ *   arg <length>\n<argument>		(for every argument)
+ *   file <length> <length>\n<name><contents>
+ *   end\n
+ *
+ * The arguments are a command line without the program name, like a line
+ * of a batch manifest.  file records give the contents of files which are
+ * then not read from disk.  The reply is:
+ *
+ *   errors <number>\n			(-1 if the assembler didn't run)
+ *   image <length>\n<image>
+ *   symbol <value> <name>\n		(for every global label)
+ *   diagnostic <error> <line> <length> <length>\n<file><message>
+ *   output <length>\n<text>		(what z80asm would print on stderr)
+ *   end\n
+ *
+ * One context is used for all requests, so files which haven't changed
+ * are not read again, and includes which were assembled in the same
+ * state by the previous request are replayed (see incremental.c).
+ *
+ * Lengths are checked against the limits below before anything is
+ * allocated; a request which exceeds them closes the connection.  */
+
+#define MAX_SERVE_STRING 0x10000	/* an argument or a file name */
+#define MAX_SERVE_FILE 0x4000000	/* the contents of a file */
+
+struct connection
+{
+  int fd;
+  char in[0x1000];		/* buffered input */
+  size_t in_pos, in_len;
+  char *out;			/* the reply, which is sent at once */
+  size_t out_len, out_size;
+  int failed;			/* if there was no memory for the reply */
+};
+
+/* read len bytes.  Returns 0 at the end of the input, or on errors.  */
+static int
+read_data (struct connection *c, char *data, size_t len)
+{
+  while (len)
+    {
+      size_t n;
+      if (c->in_pos == c->in_len)
+	{
+	  ssize_t r = read (c->fd, c->in, sizeof (c->in));
+	  if (r < 0 && errno == EINTR)
+	    continue;
+	  if (r <= 0)
+	    return 0;
+	  c->in_pos = 0;
+	  c->in_len = r;
+	}
+      n = c->in_len - c->in_pos;
+      if (n > len)
+	n = len;
+      memcpy (data, c->in + c->in_pos, n);
+      c->in_pos += n;
+      data += n;
+      len -= n;
+    }
+  return 1;
+}
+
+/* read a line of at most max - 1 characters, without the newline */
+static int
+read_record (struct connection *c, char *line, size_t max)
+{
+  size_t len = 0;
+  while (len + 1 < max)
+    {
+      if (!read_data (c, line + len, 1))
+	return 0;
+      if (line[len] == '\n')
+	{
+	  line[len] = 0;
+	  return 1;
+	}
+      ++len;
+    }
+  return 0;
+}
+
+/* read a record with data of length len into a malloced string.  Returns
+ * NULL if len is more than max.  */
+static char *
+read_string (struct connection *c, unsigned long len, unsigned long max)
+{
+  char *ret;
+  if (len > max || !(ret = malloc (len + 1)))
+    return NULL;
+  if (!read_data (c, ret, len))
+    {
+      free (ret);
+      return NULL;
+    }
+  ret[len] = 0;
+  return ret;
+}
+
+static void
+write_data (struct connection *c, const void *data, size_t len)
+{
+  if (c->out_len + len > c->out_size)
+    {
+      size_t size = 2 * (c->out_len + len);
+      char *out = realloc (c->out, size);
+      if (!out)
+	{
+	  c->failed = 1;
+	  return;
+	}
+      c->out = out;
+      c->out_size = size;
+    }
+  memcpy (c->out + c->out_len, data, len);
+  c->out_len += len;
+}
+
+static void
+write_record (struct connection *c, const char *line)
+{
+  write_data (c, line, strlen (line));
+}
+
+/* send the reply.  Returns 0 if the client is gone.  */
+static int
+send_reply (struct connection *c)
+{
+  size_t pos = 0;
+  if (c->failed)
+    {
+      /* the reply is incomplete, so the client can't use it */
+      c->failed = 0;
+      c->out_len = 0;
+      return 0;
+    }
+  while (pos < c->out_len)
+    {
+      ssize_t n = write (c->fd, c->out + pos, c->out_len - pos);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	return 0;
+      pos += n;
+    }
+  c->out_len = 0;
+  return 1;
+}
+
+/* write the results of a request */
+static void
+write_results (struct z80asm *z, struct connection *c, struct job *j)
+{
+  char line[128];
+  sprintf (line, "errors %d\n", j->assembled ? j->errors : -1);
+  write_record (c, line);
+  if (j->assembled)
+    {
+      const struct z80asm_symbol *sym;
+      const struct z80asm_diagnostic *d;
+      const unsigned char *image;
+      unsigned long size;
+      unsigned num, n;
+      image = z80asm_get_image (z, &size);
+      sprintf (line, "image %lu\n", size);
+      write_record (c, line);
+      write_data (c, image, size);
+      sym = z80asm_get_symbols (z, &num);
+      for (n = 0; n < num; ++n)
+	{
+	  sprintf (line, "symbol %d ", sym[n].value);
+	  write_record (c, line);
+	  write_record (c, sym[n].name);
+	  write_record (c, "\n");
+	}
+      d = z80asm_get_diagnostics (z, &num);
+      for (n = 0; n < num; ++n)
+	{
+	  sprintf (line, "diagnostic %d %d %lu %lu\n", d[n].error, d[n].line,
+		   (unsigned long) (d[n].file ? strlen (d[n].file) : 0),
+		   (unsigned long) strlen (d[n].message));
+	  write_record (c, line);
+	  if (d[n].file)
+	    write_record (c, d[n].file);
+	  write_record (c, d[n].message);
+	}
+    }
+  sprintf (line, "output %lu\n", (unsigned long) j->messages_len);
+  write_record (c, line);
+  if (j->messages)
+    write_record (c, j->messages);
+  write_record (c, "end\n");
+}
+
+/* read a request and answer it.  Returns 0 when the connection should be
+ * closed.  */
+static int
+serve_request (struct z80asm *z, struct connection *c, char *progname)
+{
+  struct job j;
+  char line[128];
+  char **args = NULL;
+  int num_args = 1, max_args = 0, ret = 0;
+  unsigned long len, size;
+  const char *error;
+  memset (&j, 0, sizeof (struct job));
+  j.incremental = 1;
+  while (1)
+    {
+      if (!read_record (c, line, sizeof (line)))
+	goto done;
+      if (!strcmp (line, "end"))
+	break;
+      if (sscanf (line, "arg %lu", &len) == 1)
+	{
+	  if (num_args + 1 >= max_args)
+	    {
+	      char **a;
+	      max_args = max_args ? max_args * 2 : 16;
+	      if (!(a = realloc (args, max_args * sizeof (char *))))
+		goto done;
+	      args = a;
+	    }
+	  if (!(args[num_args] = read_string (c, len, MAX_SERVE_STRING)))
+	    goto done;
+	  ++num_args;
+	}
+      else if (sscanf (line, "file %lu %lu", &len, &size) == 2)
+	{
+	  struct override *o = malloc (sizeof (struct override));
+	  if (!o)
+	    goto done;
+	  o->next = j.overrides;
+	  j.overrides = o;
+	  o->data = NULL;
+	  o->size = size;
+	  if (!(o->name = read_string (c, len, MAX_SERVE_STRING))
+	      || !(o->data = read_string (c, size, MAX_SERVE_FILE)))
+	    goto done;
+	}
+      else
+	goto done;
+    }
+  if (!args && !(args = malloc (2 * sizeof (char *))))
+    goto done;
+  args[0] = progname;
+  args[num_args] = NULL;
+  j.argv = args;
+  j.argc = num_args;
+  j.sources = malloc (num_args * sizeof (char *));
+  j.includes = malloc (num_args * sizeof (char *));
+  if (!j.sources || !j.includes)
+    goto done;
+  if ((error = parse_job (&j)))
+    {
+      add_text (&j, error);
+      add_text (&j, "\n");
+    }
+  else
+    run_job (z, &j);
+  write_results (z, c, &j);
+  ret = send_reply (c);
+done:
+  while (--num_args > 0)
+    free (args[num_args]);
+  free (args);
+  free (j.sources);
+  free (j.includes);
+  free (j.messages);
+  while (j.overrides)
+    {
+      struct override *next = j.overrides->next;
+      free (j.overrides->name);
+      free (j.overrides->data);
+      free (j.overrides);
+      j.overrides = next;
+    }
+  return ret;
+}
+
+static void
+stop_server (int sig)
+{
+  unlink (servename);
+  signal (sig, SIG_DFL);
+  raise (sig);
+}
+
+/* whether nothing accepts connections on the socket addr */
+static int
+stale_socket (const struct sockaddr_un *addr)
+{
+  int s = socket (AF_UNIX, SOCK_STREAM, 0), ret;
+  if (s < 0)
+    return 0;
+  ret = connect (s, (const struct sockaddr *) addr, sizeof (*addr)) < 0
+    && errno == ECONNREFUSED;
+  close (s);
+  return ret;
+}
+
+/* answer requests until the server is killed */
+static int
+run_server (char *progname)
+{
+  struct sockaddr_un addr;
+  struct connection c;
+  struct z80asm *z = z80asm_create ();
+  int s, bound;
+  if (!z)
+    out_of_memory ();
+  if (strlen (servename) >= sizeof (addr.sun_path))
+    {
+      fprintf (stderr, "Error: socket name too long: %s\n", servename);
+      return 1;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, servename);
+  if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+      fprintf (stderr, "Unable to create socket: %s\n", strerror (errno));
+      return 1;
+    }
+  /* a socket which is left by a server which died is removed, unless
+   * another server answers on it */
+  bound = bind (s, (struct sockaddr *) &addr, sizeof (addr)) == 0;
+  if (!bound && errno == EADDRINUSE)
+    {
+      if (!stale_socket (&addr))
+	errno = EADDRINUSE;
+      else
+	{
+	  unlink (servename);
+	  if (verbose >= 1)
+	    fprintf (stderr, "Removed stale socket %s\n", servename);
+	  bound = bind (s, (struct sockaddr *) &addr, sizeof (addr)) == 0;
+	}
+    }
+  if (!bound || listen (s, 16) < 0)
+    {
+      fprintf (stderr, "Unable to listen on %s: %s\n", servename,
+	       strerror (errno));
+      return 1;
+    }
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGINT, stop_server);
+  signal (SIGTERM, stop_server);
+  if (verbose >= 1)
+    fprintf (stderr, "Listening on %s\n", servename);
+  memset (&c, 0, sizeof (c));
+  while (1)
+    {
+      if ((c.fd = accept (s, NULL, NULL)) < 0)
+	{
+	  if (errno == EINTR || errno == ECONNABORTED)
+	    continue;
+	  fprintf (stderr, "Unable to accept connection: %s\n",
+		   strerror (errno));
+	  unlink (servename);
+	  return 1;
+	}
+      c.in_pos = c.in_len = 0;
+      while (serve_request (z, &c, progname))
+	{
+	}
+      close (c.fd);
+    }
+}
+
+/* print the statistics of --stats */
+static void
+print_stats (const struct z80asm_stats *s)
+{
+  static const char *const phases[Z80ASM_NUM_PHASES] = {
+    "read", "parse", "encode", "resolve", "list", "output"
+  };
+  struct rusage usage;
+  double wall = 0, cpu = 0;
+  int i;
+  fprintf (stderr, "phase\t\twall (ms)\tcpu (ms)\n");
+  for (i = 0; i < Z80ASM_NUM_PHASES; ++i)
+    {
+      fprintf (stderr, "%s\t\t%9.3f\t%9.3f\n", phases[i],
+	       s->wall[i] * 1000, s->cpu[i] * 1000);
+      wall += s->wall[i];
+      cpu += s->cpu[i];
+    }
+  fprintf (stderr, "total\t\t%9.3f\t%9.3f\n", wall * 1000, cpu * 1000);
+  fprintf (stderr, "lines read:\t\t%lu\n", s->lines);
+  fprintf (stderr, "macro expansions:\t%lu\n", s->macro_expansions);
+  fprintf (stderr, "indx calls:\t\t%lu\n", s->indx_calls);
+  fprintf (stderr, "operand expressions:\t%lu (%lu times reused)\n",
+	   s->operand_reads, s->operand_reuses);
+  fprintf (stderr, "label lookups:\t\t%lu (%lu entries tried)\n",
+	   s->label_lookups, s->label_probes);
+  fprintf (stderr, "operands:\t\t%lu (%lu immediate, %lu references)\n",
+	   s->operands, s->immediate, s->deferred);
+  fprintf (stderr, "compute_ref calls:\t%lu\n", s->compute_refs);
+  fprintf (stderr, "bytes emitted:\t\t%lu\n", s->bytes);
+  if (!getrusage (RUSAGE_SELF, &usage))
+    fprintf (stderr, "peak memory:\t\t%ld kB\n", usage.ru_maxrss);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct z80asm *z = z80asm_create ();
+  int errors;
+  if (!z)
+    out_of_memory ();
+  add_include (z, DEFAULT_INCLUDE);
+  parse_commandline (z, argc, argv);
+  if (batchname)
+    {
+      z80asm_destroy (z);
+      return run_batch (argv[0]);
+    }
+  if (servename)
+    {
+      z80asm_destroy (z);
+      return run_server (argv[0]);
+    }
+  if (incrementalname)
+    {
+      FILE *f = fopen (incrementalname, "rb");
+      z80asm_set_incremental (z, 1);
+      /* a missing or old file means that everything is assembled */
+      if (f)
+	{
+	  if (!z80asm_load_incremental (z, f) && verbose >= 1)
+	    fprintf (stderr, "Ignoring incremental file %s\n",
+		     incrementalname);
+	  fclose (f);
+	}
+    }
+  if (verbose >= 1)
+    fprintf (stderr, "Assembling....\n");
+  errors = z80asm_assemble (z);
+  if (object)
+    {
+      if ((!errors || use_force) && !z80asm_write_object (z, realoutputfile))
+	{
+	  fprintf (stderr, "error writing object: %s\n", strerror (errno));
+	  exit (1);
+	}
+    }
+  else if ((!errors || use_force) && !z80asm_write_image (z, realoutputfile))
+    {
+      fprintf (stderr, "error writing final file: %s\n", strerror (errno));
+      exit (1);
+    }
+  /* the listing is useful to find errors, so it is always written */
+  if (havelist && !z80asm_write_listing (z, reallistfile))
+    {
+      fprintf (stderr, "error writing list file: %s\n", strerror (errno));
+      exit (1);
+    }
+  if (label)
+    {
+      fseek (labelfile, 0, SEEK_END);
+      if (!z80asm_write_labels (z, labelfile, labelprefix))
+	{
+	  fprintf (stderr, "error writing label file: %s\n",
+		   strerror (errno));
+	  exit (1);
+	}
+      fclose (labelfile);
+    }
+  if (incrementalname)
+    {
+      FILE *f = fopen (incrementalname, "wb");
+      if (!f || !z80asm_save_incremental (z, f) || fclose (f))
+	{
+	  fprintf (stderr, "error writing incremental file %s: %s\n",
+		   incrementalname, strerror (errno));
+	  exit (1);
+	}
+    }
+  if (realoutputfile != stdout)
+    fclose (realoutputfile);
+  if (havelist && reallistfile != stderr)
+    fclose (reallistfile);
+  if (stats)
+    print_stats (z80asm_get_stats (z));
+  /* the trace is useful to find errors, so it is always written */
+  if (trace && (!z80asm_write_trace (z, tracefile, trace_json)
+		|| (tracefile != stderr && fclose (tracefile))))
+    {
+      fprintf (stderr, "error writing trace file: %s\n", strerror (errno));
+      exit (1);
+    }
+  z80asm_destroy (z);
+  if (errors)
+    {
+      if (errors == 1)
+	fprintf (stderr, "*** 1 error found ***\n");
+      else
+	fprintf (stderr, "*** %d errors found ***\n", errors);
+      if (realoutputfile != stdout && !use_force)
+	{
+	  unlink (realoutputfilename);
+	  if (labelfilename)
+	    unlink (labelfilename);
+	}
+      return 1;
+    }
+  else
+    {
+      if (verbose >= 1)
+	fprintf (stderr, "Assembly succesful.\n");
+      return 0;
+    }
+}
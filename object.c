@@ -0,0 +1,487 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* relocatable objects.  An object is assembled as if it starts at
+ * address 0 and at the start of the output.  When it is linked, it is
+ * placed where the previous input ended, like a source would be, so
+ * linking objects gives the same output as assembling their sources
+ * together.
+ *
+ * Addresses before the first org move with the object.  Every value
+ * knows how: its reloc is the number of times the address of the object
+ * is in it, so the linker adds reloc times that address.  Values which
+ * don't grow with the address of the object (like label >> 8) get
+ * RELOC_EXPR, and are computed again by the linker from their compiled
+ * code.  So are references to labels which are not in the object; they
+ * may be in another one.  The local labels which such code uses are
+ * bound to their values before they go out of scope.
+ *
+ * Values which are used while assembling (like the argument of org, ds
+ * or if) can't move.  Seek is not possible in an object.  */
+
+/* the file is text, except for the image.  Strings are written like in
+ * the file of incremental assembly.  The last record is "done", so a file
+ * which was cut short is not accepted.  */
+#define OBJECT_HEADER "z80asm object 2\n"
+
+/* if a reference of an object must be written by the linker */
+int
+relocatable_ref (const struct reference *ref)
+{
+  int reloc = ref->reloc;
+  if (!ref->done || reloc == RELOC_EXPR)
+    return 1;
+  /* a relative jump to an address in the object doesn't change */
+  if (ref->type == TYPE_RELB)
+    reloc -= ref->addr_reloc;
+  return reloc != 0;
+}
+
+/* check that the linker can compute a reference of an object.  A label
+ * which code uses must be global, or bound by bind_local_labels.  */
+void
+check_relocatable (struct z80asm *z, struct reference *ref)
+{
+  unsigned i;
+  if (ref->done && ref->reloc != RELOC_EXPR)
+    return;
+  z->stack[z->sp].name = ref->file;
+  z->stack[z->sp].dir = ref->dir;
+  z->stack[z->sp].line = ref->line;
+  if (!ref->code)
+    {
+      printerr (z, 1, "expression can not be relocated: %s\n", ref->input);
+      return;
+    }
+  for (i = 0; i < ref->code->num_slots; ++i)
+    {
+      const struct expr_slot *slot = &ref->code->slots[i];
+      const char *name = ref->code->input + slot->offset;
+      if (!slot->label && *name == '.')
+	printerr (z, 1, "using undefined label %.*s\n", (int) slot->len,
+		  name);
+      else if (slot->label && !slot->label->table
+	       && slot->label->reloc == RELOC_EXPR)
+	printerr (z, 1, "local label %.*s can not be relocated\n",
+		  (int) slot->len, name);
+    }
+}
+
+static void
+save_where (FILE * f, const struct reference *ref)
+{
+  save_string (f, ref->file);
+  save_string (f, ref->dir ? ref->dir->name : NULL);
+  fprintf (f, " %d %d %d %d", ref->line, ref->addr, ref->baseaddr,
+	   ref->addr_reloc);
+}
+
+/* write compiled code.  Labels which are bound are written with their
+ * value; the others are looked up by name.  */
+static void
+save_code (FILE * f, const struct reference *ref)
+{
+  const struct expr_code *code = ref->code;
+  unsigned i;
+  save_string (f, code->input);
+  /* a warning about it was given if it was computed */
+  fprintf (f, " %d %u", ref->done ? 0 : code->check, code->num_ops);
+  for (i = 0; i < code->num_ops; ++i)
+    fprintf (f, " %d %d", (int) code->ops[i].op, code->ops[i].arg);
+  fprintf (f, " %u", code->num_slots);
+  for (i = 0; i < code->num_slots; ++i)
+    {
+      const struct label *l = code->slots[i].label;
+      fprintf (f, " %u %u", code->slots[i].offset, code->slots[i].len);
+      if (l && !l->table)
+	fprintf (f, " b %d %d", l->value, l->reloc);
+      else
+	fputs (" n", f);
+    }
+  fputc ('\n', f);
+}
+
+int
+z80asm_write_object (struct z80asm *z, FILE * f)
+{
+  struct label **sorted;
+  struct reference *ref, *last = NULL;
+  unsigned i;
+  int phase;
+  if (!z->object)
+    {
+      errno = EINVAL;
+      return 0;
+    }
+  sorted = sort_labels (&z->globallabels);
+  if (z->globallabels.count && !sorted)
+    return 0;
+  phase = ENTER_PHASE (z, Z80ASM_PHASE_OUTPUT);
+  fputs (OBJECT_HEADER, f);
+  fprintf (f, "end %d %d %lu\n", z->end_addr, z->addr_reloc, z->image_end);
+  if (z->image_end)
+    fwrite (z->image, 1, z->image_end, f);
+  fputc ('\n', f);
+  for (i = 0; i < z->globallabels.count; ++i)
+    {
+      const struct label *l = sorted[i];
+      if (l->valid && l->reloc != RELOC_EXPR)
+	{
+	  fputs ("label", f);
+	  save_string (f, l->name);
+	  fprintf (f, " %d %d\n", l->value, l->reloc);
+	}
+      else if (l->ref && l->ref->code)
+	{
+	  fputs ("equ", f);
+	  save_string (f, l->name);
+	  save_where (f, l->ref);
+	  save_code (f, l->ref);
+	}
+    }
+  free (sorted);
+  /* the oldest first, so the linker makes them in the same order */
+  for (ref = z->firstreference; ref; ref = ref->next)
+    last = ref;
+  for (ref = last; ref; ref = ref->prev)
+    {
+      if (!relocatable_ref (ref) || (!ref->done && !ref->code))
+	continue;
+      fprintf (f, "%s %d %ld %d", ref->done && ref->reloc != RELOC_EXPR
+	       ? "ref" : "expr", (int) ref->type, ref->oseekpos, ref->count);
+      save_where (f, ref);
+      if (!ref->done || ref->reloc == RELOC_EXPR)
+	save_code (f, ref);
+      else
+	fprintf (f, " %d %d\n", ref->computed_value, ref->reloc);
+    }
+  fputs ("done\n", f);
+  ENTER_PHASE (z, phase);
+  return !ferror (f);
+}
+
+/* the address where an object is linked, and its position in the
+ * output */
+struct placement
+{
+  int addr;
+  unsigned long pos;
+  unsigned long size;		/* of the image of the object */
+};
+
+static struct label *
+new_label (struct z80asm *z, const char *name, unsigned len, int value)
+{
+  struct label *l = arena_alloc (&z->globalarena, sizeof (struct label)
+				 + len);
+  if (!l)
+    {
+      printerr (z, 1, "not enough memory to store label %.*s\n", (int) len,
+		name);
+      return NULL;
+    }
+  memcpy (l->name, name, len);
+  l->name[len] = 0;
+  l->len = len;
+  l->value = value;
+  l->valid = 1;
+  l->busy = 0;
+  l->ref = NULL;
+  l->table = NULL;
+  l->reloc = 0;
+  l->hash = hash_label (l->name, len);
+  return l;
+}
+
+/* read where a reference was made, and move it to where the object is
+ * placed.  Returns 0 if the file is damaged.  */
+static int
+load_where (struct z80asm *z, FILE * f, struct reference *ref,
+	    const struct placement *at)
+{
+  char *file = NULL, *dir = NULL;
+  int ok;
+  memset (ref, 0, sizeof (struct reference));
+  ref->input = "";
+  ok = load_string (f, &file) && file && load_string (f, &dir)
+    && fscanf (f, " %d %d %d %d", &ref->line, &ref->addr, &ref->baseaddr,
+	       &ref->addr_reloc) == 4;
+  if (ok)
+    {
+      ref->file = arena_strdup (&z->globalarena, file);
+      if (dir && (ref->dir = arena_alloc (&z->globalarena,
+					   sizeof (struct includedir)
+					   + strlen (dir))))
+	strcpy (ref->dir->name, dir);
+      if (!ref->file || (dir && !ref->dir))
+	{
+	  printerr (z, 1, "unable to allocate memory for reference\n");
+	  ok = 0;
+	}
+    }
+  free (file);
+  free (dir);
+  if (ref->addr_reloc)
+    {
+      ref->addr = (ref->addr + at->addr) & 0xffff;
+      ref->baseaddr = (ref->baseaddr + at->addr) & 0xffff;
+    }
+  ref->infile = z->file;
+  ref->seq = z->num_references++;
+  return ok;
+}
+
+/* read compiled code, and make a reference with it, which is made where
+ * says.  Returns NULL if the file is damaged.  */
+static struct reference *
+load_code (struct z80asm *z, FILE * f, const struct placement *at,
+	   const struct reference *where)
+{
+  struct reference *ref = NULL;
+  struct expr_code code;
+  char *input = NULL, *text;
+  unsigned i;
+  int op, ok = 0;
+  memset (&code, 0, sizeof (code));
+  if (!load_string (f, &input) || !input
+      || fscanf (f, " %d %u", &code.check, &code.num_ops) != 2
+      || code.num_ops > 0x10000
+      || !(code.ops = malloc ((code.num_ops + 1) * sizeof (struct expr_op))))
+    goto done;
+  for (i = 0; i < code.num_ops; ++i)
+    {
+      if (fscanf (f, " %d %d", &op, &code.ops[i].arg) != 2
+	  || op < OP_CONST || op > OP_MOD)
+	goto done;
+      code.ops[i].op = op;
+    }
+  if (fscanf (f, " %u", &code.num_slots) != 1 || code.num_slots > 0x10000
+      || !(code.slots = calloc (code.num_slots + 1,
+				sizeof (struct expr_slot))))
+    goto done;
+  for (i = 0; i < code.num_slots; ++i)
+    {
+      struct expr_slot *slot = &code.slots[i];
+      char bound[2];
+      int value, reloc;
+      if (fscanf (f, " %u %u %1s", &slot->offset, &slot->len, bound) != 3
+	  || slot->offset > strlen (input)
+	  || slot->len > strlen (input) - slot->offset)
+	goto done;
+      slot->hash = hash_label (input + slot->offset, slot->len);
+      if (*bound == 'n')
+	continue;
+      if (*bound != 'b' || fscanf (f, " %d %d", &value, &reloc) != 2)
+	goto done;
+      /* a local label of the object, with its value */
+      slot->label = new_label (z, input + slot->offset, slot->len,
+			       value + reloc * at->addr);
+      if (!slot->label)
+	goto done;
+    }
+  code.max_ops = code.num_ops;
+  code.max_slots = code.num_slots;
+  if (!load_newline (f)
+      || !valid_code (code.ops, code.num_ops, code.slots, code.num_slots,
+		      input))
+    goto done;
+  ok = 1;
+  ref = arena_alloc (&z->globalarena, sizeof (struct reference));
+  if (ref)
+    {
+      *ref = *where;
+      text = arena_strdup (&z->globalarena, input);
+      if (text)
+	{
+	  ref->input = text;
+	  ref->code = copy_expr_code (&code, ref->input, &z->globalarena);
+	}
+    }
+  if (!ref || !ref->code)
+    printerr (z, 1, "unable to allocate memory for reference\n");
+done:
+  free (input);
+  free (code.ops);
+  free (code.slots);
+  return ok ? ref : NULL;
+}
+
+/* read a reference which the linker writes.  If it is an expression, it
+ * is computed with the references of the sources.  */
+static int
+load_ref (struct z80asm *z, FILE * f, int expr, const struct placement *at)
+{
+  struct reference where, *ref;
+  int type, count, value, reloc;
+  long pos, size;
+  if (fscanf (f, " %d %ld %d", &type, &pos, &count) != 3
+      || type < TYPE_BSR || type >= TYPE_LABEL)
+    return 0;
+  /* the bytes which it writes must be in the image of the object */
+  size = type == TYPE_ABSW ? 2 : type == TYPE_DS ? count : 1;
+  if (pos < 0 || size < 0 || (unsigned long) pos > at->size
+      || (unsigned long) size > at->size - pos)
+    {
+      printerr (z, 1, "reference outside the object at position %ld\n",
+		pos);
+      return 0;
+    }
+  if (!load_where (z, f, &where, at))
+    return 0;
+  where.type = type;
+  where.oseekpos = at->pos + pos;
+  where.count = count;
+  /* the address after a relative jump moves with it */
+  if (type == TYPE_RELB && where.addr_reloc)
+    where.count = (count + at->addr) & 0xffff;
+  where.addr_reloc = 0;
+  if (expr)
+    {
+      if (!(ref = load_code (z, f, at, &where)))
+	return 0;
+      if (!ref->code)
+	return 1;
+    }
+  else
+    {
+      if (fscanf (f, " %d %d", &value, &reloc) != 2 || !load_newline (f))
+	return 0;
+      if (!(ref = arena_alloc (&z->globalarena, sizeof (struct reference))))
+	{
+	  printerr (z, 1, "unable to allocate memory for reference\n");
+	  return 1;
+	}
+      *ref = where;
+      ref->done = 1;
+      ref->computed_value = value + reloc * at->addr;
+    }
+  ref->next = z->firstreference;
+  if (ref->next)
+    ref->next->prev = ref;
+  z->firstreference = ref;
+  return 1;
+}
+
+/* read a global label.  If it is an expression, it is computed when it
+ * is used, like an equ.  */
+static int
+load_label (struct z80asm *z, FILE * f, int expr, const struct placement *at)
+{
+  struct reference where;
+  struct label *l;
+  char *name;
+  int value = 0, reloc = 0, ok;
+  if (!load_string (f, &name) || !name)
+    return 0;
+  if (expr)
+    ok = load_where (z, f, &where, at);
+  else
+    ok = fscanf (f, " %d %d", &value, &reloc) == 2 && load_newline (f);
+  if (!ok)
+    {
+      free (name);
+      return 0;
+    }
+  if (find_label (z, &z->globallabels, name, strlen (name),
+		  hash_label (name, strlen (name))))
+    {
+      printerr (z, 1, "duplicate definition of label %s\n", name);
+      l = NULL;
+    }
+  else
+    l = new_label (z, name, strlen (name), value + reloc * at->addr);
+  free (name);
+  if (expr)
+    {
+      struct reference *ref;
+      where.addr_reloc = 0;
+      where.type = TYPE_LABEL;
+      where.label = l;
+      if (!(ref = load_code (z, f, at, &where)))
+	return 0;
+      if (l)
+	{
+	  l->ref = ref;
+	  l->valid = 0;
+	}
+    }
+  if (l && !add_label (&z->globallabels, l))
+    printerr (z, 1, "not enough memory to store label %s\n", l->name);
+  else if (l)
+    wake_references (z, l->hash);
+  return 1;
+}
+
+/* place an object where the assembler is now */
+void
+load_object (struct z80asm *z, const char *name)
+{
+  FILE *f = fopen (name, "rb");
+  struct placement at;
+  char header[sizeof (OBJECT_HEADER)], word[8];
+  unsigned char *image = NULL;
+  int addr, addr_reloc, ok = 0;
+  if (!f)
+    {
+      printerr (z, 1, "unable to open %s: %s\n", name, strerror (errno));
+      return;
+    }
+  at.addr = z->addr;
+  at.pos = z->image_pos;
+  if (!fgets (header, sizeof (header), f) || strcmp (header, OBJECT_HEADER)
+      || fscanf (f, "end %d %d %lu", &addr, &addr_reloc, &at.size) != 3
+      || !load_newline (f))
+    goto done;
+  if (at.size && !(image = malloc (at.size)))
+    {
+      printerr (z, 1, "not enough memory for output\n");
+      ok = 1;
+      goto done;
+    }
+  if (fread (image, 1, at.size, f) != at.size || !load_newline (f))
+    goto done;
+  write_image (z, image, at.size);
+  z->addr = addr_reloc ? (addr + at.addr) & 0xffff : addr;
+  while (fscanf (f, "%7s", word) == 1)
+    {
+      int record;
+      if (!strcmp (word, "done"))
+	{
+	  /* nothing may follow it */
+	  ok = load_newline (f) && getc (f) == EOF && !ferror (f);
+	  break;
+	}
+      if (!strcmp (word, "label") || !strcmp (word, "equ"))
+	record = load_label (z, f, word[0] == 'e', &at);
+      else if (!strcmp (word, "ref") || !strcmp (word, "expr"))
+	record = load_ref (z, f, word[0] == 'e', &at);
+      else
+	record = 0;
+      if (!record)
+	break;
+    }
+done:
+  if (!ok)
+    printerr (z, 1, "%s is not a valid object file\n", name);
+  free (image);
+  fclose (f);
+}
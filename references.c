@@ -0,0 +1,286 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2002-2009 Bas Wijnen <wijnen@debian.org>
+   Copyright (C) 2005 Jan Wilmans <jw@dds.nl>
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* resolving references.  A reference which can't be computed when it is
+ * made waits for the labels in its expression.  When a label with one of
+ * those names is defined, the reference is woken, and it is tried again
+ * when the next stack level is popped.  References at the level which is
+ * popped are always tried, because labels go out of scope.  References
+ * which could not be compiled are tried at every pop.  */
+
+/* let a reference wait for all labels in its expression.  The waits are
+ * allocated from arena, which must be the arena of the reference.  */
+void
+wait_for_labels (struct z80asm *z, struct reference *ref, struct arena *arena)
+{
+  unsigned i, n;
+  ref->waits = NULL;
+  if (!ref->code || !ref->code->num_slots)
+    return;
+  n = ref->code->num_slots;
+  ref->waits = arena_alloc (arena, n * sizeof (struct ref_wait));
+  if (!ref->waits)
+    {
+      /* without waiting, the reference must be tried every time */
+      ref->code = NULL;
+      return;
+    }
+  for (i = 0; i < n; ++i)
+    {
+      struct ref_wait *w = &ref->waits[i];
+      struct ref_wait **list;
+      w->ref = ref;
+      w->hash = ref->code->slots[i].hash;
+      list = &z->wait_table[w->hash & (WAIT_TABLE_SIZE - 1)];
+      w->prev = NULL;
+      w->next = *list;
+      if (*list)
+	(*list)->prev = w;
+      *list = w;
+    }
+}
+
+/* stop waiting for labels */
+static void
+stop_waiting (struct z80asm *z, struct reference *ref)
+{
+  unsigned i;
+  if (!ref->waits)
+    return;
+  for (i = 0; i < ref->code->num_slots; ++i)
+    {
+      struct ref_wait *w = &ref->waits[i];
+      if (w->prev)
+	w->prev->next = w->next;
+      else
+	z->wait_table[w->hash & (WAIT_TABLE_SIZE - 1)] = w->next;
+      if (w->next)
+	w->next->prev = w->prev;
+    }
+  ref->waits = NULL;
+}
+
+static void
+add_woken (struct z80asm *z, struct reference *ref)
+{
+  ref->woken = 1;
+  ref->next_woken = z->woken;
+  z->woken = ref;
+}
+
+static void
+wake_reference (struct z80asm *z, struct reference *ref)
+{
+  if (ref->done)
+    return;
+  if (ref->type == TYPE_LABEL)
+    {
+      /* the label may become computable, so wake everything which waits
+       * for it as well.  busy stops loops in recursive definitions.  */
+      if (ref->label && !ref->label->busy)
+	{
+	  ref->label->busy = 1;
+	  wake_references (z, ref->label->hash);
+	  ref->label->busy = 0;
+	}
+      return;
+    }
+  if (!ref->woken)
+    add_woken (z, ref);
+}
+
+/* wake all references which wait for labels with the given hash.  Other
+ * labels may have the same hash; waking too many references is harmless. */
+void
+wake_references (struct z80asm *z, unsigned hash)
+{
+  struct ref_wait *w;
+  for (w = z->wait_table[hash & (WAIT_TABLE_SIZE - 1)]; w; w = w->next)
+    {
+      if (w->hash == hash)
+	wake_reference (z, w->ref);
+    }
+}
+
+/* the labels in table go out of scope.  Labels with the same name in
+ * outer scopes may be found now, so wake everything which waits for them.
+ * The labels themselves are not freed.  */
+void
+forget_labels (struct z80asm *z, struct label_table *table)
+{
+  unsigned i;
+  for (i = 0; i < table->size; ++i)
+    {
+      if (table->slots[i])
+	wake_references (z, table->slots[i]->hash);
+    }
+}
+
+static void
+link_level (struct z80asm *z, struct reference *ref)
+{
+  ref->level_prev = NULL;
+  ref->level_next = z->stack[ref->level].refs;
+  if (ref->level_next)
+    ref->level_next->level_prev = ref;
+  z->stack[ref->level].refs = ref;
+}
+
+static void
+unlink_level (struct z80asm *z, struct reference *ref)
+{
+  if (ref->level_prev)
+    ref->level_prev->level_next = ref->level_next;
+  else if (z->stack[ref->level].refs == ref)
+    z->stack[ref->level].refs = ref->level_next;
+  if (ref->level_next)
+    ref->level_next->level_prev = ref->level_prev;
+  ref->level_next = NULL;
+  ref->level_prev = NULL;
+}
+
+/* newest references first, like in the list of references */
+static int
+compare_seq (const void *a, const void *b)
+{
+  const struct reference *ra = *(struct reference *const *) a;
+  const struct reference *rb = *(struct reference *const *) b;
+  return ra->seq < rb->seq ? 1 : ra->seq > rb->seq ? -1 : 0;
+}
+
+/* the top of stack is about to be popped off, throwing all local labels
+ * out of scope.  Try all references which were woken, and all references
+ * at this level.  Those at this level which aren't computable are moved
+ * to the level below, or are errors if there is none.  */
+void
+resolve_references (struct z80asm *z)
+{
+  struct reference *ref;
+  unsigned i, n = 0;
+  int phase = ENTER_PHASE (z, Z80ASM_PHASE_RESOLVE);
+  for (ref = z->stack[z->sp].refs; ref; ref = ref->level_next)
+    {
+      if (!ref->woken)
+	add_woken (z, ref);
+    }
+  for (ref = z->woken; ref; ref = ref->next_woken)
+    {
+      if (n == z->max_todo)
+	{
+	  unsigned size = z->max_todo ? 2 * z->max_todo : 64;
+	  struct reference **t = realloc (z->todo, size * sizeof (*t));
+	  if (!t)
+	    {
+	      printerr (z, 1, "not enough memory to resolve references\n");
+	      ENTER_PHASE (z, phase);
+	      return;
+	    }
+	  z->todo = t;
+	  z->max_todo = size;
+	}
+      z->todo[n++] = ref;
+    }
+  z->woken = NULL;
+  /* todo is still NULL if nothing was ever woken */
+  if (!n)
+    {
+      ENTER_PHASE (z, phase);
+      return;
+    }
+  qsort (z->todo, n, sizeof (struct reference *), compare_seq);
+  for (i = 0; i < n; ++i)
+    {
+      ref = z->todo[i];
+      ref->woken = 0;
+      compute_ref (z, ref, 1);
+      if (ref->done)
+	{
+	  stop_waiting (z, ref);
+	  unlink_level (z, ref);
+	  continue;
+	}
+      if (ref->level == z->sp)
+	{
+	  unlink_level (z, ref);
+	  /* in an object, the linker computes it, perhaps with labels of
+	   * other objects.  The local labels must be kept for it.  */
+	  if (z->object && ref->code)
+	    bind_local_labels (z, ref->code, ref->level);
+	  if (!ref->level && z->object)
+	    {
+	      stop_waiting (z, ref);
+	      continue;
+	    }
+	  if (!ref->level--)
+	    {
+	      printerr (z, 1, "unable to resolve reference: %s\n", ref->input);
+	      if (ref->prev)
+		ref->prev->next = ref->next;
+	      else
+		z->firstreference = ref->next;
+	      if (ref->next)
+		ref->next->prev = ref->prev;
+	      ref->level = 0;
+	      forget_reference (z, ref);
+	      continue;
+	    }
+	  link_level (z, ref);
+	}
+      if (!ref->code)
+	add_woken (z, ref);
+    }
+  ENTER_PHASE (z, phase);
+}
+
+/* add a reference which isn't computed, but was made in an include which
+ * is replayed (see incremental.c).  It waits for its labels again, and
+ * unless it is the reference of a label it is added to its level.  */
+void
+restore_reference (struct z80asm *z, struct reference *ref,
+		   struct arena *arena)
+{
+  wait_for_labels (z, ref, arena);
+  if (ref->type == TYPE_LABEL)
+    return;
+  link_level (z, ref);
+  if (!ref->code)
+    add_woken (z, ref);
+}
+
+/* remove a reference from all lists, when it isn't needed any more.  Its
+ * memory belongs to an arena.  */
+void
+forget_reference (struct z80asm *z, struct reference *ref)
+{
+  if (ref->woken)
+    {
+      struct reference **r;
+      for (r = &z->woken; *r != ref; r = &(*r)->next_woken)
+	{
+	}
+      *r = ref->next_woken;
+    }
+  stop_waiting (z, ref);
+  if (ref->type != TYPE_LABEL)
+    unlink_level (z, ref);
+}
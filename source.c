@@ -0,0 +1,383 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* reading source files.  Regular files are mapped into memory; anything
+ * else (such as standard input, or a pipe) is read into a buffer at once.
+ * The lines of a file are found once, when it is loaded.  Files are kept
+ * until the end of the run, so a file which is included again (from the
+ * same or from another input file) is read from memory.  It is found by
+ * its path, device, inode, size and modification times; when a file has
+ * changed, the old contents are dropped from the cache.  A file which was
+ * modified in the second in which it was loaded may have changed without
+ * a new time, so it is only used again in the same run.  Files which are
+ * given by the library user are not copied; they are found by their name
+ * and their address, and forgotten at the end of the run.  */
+
+/* read everything from fd into a malloced buffer */
+static int
+read_all (struct source_file *f, int fd)
+{
+  size_t max = 0x10000;
+  f->data = f->buffer = malloc (max);
+  f->size = 0;
+  if (!f->buffer)
+    return 0;
+  while (1)
+    {
+      ssize_t n;
+      if (f->size == max)
+	{
+	  char *d = realloc (f->buffer, max * 2);
+	  if (!d)
+	    {
+	      free (f->buffer);
+	      errno = ENOMEM;
+	      return 0;
+	    }
+	  f->data = f->buffer = d;
+	  max *= 2;
+	}
+      n = read (fd, f->buffer + f->size, max - f->size);
+      if (n == 0)
+	return 1;
+      if (n < 0)
+	{
+	  if (errno == EINTR)
+	    continue;
+	  free (f->buffer);
+	  return 0;
+	}
+      f->size += n;
+    }
+}
+
+/* record where every line of a file starts */
+static int
+split_lines (struct source_file *f)
+{
+  size_t max = 256, pos = 0;
+  f->num_lines = 0;
+  f->lines = malloc (max * sizeof (size_t));
+  if (!f->lines)
+    return 0;
+  while (1)
+    {
+      const char *end;
+      if (f->num_lines + 1 == max)
+	{
+	  size_t *l = realloc (f->lines, max * 2 * sizeof (size_t));
+	  if (!l)
+	    {
+	      free (f->lines);
+	      errno = ENOMEM;
+	      return 0;
+	    }
+	  f->lines = l;
+	  max *= 2;
+	}
+      f->lines[f->num_lines] = pos;
+      if (pos >= f->size)
+	return 1;
+      ++f->num_lines;
+      end = memchr (f->data + pos, '\n', f->size - pos);
+      pos = end ? (size_t) (end - f->data) + 1 : f->size;
+    }
+}
+
+static void
+free_source_file (struct source_file *f)
+{
+  if (f->mapped)
+    munmap (f->buffer, f->size);
+  else
+    free (f->buffer);
+  free (f->lines);
+  free (f->path);
+  free (f);
+}
+
+/* load a file which isn't in the cache yet.  st is NULL for standard
+ * input.  */
+static struct source_file *
+load_source (struct z80asm *z, const char *name, int fd, const struct stat *st)
+{
+  struct source_file *f = malloc (sizeof (struct source_file));
+  int ok = 0;
+  if (!f)
+    return NULL;
+  f->data = f->buffer = NULL;
+  f->size = 0;
+  f->mapped = 0;
+  f->borrowed = 0;
+  f->have_id = 0;
+  f->racy = 0;
+  f->lines = NULL;
+  f->path = NULL;
+  if (st)
+    {
+      f->dev = st->st_dev;
+      f->ino = st->st_ino;
+      f->mtime = st->st_mtim;
+      f->ctime = st->st_ctim;
+      /* file times have a coarse granularity, so a change in the same
+       * second may not be seen.  Such a file is loaded again next run.  */
+      f->racy = st->st_mtim.tv_sec >= time (NULL);
+      f->path = malloc (strlen (name) + 1);
+      if (!f->path)
+	{
+	  free (f);
+	  errno = ENOMEM;
+	  return NULL;
+	}
+      strcpy (f->path, name);
+    }
+  if (st && S_ISREG (st->st_mode))
+    {
+      f->size = st->st_size;
+      if (!f->size)
+	ok = 1;
+      else
+	{
+	  f->buffer = mmap (NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	  if (f->buffer != MAP_FAILED)
+	    {
+	      f->data = f->buffer;
+	      ok = f->mapped = 1;
+	    }
+	  else
+	    f->buffer = NULL;
+	}
+    }
+  if (!ok && !(ok = read_all (f, fd)))
+    f->buffer = NULL;
+  if (!ok || !split_lines (f))
+    {
+      f->lines = NULL;
+      free_source_file (f);
+      return NULL;
+    }
+  f->run = z->run;
+  f->next = z->source_cache;
+  z->source_cache = f;
+  return f;
+}
+
+/* find a file which was given by the library user, either with
+ * z80asm_add_file or through the read function.  Returns 0 if it
+ * wasn't.  */
+int
+find_file (struct z80asm *z, const char *name, const char **data,
+	   unsigned long *size)
+{
+  struct file_override *o;
+  for (o = z->overrides; o; o = o->next)
+    {
+      if (!strcmp (o->name, name))
+	{
+	  *data = o->data;
+	  *size = o->size;
+	  return 1;
+	}
+    }
+  return z->read_file
+    && z->read_file (z->read_file_data, name, data, size);
+}
+
+/* open a source which is in memory.  The data is not copied.  Returns 0
+ * and sets errno if there is no memory.  */
+int
+open_source_buffer (struct z80asm *z, struct source *src, const char *name,
+		    const char *data, size_t size)
+{
+  struct source_file *f;
+  src->line = 0;
+  for (f = z->source_cache; f; f = f->next)
+    {
+      if (f->borrowed && f->data == data && f->size == size
+	  && !strcmp (f->path, name))
+	{
+	  src->file = f;
+	  return 1;
+	}
+    }
+  f = malloc (sizeof (struct source_file));
+  if (!f)
+    return 0;
+  f->path = malloc (strlen (name) + 1);
+  if (!f->path)
+    {
+      free (f);
+      errno = ENOMEM;
+      return 0;
+    }
+  strcpy (f->path, name);
+  f->data = data;
+  f->size = size;
+  f->buffer = NULL;
+  f->mapped = 0;
+  f->borrowed = 1;
+  f->have_id = 0;
+  f->racy = 0;
+  f->run = z->run;
+  if (!split_lines (f))
+    {
+      f->lines = NULL;
+      free_source_file (f);
+      return 0;
+    }
+  f->next = z->source_cache;
+  z->source_cache = f;
+  src->file = f;
+  return 1;
+}
+
+static int
+same_time (const struct timespec *a, const struct timespec *b)
+{
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+/* open a source file.  If name is NULL, standard input is read.  Files
+ * which were given by the library user are used instead of the file
+ * system.  Returns 0 and sets errno if the file can't be read.  */
+int
+open_source (struct z80asm *z, struct source *src, const char *name)
+{
+  struct source_file *f, **p;
+  struct stat st;
+  const char *data;
+  unsigned long size;
+  int fd;
+  src->line = 0;
+  if (find_file (z, name ? name : "-", &data, &size))
+    return open_source_buffer (z, src, name ? name : "-", data, size);
+  if (z->read_file)
+    {
+      errno = ENOENT;
+      return 0;
+    }
+  if (!name)
+    return (src->file = load_source (z, NULL, 0, NULL)) != NULL;
+  if (stat (name, &st) < 0)
+    return 0;
+  for (p = &z->source_cache; (f = *p);)
+    {
+      if (f->path && !f->borrowed && !strcmp (f->path, name))
+	{
+	  if (f->dev == st.st_dev && f->ino == st.st_ino
+	      && same_time (&f->mtime, &st.st_mtim)
+	      && same_time (&f->ctime, &st.st_ctim)
+	      && (off_t) f->size == st.st_size
+	      && (!f->racy || f->run == z->run))
+	    {
+	      f->run = z->run;
+	      src->file = f;
+	      return 1;
+	    }
+	  /* the file has changed.  Drop the old contents, unless they
+	   * are still being read.  */
+	  if (f->run != z->run)
+	    {
+	      *p = f->next;
+	      free_source_file (f);
+	      continue;
+	    }
+	}
+      p = &f->next;
+    }
+  if ((fd = open (name, O_RDONLY)) < 0)
+    return 0;
+  /* use the status of the file which was actually opened */
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return 0;
+    }
+  src->file = load_source (z, name, fd, &st);
+  close (fd);
+  return src->file != NULL;
+}
+
+/* return the next line, including its newline.  Returns 0 at the end.  */
+int
+read_source_line (struct source *src, const char **line, size_t *len)
+{
+  const struct source_file *f = src->file;
+  if (src->line >= f->num_lines)
+    return 0;
+  *line = f->data + f->lines[src->line];
+  *len = f->lines[src->line + 1] - f->lines[src->line];
+  ++src->line;
+  return 1;
+}
+
+/* return the digest of the contents of a file, for incremental
+ * assembly */
+const struct digest *
+source_digest (struct source_file *f)
+{
+  if (!f->have_id)
+    {
+      digest_init (&f->id);
+      digest_add_int (&f->id, f->size);
+      digest_add (&f->id, f->data, f->size);
+      f->have_id = 1;
+    }
+  return &f->id;
+}
+
+/* stop reading a source.  The file stays in the cache.  */
+void
+close_source (struct source *src)
+{
+  src->file = NULL;
+}
+
+/* free all cached files */
+void
+free_sources (struct z80asm *z)
+{
+  while (z->source_cache)
+    {
+      struct source_file *f = z->source_cache;
+      z->source_cache = f->next;
+      free_source_file (f);
+    }
+}
+
+/* forget the files which were given by the library user */
+void
+free_source_buffers (struct z80asm *z)
+{
+  struct source_file **f = &z->source_cache;
+  while (*f)
+    {
+      struct source_file *next = (*f)->next;
+      if ((*f)->borrowed)
+	{
+	  free_source_file (*f);
+	  *f = next;
+	}
+      else
+	f = &(*f)->next;
+    }
+}
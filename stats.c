@@ -0,0 +1,136 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+#include <time.h>
+
+/* statistics of a run.  The counters are always kept, because
+ * incrementing them costs less than checking if they are needed.  The
+ * time of each phase is only measured with z80asm_set_stats.
+ *
+ * Reading the clock at every switch would make assembling about 1.4
+ * times slower, because the phases change a few times for every line.
+ * So the phases of lines (read, parse and encode) are sampled: about
+ * one in SAMPLE_RATE of their stretches is timed, at random so a
+ * pattern in the lines can't always hit the same phase.  The wall time
+ * which the other phases don't use is divided over them like the
+ * samples.  The cpu time of the thread is only read when timing starts
+ * and stops, and divided over the phases like their wall time.  */
+
+#define SAMPLE_RATE 32
+
+/* phases which don't change for every line are always timed */
+#define EXACT(phase) ((phase) == Z80ASM_PHASE_RESOLVE \
+		      || (phase) == Z80ASM_PHASE_LIST \
+		      || (phase) == Z80ASM_PHASE_OUTPUT)
+
+static double
+read_clock (clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime (clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* add the times since timing started to the statistics */
+static void
+add_times (struct z80asm *z, double wall)
+{
+  double exact = 0, sampled = 0, cpu;
+  int i;
+  /* a context is used by one thread at a time */
+  cpu = read_clock (CLOCK_THREAD_CPUTIME_ID) - z->start_cpu;
+  wall -= z->start_wall;
+  for (i = 0; i < Z80ASM_NUM_PHASES; ++i)
+    {
+      if (EXACT (i))
+	exact += z->phase_time[i];
+      else
+	sampled += z->phase_time[i];
+    }
+  for (i = 0; i < Z80ASM_NUM_PHASES; ++i)
+    {
+      if (!EXACT (i))
+	z->phase_time[i] = sampled > 0 && wall > exact
+	  ? (wall - exact) * z->phase_time[i] / sampled : 0;
+      z->stats.wall[i] += z->phase_time[i];
+      if (wall > 0)
+	z->stats.cpu[i] += cpu * z->phase_time[i] / wall;
+    }
+}
+
+/* add the time since the last switch to the phase which ends, if it was
+ * timed, and start another one.  Returns the phase which ends.  */
+int
+enter_phase (struct z80asm *z, int phase)
+{
+  double wall = 0;
+  int old = z->phase, timed;
+  if (old == phase)
+    return old;
+  z->phase = phase;
+  if (old == PHASE_IDLE)
+    {
+      z->start_cpu = read_clock (CLOCK_THREAD_CPUTIME_ID);
+      memset (z->phase_time, 0, sizeof (z->phase_time));
+      z->sample_skip = 0;
+    }
+  timed = phase == PHASE_IDLE || EXACT (phase);
+  if (!timed && !z->sample_skip--)
+    {
+      /* the gap to the next sample is 1 to 2 * SAMPLE_RATE - 1 */
+      z->sample_seed = z->sample_seed * 1103515245 + 12345;
+      z->sample_skip = (z->sample_seed >> 16) % (2 * SAMPLE_RATE - 1);
+      timed = 1;
+    }
+  if (!timed && !z->phase_timed)
+    return old;
+  wall = read_clock (CLOCK_MONOTONIC);
+  if (old == PHASE_IDLE)
+    z->start_wall = wall;
+  else if (z->phase_timed)
+    z->phase_time[old] += wall - z->phase_wall;
+  if (phase == PHASE_IDLE)
+    add_times (z, wall);
+  z->phase_wall = wall;
+  z->phase_timed = timed;
+  return old;
+}
+
+/* clear the statistics for a new run */
+void
+start_stats (struct z80asm *z)
+{
+  memset (&z->stats, 0, sizeof (z->stats));
+  z->phase = PHASE_IDLE;
+  z->sample_seed = 1;
+}
+
+void
+z80asm_set_stats (struct z80asm *z, int stats)
+{
+  z->timing = stats;
+}
+
+const struct z80asm_stats *
+z80asm_get_stats (struct z80asm *z)
+{
+  return &z->stats;
+}
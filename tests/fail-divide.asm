@@ -0,0 +1,33 @@
+; fail-divide.asm - test program with divisions by zero, which must fail
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Each of these is an error, and the assembler must not crash.
+
+	ld a, 1 / 0
+	ld bc, 7 % 0
+	db 3 / (2 - 2)
+	dw 100 / zero		; the divisor is only known later
+	ld a, (ix + 4 / zero)
+	jr $ + 1 % zero
+zero:	equ 0
+	ld hl, 10 / 2		; this one is fine
+	; These must not trap.
+	ld hl, (-2147483647 - 1) / -1
+	ld hl, (-2147483647 - 1) % minus1
+	ld hl, (-2147483647 - 1) / minus1
+minus1:	equ -1
@@ -0,0 +1,35 @@
+; fail-macro.asm - test program which calls macros with the wrong arguments
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Each call is an error, and the lines after it are assembled
+	; normally.
+
+pair:	macro left, right
+	db left, right
+	endm
+
+	pair 1
+	nop
+	pair 1, 2, 3
+	nop
+	pair
+	nop
+	pair 1 + 1, 2	; an argument is one word
+	pair 1, 2	; this one is fine
+empty:	macro first, , third
+	endm
@@ -0,0 +1,30 @@
+; fail-output.asm - test program whose error is only found at the end
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; There must be no output file, although most of the output was
+	; written before the error was found.
+
+	org 0x8000
+start:	ld hl, data
+	ld de, 0x4000
+	ld bc, end - data
+	ldir
+	jp start
+data:	ds 0x1000, 0xaa
+	dw start, data
+end:	dw missing		; only found to be an error at the end
@@ -0,0 +1,29 @@
+; fail-paren.asm - test program with unterminated parentheses
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Each line misses a closing parenthesis.  The error must not
+	; mention text of the longer line before it.
+
+	ld hl, 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234
+	ld a, (1 + 2
+	ld hl, 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234
+	db (3
+	ld hl, 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234
+	ld (ix + (2), a
+	ld hl, 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234 + 0x1234
+	jp (
@@ -0,0 +1,29 @@
+; fail-seek.asm - test program which seeks too far
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Each of these is an error; the image must not grow to them.
+
+	db 1, 2, 3
+	seek 0x7fffffff
+	db 4
+	seek -1
+	db 5
+	seek 0x10001
+	db 6
+	seek 0x10000		; the end of the address space is fine
+	db 7
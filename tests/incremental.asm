@@ -0,0 +1,26 @@
+; incremental.asm - test program which is assembled with and without -r
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Both this file and the include are replayed the second time.
+
+	org 0x100
+start:	ld hl, table
+	call sub
+	jr start
+	include "incremental.inc"
+table:	dw sub, start, later	; from pass.asm, which comes first
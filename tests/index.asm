@@ -0,0 +1,31 @@
+; index.asm - test program for index registers without an offset
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; (ix) and (iy) mean (ix+0) and (iy+0), except for jp.
+
+	ld a, (ix)		; dd 7e 00
+	ld (iy), b		; fd 70 00
+	ld (ix), 0x55		; dd 36 00 55
+	inc (iy)		; fd 34 00
+	add a, (ix)		; dd 86 00
+	bit 3, (iy)		; fd cb 00 5e
+	set 7, (ix)		; dd cb 00 fe
+	ld a, (ix+5)		; dd 7e 05
+	ld a, (iy-1)		; fd 7e ff
+	jp (ix)			; dd e9
+	jp (iy)			; fd e9
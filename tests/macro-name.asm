@@ -0,0 +1,39 @@
+; macro-name.asm - test program for macros whose names are prefixes
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; A macro is only called by its exact name, not by another name
+	; which starts with it.
+
+print:	macro
+	db 1
+	endm
+
+printx:	macro
+	db 2
+	endm
+
+pr:	macro
+	db 3
+	endm
+
+	printx
+	print
+	pr
+	printx	; again, after the others were used
+print_all:
+	dw print_all
@@ -0,0 +1,48 @@
+; macro.asm - test program for macros with several arguments
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; Every argument is substituted, also when a line uses several of
+	; them, or the same one twice.  Arguments are separated by commas
+	; or white space.
+
+store:	macro addr, value, reg
+	ld reg, value
+	ld (addr), reg
+	ld (addr + 1), reg
+	endm
+
+pair:	macro left, right
+	db left, right, left + right, left * right
+	endm
+
+label:	macro name, value
+.local:	nop
+name:	equ value
+	jr .local
+	endm
+
+	store 0x4000, 0x12, a
+	store 0x5000, 0x34, a
+	pair 2, 3
+	pair 1+1, 5	; a textual substitution: 1+1 * 5 is 6
+	label first, 1
+	label second, 2
+	db first, second
+	pair first, second
+	pair 7 8
+	store 0x6000 0x56 a
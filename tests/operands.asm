@@ -0,0 +1,37 @@
+; operands.asm - test program for literals and repeated operands
+; Copyright 2026  the z80asm contributors
+;
+; This file is part of z80asm.
+;
+; Z80asm is free software; you can redistribute it and/or modify
+; it under the terms of the GNU General Public License as published by
+; the Free Software Foundation; either version 3 of the License, or
+; (at your option) any later version.
+;
+; Z80asm is distributed in the hope that it will be useful,
+; but WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+; GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License
+; along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+	; All literals are 14, as in the manual.
+	db @c11, 14, 14d, @914, 016, 16o, 16q, &o16, @716
+	db 0Eh, 0xE, &hE, $E, @FE, %1110, 1110b, &b1110, @11110
+	db @z10 - 22	; base 36
+
+	; An expression which is used twice in a line gives the same value
+	; both times, also if it is only known later.
+val:	equ 7
+	ld (ix + val), val
+	ld (iy + val * 2), val * 2
+	ld (ix + later), later
+	ld (iy - later), later + 1
+	db later, later, val, val
+	bit 1 + 1, (ix + 1 + 1)
+	out (val), a
+	in a, (val)
+	ld a, (val)
+	ld a, val
+later:	equ 5
@@ -37,3 +37,6 @@
 label:
 	jr label + 2
 	db ';("', "'"
+	ld hl, forward		; equ which is defined later
+forward: equ later + 1
+later:	equ 0x1233
@@ -0,0 +1,155 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Client for the tests of z80asm --serve.  serve-client socket args...
+ * sends the arguments as one request, writes the image of the reply on
+ * stdout and its output on stderr.  The exit code is 0 without errors, 1
+ * with errors, and 2 if there was no valid reply.  The protocol is
+ * described in main.c.  */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int fd;
+
+static void
+fail (const char *what)
+{
+  fprintf (stderr, "serve-client: %s\n", what);
+  exit (2);
+}
+
+static void
+send_data (const char *data, size_t len)
+{
+  while (len)
+    {
+      ssize_t n = write (fd, data, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	fail ("unable to send the request");
+      data += n;
+      len -= n;
+    }
+}
+
+static void
+receive_data (char *data, size_t len)
+{
+  while (len)
+    {
+      ssize_t n = read (fd, data, len);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n <= 0)
+	fail ("no complete reply");
+      data += n;
+      len -= n;
+    }
+}
+
+/* read a record line, without the newline */
+static void
+receive_record (char *line, size_t max)
+{
+  size_t len;
+  for (len = 0; len + 1 < max; ++len)
+    {
+      receive_data (line + len, 1);
+      if (line[len] == '\n')
+	{
+	  line[len] = 0;
+	  return;
+	}
+    }
+  fail ("record too long");
+}
+
+/* read len bytes of data, and write them to f if it isn't NULL */
+static void
+copy_data (unsigned long len, FILE *f)
+{
+  char buffer[0x1000];
+  while (len)
+    {
+      size_t n = len > sizeof (buffer) ? sizeof (buffer) : len;
+      receive_data (buffer, n);
+      if (f)
+	fwrite (buffer, 1, n, f);
+      len -= n;
+    }
+}
+
+int
+main (int argc, char **argv)
+{
+  struct sockaddr_un addr;
+  char line[256];
+  unsigned long a, b;
+  int errors = -1, i, e, l;
+  if (argc < 2)
+    {
+      fprintf (stderr, "usage: %s socket args...\n", argv[0]);
+      return 2;
+    }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen (argv[1]) >= sizeof (addr.sun_path))
+    fail ("socket name too long");
+  strcpy (addr.sun_path, argv[1]);
+  if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+      || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+    fail ("unable to connect");
+  for (i = 2; i < argc; ++i)
+    {
+      sprintf (line, "arg %lu\n", (unsigned long) strlen (argv[i]));
+      send_data (line, strlen (line));
+      send_data (argv[i], strlen (argv[i]));
+    }
+  send_data ("end\n", 4);
+  while (1)
+    {
+      receive_record (line, sizeof (line));
+      if (!strcmp (line, "end"))
+	break;
+      if (sscanf (line, "errors %d", &errors) == 1)
+	continue;
+      if (sscanf (line, "image %lu", &a) == 1)
+	copy_data (a, stdout);
+      else if (sscanf (line, "output %lu", &a) == 1)
+	copy_data (a, stderr);
+      else if (sscanf (line, "diagnostic %d %d %lu %lu", &e, &l, &a, &b)
+	       == 4)
+	copy_data (a + b, NULL);
+      else if (strncmp (line, "symbol ", 7))
+	fail ("invalid reply");
+    }
+  close (fd);
+  return errors < 0 ? 2 : errors > 0;
+}
@@ -0,0 +1,84 @@
+#!/bin/sh
+# serve.sh - tests of z80asm --serve
+# Copyright 2026  the z80asm contributors
+#
+# This file is part of z80asm.
+#
+# Z80asm is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# Z80asm is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Run from the tests directory, after serve-client is built.
+
+set -e
+socket=serve.sock
+pid=
+
+stop () {
+	if test -n "$pid"; then
+		kill $pid 2> /dev/null || true
+		wait $pid 2> /dev/null || true
+	fi
+	pid=
+}
+
+# wait until the server answers; the socket may be left by a dead one
+start () {
+	../z80asm --serve=$socket &
+	pid=$!
+	tries=0
+	status=2
+	while test $status = 2; do
+		kill -0 $pid
+		tries=$((tries + 1))
+		test $tries -lt 100
+		sleep 0.1
+		status=0
+		./serve-client $socket serve-0.asm 2> /dev/null || status=$?
+	done
+}
+
+cleanup () {
+	stop
+	rm -f $socket serve-*.asm serve-*.bin serve-*.err
+}
+trap cleanup 0
+
+rm -f $socket
+: > serve-0.asm
+start
+
+# A file which is rewritten in place with the same size, in the same
+# second, must be read again.
+printf '\tld a, 1\n\tnop\n' > serve-1.asm
+./serve-client $socket serve-1.asm > serve-1.bin
+printf '\076\001\000' | cmp - serve-1.bin
+printf '\tnop\n\tld a, 1\n' > serve-1.asm
+./serve-client $socket serve-1.asm > serve-1.bin
+printf '\000\076\001' | cmp - serve-1.bin
+
+# An invalid request gets errors, and the server keeps answering.
+printf '\tld de\n\tld hl\n\tld sp\n\tjp\n\tadd\n\tds 1,\n' > serve-2.asm
+status=0
+./serve-client $socket serve-2.asm > serve-2.bin 2> serve-2.err || status=$?
+test $status = 1
+./serve-client $socket serve-1.asm > serve-1.bin
+printf '\000\076\001' | cmp - serve-1.bin
+
+# A socket which is left by a killed server is replaced.
+kill -9 $pid
+wait $pid 2> /dev/null || true
+pid=
+test -S $socket
+start
+./serve-client $socket serve-1.asm > serve-1.bin
+printf '\000\076\001' | cmp - serve-1.bin
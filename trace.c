@@ -0,0 +1,249 @@
+/* Z80 assembler by shevek
+
+   Copyright (C) 2026 the z80asm contributors
+
+   This file is part of z80asm.
+
+   Z80asm is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   Z80asm is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "z80asm.h"
+
+/* trace points.  They only exist if the library is built with
+ * Z80ASM_TRACE (make TRACE=1); otherwise TRACE is empty and
+ * z80asm_set_trace fails.  A trace point doesn't format anything: it
+ * stores its numbers and the start of its text in a ring buffer, which
+ * keeps the last records of the run.  Every context has its own buffer,
+ * and a context is used by one thread at a time, so the buffer needs no
+ * lock; batch mode, which runs contexts on several threads, doesn't
+ * trace.  It is written as JSON or binary when the run is done.
+ *
+ * The binary file starts with the text line
+ *   z80asm trace 1 <records> <dropped>
+ * followed by a line with the names of the events, in the order of their
+ * numbers, and the records.  Every record is 32 bytes: line (4),
+ * address (2), category (1), event (1), a (4), b (4) and text (16,
+ * padded with zeros).  Numbers are little endian.  */
+
+#define TRACE_TEXT 16
+
+struct trace_record
+{
+  unsigned line;
+  unsigned short addr;
+  unsigned char category, event;
+  int a, b;
+  char text[TRACE_TEXT];
+};
+
+struct trace
+{
+  struct trace_record *records;
+  unsigned long size;		/* a power of two */
+  unsigned long next;		/* number of records made in this run */
+};
+
+/* what a and b of every event mean; NULL if they are not used */
+static const struct
+{
+  const char *name, *a, *b;
+} events[TRACE_NUM_EVENTS] = {
+  {"line", "length", NULL},
+  {"mnemonic", "index", NULL},
+  {"number", "value", "base"},
+  {"character", "value", NULL},
+  {"expression", "value", "valid"},
+  {"define", "value", NULL},
+  {"lookup", "value", "found"},
+  {"equ", "value", "valid"},
+  {"immediate", "value", "type"},
+  {"defer", "type", "level"},
+  {"compute", "value", "done"},
+  {"macro_line", "command", NULL},
+  {"expand", "args", "level"},
+  {"byte", "value", "pos"},
+  {"bytes", "count", "pos"}
+};
+
+static const char *const category_names[] = {
+  "lexer", "labels", "refs", "macros", "output"
+};
+
+void
+trace_point (struct z80asm *z, int category, int event, int a, int b,
+	     const char *text)
+{
+  struct trace_record *r;
+  unsigned i;
+  r = &z->trace->records[z->trace->next++ & (z->trace->size - 1)];
+  r->line = z->stack[z->sp].line;
+  r->addr = z->addr;
+  r->category = category;
+  r->event = event;
+  r->a = a;
+  r->b = b;
+  /* only the start of a line is kept */
+  for (i = 0; i < TRACE_TEXT && text && text[i] && text[i] != '\n'; ++i)
+    r->text[i] = text[i];
+  for (; i < TRACE_TEXT; ++i)
+    r->text[i] = 0;
+}
+
+/* start the trace of a new run */
+void
+start_trace (struct z80asm *z)
+{
+  if (z->trace)
+    z->trace->next = 0;
+}
+
+void
+free_trace (struct z80asm *z)
+{
+  if (!z->trace)
+    return;
+  free (z->trace->records);
+  free (z->trace);
+  z->trace = NULL;
+  z->trace_categories = 0;
+}
+
+int
+z80asm_set_trace (struct z80asm *z, unsigned categories, unsigned long size)
+{
+#ifdef Z80ASM_TRACE
+  unsigned long n;
+  free_trace (z);
+  if (!categories)
+    return 1;
+  /* round up to a power of two, so the index is a mask.  The limit
+   * keeps n from overflowing, and the buffer below 1 GiB.  */
+  if (size > Z80ASM_MAX_TRACE_SIZE)
+    size = Z80ASM_MAX_TRACE_SIZE;
+  for (n = 1; n < size; n <<= 1)
+    {
+    }
+  z->trace = malloc (sizeof (struct trace));
+  if (!z->trace)
+    return 0;
+  z->trace->records = malloc (n * sizeof (struct trace_record));
+  if (!z->trace->records)
+    {
+      free (z->trace);
+      z->trace = NULL;
+      return 0;
+    }
+  z->trace->size = n;
+  z->trace->next = 0;
+  z->trace_categories = categories;
+  return 1;
+#else
+  (void) size;
+  free_trace (z);
+  return !categories;
+#endif
+}
+
+/* the category of a record, by the number of its bit */
+static const char *
+category_name (unsigned category)
+{
+  unsigned i;
+  for (i = 0; category > 1; ++i)
+    category >>= 1;
+  return category_names[i];
+}
+
+/* write text as a JSON string.  The text of a label or file name need
+ * not be UTF-8, so every byte outside ASCII is escaped as the character
+ * with its number.  */
+static void
+write_json_text (const char *text, FILE * f)
+{
+  unsigned i;
+  putc ('"', f);
+  for (i = 0; i < TRACE_TEXT && text[i]; ++i)
+    {
+      if (text[i] == '"' || text[i] == '\\')
+	fprintf (f, "\\%c", text[i]);
+      else if ((unsigned char) text[i] < ' '
+	       || (unsigned char) text[i] >= 0x7f)
+	fprintf (f, "\\u%04x", (unsigned char) text[i]);
+      else
+	putc (text[i], f);
+    }
+  putc ('"', f);
+}
+
+static void
+put_number (unsigned long n, int bytes, FILE * f)
+{
+  int i;
+  for (i = 0; i < bytes; ++i)
+    putc ((n >> (8 * i)) & 0xff, f);
+}
+
+int
+z80asm_write_trace (struct z80asm *z, FILE * f, int json)
+{
+  const struct trace_record *r;
+  unsigned long first, i, dropped;
+  int e;
+  if (!z->trace)
+    return 0;
+  /* the oldest records were overwritten */
+  first = z->trace->next > z->trace->size
+    ? z->trace->next - z->trace->size : 0;
+  dropped = first;
+  if (json)
+    fprintf (f, "{\"dropped\": %lu, \"events\": [", dropped);
+  else
+    {
+      fprintf (f, "z80asm trace 1 %lu %lu\n", z->trace->next - first,
+	       dropped);
+      for (e = 0; e < TRACE_NUM_EVENTS; ++e)
+	fprintf (f, e ? " %s" : "%s", events[e].name);
+      putc ('\n', f);
+    }
+  for (i = first; i < z->trace->next; ++i)
+    {
+      r = &z->trace->records[i & (z->trace->size - 1)];
+      if (!json)
+	{
+	  put_number (r->line, 4, f);
+	  put_number (r->addr, 2, f);
+	  put_number (r->category, 1, f);
+	  put_number (r->event, 1, f);
+	  put_number ((unsigned) r->a, 4, f);
+	  put_number ((unsigned) r->b, 4, f);
+	  fwrite (r->text, 1, TRACE_TEXT, f);
+	  continue;
+	}
+      fprintf (f, "%s\n{\"line\": %u, \"addr\": %u, \"category\": \"%s\", "
+	       "\"event\": \"%s\", \"%s\": %d", i == first ? "" : ",",
+	       r->line, r->addr, category_name (r->category),
+	       events[r->event].name, events[r->event].a, r->a);
+      if (events[r->event].b)
+	fprintf (f, ", \"%s\": %d", events[r->event].b, r->b);
+      if (r->text[0])
+	{
+	  fputs (", \"text\": ", f);
+	  write_json_text (r->text, f);
+	}
+      putc ('}', f);
+    }
+  if (json)
+    fputs ("\n]}\n", f);
+  return !ferror (f);
+}
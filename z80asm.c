@@ -20,9 +20,10 @@
 */
 
 #include "z80asm.h"
+#include <pthread.h>
 
 /* global variables */
-/* mnemonics, used as argument to indx() in assemble */
+/* mnemonics, looked up by readcommand() in assemble */
 const char *mnemonics[] = {
   "call", "cpdr", "cpir", "djnz", "halt", "indr", "inir", "lddr", "ldir",
   "otdr", "otir", "outd", "outi", "push", "reti", "retn", "rlca", "rrca",
@@ -37,86 +38,108 @@ const char *mnemonics[] = {
   "seek", NULL
 };
 
-/* linked lists */
-struct reference *firstreference = NULL;
-struct label *firstlabel = NULL, *lastlabel = NULL;
-struct name *firstname = NULL;
-struct includedir *firstincludedir = NULL;
-struct macro *firstmacro = NULL;
-
-/* files */
-FILE *realoutputfile, *outfile, *reallistfile, *listfile, *labelfile;
-const char *realoutputfilename;
-const char *labelfilename;
-struct infile *infile;
-/* prefix for labels in labelfile */
-const char *labelprefix = "";
-/* bools to see if files are opened */
-int havelist = 0, label = 0;
-/* number of infiles in array */
-int infilecount;
-
-/* number of errors seen so far */
-int errors = 0;
-
-/* current line, address and file */
-int addr = 0, file;
-/* current number of characters in list file, for indentation */
-int listdepth;
-
-/* use readbyte instead of (hl) if writebyte is true */
-int writebyte;
-const char *readbyte;
-/* variables which are filled by rd_* functions and used later,
- * like readbyte */
-const char *readword, *indexjmp, *bitsetres;
-
-/* 0, 0xdd or 0xfd depening on which index prefix should be given */
-int indexed;
-
-/* increased for every -v option on the command line */
-int verbose = 0;
-
-/* read commas after indx() if comma > 1. increase for every call */
-int comma;
-
-/* address at start of line (for references) */
-int baseaddr;
-
-/* set by readword and readbyte, used for new_reference */
-char mem_delimiter;
-
-/* line currently being parsed */
-char *buffer = NULL;
-
-/* if a macro is currently being defined */
-int define_macro = 0;
-
-/* file (and macro) stack */
-int sp;
-struct stack stack[MAX_INCLUDE];	/* maximum level of includes */
-
-/* Produce output even with errors.  */
-int use_force = 0;
+/* the table above must have one entry for every enum mnemonic */
+typedef char mnemonic_table_check[(sizeof (mnemonics) / sizeof (mnemonics[0])
+				   == SEEK + 2) ? 1 : -1];
+
+/* perfect hash of the mnemonics, filled by init_mnemonic_hash().  Every
+ * slot holds the index in mnemonics[] plus one, or 0 if it is unused.  */
+#define MNEMONIC_HASH_SIZE 512
+static unsigned char mnemonic_hash[MNEMONIC_HASH_SIZE];
+/* seed which gives no collisions for the current table.  If the table is
+ * changed, init_mnemonic_hash() will search for a new one.  */
+static unsigned long mnemonic_seed = 5429;
+/* length of the longest mnemonic */
+static unsigned mnemonic_maxlen;
+/* the tables are filled once, by the first z80asm_create() */
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+/* see z80asm.h */
+unsigned char char_class[256];
+
+/* store a diagnostic for z80asm_get_diagnostics.  If there is no memory,
+ * it is lost.  */
+static void
+add_diagnostic (struct z80asm *z, int error, const char *message)
+{
+  struct z80asm_diagnostic *d;
+  size_t len = strlen (message);
+  char *copy;
+  if (z->num_diagnostics == z->max_diagnostics)
+    {
+      unsigned max = z->max_diagnostics ? z->max_diagnostics * 2 : 16;
+      d = realloc (z->diagnostics, max * sizeof (struct z80asm_diagnostic));
+      if (!d)
+	return;
+      z->diagnostics = d;
+      z->max_diagnostics = max;
+    }
+  d = &z->diagnostics[z->num_diagnostics];
+  d->file = NULL;
+  d->line = 0;
+  d->error = error;
+  if (z->sp >= 0 && z->stack[z->sp].name)
+    {
+      const char *dir = z->stack[z->sp].dir ? z->stack[z->sp].dir->name : "";
+      char *file = arena_alloc (&z->globalarena, strlen (dir)
+				+ strlen (z->stack[z->sp].name) + 1);
+      if (!file)
+	return;
+      strcpy (file, dir);
+      strcat (file, z->stack[z->sp].name);
+      d->file = file;
+      d->line = z->stack[z->sp].line;
+    }
+  if (len && message[len - 1] == '\n')
+    --len;
+  if (!(copy = arena_alloc (&z->globalarena, len + 1)))
+    return;
+  memcpy (copy, message, len);
+  copy[len] = 0;
+  d->message = copy;
+  ++z->num_diagnostics;
+}
 
 /* print an error message, including current line and file */
 void
-printerr (int error, const char *fmt, ...)
+printerr (struct z80asm *z, int error, const char *fmt, ...)
 {
   va_list l;
-  va_start (l, fmt);
-  if ((sp < 0) || (stack[sp].name == 0))
-    {
-      fprintf (stderr, "internal assembler error, sp == %i\n", sp);
-      vfprintf (stderr, fmt, l);
-      exit (2);
+  if (error)
+    z->errors++;
+  ++z->num_messages;
+  if (z->capture)
+    {
+      char buf[256], *message = buf;
+      int len;
+      va_start (l, fmt);
+      len = vsnprintf (buf, sizeof (buf), fmt, l);
+      va_end (l);
+      if (len < 0)
+	return;
+      if ((size_t) len >= sizeof (buf))
+	{
+	  if (!(message = malloc (len + 1)))
+	    return;
+	  va_start (l, fmt);
+	  vsnprintf (message, len + 1, fmt, l);
+	  va_end (l);
+	}
+      add_diagnostic (z, error, message);
+      if (message != buf)
+	free (message);
+      return;
     }
-  fprintf (stderr, "%s%s:%d: %s: ", stack[sp].dir ? stack[sp].dir->name : "",
-	   stack[sp].name, stack[sp].line, error ? "error" : "warning");
+  va_start (l, fmt);
+  if ((z->sp < 0) || (z->stack[z->sp].name == 0))
+    fprintf (stderr, "internal assembler error, sp == %i\n", z->sp);
+  else
+    fprintf (stderr, "%s%s:%d: %s: ",
+	     z->stack[z->sp].dir ? z->stack[z->sp].dir->name : "",
+	     z->stack[z->sp].name, z->stack[z->sp].line,
+	     error ? "error" : "warning");
   vfprintf (stderr, fmt, l);
   va_end (l);
-  if (error)
-    errors++;
 }
 
 /* skip over spaces in string */
@@ -132,12 +155,12 @@ delspc (const char *ptr)
 
 /* read away a comma, error if there is none */
 static void
-rd_comma (const char **p)
+rd_comma (struct z80asm *z, const char **p)
 {
   *p = delspc (*p);
   if (**p != ',')
     {
-      printerr (1, "`,' expected. Remainder of line: %s\n", *p);
+      printerr (z, 1, "`,' expected. Remainder of line: %s\n", *p);
       return;
     }
   *p = delspc ((*p) + 1);
@@ -151,78 +174,84 @@ has_argument (const char **p)
   return (*q == ',');
 }
 
-/* During assembly, many literals are not parsed.  Instead, they are saved
- * until all labels are read.  After that, they are parsed.  This function
- * is used during assembly, to find the place where the command continues. */
-static void
-skipword (const char **pos, char delimiter)
+/* find an operand expression of the line which starts at p and ends at
+ * delimiter, if it was read already.  */
+static const struct operand *
+find_operand (struct z80asm *z, const char *p, char delimiter)
 {
-  /* rd_expr will happily read the expression, and possibly return
-   * an invalid result.  It will update pos, which is what we need.  */
-  /* Pass valid to allow using undefined labels without errors.  */
-  int valid;
-  rd_expr (pos, delimiter, &valid, sp, 0);
+  unsigned i, n;
+  n = z->num_operands < MAX_OPERANDS ? z->num_operands : MAX_OPERANDS;
+  for (i = 0; i < n; ++i)
+    if (z->operands[i].start == p && z->operands[i].delimiter == delimiter)
+      return &z->operands[i];
+  return NULL;
 }
 
-/* callback function for argument parser, used to open output files. */
-static FILE *
-openfile (int *done,		/* flag to check that a file is opened only once. */
-	  const char *type,	/* name of filetype for error message */
-	  FILE * def,		/* default value, in case "-" is specified */
-	  const char *name,	/* filename to open */
-	  const char *flags)	/* open flags */
+/* During assembly, many literals are not parsed.  Instead, they are saved
+ * until all labels are read.  After that, they are parsed.  This function
+ * is used during assembly, to find the place where the command continues.
+ * Every operand expression of a line is read only once; its value is
+ * kept for new_reference.  */
+static const struct operand *
+read_operand (struct z80asm *z, const char **pos, char delimiter)
 {
-  FILE *retval;
-  if (*done)
-    {
-      fprintf (stderr, "Error: more than one %s specified\n", type);
-      exit (1);
-    }
-  *done = 1;
-  if (def && (!name || (name[0] == '-' && name[1] == 0)))
-    {
-      return def;
-    }
-  if (!name || !name[0])
+  struct operand *op;
+  unsigned long relocs;
+  const char *c;
+  const struct operand *found = find_operand (z, *pos, delimiter);
+  if (found)
     {
-      fprintf (stderr, "Error: no %s specified\n", type);
-      exit (1);
+      ++z->stats.operand_reuses;
+      *pos = found->end;
+      return found;
     }
-  if (!(retval = fopen (name, flags)))
+  /* when all are used, the oldest is replaced */
+  op = &z->operands[z->num_operands++ % MAX_OPERANDS];
+  ++z->stats.operand_reads;
+  op->start = *pos;
+  op->delimiter = delimiter;
+  for (c = delspc (*pos); *c && strchr ("+-~", *c); c = delspc (c + 1))
     {
-      fprintf (stderr, "Unable to open %s %s: %s\n",
-	       type, name, strerror (errno));
-      exit (1);
     }
-  return retval;
+  op->paren = *c == '(';
+  relocs = z->num_relocs;
+  /* rd_expr will happily read the expression, and possibly return
+   * an invalid result.  It will update pos, which is what we need.  */
+  /* Pass valid to allow using undefined labels without errors.  */
+  op->value = rd_expr (z, pos, delimiter, &op->valid, z->sp, 0);
+  if (z->num_relocs != relocs)
+    op->valid = 0;
+  op->end = *pos;
+  return op;
 }
 
-/* open an included file, searching the path */
-static FILE *
-open_include_file (const char *name, struct includedir **dir,
-		   const char *flags)
+/* search an included file in the path.  try_open is called for every
+ * candidate name until it returns nonzero.  */
+static int
+search_include (struct z80asm *z, const char *name, struct includedir **dir,
+		int (*try_open) (const char *path, void *data), void *data)
 {
-  FILE *result;
+  int result;
   struct includedir *i;
   /* always try the current directory first */
-  result = fopen (name, flags);
+  result = try_open (name, data);
   if (result)
     {
       if (dir)
 	*dir = NULL;
       return result;
     }
-  for (i = firstincludedir; i != NULL; i = i->next)
+  for (i = z->firstincludedir; i != NULL; i = i->next)
     {
       char *tmp = malloc (strlen (i->name) + strlen (name) + 1);
       if (!tmp)
 	{
-	  printerr (1, "not enough memory trying to open include file\n");
-	  return NULL;
+	  printerr (z, 1, "not enough memory trying to open include file\n");
+	  return 0;
 	}
       strcpy (tmp, i->name);
       strcat (tmp, name);
-      result = fopen (tmp, flags);
+      result = try_open (tmp, data);
       free (tmp);
       if (result)
 	{
@@ -231,258 +260,175 @@ open_include_file (const char *name, struct includedir **dir,
 	  return result;
 	}
     }
-  return NULL;
+  return 0;
 }
 
-/* queue a file to be opened for reading */
-static void
-open_infile (const char *name)
+/* an included binary file: either data (if it was given by the library
+ * user) or f is set.  */
+struct file_request
 {
-  infile = realloc (infile, sizeof (struct infile) * (infilecount + 1));
-  if (!infile)
-    {
-      fprintf (stderr, "Error: insufficient memory\n");
-      exit (1);
-    }
-  /* only asm is currently supported */
-  infile[infilecount].type = FILETYPE_ASM;
-  infile[infilecount].name = name;
-  if (verbose >= 5)
-    fprintf (stderr, "queued inputfile %s\n", infile[infilecount].name);
-  infilecount++;
+  struct z80asm *z;
+  const char *data;
+  unsigned long size;
+  FILE *f;
+};
+
+static int
+try_open_file (const char *path, void *data)
+{
+  struct file_request *r = data;
+  r->f = NULL;
+  if (find_file (r->z, path, &r->data, &r->size))
+    return 1;
+  if (r->z->read_file)
+    return 0;
+  return (r->f = fopen (path, "rb")) != NULL;
 }
 
-/* add a directory to the include search path */
-static void
-add_include (const char *name)
+struct source_request
 {
-  struct includedir *i;
-  i = malloc (sizeof (struct includedir) + strlen (name) + 1);
-  if (!i)
-    {
-      fprintf (stderr, "Error: insufficient memory\n");
-      exit (1);
-    }
-  strcpy (i->name, name);
-  if (name[strlen (name) - 1] != '/')
-    strcat (i->name, "/");
-  i->next = firstincludedir;
-  firstincludedir = i;
+  struct z80asm *z;
+  struct source *src;
+};
+
+static int
+try_open_source (const char *path, void *data)
+{
+  struct source_request *r = data;
+  return open_source (r->z, r->src, path);
 }
 
-static void
-try_use_real_file (FILE * real, FILE ** backup)
+/* open an included source file, searching the path */
+int
+open_include_source (struct z80asm *z, const char *name,
+		     struct includedir **dir, struct source *src)
 {
-  fpos_t pos;
-  if (fgetpos (real, &pos) == 0)
-    {
-      *backup = real;
-      return;
-    }
-  if (!(*backup = tmpfile ()))
-    {
-      fprintf (stderr, "Error: Unable to open temporary file: %s\n",
-	       strerror (errno));
-      exit (1);
-    }
+  struct source_request r;
+  r.z = z;
+  r.src = src;
+  return search_include (z, name, dir, try_open_source, &r);
 }
 
-static void
-flush_to_real_file (FILE * real, FILE * tmp)
+/* a pattern list for indx(), compiled on first use.  For every possible
+ * first character of the input, first[] has a bit set for each pattern
+ * which can match it, so indx() only tries those.  */
+struct patterns
+{
+  const char **list;		/* the list this was compiled from */
+  unsigned long wild;		/* patterns which can start with anything */
+  unsigned long first[128];	/* patterns by first character of input */
+};
+
+/* displacement for (ix) and (iy) without an offset */
+static const char no_offset[] = "0";
+
+/* find the compiled form of list, compiling it if needed.  list must be
+ * static.  Returns NULL if the list cannot be compiled; it must then be
+ * matched without help.  */
+static struct patterns *
+compile_patterns (struct z80asm *z, const char **list)
 {
-  int l, size, len = 0;
-  char buf[BUFLEN];
-  if (tmp == real)
+  struct patterns *pat;
+  unsigned h = ((unsigned long) list / sizeof (*list)) % MAX_PATTERN_LISTS;
+  int i;
+  if (!z->pattern_cache)
     {
-      return;
+      z->pattern_cache = calloc (MAX_PATTERN_LISTS, sizeof (struct patterns));
+      if (!z->pattern_cache)
+	return NULL;
     }
-  rewind (tmp);
-  while (1)
+  while (z->pattern_cache[h].list)
     {
-      clearerr (tmp);
-      errno = 0;
-      len = fread (buf, 1, BUFLEN, tmp);
-      if (len == 0 && feof (tmp))
-	break;
-      if (len <= 0)
-	{
-	  fprintf (stderr, "error reading temp file: %s\n", strerror (errno));
-	  exit (1);
-	}
-      l = 0;
-      while (l < len)
-	{
-	  clearerr (real);
-	  size = fwrite (&buf[l], 1, len - l, real);
-	  if (size <= 0)
-	    {
-	      fprintf (stderr, "error writing final file: %s\n",
-		       strerror (errno));
-	      exit (1);
-	    }
-	  l += size;
-	}
+      if (z->pattern_cache[h].list == list)
+	return &z->pattern_cache[h];
+      h = (h + 1) % MAX_PATTERN_LISTS;
     }
-}
-
-/* parse commandline arguments */
-static void
-parse_commandline (int argc, char **argv)
-{
-  const struct option opts[] = {
-    {"help", no_argument, NULL, 'h'},
-    {"version", no_argument, NULL, 'V'},
-    {"verbose", no_argument, NULL, 'v'},
-    {"list", optional_argument, NULL, 'l'},
-    {"label", optional_argument, NULL, 'L'},
-    {"input", required_argument, NULL, 'i'},
-    {"output", required_argument, NULL, 'o'},
-    {"label-prefix", required_argument, NULL, 'p'},
-    {"includepath", required_argument, NULL, 'I'},
-    {"force", no_argument, NULL, 'f'},
-    {NULL, 0, NULL, 0}
-  };
-  const char *short_opts = "hVvl::L::i:o:p:I:f";
-  int done = 0, i, out = 0;
-  infile = NULL;
-  while (!done)
+  if (z->num_pattern_lists + 1 >= MAX_PATTERN_LISTS)
+    return NULL;
+  for (i = 0; list[i]; ++i)
+    {
+    }
+  if (i > (int) (8 * sizeof (unsigned long)))
+    return NULL;
+  pat = &z->pattern_cache[h];
+  for (i = 0; list[i]; ++i)
     {
-      switch (getopt_long (argc, argv, short_opts, opts, NULL))
+      unsigned char c = list[i][0];
+      unsigned long bit = 1UL << i;
+      if (!c)
+	continue;
+      if (c == '*' || c == '+' || c == ' ' || c >= 128)
+	pat->wild |= bit;
+      else
 	{
-	case 'h':
-	  /* split in two, to avoid too long string constant */
-	  printf ("Usage: %s [options] [input files]\n"
-		  "\n"
-		  "Possible options are:\n"
-		  "-h\t--help\t\tDisplay this help text and exit.\n"
-		  "-V\t--version\tDisplay version information and exit.\n"
-		  "-v\t--verbose\tBe verbose.  "
-		  "Specify again to be more verbose.\n"
-		  "-l\t--list\t\tWrite a list file.\n"
-		  "-L\t--label\t\tWrite a label file.\n", argv[0]);
-	  printf ("-p\t--label-prefix\tprefix all labels with this prefix.\n"
-		  "-i\t--input\t\tSpecify an input file (-i may be omitted).\n"
-		  "-o\t--output\tSpecify the output file.\n"
-		  "-I\t--includepath\tAdd a directory to the include path.\n"
-		  "Please send bug reports and feature requests to "
-		  "<shevek@fmf.nl>\n");
-	  exit (0);
-	case 'V':
-	  printf ("Z80 assembler version " VERSION "\n"
-		  "Copyright (C) 2002-2007 Bas Wijnen "
-		  "<shevek@fmf.nl>.\n"
-		  "Copyright (C) 2005 Jan Wilmans "
-		  "<jw@dds.nl>.\n"
-		  "This program comes with ABSOLUTELY NO WARRANTY.\n"
-		  "You may distribute copies of the program under the terms\n"
-		  "of the GNU General Public License as published by\n"
-		  "the Free Software Foundation; either version 2 of the\n"
-		  "License, or (at your option) any later version.\n\n"
-		  "The complete text of the GPL can be found in\n"
-		  "/usr/share/common-licenses/GPL.\n");
-	  exit (0);
-	case 'v':
-	  verbose++;
-	  if (verbose >= 5)
-	    fprintf (stderr, "Verbosity increased to level %d\n", verbose);
-	  break;
-	case 'o':
-	  realoutputfile
-	    = openfile (&out, "output file", stdout, optarg, "wb");
-	  realoutputfilename = optarg;
-	  if (verbose >= 5)
-	    fprintf (stderr, "Opened outputfile\n");
-	  break;
-	case 'i':
-	  open_infile (optarg);
-	  break;
-	case 'l':
-	  reallistfile
-	    = openfile (&havelist, "list file", stderr, optarg, "w");
-	  if (verbose >= 5)
-	    fprintf (stderr, "Opened list file\n");
-	  break;
-	case 'L':
-	  labelfile = openfile (&label, "label file", stderr, optarg, "w");
-	  labelfilename = optarg;
-	  if (verbose >= 5)
-	    fprintf (stderr, "Opened label file\n");
-	  break;
-	case 'p':
-	  labelprefix = optarg;
-	  break;
-	case 'I':
-	  add_include (optarg);
-	  break;
-	case 'f':
-	  use_force = 1;
-	  break;
-	case -1:
-	  done = 1;
-	  break;
-	default:
-	  /* errors are handled by getopt_long */
-	  break;
+	  pat->first[c] |= bit;
+	  if (c >= 'a' && c <= 'z')
+	    pat->first[c - 'a' + 'A'] |= bit;
 	}
     }
-  for (i = optind; i < argc; ++i)
-    open_infile (argv[i]);
-  if (!infilecount)
-    open_infile ("-");
-  if (!out)
-    realoutputfile = openfile (&out, "output file", stdout, "a.bin", "wb");
-  try_use_real_file (realoutputfile, &outfile);
-  if (havelist)
-    try_use_real_file (reallistfile, &listfile);
+  pat->list = list;
+  ++z->num_pattern_lists;
+  if (z->verbose >= 7)
+    fprintf (stderr, "compiled pattern list starting with %s\n", list[0]);
+  return pat;
 }
 
-/* find any of the list[] entries as the start of ptr and return index */
+/* find any of the list[] entries as the start of ptr and return index.
+ * list must be static, so its compiled form can be reused. */
 static int
-indx (const char **ptr, const char **list, int error, const char **expr)
+indx (struct z80asm *z, const char **ptr, const char **list, int error,
+      const char **expr)
 {
-  int i, l;
+  int i;
+  struct patterns *pat;
+  unsigned long candidates = 0;
+  ++z->stats.indx_calls;
   *ptr = delspc (*ptr);
   if (!**ptr)
     {
       if (error)
 	{
-	  printerr (1, "unexpected end of line\n");
+	  printerr (z, 1, "unexpected end of line\n");
 	  return 0;
 	}
       else
 	return 0;
     }
-  if (comma > 1)
-    rd_comma (ptr);
+  if (z->comma > 1)
+    rd_comma (z, ptr);
+  pat = compile_patterns (z, list);
+  if (pat)
+    {
+      unsigned char c = **ptr;
+      candidates = pat->wild | (c < 128 ? pat->first[c] : 0);
+    }
   for (i = 0; list[i]; i++)
     {
       const char *input = *ptr;
       const char *check = list[i];
       int had_expr = 0;
+      if (pat && !(candidates & (1UL << i)))
+	continue;
       if (!list[i][0])
 	continue;
-      l = strlen (list[i]);
       while (*check)
 	{
 	  if (*check == ' ')
 	    {
 	      input = delspc (input);
 	    }
-	  else if (*check == '*')
+	  else if (*check == '*' || (*check == '+'
+				     && (*input == '+' || *input == '-')))
 	    {
 	      *expr = input;
-	      mem_delimiter = check[1];
-	      rd_expr (&input, mem_delimiter, NULL, sp, 0);
-	      had_expr = 1;
+	      z->mem_delimiter = check[1];
+	      read_operand (z, &input, z->mem_delimiter);
+	      had_expr |= *check == '*';
 	    }
 	  else if (*check == '+')
 	    {
-	      if (*input == '+' || *input == '-')
-		{
-		  *expr = input;
-		  mem_delimiter = check[1];
-		  rd_expr (&input, mem_delimiter, NULL, sp, 0);
-		}
+	      /* no offset given, so it is 0 */
+	      *expr = no_offset;
 	    }
 	  else if (*check == *input || (*check >= 'a' && *check <= 'z'
 					&& *check - 'a' + 'A' == *input))
@@ -501,19 +447,14 @@ indx (const char **ptr, const char **list, int error, const char **expr)
 	    continue;
 	}
       *ptr = input;
-      if (verbose >= 4)
-	fprintf (stderr, "%5d (0x%04x): Piece of code found:%s\n",
-		 stack[sp].line, addr, list[i]);
-      if (verbose >= 6)
-	fprintf (stderr, "%5d (0x%04x): Remainder of line=%s.\n",
-		 stack[sp].line, addr, *ptr);
-      comma++;
+      TRACE (z, Z80ASM_TRACE_LEXER, TRACE_MNEMONIC, i, 0, list[i]);
+      z->comma++;
       return i + 1;
     }
   if (error)
     {
-      printerr (1, "parse error. Remainder of line=%s\n", *ptr);
-      if (verbose >= 3)
+      printerr (z, 1, "parse error. Remainder of line=%s\n", *ptr);
+      if (z->verbose >= 3)
 	{
 	  fprintf (stderr, "When looking for any of:\n");
 	  for (i = 0; list[i]; i++)
@@ -524,32 +465,116 @@ indx (const char **ptr, const char **list, int error, const char **expr)
   return 0;
 }
 
-/* read a mnemonic */
-static int
-readcommand (const char **p)
+/* compute the slot of a (lower case) word in mnemonic_hash[] */
+static unsigned
+hash_mnemonic (const char *word, unsigned len, unsigned long seed)
 {
-  return indx (p, mnemonics, 0, NULL);
+  unsigned long h = seed;
+  unsigned i;
+  for (i = 0; i < len; ++i)
+    h = ((h ^ (unsigned char) word[i]) * 0x01000193UL) & 0xffffffffUL;
+  h ^= h >> 15;
+  h = (h * 0x2c1b3c6dUL) & 0xffffffffUL;
+  h ^= h >> 12;
+  return h % MNEMONIC_HASH_SIZE;
 }
 
-/* try to read a label and optionally store it in the list */
+/* fill char_class[] */
 static void
-readlabel (const char **p, int store)
+init_char_class (void)
 {
-  const char *c, *d, *pos, *dummy;
-  int i, j;
-  struct label *buf, *previous, **thefirstlabel;
-  for (d = *p; *d && *d != ';'; ++d)
+  int c;
+  for (c = 0; c < 256; ++c)
+    {
+      char_class[c] = 0;
+      if (isspace (c))
+	char_class[c] |= CHAR_SPACE;
+      if (!c || strchr (" \r\n\t;", c))
+	char_class[c] |= CHAR_WORD_END;
+      if (isalnum (c) || c == '_' || c == '.')
+	char_class[c] |= CHAR_LABEL;
+    }
+}
+
+/* fill mnemonic_hash[] */
+static void
+init_mnemonic_hash (void)
+{
+  int i;
+  while (1)
     {
+      memset (mnemonic_hash, 0, sizeof (mnemonic_hash));
+      mnemonic_maxlen = 0;
+      for (i = 0; mnemonics[i]; ++i)
+	{
+	  unsigned len = strlen (mnemonics[i]);
+	  unsigned h = hash_mnemonic (mnemonics[i], len, mnemonic_seed);
+	  if (mnemonic_hash[h])
+	    break;
+	  mnemonic_hash[h] = i + 1;
+	  if (len > mnemonic_maxlen)
+	    mnemonic_maxlen = len;
+	}
+      if (!mnemonics[i])
+	break;
+      /* collision; try the next seed */
+      ++mnemonic_seed;
     }
-  for (c = *p; !strchr (" \r\n\t", *c) && c < d; ++c)
+}
+
+/* fill the tables which all contexts share */
+static void
+init_tables (void)
+{
+  init_char_class ();
+  init_mnemonic_hash ();
+}
+
+/* read a mnemonic.  This accepts the same input as indx() would with
+ * mnemonics[] as the list, but it looks the word up in constant time. */
+static int
+readcommand (struct z80asm *z, const char **p)
+{
+  char word[16];
+  const char *c;
+  unsigned len, i;
+  int m;
+  *p = delspc (*p);
+  for (c = *p; isalnum (*c); ++c)
     {
     }
-  pos = strchr (*p, ':');
-  if (!pos || pos >= c)
+  len = c - *p;
+  if (!len || len > mnemonic_maxlen || len >= sizeof (word))
+    return 0;
+  /* mnemonics are lower case; upper case input matches as well */
+  for (i = 0; i < len; ++i)
+    word[i] = ((*p)[i] >= 'A' && (*p)[i] <= 'Z')
+      ? (*p)[i] - 'A' + 'a' : (*p)[i];
+  m = mnemonic_hash[hash_mnemonic (word, len, mnemonic_seed)];
+  if (!m || strncmp (mnemonics[m - 1], word, len) || mnemonics[m - 1][len])
+    return 0;
+  *p = c;
+  TRACE (z, Z80ASM_TRACE_LEXER, TRACE_MNEMONIC, m - 1, 0, mnemonics[m - 1]);
+  z->comma++;
+  return m;
+}
+
+/* try to read a label and optionally store it in the list.  *p is the
+ * start of the line, where scan_line found the label.  */
+static void
+readlabel (struct z80asm *z, const char **p, int store)
+{
+  const char *c, *pos, *dummy;
+  int i, j;
+  struct label *buf;
+  struct label_table *table;
+  struct arena *arena;
+  pos = z->tokens.colon;
+  if (!pos)
     return;
   if (pos == *p)
     {
-      printerr (1, "`:' found without a label");
+      printerr (z, 1, "`:' found without a label");
       return;
     }
   if (!store)
@@ -559,351 +584,611 @@ readlabel (const char **p, int store)
     }
   c = pos + 1;
   dummy = *p;
-  j = rd_label (&dummy, &i, &previous, sp, 0);
+  j = rd_label (z, &dummy, &i, z->sp, 0);
   if (i || j)
     {
-      printerr (1, "duplicate definition of label %s\n", *p);
+      printerr (z, 1, "duplicate definition of label %s\n", *p);
       *p = c;
       return;
     }
-  if (NULL == (buf = malloc (sizeof (struct label) + c - *p)))
+  /* local labels are released when the stack level is popped off */
+  if (**p == '.')
+    {
+      table = &z->stack[z->sp].labels;
+      arena = &z->stack[z->sp].arena;
+    }
+  else
+    {
+      table = &z->globallabels;
+      arena = &z->globalarena;
+    }
+  buf = arena_alloc (arena, sizeof (struct label) + c - *p);
+  if (!buf)
     {
-      printerr (1, "not enough memory to store label %s\n", *p);
+      printerr (z, 1, "not enough memory to store label %s\n", *p);
       *p = c;
       return;
     }
   strncpy (buf->name, *p, c - *p - 1);
   buf->name[c - *p - 1] = 0;
-  if (verbose >= 3)
-    fprintf (stderr, "%5d (0x%04x): Label found: %s\n", stack[sp].line,
-	     addr, buf->name);
+  buf->len = c - *p - 1;
+  TRACE (z, Z80ASM_TRACE_LABELS, TRACE_DEFINE, z->addr, 0, buf->name);
   *p = c;
-  buf->value = addr;
-  lastlabel = buf;
-  if (buf->name[0] == '.')
-    thefirstlabel = &stack[sp].labels;
-  else
-    thefirstlabel = &firstlabel;
-  if (previous)
-    buf->next = previous->next;
-  else
-    buf->next = *thefirstlabel;
-  buf->prev = previous;
+  buf->value = z->addr;
   buf->valid = 1;
   buf->busy = 0;
   buf->ref = NULL;
-  if (buf->prev)
-    buf->prev->next = buf;
-  else
-    *thefirstlabel = buf;
-  if (buf->next)
-    buf->next->prev = buf;
+  buf->table = NULL;
+  buf->reloc = z->addr_reloc;
+  buf->hash = hash_label (buf->name, buf->len);
+  if (!add_label (table, buf))
+    {
+      printerr (z, 1, "not enough memory to store label %s\n", buf->name);
+      return;
+    }
+  if (z->num_frames && table == &z->globallabels)
+    log_label (z, buf);
+  z->lastlabel = buf;
+  wake_references (z, buf->hash);
 }
 
-static void new_reference (const char *data, int type, char delimiter,
-			   int ds_count);
+static const char *new_reference (struct z80asm *z, const char *data,
+				  int type, char delimiter, int ds_count);
 
-/* write one byte to the outfile, and add it to the list file as well */
-static void
-write_one_byte (int b, int list)
+/* make room in the image for at least size bytes.  Returns 0 if there
+ * is no memory.  */
+static int
+grow_image (struct z80asm *z, unsigned long size)
 {
-  if (verbose >= 4)
-    fprintf (stderr,
-	     "%5d (0x%04x): write_one_byte called with argument 0x%02x\n",
-	     stack[sp].line, addr, b);
-  b &= 0xff;
-  putc (b, outfile);
-  if (list && havelist)
+  unsigned long new_size = z->image_size ? z->image_size : 0x10000;
+  unsigned char *new_image;
+  while (new_size < size)
+    new_size *= 2;
+  if (!(new_image = realloc (z->image, new_size)))
     {
-      fprintf (listfile, " %02x", b);
-      listdepth += 3;
+      printerr (z, 1, "not enough memory for output\n");
+      return 0;
     }
-  addr++;
-  addr &= 0xffff;
+  memset (new_image + z->image_size, 0, new_size - z->image_size);
+  z->image = new_image;
+  z->image_size = new_size;
+  return 1;
+}
+
+/* write bytes to the image at the current position.  Like for a file,
+ * seeking past the end and writing leaves a hole of zeros.  */
+void
+write_image (struct z80asm *z, const void *data, unsigned long size)
+{
+  if (z->image_pos + size > z->image_size
+      && !grow_image (z, z->image_pos + size))
+    return;
+  if (z->num_frames)
+    log_write (z, z->image_pos, size);
+  memcpy (z->image + z->image_pos, data, size);
+  z->image_pos += size;
+  z->stats.bytes += size;
+  if (z->image_pos > z->image_end)
+    z->image_end = z->image_pos;
 }
 
-/* write byte to outfile and possibly some index things as well */
+/* write one byte to the image, and add it to the list file as well */
 static void
-wrtb (int b)
+write_one_byte (struct z80asm *z, int b, int list)
 {
-  if (verbose >= 4)
-    fprintf (stderr, "%5d (0x%04x): wrtb called with argument 0x%02x\n",
-	     stack[sp].line, addr, b);
-  if (indexed)
+  b &= 0xff;
+  TRACE (z, Z80ASM_TRACE_OUTPUT, TRACE_BYTE, b, z->image_pos, NULL);
+  if (z->image_pos < z->image_size)
     {
-      if (verbose >= 5)
-	fprintf (stderr, "%5d (0x%04x): writing indexed byte 0x%02x\n",
-		 stack[sp].line, addr, indexed);
-      write_one_byte (indexed, 1);
-      indexed = 0;
+      /* fast path for the common case */
+      if (z->num_frames)
+	log_write (z, z->image_pos, 1);
+      z->image[z->image_pos++] = b;
+      ++z->stats.bytes;
+      if (z->image_pos > z->image_end)
+	z->image_end = z->image_pos;
     }
-  if (writebyte)
+  else
+    {
+      unsigned char c = b;
+      write_image (z, &c, 1);
+    }
+  if (list && z->havelist)
+    list_item (z->listing, LIST_BYTE, b);
+  z->addr++;
+  z->addr &= 0xffff;
+}
+
+/* write byte to image and possibly some index things as well */
+static void
+wrtb (struct z80asm *z, int b)
+{
+  if (z->indexed)
     {
-      if (verbose >= 5)
-	fprintf (stderr, "%5d (0x%04x): using a xor on byte because there is "
-		 "a writebyte.\n", stack[sp].line, addr);
-      b ^= 0x40;
+      write_one_byte (z, z->indexed, 1);
+      z->indexed = 0;
     }
-  if (verbose >= 5)
-    fprintf (stderr, "%5d (0x%04x): writing byte 0x%02x\n", stack[sp].line,
-	     addr, b);
-  if (bitsetres && b != 0xCB)
+  if (z->writebyte)
+    b ^= 0x40;
+  if (z->bitsetres && b != 0xCB)
     {
-      new_reference (bitsetres, TYPE_BSR, ',', b);
-      bitsetres = NULL;
+      new_reference (z, z->bitsetres, TYPE_BSR, ',', b);
+      z->bitsetres = NULL;
     }
   else
     {
-      write_one_byte (b, 1);
+      write_one_byte (z, b, 1);
     }
-  if (indexjmp)
+  if (z->indexjmp)
     {
-      if (verbose >= 5)
-	fprintf (stderr, "%5d (0x%04x): Making reference for index/jump %s\n",
-		 stack[sp].line, addr, indexjmp);
-      new_reference (indexjmp, TYPE_ABSB, ')', 1);
-      indexjmp = NULL;
+      new_reference (z, z->indexjmp, TYPE_ABSB, ')', 1);
+      z->indexjmp = NULL;
     }
-  if (writebyte)
+  if (z->writebyte)
     {
-      if (verbose >= 5)
-	fprintf (stderr, "%5d (0x%04x): writing argument byte for padding\n",
-		 stack[sp].line, addr);
-      writebyte = 0;
-      new_reference (readbyte, TYPE_ABSB, mem_delimiter, 1);
+      z->writebyte = 0;
+      new_reference (z, z->readbyte, TYPE_ABSB, z->mem_delimiter, 1);
     }
 }
 
 int
-compute_ref (struct reference *ref, int allow_invalid)
+compute_ref (struct z80asm *z, struct reference *ref, int allow_invalid)
 {
   const char *ptr;
   int valid = 0;
-  int backup_addr = addr;
-  int backup_baseaddr = baseaddr;
-  int backup_comma = comma;
-  int backup_file = file;
-  int backup_sp = sp;
-  sp = ref->level;
-  addr = ref->addr;
-  baseaddr = ref->baseaddr;
-  comma = ref->comma;
-  file = ref->infile;
-  if (verbose >= 3)
-    fprintf (stderr, "%5d (0x%04x): Making reference to %s (done=%d, "
-	     "computed=%d)\n",
-	     stack[sp].line, addr, ref->input, ref->done,
-	     ref->computed_value);
+  int backup_addr = z->addr;
+  int backup_baseaddr = z->baseaddr;
+  int backup_comma = z->comma;
+  int backup_file = z->file;
+  int backup_sp = z->sp;
+  int backup_addr_reloc = z->addr_reloc;
+  const char *backup_name;
+  struct includedir *backup_dir;
+  int backup_line;
+  ++z->stats.compute_refs;
+  z->sp = ref->level;
+  /* errors are reported at the line of the reference */
+  backup_name = z->stack[z->sp].name;
+  backup_dir = z->stack[z->sp].dir;
+  backup_line = z->stack[z->sp].line;
+  z->stack[z->sp].name = ref->file;
+  z->stack[z->sp].dir = ref->dir;
+  z->stack[z->sp].line = ref->line;
+  z->addr = ref->addr;
+  z->addr_reloc = ref->addr_reloc;
+  z->baseaddr = ref->baseaddr;
+  z->comma = ref->comma;
+  z->file = ref->infile;
   ptr = ref->input;
-  if (!ref->done)
+  if (!ref->done && ref->code)
+    {
+      /* the expression was compiled when the reference was made */
+      ref->computed_value = eval_expr_code (z, ref->code, ref->level,
+					    allow_invalid ? &valid : NULL, 1);
+      if ((!allow_invalid || valid) && ref->code->check)
+	printerr (z, 0, "expression fully enclosed in parenthesis\n");
+      if (allow_invalid && valid)
+	ref->done = 1;
+      ref->reloc = z->object ? z->expr_reloc : 0;
+      /* the linker computes it again, when local labels are gone */
+      if (ref->done && ref->reloc == RELOC_EXPR)
+	bind_local_labels (z, ref->code, ref->level);
+    }
+  else if (!ref->done)
     {
-      ref->computed_value = rd_expr (&ptr, ref->delimiter,
+      unsigned long relocs = z->num_relocs;
+      /* this may use ?label as well */
+      ++z->num_unstable;
+      ref->computed_value = rd_expr (z, &ptr, ref->delimiter,
 				     allow_invalid ? &valid : NULL,
 				     ref->level, 1);
       if (valid)
 	ref->done = 1;
-    }
-  if (verbose >= 4)
-    fprintf (stderr, "%5d (0x%04x): Reference is %d (0x%04x).\n",
-	     stack[sp].line, addr, ref->computed_value, ref->computed_value);
-  sp = backup_sp;
-  addr = backup_addr;
-  baseaddr = backup_baseaddr;
-  comma = backup_comma;
-  file = backup_file;
+      /* without code, the linker can't compute it */
+      ref->reloc = z->num_relocs != relocs ? RELOC_EXPR : 0;
+    }
+  if (ref->label && (ref->done || !allow_invalid))
+    {
+      /* this is the value of an equ */
+      ref->label->reloc = ref->reloc;
+      set_label (ref->label, ref->done, ref->computed_value);
+    }
+  TRACE (z, Z80ASM_TRACE_REFS, TRACE_COMPUTE, ref->computed_value, ref->done,
+	 ref->input);
+  z->stack[z->sp].name = backup_name;
+  z->stack[z->sp].dir = backup_dir;
+  z->stack[z->sp].line = backup_line;
+  z->sp = backup_sp;
+  z->addr = backup_addr;
+  z->addr_reloc = backup_addr_reloc;
+  z->baseaddr = backup_baseaddr;
+  z->comma = backup_comma;
+  z->file = backup_file;
   return ref->computed_value;
 }
 
-static void wrt_ref (int val, int type, int count);
+static void wrt_ref (struct z80asm *z, int val, int type, int count);
 
-/* Create a new reference, to be resolved after assembling (so all labels are
- * known.) */
-static void
-new_reference (const char *p, int type, char delimiter, int ds_count)
+/* copy the text of a reference, which starts at p and goes on to the end
+ * of the line.  The references of a line share one copy of it, so a long
+ * line with many references is copied once, not once per reference.  */
+static const char *
+copy_ref_input (struct z80asm *z, const char *p, struct arena *arena)
+{
+  if (arena != &z->globalarena || p < z->buffer
+      || p > z->buffer + z->buffer_len)
+    return arena_strdup (arena, p);
+  if (!z->ref_line || z->ref_line_seq != z->stats.lines)
+    {
+      z->ref_line = arena_alloc (arena, z->buffer_len + 1);
+      if (!z->ref_line)
+	return NULL;
+      memcpy (z->ref_line, z->buffer, z->buffer_len + 1);
+      z->ref_line_seq = z->stats.lines;
+    }
+  return z->ref_line + (p - z->buffer);
+}
+
+static const char *
+do_new_reference (struct z80asm *z, const char *p, int type, char delimiter,
+	       int ds_count)
 {
   struct reference *tmp = NULL;
   long opos, lpos;
   int valid, value;
   const char *c;
+  struct arena *arena;
+  unsigned long relocs = z->num_relocs;
+  const struct operand *op = find_operand (z, p, delimiter);
+  /* an operand which was computed when it was read.  If it starts with
+   * a parenthesis, it is read again for the warning if that encloses all
+   * of it.  */
+  if (op && op->valid && !op->paren && type != TYPE_LABEL
+      && !(type == TYPE_RELB && z->addr_reloc))
+    {
+      ++z->stats.operand_reuses;
+      ++z->stats.immediate;
+      TRACE (z, Z80ASM_TRACE_REFS, TRACE_IMMEDIATE, op->value, type, p);
+      wrt_ref (z, op->value, type, ds_count);
+      return op->end;
+    }
   c = p;
-  value = rd_expr (&c, delimiter, &valid, sp, 1);
+  value = rd_expr_code (z, &c, delimiter, &valid, z->sp, 1, &z->scratch_code);
+  /* in an object, a value which depends on its address is computed like
+   * a reference, which finds out how it does.  So is a relative jump from
+   * a relative address, which may go to an absolute one.  */
+  if (z->num_relocs != relocs || (type == TYPE_RELB && z->addr_reloc))
+    valid = 0;
   if (valid)
     {
-      if (verbose >= 5)
-	{
-	  fprintf (stderr, "%5d (0x%04x): Using calculated value %d (%x) "
-		   "immediately.\n", stack[sp].line, addr, value, value);
-	}
+      ++z->stats.immediate;
+      TRACE (z, Z80ASM_TRACE_REFS, TRACE_IMMEDIATE, value, type, p);
     }
   else
     {
-      /* the expression is not valid (yet), we need to make a real reference.  */
-      tmp = malloc (sizeof (struct reference) + strlen (p));
-      if (!tmp)
+      /* the expression is not valid (yet), we need to make a real reference.
+       * The value of a local label is not needed after its stack level is
+       * popped off, everything else is needed until the end.  */
+      if (type == TYPE_LABEL && z->lastlabel->name[0] == '.')
+	arena = &z->stack[z->sp].arena;
+      else
+	arena = &z->globalarena;
+      tmp = arena_alloc (arena, sizeof (struct reference));
+      if (!tmp || !(tmp->input = copy_ref_input (z, p, arena)))
 	{
-	  printerr (1, "unable to allocate memory for reference %s\n", p);
-	  return;
+	  printerr (z, 1, "unable to allocate memory for reference %s\n", p);
+	  return c;
 	}
-      tmp->file = malloc (strlen (stack[sp].name) + 1);
+      tmp->file = arena_strdup (arena, z->stack[z->sp].name);
       if (!tmp->file)
 	{
-	  printerr (1, "unable to allocate memory for reference filename\n");
-	  free (tmp);
-	  return;
+	  printerr (z, 1,
+		    "unable to allocate memory for reference filename\n");
+	  return c;
 	}
-      strcpy (tmp->file, stack[sp].name);
-      if (stack[sp].dir)
+      if (z->stack[z->sp].dir)
 	{
-	  tmp->dir = malloc (strlen (stack[sp].dir->name)
-			  + sizeof (struct includedir));
+	  tmp->dir = arena_alloc (arena, strlen (z->stack[z->sp].dir->name)
+				  + sizeof (struct includedir));
 	  if (!tmp->dir)
 	    {
-	      printerr (1, "unable to allocate memory for reference dir\n");
-	      free (tmp->file);
-	      free (tmp);
-	      return;
+	      printerr (z, 1, "unable to allocate memory for reference dir\n");
+	      return c;
 	    }
-	  strcpy (tmp->dir->name, stack[sp].dir->name);
+	  strcpy (tmp->dir->name, z->stack[z->sp].dir->name);
 	}
       else
 	tmp->dir = NULL;
-      opos = ftell (outfile);
-      lpos = havelist ? ftell (listfile) : 0;
-      if (verbose >= 3)
-	fprintf (stderr, "%5d (0x%04x): reference set to %s (delimiter=%c, "
-		 "sp=%d)\n", stack[sp].line, addr, p, delimiter, sp);
-      strcpy (tmp->input, p);
-      tmp->line = stack[sp].line;
-      tmp->addr = addr;
-      tmp->baseaddr = baseaddr;
+      opos = z->image_pos;
+      lpos = z->havelist ? list_tell (z->listing) : 0;
+      TRACE (z, Z80ASM_TRACE_REFS, TRACE_DEFER, type, z->sp, p);
+      tmp->code = copy_expr_code (&z->scratch_code, tmp->input, arena);
+      ++z->stats.deferred;
+      tmp->line = z->stack[z->sp].line;
+      tmp->addr = z->addr;
+      tmp->baseaddr = z->baseaddr;
       tmp->count = ds_count;
-      tmp->infile = file;
-      tmp->comma = comma;
+      tmp->infile = z->file;
+      tmp->comma = z->comma;
       tmp->oseekpos = opos;
       tmp->lseekpos = lpos;
       tmp->delimiter = delimiter;
       tmp->type = type;
-      tmp->next = firstreference;
+      tmp->next = z->firstreference;
       tmp->done = 0;
-      tmp->level = sp;
+      tmp->reloc = 0;
+      tmp->addr_reloc = z->addr_reloc;
+      tmp->level = z->sp;
+      tmp->woken = 0;
+      tmp->seq = z->num_references++;
+      tmp->level_next = NULL;
+      tmp->level_prev = NULL;
+      tmp->label = (type == TYPE_LABEL) ? z->lastlabel : NULL;
+      wait_for_labels (z, tmp, arena);
       if (type != TYPE_LABEL)
 	{
-	  if (firstreference)
-	    firstreference->prev = tmp;
+	  if (z->firstreference)
+	    z->firstreference->prev = tmp;
 	  tmp->prev = NULL;
-	  firstreference = tmp;
+	  z->firstreference = tmp;
+	  tmp->level_next = z->stack[z->sp].refs;
+	  if (tmp->level_next)
+	    tmp->level_next->level_prev = tmp;
+	  z->stack[z->sp].refs = tmp;
+	}
+      else if (z->object && z->lastlabel->name[0] != '.')
+	{
+	  /* the local labels it uses must be bound when they go out of
+	   * scope, see resolve_references */
+	  tmp->level_next = z->stack[z->sp].refs;
+	  if (tmp->level_next)
+	    tmp->level_next->level_prev = tmp;
+	  z->stack[z->sp].refs = tmp;
 	}
       /* Dummy value which should not give warnings */
       value = (type == TYPE_RELB) ? ds_count : 0;
     }
   if (type != TYPE_LABEL)
     {
-      wrt_ref (value, type, ds_count);
+      wrt_ref (z, value, type, ds_count);
     }
   else
     {
-      lastlabel->ref = tmp;
-      lastlabel->valid = valid;
-      lastlabel->value = value;
+      z->lastlabel->ref = tmp;
+      z->lastlabel->reloc = 0;
+      set_label (z->lastlabel, valid, value);
     }
+  return c;
+}
+
+/* Create a new reference, to be resolved after assembling (so all labels are
+ * known.)  Returns the end of the expression.  */
+static const char *
+new_reference (struct z80asm *z, const char *p, int type, char delimiter,
+	       int ds_count)
+{
+  int phase = ENTER_PHASE (z, Z80ASM_PHASE_ENCODE);
+  ++z->stats.operands;
+  p = do_new_reference (z, p, type, delimiter, ds_count);
+  ENTER_PHASE (z, phase);
+  return p;
+}
+
+/* constant bytes of a data directive, which are written to the image
+ * together */
+struct byte_run
+{
+  unsigned n;
+  unsigned char data[256];
+};
+
+static void
+flush_run (struct z80asm *z, struct byte_run *run)
+{
+  if (!run->n)
+    return;
+  TRACE (z, Z80ASM_TRACE_OUTPUT, TRACE_BYTES, run->n, z->image_pos, NULL);
+  write_image (z, run->data, run->n);
+  z->addr = (z->addr + run->n) & 0xffff;
+  run->n = 0;
+}
+
+static void
+run_byte (struct z80asm *z, struct byte_run *run, int b, int list)
+{
+  b &= 0xff;
+  if (list && z->havelist)
+    list_item (z->listing, LIST_BYTE, b);
+  run->data[run->n++] = b;
+  if (run->n == sizeof (run->data))
+    flush_run (z, run);
+}
+
+static void
+run_bytes (struct z80asm *z, struct byte_run *run, const char *data,
+	   unsigned long size)
+{
+  unsigned long n;
+  while (size)
+    {
+      n = sizeof (run->data) - run->n;
+      if (n > size)
+	n = size;
+      memcpy (run->data + run->n, data, n);
+      run->n += n;
+      data += n;
+      size -= n;
+      if (run->n == sizeof (run->data))
+	flush_run (z, run);
+    }
+}
+
+/* read an item of a data directive which is a plain number: decimal, or
+ * hexadecimal with 0x.  It is what rd_expr would read, but without
+ * compiling an expression.  Returns 0 for anything else.  */
+static int
+rd_plain_number (const char **p, int *value)
+{
+  const char *c = delspc (*p);
+  unsigned long v = 0;
+  if (c[0] == '0' && c[1] == 'x' && isxdigit ((unsigned char) c[2]))
+    {
+      for (c += 2; isxdigit ((unsigned char) *c); ++c)
+	v = v * 16 + (isdigit ((unsigned char) *c) ? *c - '0'
+		      : tolower ((unsigned char) *c) - 'a' + 10);
+    }
+  /* a number which starts with 0 is octal */
+  else if ((*c >= '1' && *c <= '9') || (*c == '0' && !IS_LABEL_CHAR (c[1])))
+    {
+      for (; isdigit ((unsigned char) *c); ++c)
+	v = v * 10 + (*c - '0');
+    }
+  else
+    return 0;
+  /* a suffix, or something which makes it an expression */
+  if (IS_LABEL_CHAR (*c))
+    return 0;
+  c = delspc (c);
+  if (*c && *c != ',')
+    return 0;
+  *p = c;
+  *value = (int) (v & 0xffffffffUL);
+  return 1;
+}
+
+/* write an item of db or dw (type is TYPE_ABSB or TYPE_ABSW), and return
+ * its end.  A plain number is added to run; anything else is written
+ * after it, through new_reference.  */
+static const char *
+write_data (struct z80asm *z, struct byte_run *run, const char *p, int type)
+{
+  int value;
+  if (!rd_plain_number (&p, &value))
+    {
+      flush_run (z, run);
+      return new_reference (z, p, type, ',', 1);
+    }
+  ++z->stats.operands;
+  ++z->stats.immediate;
+  if (type == TYPE_ABSW)
+    {
+      if (value < -0x8000 || value >= 0x10000)
+	printerr (z, 0, "word value %d (0x%x) truncated\n", value, value);
+      run_byte (z, run, value, 1);
+      run_byte (z, run, value >> 8, 1);
+    }
+  else
+    {
+      if (value < -0x80 || value >= 0x100)
+	printerr (z, 0, "byte value %d (0x%x) truncated\n", value, value);
+      run_byte (z, run, value, 1);
+    }
+  return p;
 }
 
 /* write the last read word to file */
 static void
-write_word (void)
+write_word (struct z80asm *z)
 {
-  new_reference (readword, TYPE_ABSW, mem_delimiter, 1);
+  new_reference (z, z->readword, TYPE_ABSW, z->mem_delimiter, 1);
 }
 
 /* write the last read byte to file (relative) */
 static void
-write_rel (void)
+write_rel (struct z80asm *z)
 {
-  new_reference (readbyte, TYPE_RELB, mem_delimiter, (addr + 1) & 0xffff);
-  writebyte = 0;
+  new_reference (z, z->readbyte, TYPE_RELB, z->mem_delimiter,
+		 (z->addr + 1) & 0xffff);
+  z->writebyte = 0;
 }
 
 /* read a word from input and store it in readword. return 1 on success */
 static int
-rd_word (const char **p, char delimiter)
+rd_word (struct z80asm *z, const char **p, char delimiter)
 {
   *p = delspc (*p);
   if (**p == 0)
     return 0;
-  readword = *p;
-  mem_delimiter = delimiter;
-  skipword (p, delimiter);
+  z->readword = *p;
+  z->mem_delimiter = delimiter;
+  read_operand (z, p, delimiter);
   return 1;
 }
 
 /* read a byte from input and store it in readbyte. return 1 on success */
 static int
-rd_byte (const char **p, char delimiter)
+rd_byte (struct z80asm *z, const char **p, char delimiter)
 {
   *p = delspc (*p);
   if (**p == 0)
     return 0;
-  readbyte = *p;
-  writebyte = 1;
-  mem_delimiter = delimiter;
-  skipword (p, delimiter);
+  z->readbyte = *p;
+  z->writebyte = 1;
+  z->mem_delimiter = delimiter;
+  read_operand (z, p, delimiter);
   return 1;
 }
 
 /* read an address from infile and put it in reference table.
  * so that it will be written here afterwards */
 static void
-rd_wrt_addr (const char **p, char delimiter)
+rd_wrt_addr (struct z80asm *z, const char **p, char delimiter)
 {
-  if (!rd_word (p, delimiter))
-    return;
-  write_word ();
+  if (!rd_word (z, p, delimiter))
+    {
+      printerr (z, 1, "unexpected end of line\n");
+      return;
+    }
+  write_word (z);
 }
 
 /* like rd_wrt_addr, but for a relative jump */
 static void
-rd_wrt_jr (const char **p, char delimiter)
+rd_wrt_jr (struct z80asm *z, const char **p, char delimiter)
 {
-  if (!rd_byte (p, delimiter))
-    return;
-  write_rel ();
+  if (!rd_byte (z, p, delimiter))
+    {
+      printerr (z, 1, "unexpected end of line\n");
+      return;
+    }
+  write_rel (z);
 }
 
 /* read (SP), DE, or AF */
 static int
-rd_ex1 (const char **p)
+rd_ex1 (struct z80asm *z, const char **p)
 {
 #define DE 2
 #define AF 3
-  const char *list[] = { "( sp )", "de", "af", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "( sp )", "de", "af", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read first argument of IN */
 static int
-rd_in (const char **p)
+rd_in (struct z80asm *z, const char **p)
 {
 #define A 8
-  const char *list[] = { "b", "c", "d", "e", "h", "l", "f", "a", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "b", "c", "d", "e", "h", "l", "f", "a", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read second argument of out (c),x */
 static int
-rd_out (const char **p)
+rd_out (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "b", "c", "d", "e", "h", "l", "0", "a", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "b", "c", "d", "e", "h", "l", "0", "a", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read (c) or (nn) */
 static int
-rd_nnc (const char **p)
+rd_nnc (struct z80asm *z, const char **p)
 {
 #define C 1
   int i;
-  const char *list[] = { "( c )", "(*)", "a , (*)", NULL };
-  i = indx (p, list, 1, &readbyte);
+  static const char *list[] = { "( c )", "(*)", "a , (*)", NULL };
+  i = indx (z, p, list, 1, &z->readbyte);
   if (i < 2)
     return i;
   return 2;
@@ -911,24 +1196,24 @@ rd_nnc (const char **p)
 
 /* read (C) */
 static int
-rd_c (const char **p)
+rd_c (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "( c )", "( bc )", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "( c )", "( bc )", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read a or hl */
 static int
-rd_a_hl (const char **p)
+rd_a_hl (struct z80asm *z, const char **p)
 {
 #define HL 2
-  const char *list[] = { "a", "hl", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "a", "hl", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read first argument of ld */
 static int
-rd_ld (const char **p)
+rd_ld (struct z80asm *z, const char **p)
 {
 #define ldBC	1
 #define ldDE	2
@@ -952,102 +1237,102 @@ rd_ld (const char **p)
 #define ld_IY	20
 #define ld_NN	21
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "ixh", "ixl", "iyh", "iyl", "bc", "de", "hl", "sp", "ix",
     "iy", "b", "c", "d", "e", "h", "l", "( hl )", "a", "i",
     "r", "( bc )", "( de )", "( ix +)", "(iy +)", "(*)", NULL
   };
   const char *nn;
-  i = indx (p, list, 1, &nn);
+  i = indx (z, p, list, 1, &nn);
   if (!i)
     return 0;
   if (i <= 2)
     {
-      indexed = 0xdd;
+      z->indexed = 0xdd;
       return ldH + (i == 2);
     }
   if (i <= 4)
     {
-      indexed = 0xfd;
+      z->indexed = 0xfd;
       return ldH + (i == 4);
     }
   i -= 4;
   if (i == ldIX || i == ldIY)
     {
-      indexed = i == ldIX ? 0xDD : 0xFD;
+      z->indexed = i == ldIX ? 0xDD : 0xFD;
       return ldHL;
     }
   if (i == ld_IX || i == ld_IY)
     {
-      indexjmp = nn;
-      indexed = i == ld_IX ? 0xDD : 0xFD;
+      z->indexjmp = nn;
+      z->indexed = i == ld_IX ? 0xDD : 0xFD;
       return ld_HL;
     }
   if (i == ld_NN)
-    readword = nn;
+    z->readword = nn;
   return i;
 }
 
 /* read first argument of JP */
 static int
-rd_jp (const char **p)
+rd_jp (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "nz", "z", "nc", "c", "po", "pe", "p", "m", "( ix )", "( iy )",
     "(hl)", NULL
   };
-  i = indx (p, list, 0, NULL);
+  i = indx (z, p, list, 0, NULL);
   if (i < 9)
     return i;
   if (i == 11)
     return -1;
-  indexed = 0xDD + 0x20 * (i - 9);
+  z->indexed = 0xDD + 0x20 * (i - 9);
   return -1;
 }
 
 /* read first argument of JR */
 static int
-rd_jr (const char **p)
+rd_jr (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "nz", "z", "nc", "c", NULL };
-  return indx (p, list, 0, NULL);
+  static const char *list[] = { "nz", "z", "nc", "c", NULL };
+  return indx (z, p, list, 0, NULL);
 }
 
 /* read A */
 static int
-rd_a (const char **p)
+rd_a (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "a", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "a", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read bc,de,hl,af */
 static int
-rd_stack (const char **p)
+rd_stack (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = { "bc", "de", "hl", "af", "ix", "iy", NULL };
-  i = indx (p, list, 1, NULL);
+  static const char *list[] = { "bc", "de", "hl", "af", "ix", "iy", NULL };
+  i = indx (z, p, list, 1, NULL);
   if (i < 5)
     return i;
-  indexed = 0xDD + 0x20 * (i - 5);
+  z->indexed = 0xDD + 0x20 * (i - 5);
   return 3;
 }
 
 #if 0
 /* read a or hl(2) or i[xy](2) with variables set */
 static int
-rd_a_hlx (const char **p)
+rd_a_hlx (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = { "a", "hl", "ix", "iy", NULL };
-  i = indx (p, list, 1, NULL);
+  static const char *list[] = { "a", "hl", "ix", "iy", NULL };
+  i = indx (z, p, list, 1, NULL);
   if (i < 2)
     return i;
   if (i == 2)
     return 2;
-  indexed = 0xDD + 0x20 * (i - 3);
+  z->indexed = 0xDD + 0x20 * (i - 3);
   return 2;
 }
 #endif
@@ -1056,389 +1341,394 @@ rd_a_hlx (const char **p)
  * but now with extra hl or i[xy](15) for add-instruction
  * and set variables accordingly */
 static int
-rd_r_add (const char **p)
+rd_r_add (struct z80asm *z, const char **p)
 {
 #define addHL 	15
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "ixl", "ixh", "iyl", "iyh", "b", "c", "d", "e", "h", "l",
     "( hl )", "a", "( ix +)", "( iy +)", "hl", "ix", "iy", "*", NULL
   };
   const char *nn;
-  i = indx (p, list, 0, &nn);
+  if (!(i = indx (z, p, list, 1, &nn)))
+    return 0;
   if (i == 18)	/* expression */
     {
-      readbyte = nn;
-      writebyte = 1;
+      z->readbyte = nn;
+      z->writebyte = 1;
       return 7;
     }
   if (i > 14)	/* hl, ix, iy */
     {
       if (i > 15)
-	indexed = 0xDD + 0x20 * (i - 16);
+	z->indexed = 0xDD + 0x20 * (i - 16);
       return addHL;
     }
   if (i <= 4)	/* i[xy][hl]  */
     {
-      indexed = 0xdd + 0x20 * (i > 2);
+      z->indexed = 0xdd + 0x20 * (i > 2);
       return 6 - (i & 1);
     }
   i -= 4;
   if (i < 9)
     return i;
-  indexed = 0xDD + 0x20 * (i - 9);	/* (i[xy] +) */
-  indexjmp = nn;
+  z->indexed = 0xDD + 0x20 * (i - 9);	/* (i[xy] +) */
+  z->indexjmp = nn;
   return 7;
 }
 
 /* read bc,de,hl, or sp */
 static int
-rd_rr_ (const char **p)
+rd_rr_ (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "bc", "de", "hl", "sp", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "bc", "de", "hl", "sp", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read bc,de,hl|ix|iy,sp. hl|ix|iy only if it is already indexed the same. */
 static int
-rd_rrxx (const char **p)
+rd_rrxx (struct z80asm *z, const char **p)
 {
-  const char *listx[] = { "bc", "de", "ix", "sp", NULL };
-  const char *listy[] = { "bc", "de", "iy", "sp", NULL };
-  const char *list[] = { "bc", "de", "hl", "sp", NULL };
-  switch (indexed)
+  static const char *listx[] = { "bc", "de", "ix", "sp", NULL };
+  static const char *listy[] = { "bc", "de", "iy", "sp", NULL };
+  static const char *list[] = { "bc", "de", "hl", "sp", NULL };
+  switch (z->indexed)
     {
     case 0xDD:
-      return indx (p, listx, 1, NULL);
+      return indx (z, p, listx, 1, NULL);
     case 0xFD:
-      return indx (p, listy, 1, NULL);
+      return indx (z, p, listy, 1, NULL);
     default:
-      return indx (p, list, 1, NULL);
+      return indx (z, p, list, 1, NULL);
     }
 }
 
 /* read b,c,d,e,h,l,(hl),a,(ix+nn),(iy+nn),nn
  * and set variables accordingly */
 static int
-rd_r (const char **p)
+rd_r (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "ixl", "ixh", "iyl", "iyh", "b", "c", "d", "e", "h", "l", "( hl )",
     "a", "( ix +)", "( iy +)", "*", NULL
   };
   const char *nn;
-  i = indx (p, list, 0, &nn);
+  if (!(i = indx (z, p, list, 1, &nn)))
+    return 0;
   if (i == 15)	/* expression */
     {
-      readbyte = nn;
-      writebyte = 1;
+      z->readbyte = nn;
+      z->writebyte = 1;
       return 7;
     }
   if (i <= 4)
     {
-      indexed = 0xdd + 0x20 * (i > 2);
+      z->indexed = 0xdd + 0x20 * (i > 2);
       return 6 - (i & 1);
     }
   i -= 4;
   if (i < 9)
     return i;
-  indexed = 0xDD + 0x20 * (i - 9);
-  indexjmp = nn;
+  z->indexed = 0xDD + 0x20 * (i - 9);
+  z->indexjmp = nn;
   return 7;
 }
 
 /* like rd_r(), but without nn */
 static int
-rd_r_ (const char **p)
+rd_r_ (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "b", "c", "d", "e", "h", "l", "( hl )", "a", "( ix +)", "( iy +)", NULL
   };
-  i = indx (p, list, 1, &indexjmp);
+  i = indx (z, p, list, 1, &z->indexjmp);
   if (i < 9)
     return i;
-  indexed = 0xDD + 0x20 * (i - 9);
+  z->indexed = 0xDD + 0x20 * (i - 9);
   return 7;
 }
 
 /* read a number from 0 to 7, for bit, set or res */
 static int
-rd_0_7 (const char **p)
+rd_0_7 (struct z80asm *z, const char **p)
 {
   *p = delspc (*p);
   if (**p == 0)
-    return 0;
-  bitsetres = *p;
-  skipword (p, ',');
+    {
+      printerr (z, 1, "unexpected end of line\n");
+      return 0;
+    }
+  z->bitsetres = *p;
+  read_operand (z, p, ',');
   return 1;
 }
 
 /* read long condition. do not error if not found. */
 static int
-rd_cc (const char **p)
+rd_cc (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "nz", "z", "nc", "c", "po", "pe", "p", "m", NULL };
-  return indx (p, list, 0, NULL);
+  static const char *list[] = { "nz", "z", "nc", "c", "po", "pe", "p", "m", NULL };
+  return indx (z, p, list, 0, NULL);
 }
 
 /* read long or short register,  */
 static int
-rd_r_rr (const char **p)
+rd_r_rr (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "iy", "ix", "sp", "hl", "de", "bc", "", "b", "c", "d", "e", "h",
     "l", "( hl )", "a", "( ix +)", "( iy +)", NULL
   };
-  i = indx (p, list, 1, &indexjmp);
+  i = indx (z, p, list, 1, &z->indexjmp);
   if (!i)
     return 0;
   if (i < 16 && i > 2)
     return 7 - i;
   if (i > 15)
     {
-      indexed = 0xDD + (i - 16) * 0x20;
+      z->indexed = 0xDD + (i - 16) * 0x20;
       return -7;
     }
-  indexed = 0xDD + (2 - i) * 0x20;
+  z->indexed = 0xDD + (2 - i) * 0x20;
   return 3;
 }
 
 /* read hl */
 static int
-rd_hl (const char **p)
+rd_hl (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "hl", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "hl", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read hl, ix, or iy */
 static int
-rd_hlx (const char **p)
+rd_hlx (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = { "hl", "ix", "iy", NULL };
-  i = indx (p, list, 1, NULL);
+  static const char *list[] = { "hl", "ix", "iy", NULL };
+  i = indx (z, p, list, 1, NULL);
   if (i < 2)
     return i;
-  indexed = 0xDD + 0x20 * (i - 2);
+  z->indexed = 0xDD + 0x20 * (i - 2);
   return 1;
 }
 
 /* read af' */
 static int
-rd_af_ (const char **p)
+rd_af_ (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "af'", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "af'", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read 0(1), 1(3), or 2(4) */
 static int
-rd_0_2 (const char **p)
+rd_0_2 (struct z80asm *z, const char **p)
 {
-  const char *list[] = { "0", "", "1", "2", NULL };
-  return indx (p, list, 1, NULL);
+  static const char *list[] = { "0", "", "1", "2", NULL };
+  return indx (z, p, list, 1, NULL);
 }
 
 /* read argument of ld (hl), */
 static int
-rd_ld_hl (const char **p)
+rd_ld_hl (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = { "b", "c", "d", "e", "h", "l", "", "a", "*", NULL };
-  i = indx (p, list, 0, &readbyte);
+  static const char *list[] = { "b", "c", "d", "e", "h", "l", "", "a", "*", NULL };
+  i = indx (z, p, list, 0, &z->readbyte);
   if (i < 9)
     return i;
-  writebyte = 1;
+  z->writebyte = 1;
   return 7;
 }
 
 /* read argument of ld (nnnn), */
 static int
-rd_ld_nn (const char **p)
+rd_ld_nn (struct z80asm *z, const char **p)
 {
 #define ld_nnHL 5
 #define ld_nnA 6
   int i;
-  const char *list[] = { "bc", "de", "", "sp", "hl", "a", "ix", "iy", NULL };
-  i = indx (p, list, 1, NULL);
+  static const char *list[] = { "bc", "de", "", "sp", "hl", "a", "ix", "iy", NULL };
+  i = indx (z, p, list, 1, NULL);
   if (i < 7)
     return i;
-  indexed = 0xdd + 0x20 * (i == 8);
+  z->indexed = 0xdd + 0x20 * (i == 8);
   return ld_nnHL;
 }
 
 /* read argument of ld a, */
 static int
-rd_lda (const char **p)
+rd_lda (struct z80asm *z, const char **p)
 {
 #define A_I 9
 #define A_R 10
 #define A_NN 11
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "( sp )", "( iy +)", "( de )", "( bc )", "( ix +)", "b", "c", "d", "e", "h",
     "l", "( hl )", "a", "i", "r", "(*)", "*", NULL
   };
   const char *nn;
-  i = indx (p, list, 0, &nn);
+  i = indx (z, p, list, 0, &nn);
   if (i == 2 || i == 5)
     {
-      indexed = (i == 2) ? 0xFD : 0xDD;
-      indexjmp = nn;
+      z->indexed = (i == 2) ? 0xFD : 0xDD;
+      z->indexjmp = nn;
       return 7;
     }
   if (i == 17)
     {
-      readbyte = nn;
-      writebyte = 1;
+      z->readbyte = nn;
+      z->writebyte = 1;
       return 7;
     }
   if (i == 16)
     {
-      readword = nn;
+      z->readword = nn;
     }
   return i - 5;
 }
 
 /* read argument of ld b|c|d|e|h|l */
 static int
-rd_ldbcdehla (const char **p)
+rd_ldbcdehla (struct z80asm *z, const char **p)
 {
   int i;
-  const char *list[] = {
+  static const char *list[] = {
     "b", "c", "d", "e", "h", "l", "( hl )", "a", "( ix +)", "( iy +)", "ixh",
     "ixl", "iyh", "iyl", "*", NULL
   };
   const char *nn;
-  i = indx (p, list, 0, &nn);
+  i = indx (z, p, list, 0, &nn);
   if (i == 15)
     {
-      readbyte = nn;
-      writebyte = 1;
+      z->readbyte = nn;
+      z->writebyte = 1;
       return 7;
     }
   if (i > 10)
     {
       int x;
       x = 0xdd + 0x20 * (i > 12);
-      if (indexed && indexed != x)
+      if (z->indexed && z->indexed != x)
 	{
-	  printerr (1, "illegal use of index registers\n");
+	  printerr (z, 1, "illegal use of index registers\n");
 	  return 0;
 	}
-      indexed = x;
+      z->indexed = x;
       return 6 - (i & 1);
     }
   if (i > 8)
     {
-      if (indexed)
+      if (z->indexed)
 	{
-	  printerr (1, "illegal use of index registers\n");
+	  printerr (z, 1, "illegal use of index registers\n");
 	  return 0;
 	}
-      indexed = 0xDD + 0x20 * (i == 10);
-      indexjmp = nn;
+      z->indexed = 0xDD + 0x20 * (i == 10);
+      z->indexjmp = nn;
       return 7;
     }
   return i;
 }
 
-/* read nnnn, or (nnnn) */
+/* read nnnn, or (nnnn).  Returns 0 if it is neither.  */
 static int
-rd_nn_nn (const char **p)
+rd_nn_nn (struct z80asm *z, const char **p)
 {
 #define _NN 1
-  const char *list[] = { "(*)", "*", NULL };
-  return 2 - indx (p, list, 0, &readword);
+  static const char *list[] = { "(*)", "*", NULL };
+  return indx (z, p, list, 1, &z->readword);
 }
 
-/* read {HL|IX|IY},nnnn, or (nnnn) */
+/* read {HL|IX|IY},nnnn, or (nnnn).  Returns -1 if it is none of
+ * them.  */
 static int
-rd_sp (const char **p)
+rd_sp (struct z80asm *z, const char **p)
 {
 #define SPNN 0
 #define SPHL 1
   int i;
-  const char *list[] = { "hl", "ix", "iy", "(*)", "*", NULL };
+  static const char *list[] = { "hl", "ix", "iy", "(*)", "*", NULL };
   const char *nn;
-  i = indx (p, list, 0, &nn);
+  i = indx (z, p, list, 1, &nn);
+  if (!i)
+    return -1;
   if (i > 3)
     {
-      readword = nn;
+      z->readword = nn;
       return i == 4 ? 2 : 0;
     }
   if (i != 1)
-    indexed = 0xDD + 0x20 * (i - 2);
+    z->indexed = 0xDD + 0x20 * (i - 2);
   return 1;
 }
 
 /* write a reference after it has been computed */
 static void
-wrt_ref (int val, int type, int count)
+wrt_ref (struct z80asm *z, int val, int type, int count)
 {
   switch (type)
     {
     case TYPE_RST:
       if ((val & 0x38) != val)
 	{
-	  printerr (1, "incorrect RST value %d (0x%02x)\n", val, val);
+	  printerr (z, 1, "incorrect RST value %d (0x%02x)\n", val, val);
 	  return;
 	}
-      write_one_byte (val + 0xC7, 1);
+      write_one_byte (z, val + 0xC7, 1);
       return;
     case TYPE_ABSW:
       if (val < -0x8000 || val >= 0x10000)
-	printerr (0, "word value %d (0x%x) truncated\n", val, val);
-      write_one_byte (val & 0xff, 1);
-      write_one_byte ((val >> 8) & 0xff, 1);
+	printerr (z, 0, "word value %d (0x%x) truncated\n", val, val);
+      write_one_byte (z, val & 0xff, 1);
+      write_one_byte (z, (val >> 8) & 0xff, 1);
       return;
     case TYPE_ABSB:
       if (val < -0x80 || val >= 0x100)
-	printerr (0, "byte value %d (0x%x) truncated\n", val, val);
-      write_one_byte (val & 0xff, 1);
+	printerr (z, 0, "byte value %d (0x%x) truncated\n", val, val);
+      write_one_byte (z, val & 0xff, 1);
       return;
     case TYPE_DS:
       if (val < -0x80 || val >= 0x100)
-	printerr (0, "byte value %d (0x%x) truncated\n", val, val);
-      if (havelist)
-	{
-	  fprintf (listfile, " 0x%02x...", val & 0xff);
-	  listdepth += 6;
-	}
+	printerr (z, 0, "byte value %d (0x%x) truncated\n", val, val);
+      if (z->havelist)
+	list_item (z->listing, LIST_DS, val);
       while (count--)
 	{
-	  write_one_byte (val & 0xff, 0);
+	  write_one_byte (z, val & 0xff, 0);
 	}
       return;
     case TYPE_BSR:
       if (val & ~7)
 	{
-	  printerr (1, "incorrect BIT/SET/RES value %d\n", val);
+	  printerr (z, 1, "incorrect BIT/SET/RES value %d\n", val);
 	  return;
 	}
-      write_one_byte (0x08 * val + count, 1);
+      write_one_byte (z, 0x08 * val + count, 1);
       return;
     case TYPE_RELB:
       val -= count;
       if (val & 0xff80 && ~val & 0xff80) 
 	{
-	  printerr (1, "relative jump out of range (%d)\n", val);
+	  printerr (z, 1, "relative jump out of range (%d)\n", val);
 	}
-      write_one_byte (val & 0xff, 1);
+      write_one_byte (z, val & 0xff, 1);
       return;
     case TYPE_LABEL:
-      printerr (1, "bug in the assembler: trying to write label reference.  "
-		"Please report.\n");
+      printerr (z, 1, "bug in the assembler: trying to write label "
+		"reference.  Please report.\n");
       return;
     }
 }
 
 static char *
-get_include_name (const char **ptr)
+get_include_name (struct z80asm *z, const char **ptr)
 {
   int pos = 0;
   char quote;
@@ -1447,13 +1737,13 @@ get_include_name (const char **ptr)
   name = malloc (strlen (*ptr));
   if (!name)
     {
-      printerr (1, "unable to allocate memory for filename %.*s\n",
+      printerr (z, 1, "unable to allocate memory for filename %.*s\n",
 		strlen (*ptr) - 1, *ptr);
       return NULL;
     }
   if (!**ptr)
     {
-      printerr (1, "include without filename\n");
+      printerr (z, 1, "include without filename\n");
       free (name);
       return NULL;
     }
@@ -1462,7 +1752,7 @@ get_include_name (const char **ptr)
     {
       if (!**ptr)
 	{
-	  printerr (1, "filename without closing quote (%c)\n", quote);
+	  printerr (z, 1, "filename without closing quote (%c)\n", quote);
 	  free (name);
 	  return NULL;
 	}
@@ -1473,89 +1763,199 @@ get_include_name (const char **ptr)
   return name;
 }
 
+/* make sure a buffer has room for need bytes */
 static int
-read_line (void)
-{
-  unsigned pos, newpos, size;
-  struct macro_arg *arg;
-  if (stack[sp].file)
-    {
-      FILE *f = stack[sp].file;
-      static char short_buffer[BUFLEN + 1];
-      if (buffer && buffer != short_buffer)
-	free (buffer);
-      buffer = NULL;
-      if (!fgets (short_buffer, BUFLEN + 1, f))
+reserve (char **buf, size_t *size, size_t need)
+{
+  size_t new_size;
+  char *b;
+  if (need <= *size)
+    return 1;
+  new_size = *size ? *size : BUFLEN + 1;
+  while (new_size < need)
+    new_size *= 2;
+  if (!(b = realloc (*buf, new_size)))
+    return 0;
+  *buf = b;
+  *size = new_size;
+  return 1;
+}
+
+static int
+do_read_line (struct z80asm *z, int raw)
+{
+  const struct macro_line *ml;
+  size_t size, pos, i;
+  char *out;
+  if (z->stack[z->sp].file)
+    {
+      /* the line is copied, because the parser needs a terminating 0 */
+      const char *line;
+      size_t len;
+      z->buffer = NULL;
+      if (!read_source_line (z->stack[z->sp].file, &line, &len))
 	return 0;
-      if (strlen (short_buffer) < BUFLEN)
-	{
-	  buffer = short_buffer;
-	  return 1;
-	}
-      size = 2 * BUFLEN;
-      buffer = malloc (size + 1);
-      if (!buffer)
+      if (!reserve (&z->line_buffer, &z->line_size, len + 1))
 	{
-	  printerr (1, "out of memory reading line\n");
+	  printerr (z, 1, "out of memory reading line\n");
 	  return 0;
 	}
-      memcpy (buffer, short_buffer, BUFLEN + 1);
-      while (1)
+      memcpy (z->line_buffer, line, len);
+      if (!raw)
 	{
-	  char *b;
-	  if (!fgets (&buffer[size - BUFLEN], BUFLEN + 1, f)
-	      || (buffer[strlen (buffer) - 1] == '\n'))
-	    {
-	      return 1;
-	    }
-	  size += BUFLEN;
-	  b = realloc (buffer, size + 1);
-	  if (!b)
-	    {
-	      printerr (1, "out of memory reading line\n");
-	      return 0;
-	    }
-	  buffer = b;
+	  /* a line only has a '\n' at its end, and rarely a '\r' */
+	  char *c = z->line_buffer, *end = z->line_buffer + len;
+	  if (len && end[-1] == '\n')
+	    end[-1] = ' ';
+	  while ((c = memchr (c, '\r', end - c)))
+	    *c++ = ' ';
 	}
+      z->line_buffer[len] = 0;
+      z->buffer = z->line_buffer;
+      z->buffer_len = len;
+      return 1;
     }
-  /* macro line */
-  if (!stack[sp].macro_line)
+  /* macro line.  The arguments are inserted into the text in the
+   * expansion buffer of this stack level.  */
+  ml = z->stack[z->sp].macro_line;
+  if (!ml)
+    return 0;
+  size = ml->len + 1;
+  for (i = 0; i < ml->numargs; ++i)
+    size += z->stack[z->sp].macro_arg_len[ml->args[i].which];
+  if (!reserve (&z->stack[z->sp].expansion, &z->stack[z->sp].expansion_size,
+		size))
     {
-      unsigned i;
-      for (i = 0; i < stack[sp].macro->numargs; ++i)
-	free (stack[sp].macro_args[i]);
-      free (stack[sp].macro_args);
+      printerr (z, 1, "out of memory\n");
       return 0;
     }
-  size = strlen (stack[sp].macro_line->line) + 1;
-  for (arg = stack[sp].macro_line->args; arg; arg = arg->next)
-    size += strlen (stack[sp].macro_args[arg->which]);
-  buffer = malloc (size);
-  if (!buffer)
+  out = z->stack[z->sp].expansion;
+  pos = 0;
+  for (i = 0; i < ml->numargs; ++i)
+    {
+      const struct macro_arg *arg = &ml->args[i];
+      size_t len = z->stack[z->sp].macro_arg_len[arg->which];
+      memcpy (out, &ml->line[pos], arg->pos - pos);
+      out += arg->pos - pos;
+      memcpy (out, z->stack[z->sp].macro_args[arg->which], len);
+      out += len;
+      pos = arg->pos;
+    }
+  memcpy (out, &ml->line[pos], ml->len - pos + 1);
+  z->buffer = z->stack[z->sp].expansion;
+  z->buffer_len = out - z->buffer + ml->len - pos;
+  z->stack[z->sp].macro_line = ml->next;
+  return 1;
+}
+
+/* find the parts of the line in buffer which the parser needs first, in
+ * one pass: where it starts, and the label in its first word.  This is
+ * what delspc() and a search for ':' would find.  */
+static void
+scan_line (struct z80asm *z)
+{
+  const char *c = z->buffer;
+  while (char_class[(unsigned char) *c] & CHAR_SPACE)
+    ++c;
+  z->tokens.colon = NULL;
+  if (*c == ';')
     {
-      printerr (1, "out of memory\n");
-      return 0;
+      z->tokens.start = "";
+      return;
     }
-  pos = 0;
-  newpos = 0;
-  for (arg = stack[sp].macro_line->args; arg; arg = arg->next)
-    {
-      memcpy (&buffer[newpos], &stack[sp].macro_line->line[pos],
-	      arg->pos - pos);
-      newpos += arg->pos - pos;
-      strcpy (&buffer[newpos], stack[sp].macro_args[arg->which]);
-      newpos += strlen (stack[sp].macro_args[arg->which]);
-      pos = arg->pos + 1;
-    }
-  strcpy (&buffer[newpos], &stack[sp].macro_line->line[pos]);
-  stack[sp].macro_line = stack[sp].macro_line->next;
+  z->tokens.start = c;
+  for (; !(char_class[(unsigned char) *c] & CHAR_WORD_END); ++c)
+    if (*c == ':')
+      {
+	z->tokens.colon = c;
+	return;
+      }
+}
+
+/* read the next line into buffer.  Line ends are replaced by spaces,
+ * and the line is scanned, unless raw is nonzero.  */
+static int
+read_line (struct z80asm *z, int raw)
+{
+  int phase = ENTER_PHASE (z, Z80ASM_PHASE_READ);
+  int ret = do_read_line (z, raw);
+  if (ret && !raw)
+    scan_line (z);
+  ENTER_PHASE (z, phase);
+  if (ret)
+    ++z->stats.lines;
+  return ret;
+}
+
+/* macros are found through a hash table with open addressing, like
+ * labels (see labels.c).  */
+static struct macro *
+find_macro (struct z80asm *z, const char *name, unsigned len, unsigned hash)
+{
+  unsigned mask, i;
+  struct macro *m;
+  if (!z->macro_count)
+    return NULL;
+  mask = z->macro_slots_size - 1;
+  for (i = hash & mask; (m = z->macro_slots[i]); i = (i + 1) & mask)
+    {
+      if (m->hash == hash && m->len == len && !memcmp (m->name, name, len))
+	return m;
+    }
+  return NULL;
+}
+
+/* add a macro to the table.  A macro with the same name is replaced.
+ * Returns 0 if there is no memory.  */
+static int
+add_macro (struct z80asm *z, struct macro *m)
+{
+  unsigned mask, i;
+  if (2 * (z->macro_count + 1) > z->macro_slots_size)
+    {
+      unsigned size = z->macro_slots_size ? 2 * z->macro_slots_size : 16;
+      struct macro **slots = calloc (size, sizeof (struct macro *));
+      if (!slots)
+	return 0;
+      for (i = 0; i < z->macro_slots_size; ++i)
+	{
+	  unsigned j;
+	  if (!z->macro_slots[i])
+	    continue;
+	  for (j = z->macro_slots[i]->hash & (size - 1); slots[j];
+	       j = (j + 1) & (size - 1))
+	    {
+	    }
+	  slots[j] = z->macro_slots[i];
+	}
+      free (z->macro_slots);
+      z->macro_slots = slots;
+      z->macro_slots_size = size;
+    }
+  mask = z->macro_slots_size - 1;
+  for (i = m->hash & mask; z->macro_slots[i]; i = (i + 1) & mask)
+    {
+      if (z->macro_slots[i]->hash == m->hash
+	  && z->macro_slots[i]->len == m->len
+	  && !memcmp (z->macro_slots[i]->name, m->name, m->len))
+	{
+	  z->macro_slots[i] = m;
+	  z->macro_generation++;
+	  return 1;
+	}
+    }
+  z->macro_slots[i] = m;
+  z->macro_count++;
+  z->macro_generation++;
   return 1;
 }
 
+/* read macro arguments into arena */
 static unsigned
-get_macro_args (const char **ptr, char ***ret_args, int allow_empty)
+get_macro_args (struct z80asm *z, const char **ptr, char ***ret_args,
+		int allow_empty, struct arena *arena)
 {
-  unsigned numargs = 0;
+  unsigned numargs = 0, max_args = 0;
   *ret_args = NULL;
   while (1)
     {
@@ -1570,152 +1970,153 @@ get_macro_args (const char **ptr, char ***ret_args, int allow_empty)
 	}
       if (*ptr == c && !allow_empty)
 	{
-	  printerr (1, "empty macro argument\n");
+	  printerr (z, 1, "empty macro argument\n");
 	  break;
 	}
       ++numargs;
-      args = realloc (*ret_args, sizeof (char *) * numargs);
-      if (!args)
+      if (numargs > max_args)
 	{
-	  printerr (1, "out of memory\n");
-	  --numargs;
-	  break;
+	  /* the old array stays in the arena, so grow it fast */
+	  max_args = max_args ? 2 * max_args : 8;
+	  args = arena_alloc (arena, sizeof (char *) * max_args);
+	  if (!args)
+	    {
+	      printerr (z, 1, "out of memory\n");
+	      --numargs;
+	      break;
+	    }
+	  if (*ret_args)
+	    memcpy (args, *ret_args, sizeof (char *) * (numargs - 1));
+	  *ret_args = args;
 	}
-      *ret_args = args;
-      args[numargs - 1] = malloc (*ptr - c + 1);
+      args = *ret_args;
+      args[numargs - 1] = arena_alloc (arena, *ptr - c + 1);
       if (!args[numargs - 1])
 	{
-	  printerr (1, "out of memory\n");
+	  printerr (z, 1, "out of memory\n");
 	  --numargs;
 	  break;
 	}
       memcpy (args[numargs - 1], c, *ptr - c);
       args[numargs - 1][*ptr - c] = 0;
+      /* the arguments are separated by white space or a comma */
+      *ptr = delspc (*ptr);
+      if (**ptr == ',')
+	++*ptr;
     }
   return numargs;
 }
 
 /* do the actual work */
 static void
-assemble (void)
+assemble (struct z80asm *z)
 {
   int ifcount = 0, noifcount = 0;
   const char *ptr;
-  struct label *l;
-  char *bufptr;
   int r, s;			/* registers */
   /* continue assembling until the last input file is done */
-  for (file = 0; file < infilecount; ++file)
+  for (z->file = 0; z->file < z->infilecount; ++z->file)
     {
       int file_ended = 0;
-      sp = 0;			/* clear stack */
-      stack[sp].line = 0;
-      stack[sp].shouldclose = 0;
-      stack[sp].name = infile[file].name;
-      stack[sp].dir = NULL;
-      if (infile[file].name[0] == '-' && infile[file].name[1] == 0)
+      z->sp = 0;			/* clear stack */
+      z->stack[z->sp].line = 0;
+      z->stack[z->sp].name = z->infile[z->file].name;
+      z->stack[z->sp].dir = NULL;
+      z->stack[z->sp].file = &z->stack[z->sp].source;
+      if (z->infile[z->file].type == FILETYPE_OBJ)
 	{
-	  stack[sp].file = stdin;
+	  if (z->object)
+	    printerr (z, 1, "objects can't be put in an object\n");
+	  else
+	    load_object (z, z->infile[z->file].name);
+	  continue;
 	}
-      else
+      if (z->infile[z->file].data
+	  ? !open_source_buffer (z, z->stack[z->sp].file,
+				 z->infile[z->file].name,
+				 z->infile[z->file].data,
+				 z->infile[z->file].size)
+	  : !open_source (z, z->stack[z->sp].file,
+			  strcmp (z->infile[z->file].name, "-")
+			  ? z->infile[z->file].name : NULL))
 	{
-	  stack[sp].file = fopen (infile[file].name, "r");
-	  if (!stack[sp].file)
-	    {
-	      printerr (1, "unable to open %s. skipping\n", infile[file].name);
-	      continue;
-	    }
-	  stack[sp].shouldclose = 1;
+	  printerr (z, 1, "unable to open %s. skipping\n",
+		    z->infile[z->file].name);
+	  continue;
+	}
+      /* an input file is recorded and replayed like an include */
+      if (z->incremental
+	  && begin_include (z, z->infile[z->file].name, ifcount))
+	continue;
+      if (z->havelist)
+	{
+	  list_text (z->listing, "# File ");
+	  list_text (z->listing, z->stack[z->sp].name);
+	  list_text (z->listing, "\n");
 	}
-      if (havelist)
-	fprintf (listfile, "# File %s\n", stack[sp].name);
-      if (buffer)
-	buffer[0] = 0;
+      if (z->buffer)
+	z->buffer[0] = 0;
       /* loop until this source file is done */
       while (1)
 	{
-	  int cmd, cont = 1;
-	  if (havelist)
+	  int cmd, cont = 1, phase;
+	  if (z->havelist)
 	    {
-	      if (buffer && buffer[0] != 0)
+	      if (z->buffer && z->buffer[0] != 0)
 		{
-		  int i, tabs;
 		  ptr = delspc (ptr);
 		  if (*ptr != 0)
 		    {
-		      printerr (1, "junk at end of line: %s\n", ptr);
+		      printerr (z, 1, "junk at end of line: %s\n", ptr);
 		    }
-		  if (listdepth < 8)
-		    tabs = 3;
-		  else if (listdepth < 16)
-		    tabs = 2;
-		  else
-		    tabs = 1;
-		  for (i = 0; i < tabs; ++i)
-		    fputc ('\t', listfile);
-		  fprintf (listfile, "%s\n", buffer);
+		  phase = ENTER_PHASE (z, Z80ASM_PHASE_LIST);
+		  list_source (z->listing, z->buffer);
+		  ENTER_PHASE (z, phase);
 		}
-	      listdepth = 4;
 	    }
 	  /* throw away the rest of the file after end */
 	  if (file_ended)
 	    {
-	      while (read_line ())
+	      while (read_line (z, 1))
 		{
-		  if (havelist)
-		    fprintf (listfile, "\t\t\t%s\n", buffer);
+		  if (z->havelist)
+		    {
+		      list_text (z->listing, "\t\t\t");
+		      list_text (z->listing, z->buffer);
+		      list_text (z->listing, "\n");
+		    }
 		}
 	      file_ended = 0;
 	    }
-	  while (!read_line ())
+	  while (!read_line (z, 0))
 	    {
-	      struct reference *ref, *nextref;
-	      struct label *next;
-	      if (verbose >= 6)
+	      if (z->verbose >= 6)
 		fprintf (stderr, "finished reading file %s\n",
-			 stack[sp].name);
-	      if (havelist)
+			 z->stack[z->sp].name);
+	      if (z->havelist)
 		{
-		  if (stack[sp].file)
-		    fprintf (listfile, "# End of file %s\n", stack[sp].name);
+		  if (z->stack[z->sp].file)
+		    list_text (z->listing, "# End of file ");
 		  else
-		    fprintf (listfile, "# End of macro %s\n", stack[sp].name);
+		    list_text (z->listing, "# End of macro ");
+		  list_text (z->listing, z->stack[z->sp].name);
+		  list_text (z->listing, "\n");
 		}
-	      if (stack[sp].shouldclose)
-		fclose (stack[sp].file);
+	      if (z->stack[z->sp].file)
+		close_source (z->stack[z->sp].file);
 	      /* the top of stack is about to be popped off, throwing all
 	       * local labels out of scope.  All references at this level
 	       * which aren't computable are errors.  */
-	      for (ref = firstreference; ref; ref = nextref)
-		{
-		  nextref = ref->next;
-		  compute_ref (ref, 1);
-		  if (ref->done)
-		    continue;
-		  if (ref->level == sp)
-		    if (!ref->level--)
-		      {
-			printerr (1, "unable to resolve reference: %s\n",
-				  ref->input);
-			if (ref->prev)
-			  ref->prev->next = ref->next;
-			else
-			  firstreference = ref->next;
-			if (ref->next)
-			  ref->next->prev = ref->prev;
-			free (ref);
-		      }
-		}
+	      resolve_references (z);
+	      /* an include which ends may be replayed next time */
+	      if (z->num_frames
+		  && z->frames[z->num_frames - 1].level == z->sp)
+		end_include (z, ifcount, noifcount);
 	      /* Ok, now junk all local labels of the top stack level */
-	      for (l = stack[sp].labels; l; l = next)
-		{
-		  next = l->next;
-		  if (l->ref)
-		    free (l->ref);
-		  free (l);
-		}
-	      stack[sp].labels = NULL;
-	      if (!sp--)
+	      forget_labels (z, &z->stack[z->sp].labels);
+	      free_labels (z, &z->stack[z->sp].labels);
+	      arena_release (&z->stack[z->sp].arena);
+	      if (!z->sp--)
 		{
 		  cont = 0;
 		  break;
@@ -1723,33 +2124,31 @@ assemble (void)
 	    }
 	  if (!cont)
 	    break;		/* break to next source file */
-	  if (havelist)
-	    fprintf (listfile, "%04x", addr);
-	  for (bufptr = buffer; (bufptr = strchr (bufptr, '\n'));)
-	    *bufptr = ' ';
-	  for (bufptr = buffer; (bufptr = strchr (bufptr, '\r'));)
-	    *bufptr = ' ';
-	  ptr = buffer;
-	  lastlabel = NULL;
-	  baseaddr = addr;
-	  ++stack[sp].line;
-	  ptr = delspc (ptr);
+	  if (z->havelist)
+	    list_line (z->listing, z->addr);
+	  ptr = z->buffer;
+	  z->lastlabel = NULL;
+	  z->baseaddr = z->addr;
+	  ++z->stack[z->sp].line;
+	  TRACE (z, Z80ASM_TRACE_LEXER, TRACE_LINE, strlen (ptr), 0, ptr);
+	  ptr = z->tokens.start;
 	  if (!*ptr)
 	    continue;
-	  if (!noifcount && !define_macro)
-	    readlabel (&ptr, 1);
+	  z->num_operands = 0;
+	  if (!noifcount && !z->define_macro)
+	    readlabel (z, &ptr, 1);
 	  else
-	    readlabel (&ptr, 0);
+	    readlabel (z, &ptr, 0);
 	  ptr = delspc (ptr);
 	  if (!*ptr)
 	    continue;
-	  comma = 0;
-	  indexed = 0;
-	  indexjmp = 0;
-	  writebyte = 0;
-	  readbyte = 0;
-	  readword = 0;
-	  cmd = readcommand (&ptr) - 1;
+	  z->comma = 0;
+	  z->indexed = 0;
+	  z->indexjmp = 0;
+	  z->writebyte = 0;
+	  z->readbyte = 0;
+	  z->readword = 0;
+	  cmd = readcommand (z, &ptr) - 1;
 	  if (noifcount)
 	    {
 	      switch (cmd)
@@ -1770,363 +2169,366 @@ assemble (void)
 	      ptr = "";
 	      continue;
 	    }
-	  if (define_macro)
+	  if (z->define_macro)
 	    {
-	      char *newptr;
-	      struct macro_line **current_line;
-	      for (current_line = &firstmacro->lines; *current_line;
-		   current_line = &(*current_line)->next)
-		{
-		}
-	      *current_line = malloc (sizeof (struct macro_line));
-	      if (!*current_line)
-		{
-		  printerr (1, "out of memory\n");
-		  continue;
-		}
-	      (*current_line)->next = NULL;
-	      (*current_line)->args = NULL;
-	      (*current_line)->line = malloc (strlen (buffer) + 1);
-	      if (!(*current_line)->line)
+	      struct macro *m = z->firstmacro;
+	      struct macro_line *ml;
+	      unsigned numargs = 0, len = 0;
+	      ml = arena_alloc (&z->globalarena, sizeof (struct macro_line));
+	      if (!ml || !(ml->line = arena_alloc (&z->globalarena,
+						   strlen (z->buffer) + 1)))
 		{
-		  printerr (1, "out of memory\n");
-		  free (*current_line);
-		  *current_line = NULL;
+		  printerr (z, 1, "out of memory\n");
 		  continue;
 		}
-	      ptr = buffer;
-	      newptr = (*current_line)->line;
+	      ptr = z->buffer;
 	      while (*ptr)
 		{
 		  unsigned p;
-		  struct macro_arg **last_arg = &(*current_line)->args;
-		  for (p = 0; p < firstmacro->numargs; ++p)
+		  for (p = 0; p < m->numargs; ++p)
+		    {
+		      if (strncmp (ptr, m->args[p], strlen (m->args[p])) == 0)
+			break;
+		    }
+		  if (p == m->numargs)
 		    {
-		      if (strncmp (ptr, firstmacro->args[p],
-				   strlen (firstmacro->args[p])) == 0)
+		      ml->line[len++] = *ptr++;
+		      continue;
+		    }
+		  if (numargs == z->max_macro_def_args)
+		    {
+		      unsigned new_max = z->max_macro_def_args
+			? 2 * z->max_macro_def_args : 16;
+		      struct macro_arg *a;
+		      a = realloc (z->macro_def_args,
+				   new_max * sizeof (struct macro_arg));
+		      if (!a)
 			{
-			  struct macro_arg *newarg;
-			  newarg = malloc (sizeof (struct macro_arg));
-			  if (!newarg)
-			    {
-			      printerr (1, "out of memory\n");
-			      break;
-			    }
-			  newarg->next = NULL;
-			  *last_arg = newarg;
-			  last_arg = &newarg->next;
-			  newarg->pos = newptr - (*current_line)->line;
-			  newarg->which = p;
-			  /* leave one character so two macros following each
-			   * other keep their order. */
-			  ptr += strlen (firstmacro->args[p]) - 1;
+			  printerr (z, 1, "out of memory\n");
 			  break;
 			}
+		      z->macro_def_args = a;
+		      z->max_macro_def_args = new_max;
 		    }
-		  *newptr++ = *ptr++;
+		  z->macro_def_args[numargs].pos = len;
+		  z->macro_def_args[numargs].which = p;
+		  ++numargs;
+		  ptr += strlen (m->args[p]);
 		}
-	      *newptr = 0;
-	      if (verbose >= 7)
-		fprintf (stderr, "added line to macro (cmd = %d): %s\n", cmd,
-			 (*current_line)->line);
+	      ml->line[len] = 0;
+	      ml->len = len;
+	      ml->numargs = numargs;
+	      ml->args = NULL;
+	      if (numargs)
+		{
+		  ml->args = arena_alloc (&z->globalarena,
+					  numargs * sizeof (struct macro_arg));
+		  if (!ml->args)
+		    {
+		      printerr (z, 1, "out of memory\n");
+		      continue;
+		    }
+		  memcpy (ml->args, z->macro_def_args,
+			  numargs * sizeof (struct macro_arg));
+		}
+	      ml->next = NULL;
+	      *m->last = ml;
+	      m->last = &ml->next;
+	      z->macro_generation++;
+	      TRACE (z, Z80ASM_TRACE_MACROS, TRACE_MACRO_LINE, cmd, 0,
+		     z->buffer);
 	      if (cmd == ENDM)
-		define_macro = 0;
+		z->define_macro = 0;
 	      continue;
 	    }
 	  switch (cmd)
 	    {
 	      int i, have_quote;
+	      struct byte_run run;
+	      const char *item, *end;
 	    case ADC:
-	      if (!(r = rd_a_hl (&ptr)))
+	      if (!(r = rd_a_hl (z, &ptr)))
 		break;
 	      if (r == HL)
 		{
-		  if (!(r = rd_rr_ (&ptr)))
+		  if (!(r = rd_rr_ (z, &ptr)))
 		    break;
-		  wrtb (0xED);
-		  wrtb (0x4A + 0x10 * --r);
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x4A + 0x10 * --r);
 		  break;
 		}
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0x88 + --r);
+	      wrtb (z, 0x88 + --r);
 	      break;
 	    case ADD:
-	      if (!(r = rd_r_add (&ptr)))
+	      if (!(r = rd_r_add (z, &ptr)))
 		break;
 	      if (r == addHL)
 		{
-		  if (!(r = rd_rrxx (&ptr)))
+		  if (!(r = rd_rrxx (z, &ptr)))
 		    break;
-		  wrtb (0x09 + 0x10 * --r);	/* ADD HL/IX/IY, qq  */
+		  wrtb (z, 0x09 + 0x10 * --r);	/* ADD HL/IX/IY, qq  */
 		  break;
 		}
 	      if (has_argument (&ptr))
 		{
 		  if (r != A)
 		    {
-		      printerr (1, "parse error before: %s\n", ptr);
+		      printerr (z, 1, "parse error before: %s\n", ptr);
 		      break;
 		    }
-		  if (!(r = rd_r (&ptr)))
+		  if (!(r = rd_r (z, &ptr)))
 		    break;
-		  wrtb (0x80 + --r);	/* ADD A,r  */
+		  wrtb (z, 0x80 + --r);	/* ADD A,r  */
 		  break;
 		}
-	      wrtb (0x80 + --r);	/* ADD r  */
+	      wrtb (z, 0x80 + --r);	/* ADD r  */
 	      break;
 	    case AND:
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0xA0 + --r);
+	      wrtb (z, 0xA0 + --r);
 	      break;
 	    case BIT:
-	      if (!rd_0_7 (&ptr))
+	      if (!rd_0_7 (z, &ptr))
 		break;
-	      rd_comma (&ptr);
-	      if (!(r = rd_r_ (&ptr)))
+	      rd_comma (z, &ptr);
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x40 + (r - 1));
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x40 + (r - 1));
 	      break;
 	    case CALL:
-	      if (!(r = rd_cc (&ptr)))
+	      if (!(r = rd_cc (z, &ptr)))
 		{
-		  wrtb (0xCD);
+		  wrtb (z, 0xCD);
 		}
 	      else
 		{
-		  wrtb (0xC4 + 8 * --r);
-		  rd_comma (&ptr);
+		  wrtb (z, 0xC4 + 8 * --r);
+		  rd_comma (z, &ptr);
 		}
-	      rd_wrt_addr (&ptr, '\0');
+	      rd_wrt_addr (z, &ptr, '\0');
 	      break;
 	    case CCF:
-	      wrtb (0x3F);
+	      wrtb (z, 0x3F);
 	      break;
 	    case CP:
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0xB8 + --r);
+	      wrtb (z, 0xB8 + --r);
 	      break;
 	    case CPD:
-	      wrtb (0xED);
-	      wrtb (0xA9);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA9);
 	      break;
 	    case CPDR:
-	      wrtb (0xED);
-	      wrtb (0xB9);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB9);
 	      break;
 	    case CPI:
-	      wrtb (0xED);
-	      wrtb (0xA1);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA1);
 	      break;
 	    case CPIR:
-	      wrtb (0xED);
-	      wrtb (0xB1);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB1);
 	      break;
 	    case CPL:
-	      wrtb (0x2F);
+	      wrtb (z, 0x2F);
 	      break;
 	    case DAA:
-	      wrtb (0x27);
+	      wrtb (z, 0x27);
 	      break;
 	    case DEC:
-	      if (!(r = rd_r_rr (&ptr)))
+	      if (!(r = rd_r_rr (z, &ptr)))
 		break;
 	      if (r < 0)
 		{
-		  wrtb (0x05 - 8 * ++r);
+		  wrtb (z, 0x05 - 8 * ++r);
 		  break;
 		}
-	      wrtb (0x0B + 0x10 * --r);
+	      wrtb (z, 0x0B + 0x10 * --r);
 	      break;
 	    case DI:
-	      wrtb (0xF3);
+	      wrtb (z, 0xF3);
 	      break;
 	    case DJNZ:
-	      wrtb (0x10);
-	      rd_wrt_jr (&ptr, '\0');
+	      wrtb (z, 0x10);
+	      rd_wrt_jr (z, &ptr, '\0');
 	      break;
 	    case EI:
-	      wrtb (0xFB);
+	      wrtb (z, 0xFB);
 	      break;
 	    case EQU:
-	      if (!lastlabel)
+	      if (!z->lastlabel)
 		{
-		  printerr (1, "EQU without label\n");
+		  printerr (z, 1, "EQU without label\n");
 		  break;
 		}
-	      new_reference (ptr, TYPE_LABEL, 0, 0);
-	      if (verbose >= 4)
-		{
-		  if (lastlabel->valid)
-		    fprintf (stderr, "Assigned value %d to label %s.\n",
-			     lastlabel->value, lastlabel->name);
-		  else
-		    fprintf (stderr,
-			     "Scheduled label %s for later computation.\n",
-			     lastlabel->name);
-		}
+	      new_reference (z, ptr, TYPE_LABEL, 0, 0);
+	      TRACE (z, Z80ASM_TRACE_LABELS, TRACE_EQU, z->lastlabel->value,
+		     z->lastlabel->valid, z->lastlabel->name);
 	      ptr = "";
 	      break;
 	    case EX:
-	      if (!(r = rd_ex1 (&ptr)))
+	      if (!(r = rd_ex1 (z, &ptr)))
 		break;
 	      switch (r)
 		{
 		case DE:
-		  if (!rd_hl (&ptr))
+		  if (!rd_hl (z, &ptr))
 		    break;
-		  wrtb (0xEB);
+		  wrtb (z, 0xEB);
 		  break;
 		case AF:
-		  if (!rd_af_ (&ptr))
+		  if (!rd_af_ (z, &ptr))
 		    break;
-		  wrtb (0x08);
+		  wrtb (z, 0x08);
 		  break;
 		default:
-		  if (!rd_hlx (&ptr))
+		  if (!rd_hlx (z, &ptr))
 		    break;
-		  wrtb (0xE3);
+		  wrtb (z, 0xE3);
 		}
 	      break;
 	    case EXX:
-	      wrtb (0xD9);
+	      wrtb (z, 0xD9);
 	      break;
 	    case HALT:
-	      wrtb (0x76);
+	      wrtb (z, 0x76);
 	      break;
 	    case IM:
-	      if (!(r = rd_0_2 (&ptr)))
+	      if (!(r = rd_0_2 (z, &ptr)))
 		break;
-	      wrtb (0xED);
-	      wrtb (0x46 + 8 * --r);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x46 + 8 * --r);
 	      break;
 	    case IN:
-	      if (!(r = rd_in (&ptr)))
+	      if (!(r = rd_in (z, &ptr)))
 		break;
 	      if (r == A)
 		{
 		  const char *tmp;
-		  if (!(r = rd_nnc (&ptr)))
+		  if (!(r = rd_nnc (z, &ptr)))
 		    break;
 		  if (r == C)
 		    {
-		      wrtb (0xED);
-		      wrtb (0x40 + 8 * (A - 1));
+		      wrtb (z, 0xED);
+		      wrtb (z, 0x40 + 8 * (A - 1));
 		      break;
 		    }
-		  tmp = readbyte;
-		  wrtb (0xDB);
-		  new_reference (tmp, TYPE_ABSB, ')', 1);
+		  tmp = z->readbyte;
+		  wrtb (z, 0xDB);
+		  new_reference (z, tmp, TYPE_ABSB, ')', 1);
 		  break;
 		}
-	      if (!rd_c (&ptr))
+	      if (!rd_c (z, &ptr))
 		break;
-	      wrtb (0xED);
-	      wrtb (0x40 + 8 * --r);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x40 + 8 * --r);
 	      break;
 	    case INC:
-	      if (!(r = rd_r_rr (&ptr)))
+	      if (!(r = rd_r_rr (z, &ptr)))
 		break;
 	      if (r < 0)
 		{
-		  wrtb (0x04 - 8 * ++r);
+		  wrtb (z, 0x04 - 8 * ++r);
 		  break;
 		}
-	      wrtb (0x03 + 0x10 * --r);
+	      wrtb (z, 0x03 + 0x10 * --r);
 	      break;
 	    case IND:
-	      wrtb (0xED);
-	      wrtb (0xAA);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xAA);
 	      break;
 	    case INDR:
-	      wrtb (0xED);
-	      wrtb (0xBA);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xBA);
 	      break;
 	    case INI:
-	      wrtb (0xED);
-	      wrtb (0xA2);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA2);
 	      break;
 	    case INIR:
-	      wrtb (0xED);
-	      wrtb (0xB2);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB2);
 	      break;
 	    case JP:
-	      r = rd_jp (&ptr);
+	      r = rd_jp (z, &ptr);
 	      if (r < 0)
 		{
-		  wrtb (0xE9);
+		  wrtb (z, 0xE9);
 		  break;
 		}
 	      if (r == 0)
 		{
-		  wrtb (0xC3);
+		  wrtb (z, 0xC3);
 		}
 	      else
 		{
-		  wrtb (0xC2 + 8 * --r);
-		  rd_comma (&ptr);
+		  wrtb (z, 0xC2 + 8 * --r);
+		  rd_comma (z, &ptr);
 		}
-	      rd_wrt_addr (&ptr, '\0');
+	      rd_wrt_addr (z, &ptr, '\0');
 	      break;
 	    case JR:
-	      r = rd_jr (&ptr);
+	      r = rd_jr (z, &ptr);
 	      if (r)
-		rd_comma (&ptr);
-	      wrtb (0x18 + 8 * r);
-	      rd_wrt_jr (&ptr, '\0');
+		rd_comma (z, &ptr);
+	      wrtb (z, 0x18 + 8 * r);
+	      rd_wrt_jr (z, &ptr, '\0');
 	      break;
 	    case LD:
-	      if (!(r = rd_ld (&ptr)))
+	      if (!(r = rd_ld (z, &ptr)))
 		break;
 	      switch (r)
 		{
 		case ld_BC:
 		case ld_DE:
-		  if (!rd_a (&ptr))
+		  if (!rd_a (z, &ptr))
 		    break;
-		  wrtb (0x02 + 0x10 * (r == ld_DE));
+		  wrtb (z, 0x02 + 0x10 * (r == ld_DE));
 		  break;
 		case ld_HL:
-		  r = rd_ld_hl (&ptr);
-		  wrtb (0x70 + --r);
+		  r = rd_ld_hl (z, &ptr);
+		  wrtb (z, 0x70 + --r);
 		  break;
 		case ld_NN:
-		  if (!(r = rd_ld_nn (&ptr)))
+		  if (!(r = rd_ld_nn (z, &ptr)))
 		    break;
 		  if (r == ld_nnA || r == ld_nnHL)
 		    {
-		      wrtb (0x22 + 0x10 * (r == ld_nnA));
-		      write_word ();
+		      wrtb (z, 0x22 + 0x10 * (r == ld_nnA));
+		      write_word (z);
 		      break;
 		    }
-		  wrtb (0xED);
-		  wrtb (0x43 + 0x10 * --r);
-		  write_word ();
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x43 + 0x10 * --r);
+		  write_word (z);
 		  break;
 		case ldA:
-		  if (!(r = rd_lda (&ptr)))
+		  if (!(r = rd_lda (z, &ptr)))
 		    break;
 		  if (r == A_NN)
 		    {
-		      wrtb (0x3A);
-		      write_word ();
+		      wrtb (z, 0x3A);
+		      write_word (z);
 		      break;
 		    }
 		  if (r == A_I || r == A_R)
 		    {
-		      wrtb (0xED);
-		      wrtb (0x57 + 8 * (r == A_R));
+		      wrtb (z, 0xED);
+		      wrtb (z, 0x57 + 8 * (r == A_R));
 		      break;
 		    }
 		  if (r < 0)
 		    {
-		      wrtb (0x0A - 0x10 * ++r);
+		      wrtb (z, 0x0A - 0x10 * ++r);
 		      break;
 		    }
-		  wrtb (0x78 + --r);
+		  wrtb (z, 0x78 + --r);
 		  break;
 		case ldB:
 		case ldC:
@@ -2134,275 +2536,281 @@ assemble (void)
 		case ldE:
 		case ldH:
 		case ldL:
-		  if (!(s = rd_ldbcdehla (&ptr)))
+		  if (!(s = rd_ldbcdehla (z, &ptr)))
 		    break;
-		  wrtb (0x40 + 0x08 * (r - 7) + (s - 1));
+		  wrtb (z, 0x40 + 0x08 * (r - 7) + (s - 1));
 		  break;
 		case ldBC:
 		case ldDE:
-		  s = rd_nn_nn (&ptr);
+		  if (!(s = rd_nn_nn (z, &ptr)))
+		    break;
 		  if (s == _NN)
 		    {
-		      wrtb (0xED);
-		      wrtb (0x4B + 0x10 * (r == ldDE));
-		      write_word ();
+		      wrtb (z, 0xED);
+		      wrtb (z, 0x4B + 0x10 * (r == ldDE));
+		      write_word (z);
 		      break;
 		    }
-		  wrtb (0x01 + (r == ldDE) * 0x10);
-		  write_word ();
+		  wrtb (z, 0x01 + (r == ldDE) * 0x10);
+		  write_word (z);
 		  break;
 		case ldHL:
-		  r = rd_nn_nn (&ptr);
-		  wrtb (0x21 + (r == _NN) * 9);
-		  write_word ();
+		  if (!(r = rd_nn_nn (z, &ptr)))
+		    break;
+		  wrtb (z, 0x21 + (r == _NN) * 9);
+		  write_word (z);
 		  break;
 		case ldI:
 		case ldR:
-		  if (!rd_a (&ptr))
+		  if (!rd_a (z, &ptr))
 		    break;
-		  wrtb (0xED);
-		  wrtb (0x47 + 0x08 * (r == ldR));
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x47 + 0x08 * (r == ldR));
 		  break;
 		case ldSP:
-		  r = rd_sp (&ptr);
+		  if ((r = rd_sp (z, &ptr)) < 0)
+		    break;
 		  if (r == SPHL)
 		    {
-		      wrtb (0xF9);
+		      wrtb (z, 0xF9);
 		      break;
 		    }
 		  if (r == SPNN)
 		    {
-		      wrtb (0x31);
-		      write_word ();
+		      wrtb (z, 0x31);
+		      write_word (z);
 		      break;
 		    }
-		  wrtb (0xED);
-		  wrtb (0x7B);
-		  write_word ();
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x7B);
+		  write_word (z);
 		  break;
 		}
 	      break;
 	    case LDD:
-	      wrtb (0xED);
-	      wrtb (0xA8);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA8);
 	      break;
 	    case LDDR:
-	      wrtb (0xED);
-	      wrtb (0xB8);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB8);
 	      break;
 	    case LDI:
-	      wrtb (0xED);
-	      wrtb (0xA0);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA0);
 	      break;
 	    case LDIR:
-	      wrtb (0xED);
-	      wrtb (0xB0);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB0);
 	      break;
 	    case NEG:
-	      wrtb (0xED);
-	      wrtb (0x44);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x44);
 	      break;
 	    case NOP:
-	      wrtb (0x00);
+	      wrtb (z, 0x00);
 	      break;
 	    case OR:
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0xB0 + --r);
+	      wrtb (z, 0xB0 + --r);
 	      break;
 	    case OTDR:
-	      wrtb (0xED);
-	      wrtb (0xBB);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xBB);
 	      break;
 	    case OTIR:
-	      wrtb (0xED);
-	      wrtb (0xB3);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xB3);
 	      break;
 	    case OUT:
-	      if (!(r = rd_nnc (&ptr)))
+	      if (!(r = rd_nnc (z, &ptr)))
 		break;
 	      if (r == C)
 		{
-		  if (!(r = rd_out (&ptr)))
+		  if (!(r = rd_out (z, &ptr)))
 		    break;
-		  wrtb (0xED);
-		  wrtb (0x41 + 8 * --r);
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x41 + 8 * --r);
 		  break;
 		}
-	      if (!rd_a (&ptr))
+	      if (!rd_a (z, &ptr))
 		break;
 	      {
-		const char *tmp = readbyte;
-		wrtb (0xD3);
-		new_reference (tmp, TYPE_ABSB, ')', 1);
+		const char *tmp = z->readbyte;
+		wrtb (z, 0xD3);
+		new_reference (z, tmp, TYPE_ABSB, ')', 1);
 	      }
 	      break;
 	    case OUTD:
-	      wrtb (0xED);
-	      wrtb (0xAB);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xAB);
 	      break;
 	    case OUTI:
-	      wrtb (0xED);
-	      wrtb (0xA3);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0xA3);
 	      break;
 	    case POP:
-	      if (!(r = rd_stack (&ptr)))
+	      if (!(r = rd_stack (z, &ptr)))
 		break;
-	      wrtb (0xC1 + 0x10 * --r);
+	      wrtb (z, 0xC1 + 0x10 * --r);
 	      break;
 	    case PUSH:
-	      if (!(r = rd_stack (&ptr)))
+	      if (!(r = rd_stack (z, &ptr)))
 		break;
-	      wrtb (0xC5 + 0x10 * --r);
+	      wrtb (z, 0xC5 + 0x10 * --r);
 	      break;
 	    case RES:
-	      if (!rd_0_7 (&ptr))
+	      if (!rd_0_7 (z, &ptr))
 		break;
-	      rd_comma (&ptr);
-	      if (!(r = rd_r_ (&ptr)))
+	      rd_comma (z, &ptr);
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x80 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x80 + --r);
 	      break;
 	    case RET:
-	      if (!(r = rd_cc (&ptr)))
+	      if (!(r = rd_cc (z, &ptr)))
 		{
-		  wrtb (0xC9);
+		  wrtb (z, 0xC9);
 		  break;
 		}
-	      wrtb (0xC0 + 8 * --r);
+	      wrtb (z, 0xC0 + 8 * --r);
 	      break;
 	    case RETI:
-	      wrtb (0xED);
-	      wrtb (0x4D);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x4D);
 	      break;
 	    case RETN:
-	      wrtb (0xED);
-	      wrtb (0x45);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x45);
 	      break;
 	    case RL:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x10 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x10 + --r);
 	      break;
 	    case RLA:
-	      wrtb (0x17);
+	      wrtb (z, 0x17);
 	      break;
 	    case RLC:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x00 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x00 + --r);
 	      break;
 	    case RLCA:
-	      wrtb (0x07);
+	      wrtb (z, 0x07);
 	      break;
 	    case RLD:
-	      wrtb (0xED);
-	      wrtb (0x6F);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x6F);
 	      break;
 	    case RR:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x18 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x18 + --r);
 	      break;
 	    case RRA:
-	      wrtb (0x1F);
+	      wrtb (z, 0x1F);
 	      break;
 	    case RRC:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x08 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x08 + --r);
 	      break;
 	    case RRCA:
-	      wrtb (0x0F);
+	      wrtb (z, 0x0F);
 	      break;
 	    case RRD:
-	      wrtb (0xED);
-	      wrtb (0x67);
+	      wrtb (z, 0xED);
+	      wrtb (z, 0x67);
 	      break;
 	    case RST:
-	      new_reference (ptr, TYPE_RST, '\0', 1);
+	      new_reference (z, ptr, TYPE_RST, '\0', 1);
 	      ptr = "";
 	      break;
 	    case SBC:
-	      if (!(r = rd_a_hl (&ptr)))
+	      if (!(r = rd_a_hl (z, &ptr)))
 		break;
 	      if (r == HL)
 		{
-		  if (!(r = rd_rr_ (&ptr)))
+		  if (!(r = rd_rr_ (z, &ptr)))
 		    break;
-		  wrtb (0xED);
-		  wrtb (0x42 + 0x10 * --r);
+		  wrtb (z, 0xED);
+		  wrtb (z, 0x42 + 0x10 * --r);
 		  break;
 		}
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0x98 + --r);
+	      wrtb (z, 0x98 + --r);
 	      break;
 	    case SCF:
-	      wrtb (0x37);
+	      wrtb (z, 0x37);
 	      break;
 	    case SET:
-	      if (!rd_0_7 (&ptr))
+	      if (!rd_0_7 (z, &ptr))
 		break;
-	      rd_comma (&ptr);
-	      if (!(r = rd_r_ (&ptr)))
+	      rd_comma (z, &ptr);
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0xC0 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0xC0 + --r);
 	      break;
 	    case SLA:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x20 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x20 + --r);
 	      break;
 	    case SLI:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x30 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x30 + --r);
 	      break;
 	    case SRA:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x28 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x28 + --r);
 	      break;
 	    case SRL:
-	      if (!(r = rd_r_ (&ptr)))
+	      if (!(r = rd_r_ (z, &ptr)))
 		break;
-	      wrtb (0xCB);
-	      wrtb (0x38 + --r);
+	      wrtb (z, 0xCB);
+	      wrtb (z, 0x38 + --r);
 	      break;
 	    case SUB:
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
 	      if (has_argument (&ptr))	/* SUB A,r ?  */
 		{
 		  if (r != A)
 		    {
-		      printerr (1, "parse error before: %s\n", ptr);
+		      printerr (z, 1, "parse error before: %s\n", ptr);
 		      break;
 		    }
-		  if (!(r = rd_r (&ptr)))
+		  if (!(r = rd_r (z, &ptr)))
 		    break;
 		}
-	      wrtb (0x90 + --r);
+	      wrtb (z, 0x90 + --r);
 	      break;
 	    case XOR:
-	      if (!(r = rd_r (&ptr)))
+	      if (!(r = rd_r (z, &ptr)))
 		break;
-	      wrtb (0xA8 + --r);
+	      wrtb (z, 0xA8 + --r);
 	      break;
 	    case DEFB:
 	    case DB:
 	    case DEFM:
 	    case DM:
+	      /* every item is read once; constant bytes are collected in
+	       * run and written together */
+	      run.n = 0;
 	      ptr = delspc (ptr);
 	      while (1)
 		{
@@ -2411,29 +2819,35 @@ assemble (void)
 		    {
 		      /* Read string.  */
 		      int quote = *ptr;
-		      if (listfile)
-			{
-			  fprintf (listfile, " ..");
-			  listdepth += 3;
-			}
+		      if (z->havelist)
+			list_item (z->listing, LIST_STRING, 0);
 		      ++ptr;
 		      while (*ptr != quote)
 			{
-			  write_one_byte (rd_character (&ptr, NULL, 1), 0);
+			  /* characters without escapes are copied */
+			  for (end = ptr; *end && *end != quote && *end != '\\';
+			       ++end)
+			    {
+			    }
+			  if (end != ptr)
+			    {
+			      run_bytes (z, &run, ptr, end - ptr);
+			      ptr = end;
+			    }
+			  else
+			    run_byte (z, &run, rd_character (z, &ptr, NULL, 1),
+				      0);
 			  if (*ptr == 0)
 			    {
-			      printerr (1, "end of line in quoted string\n");
+			      printerr (z, 1,
+					"end of line in quoted string\n");
 			      break;
 			    }
 			}
 		      ++ptr;
 		    }
 		  else
-		    {
-		      /* Read expression.  */
-		      new_reference (ptr, TYPE_ABSB, ',', 1);
-		      skipword (&ptr, ',');
-		    }
+		    ptr = write_data (z, &run, ptr, TYPE_ABSB);
 		  ptr = delspc (ptr);
 		  if (*ptr == ',')
 		    {
@@ -2441,147 +2855,168 @@ assemble (void)
 		      continue;
 		    }
 		  if (*ptr != 0)
-		    printerr (1, "junk in byte definition: %s\n", ptr);
+		    printerr (z, 1, "junk in byte definition: %s\n", ptr);
 		  break;
 		}
+	      flush_run (z, &run);
 	      break;
 	    case DEFW:
 	    case DW:
-	      if (!(r = rd_word (&ptr, ',')))
+	      run.n = 0;
+	      ptr = delspc (ptr);
+	      if (!*ptr)
 		{
-		  printerr (1, "No data for word definition\n");
+		  printerr (z, 1, "No data for word definition\n");
 		  break;
 		}
+	      item = ptr;
 	      while (1)
 		{
-		  new_reference (readword, TYPE_ABSW, ',', 1);
+		  /* after a missing expression, the previous one is used
+		   * again */
+		  end = write_data (z, &run, item, TYPE_ABSW);
+		  if (item == ptr)
+		    ptr = end;
 		  ptr = delspc (ptr);
 		  if (*ptr != ',')
 		    break;
-		  ++ptr;
-		  if (!(r = rd_word (&ptr, ',')))
-		    printerr (1, "Missing expression in defw\n");
+		  ptr = delspc (ptr + 1);
+		  if (*ptr)
+		    item = ptr;
+		  else
+		    printerr (z, 1, "Missing expression in defw\n");
 		}
+	      flush_run (z, &run);
 	      break;
 	    case DEFS:
 	    case DS:
-	      r = rd_expr (&ptr, ',', NULL, sp, 1);
+	      r = rd_expr (z, &ptr, ',', NULL, z->sp, 1);
 	      if (r < 0)
 		{
-		  printerr (1, "ds should have its first argument >=0"
+		  printerr (z, 1, "ds should have its first argument >=0"
 			    " (not -0x%x)\n", -r);
 		  break;
 		}
 	      ptr = delspc (ptr);
 	      if (*ptr)
 		{
-		  rd_comma (&ptr);
-		  readbyte = 0;
-		  rd_byte (&ptr, '\0');
-		  writebyte = 0;
-		  new_reference (readbyte, TYPE_DS, '\0', r);
+		  rd_comma (z, &ptr);
+		  if (!rd_byte (z, &ptr, '\0'))
+		    {
+		      printerr (z, 1, "Missing expression in defs\n");
+		      break;
+		    }
+		  z->writebyte = 0;
+		  new_reference (z, z->readbyte, TYPE_DS, '\0', r);
 		  break;
 		}
-	      if (havelist)
-		{
-		  fprintf (listfile, " 00...");
-		  listdepth += 6;
-		}
+	      if (z->havelist)
+		list_item (z->listing, LIST_DS0, 0);
 	      for (i = 0; i < r; i++)
 		{
-		  write_one_byte (0, 0);
+		  write_one_byte (z, 0, 0);
 		}
 	      break;
 	    case END:
 	      file_ended = 1;
 	      break;
 	    case ORG:
-	      addr = rd_expr (&ptr, '\0', NULL, sp, 1) & 0xffff;
+	      z->addr = rd_expr (z, &ptr, '\0', NULL, z->sp, 1) & 0xffff;
+	      z->addr_reloc = 0;
 	      break;
 	    case INCLUDE:
-	      if (sp + 1 >= MAX_INCLUDE)
+	      if (z->sp + 1 >= MAX_INCLUDE)
 		{
-		  printerr (1, "stack overflow (circular include?)");
-		  if (verbose >= 5)
+		  printerr (z, 1, "stack overflow (circular include?)");
+		  if (z->verbose >= 5)
 		    {
 		      int x;
 		      fprintf (stderr, "Stack dump:\nframe  line file\n");
 		      for (x = 0; x < MAX_INCLUDE; ++x)
-			fprintf (stderr, "%5d %5d %s\n", x, stack[x].line,
-				 stack[x].name);
+			fprintf (stderr, "%5d %5d %s\n", x, z->stack[x].line,
+				 z->stack[x].name);
 		    }
 		  break;
 		}
 	      {
 		struct name *name;
-		char *nm = get_include_name (&ptr);
+		char *nm = get_include_name (z, &ptr);
 		if (!nm)
 		  break;
-		name = malloc (sizeof (struct name) + strlen (nm));
+		name = arena_alloc (&z->globalarena,
+				    sizeof (struct name) + strlen (nm));
 		if (!name)
 		  {
-		    printerr (1, "out of memory while allocating name\n");
+		    printerr (z, 1, "out of memory while allocating name\n");
 		    free (nm);
 		    break;
 		  }
 		strcpy (name->name, nm);
 		free (nm);
-		++sp;
-		stack[sp].name = name->name;
-		stack[sp].shouldclose = 1;
-		stack[sp].line = 0;
-		stack[sp].file = open_include_file (name->name,
-						    &stack[sp].dir, "r");
-		if (!stack[sp].file)
+		++z->sp;
+		if (z->sp > z->max_sp)
+		  z->max_sp = z->sp;
+		z->stack[z->sp].name = name->name;
+		z->stack[z->sp].line = 0;
+		z->stack[z->sp].file = &z->stack[z->sp].source;
+		if (!open_include_source (z, name->name, &z->stack[z->sp].dir,
+					  z->stack[z->sp].file))
 		  {
-		    printerr (1, "unable to open file %s\n", name->name);
-		    free (name);
-		    --sp;
+		    printerr (z, 1, "unable to open file %s\n", name->name);
+		    --z->sp;
 		    break;
 		  }
-		name->next = firstname;
+		name->next = z->firstname;
 		name->prev = NULL;
 		if (name->next)
 		  name->next->prev = name;
-		firstname = name;
-		if (verbose >= 4)
+		z->firstname = name;
+		if (z->verbose >= 4)
 		  fprintf (stderr, "Reading file %s\n", name->name);
+		/* an include which was assembled before in the same state
+		 * is replayed instead */
+		if (z->incremental && begin_include (z, name->name, ifcount))
+		  break;
 	      }
 	      break;
 	    case INCBIN:
 	      {
-		FILE *incfile;
-		char *name = get_include_name (&ptr);
+		struct file_request req;
+		char *name = get_include_name (z, &ptr);
 		if (!name)
 		  break;
-		incfile = open_include_file (name, NULL, "rb");
-		if (!incfile)
+		req.z = z;
+		++z->num_incbins;
+		if (!search_include (z, name, NULL, try_open_file, &req))
 		  {
-		    printerr (1, "unable to open binary file %s\n", name);
+		    printerr (z, 1, "unable to open binary file %s\n", name);
 		    free (name);
 		    break;
 		  }
-		while (1)
+		if (!req.f)
 		  {
-		    char filebuffer[4096];
-		    size_t num = fread (filebuffer, 1, 4096, incfile);
-		    if (num == 0)
-		      break;
-		    if (num != fwrite (filebuffer, 1, num, outfile))
+		    write_image (z, req.data, req.size);
+		    z->addr = (z->addr + req.size) & 0xffff;
+		  }
+		else
+		  {
+		    while (1)
 		      {
-			printerr (1, "error including binary file %s: %s\n",
-				  name, strerror (errno));
-			break;
+			char filebuffer[4096];
+			size_t num = fread (filebuffer, 1, 4096, req.f);
+			if (num == 0)
+			  break;
+			write_image (z, filebuffer, num);
+			z->addr += num;
+			z->addr &= 0xffff;
 		      }
-		    addr += num;
-		    addr &= 0xffff;
+		    fclose (req.f);
 		  }
-		fclose (incfile);
 		free (name);
 		break;
 	      }
 	    case IF:
-	      if (rd_expr (&ptr, '\0', NULL, sp, 1))
+	      if (rd_expr (z, &ptr, '\0', NULL, z->sp, 1))
 		ifcount++;
 	      else
 		noifcount++;
@@ -2589,7 +3024,7 @@ assemble (void)
 	    case ELSE:
 	      if (ifcount == 0)
 		{
-		  printerr (1, "else without if\n");
+		  printerr (z, 1, "else without if\n");
 		  break;
 		}
 	      noifcount = 1;
@@ -2598,7 +3033,7 @@ assemble (void)
 	    case ENDIF:
 	      if (noifcount == 0 && ifcount == 0)
 		{
-		  printerr (1, "endif without if\n");
+		  printerr (z, 1, "endif without if\n");
 		  break;
 		}
 	      if (noifcount)
@@ -2607,224 +3042,588 @@ assemble (void)
 		ifcount--;
 	      break;
 	    case MACRO:
-	      if (!lastlabel)
+	      if (!z->lastlabel)
 		{
-		  printerr (1, "macro without label\n");
+		  printerr (z, 1, "macro without label\n");
 		  break;
 		}
-	      if (define_macro)
+	      if (z->define_macro)
 		{
-		  printerr (1, "nested macro definition\n");
+		  printerr (z, 1, "nested macro definition\n");
 		  break;
 		}
 	      {
 		struct macro *m;
-		for (m = firstmacro; m; m = m->next)
-		  {
-		    if (strcmp (m->name, lastlabel->name) == 0)
-		      {
-			printerr (1, "duplicate macro definition\n");
-			break;
-		      }
-		  }
-		m = malloc (sizeof (struct macro));
+		if (find_macro (z, z->lastlabel->name, z->lastlabel->len,
+				z->lastlabel->hash))
+		  printerr (z, 1, "duplicate macro definition\n");
+		m = arena_alloc (&z->globalarena, sizeof (struct macro));
 		if (!m)
 		  {
-		    printerr (1, "out of memory\n");
+		    printerr (z, 1, "out of memory\n");
 		    break;
 		  }
-		m->name = malloc (strlen (lastlabel->name) + 1);
+		m->name = arena_strdup (&z->globalarena, z->lastlabel->name);
 		if (!m->name)
 		  {
-		    printerr (1, "out of memory\n");
-		    free (m);
+		    printerr (z, 1, "out of memory\n");
 		    break;
 		  }
-		strcpy (m->name, lastlabel->name);
-		if (lastlabel->prev)
-		  lastlabel->prev->next = lastlabel->next;
-		else
-		  firstlabel = lastlabel->next;
-		if (lastlabel->next)
-		  lastlabel->next->prev = lastlabel->prev;
-		free (lastlabel);
-		m->next = firstmacro;
-		firstmacro = m;
+		m->len = z->lastlabel->len;
+		m->hash = z->lastlabel->hash;
+		if (!add_macro (z, m))
+		  {
+		    printerr (z, 1, "out of memory\n");
+		    break;
+		  }
+		remove_label (z->lastlabel->name[0] == '.'
+			      ? &z->stack[z->sp].labels : &z->globallabels,
+			      z->lastlabel);
+		m->next = z->firstmacro;
+		z->firstmacro = m;
 		m->lines = NULL;
-		m->numargs = get_macro_args (&ptr, &m->args, 0);
-		define_macro = 1;
+		m->last = &m->lines;
+		m->numargs = get_macro_args (z, &ptr, &m->args, 0,
+					     &z->globalarena);
+		z->define_macro = 1;
 	      }
 	      break;
 	    case ENDM:
-	      if (stack[sp].file)
-		printerr (1, "endm outside macro definition\n");
+	      if (z->stack[z->sp].file)
+		printerr (z, 1, "endm outside macro definition\n");
 	      break;
 	    case SEEK:
 	      {
-		unsigned int seekaddr = rd_expr (&ptr, '\0', NULL, sp, 1);
-		if (verbose >= 2)
+		unsigned int seekaddr = rd_expr (z, &ptr, '\0', NULL, z->sp,
+						 1);
+		if (z->object)
+		  {
+		    printerr (z, 1, "seek can't be used in an object\n");
+		    break;
+		  }
+		if (z->verbose >= 2)
 		  {
-		    fprintf (stderr, "%s%s:%d: ",
-			     stack[sp].dir ? stack[sp].dir->name : "",
-			     stack[sp].name, stack[sp].line);
+		    fprintf (stderr, "%s%s:%d: ", z->stack[z->sp].dir
+			     ? z->stack[z->sp].dir->name : "",
+			     z->stack[z->sp].name, z->stack[z->sp].line);
 		    fprintf (stderr, "[Message] seeking to 0x%0X \n",
 			     seekaddr);
 		  }
-		fseek (outfile, seekaddr, SEEK_SET);
+		/* the image grows to where it is written, so this must be
+		 * in the address space or in what is already there */
+		if (seekaddr > 0x10000 && seekaddr > z->image_end)
+		  {
+		    printerr (z, 1, "seek beyond the end of the output: %d\n",
+			      (int) seekaddr);
+		    break;
+		  }
+		z->image_pos = seekaddr;
 		break;
 	      }
 	    default:
 	      {
 		struct macro *m;
-		for (m = firstmacro; m; m = m->next)
+		const char *c;
+		for (c = ptr; IS_LABEL_CHAR (*c); ++c)
 		  {
-		    if (strncmp (m->name, ptr, strlen (m->name)) == 0)
+		  }
+		m = find_macro (z, ptr, c - ptr, hash_label (ptr, c - ptr));
+		if (m)
+		  {
+		    unsigned numargs;
+		    if (z->sp + 1 >= MAX_INCLUDE)
 		      {
-			unsigned numargs;
-			if (sp + 1 >= MAX_INCLUDE)
+			printerr (z, 1,
+				  "stack overflow (circular include?)\n");
+			if (z->verbose >= 5)
 			  {
-			    printerr (1, "stack overflow (circular include?)\n");
-			    if (verbose >= 5)
-			      {
-				int x;
-				fprintf (stderr,
-					 "Stack dump:\nframe  line file\n");
-				for (x = 0; x < MAX_INCLUDE; ++x)
-				  fprintf (stderr, "%5d %5d %s\n", x,
-					   stack[x].line, stack[x].name);
-			      }
-			    break;
+			    int x;
+			    fprintf (stderr, "Stack dump:\nframe  line file\n");
+			    for (x = 0; x < MAX_INCLUDE; ++x)
+			      fprintf (stderr, "%5d %5d %s\n", x,
+				       z->stack[x].line, z->stack[x].name);
 			  }
-			++sp;
-			ptr += strlen (m->name);
-			numargs = get_macro_args (&ptr, &stack[sp].macro_args,
-						  1);
-			if (numargs != m->numargs)
+			break;
+		      }
+		    ++z->sp;
+		    if (z->sp > z->max_sp)
+		      z->max_sp = z->sp;
+		    ptr = c;
+		    ++z->stats.macro_expansions;
+		    numargs = get_macro_args (z, &ptr,
+					      &z->stack[z->sp].macro_args, 1,
+					      &z->stack[z->sp].arena);
+		    if (numargs != m->numargs)
+		      {
+			arena_release (&z->stack[z->sp].arena);
+			--z->sp;
+			printerr (z, 1, "invalid number of arguments for "
+				  "macro (is %d, must be %d)\n", numargs,
+				  m->numargs);
+			break;
+		      }
+		    TRACE (z, Z80ASM_TRACE_MACROS, TRACE_EXPAND, numargs, z->sp,
+			   m->name);
+		    z->stack[z->sp].macro_arg_len = NULL;
+		    if (numargs)
+		      {
+			unsigned a;
+			z->stack[z->sp].macro_arg_len
+			  = arena_alloc (&z->stack[z->sp].arena,
+					 numargs * sizeof (size_t));
+			if (!z->stack[z->sp].macro_arg_len)
 			  {
-			    unsigned a;
-			    printerr (1, "invalid number of arguments for macro "
-				      "(is %d, must be %d)\n", numargs,
-				      m->numargs);
-			    for (a = 0; a < numargs; ++a)
-			      free (stack[sp].macro_args[a]);
-			    free (stack[sp].macro_args);
+			    arena_release (&z->stack[z->sp].arena);
+			    --z->sp;
+			    printerr (z, 1, "out of memory\n");
 			    break;
 			  }
-			stack[sp].name = m->name;
-			stack[sp].file = NULL;
-			stack[sp].line = 0;
-			stack[sp].macro = m;
-			stack[sp].macro_line = m->lines;
-			stack[sp].shouldclose = 0;
-			stack[sp].dir = NULL;
-			break;
+			for (a = 0; a < numargs; ++a)
+			  z->stack[z->sp].macro_arg_len[a]
+			    = strlen (z->stack[z->sp].macro_args[a]);
 		      }
+		    z->stack[z->sp].name = m->name;
+		    z->stack[z->sp].file = NULL;
+		    z->stack[z->sp].line = 0;
+		    z->stack[z->sp].macro = m;
+		    z->stack[z->sp].macro_line = m->lines;
+		    z->stack[z->sp].dir = NULL;
+		    break;
 		  }
 		if (m)
 		  break;
 	      }
-	      printerr (1, "command or comment expected (was %s)\n", ptr);
+	      printerr (z, 1, "command or comment expected (was %s)\n", ptr);
 	    }
 	}
     }
+  /* Add a stack frame for error reporting.  It still has the name and
+   * line of the last file.  */
+  ++z->sp;
   if (ifcount || noifcount)
     {
-      printerr (1, "reached EOF at IF level %d\n", ifcount + noifcount);
+      printerr (z, 1, "reached EOF at IF level %d\n", ifcount + noifcount);
     }
-  if (havelist)
+  if (z->havelist)
     {
-      fprintf (listfile, "%04x\n", addr);
+      list_line (z->listing, z->addr);
+      list_text (z->listing, "\n");
     }
+  z->end_addr = z->addr;
+  ENTER_PHASE (z, Z80ASM_PHASE_RESOLVE);
   {
     struct reference *next;
     struct reference *tmp;
-    /* Add a stack frame for error reporting.  */
-    ++sp;
-    for (tmp = firstreference; tmp; tmp = next)
+    for (tmp = z->firstreference; tmp; tmp = next)
       {
 	int ref;
 	next = tmp->next;
-	fseek (outfile, tmp->oseekpos, SEEK_SET);
-	if (havelist)
-	  fseek (listfile, tmp->lseekpos, SEEK_SET);
-	stack[sp].name = tmp->file;
-	stack[sp].dir = tmp->dir;
-	stack[sp].line = tmp->line;
-	ref = compute_ref (tmp, 0);
-	wrt_ref (ref, tmp->type, tmp->count);
-	if (tmp->dir)
-	  free (tmp->dir);
-	free (tmp->file);
-	free (tmp);
+	z->image_pos = tmp->oseekpos;
+	if (z->havelist)
+	  list_seek (z->listing, tmp->lseekpos);
+	z->stack[z->sp].name = tmp->file;
+	z->stack[z->sp].dir = tmp->dir;
+	z->stack[z->sp].line = tmp->line;
+	ref = compute_ref (z, tmp, z->object);
+	if (z->object && relocatable_ref (tmp))
+	  {
+	    /* the linker writes it */
+	    check_relocatable (z, tmp);
+	    continue;
+	  }
+	wrt_ref (z, ref, tmp->type, tmp->count);
       }
   }
-  if (!errors || use_force)
+  /* compute all labels, sorted by name so errors come in a fixed order */
+  {
+    struct label **sorted = sort_labels (&z->globallabels);
+    unsigned i;
+    for (i = 0; sorted && i < z->globallabels.count; ++i)
+      {
+	if (sorted[i]->ref)
+	  compute_ref (z, sorted[i]->ref, z->object);
+	if (z->object && sorted[i]->ref
+	    && (!sorted[i]->valid || sorted[i]->reloc == RELOC_EXPR))
+	  check_relocatable (z, sorted[i]->ref);
+      }
+    if (z->globallabels.count && !sorted)
+      printerr (z, 1, "not enough memory to sort labels\n");
+    free (sorted);
+  }
+}
+
+/* the library interface, see libz80asm.h */
+
+struct z80asm *
+z80asm_create (void)
+{
+  struct z80asm *z;
+  /* the tables are shared by all contexts; pthread_once makes sure they
+   * are filled once, before any context can use them */
+  if (pthread_once (&tables_once, init_tables))
+    return NULL;
+  z = calloc (1, sizeof (struct z80asm));
+  return z;
+}
+
+void
+z80asm_reset (struct z80asm *z)
+{
+  int i;
+  while (z->firstincludedir)
+    {
+      struct includedir *next = z->firstincludedir->next;
+      free (z->firstincludedir);
+      z->firstincludedir = next;
+    }
+  for (i = 0; i < z->infilecount; ++i)
+    free (z->infile[i].name);
+  free (z->infile);
+  z->infile = NULL;
+  z->infilecount = 0;
+  while (z->overrides)
+    {
+      struct file_override *next = z->overrides->next;
+      free (z->overrides);
+      z->overrides = next;
+    }
+  z->verbose = 0;
+  z->use_force = 0;
+  z->havelist = 0;
+  z->capture = 0;
+  z->incremental = 0;
+  z->object = 0;
+  z->timing = 0;
+  free_trace (z);
+  z->read_file = NULL;
+  z->read_file_data = NULL;
+}
+
+void
+z80asm_set_verbose (struct z80asm *z, int level)
+{
+  z->verbose = level;
+}
+
+void
+z80asm_set_reader (struct z80asm *z, z80asm_read_file *read_file, void *user)
+{
+  z->read_file = read_file;
+  z->read_file_data = user;
+}
+
+void
+z80asm_set_capture (struct z80asm *z, int capture)
+{
+  z->capture = capture;
+}
+
+void
+z80asm_set_force (struct z80asm *z, int force)
+{
+  z->use_force = force;
+}
+
+void
+z80asm_set_object (struct z80asm *z, int object)
+{
+  z->object = object;
+}
+
+void
+z80asm_set_listing (struct z80asm *z, int listing)
+{
+  z->havelist = listing;
+}
+
+int
+z80asm_add_include (struct z80asm *z, const char *dir)
+{
+  struct includedir *i;
+  size_t len = strlen (dir);
+  i = malloc (sizeof (struct includedir) + len + 1);
+  if (!i)
+    return 0;
+  strcpy (i->name, dir);
+  if (!len || dir[len - 1] != '/')
+    strcat (i->name, "/");
+  i->next = z->firstincludedir;
+  z->firstincludedir = i;
+  return 1;
+}
+
+static int
+add_infile (struct z80asm *z, const char *name, const char *data,
+	    unsigned long size, enum filetype type)
+{
+  struct infile *infile;
+  char *copy = malloc (strlen (name) + 1);
+  if (!copy)
+    return 0;
+  infile = realloc (z->infile, sizeof (struct infile) * (z->infilecount + 1));
+  if (!infile)
     {
-      flush_to_real_file (realoutputfile, outfile);
-      if (havelist)
-	flush_to_real_file (reallistfile, listfile);
+      free (copy);
+      return 0;
     }
-  /* write all labels */
-  if (label)
-    fseek (labelfile, 0, SEEK_END);
-  for (l = firstlabel; l; l = l->next)
-    {
-      if (l->ref)
+  z->infile = infile;
+  strcpy (copy, name);
+  infile[z->infilecount].type = type;
+  infile[z->infilecount].name = copy;
+  infile[z->infilecount].data = data;
+  infile[z->infilecount].size = size;
+  if (z->verbose >= 5)
+    fprintf (stderr, "queued inputfile %s\n", copy);
+  z->infilecount++;
+  return 1;
+}
+
+int
+z80asm_add_source (struct z80asm *z, const char *name)
+{
+  return add_infile (z, name, NULL, 0, FILETYPE_ASM);
+}
+
+int
+z80asm_add_file (struct z80asm *z, const char *name, const char *data,
+		 unsigned long size)
+{
+  struct file_override *o = malloc (sizeof (struct file_override)
+				    + strlen (name));
+  if (!o)
+    return 0;
+  strcpy (o->name, name);
+  o->data = data ? data : "";
+  o->size = size;
+  o->next = z->overrides;
+  z->overrides = o;
+  return 1;
+}
+
+int
+z80asm_add_source_buffer (struct z80asm *z, const char *name,
+			  const char *data, unsigned long size)
+{
+  return add_infile (z, name, data ? data : "", size, FILETYPE_ASM);
+}
+
+int
+z80asm_add_object (struct z80asm *z, const char *name)
+{
+  return add_infile (z, name, NULL, 0, FILETYPE_OBJ);
+}
+
+/* free everything which belongs to a run of the assembler.  The arenas
+ * keep their blocks for the next run.  */
+static void
+free_run (struct z80asm *z)
+{
+  int i;
+  for (i = 0; i < MAX_INCLUDE; ++i)
+    {
+      free (z->stack[i].labels.slots);
+      arena_release (&z->stack[i].arena);
+      free (z->stack[i].expansion);
+    }
+  free (z->globallabels.slots);
+  arena_release (&z->globalarena);
+  free (z->macro_slots);
+  free (z->macro_def_args);
+  free (z->line_buffer);
+  free (z->scratch_code.ops);
+  free (z->scratch_code.slots);
+  free (z->todo);
+  free (z->image);
+  free_listing (z->listing);
+  free (z->diagnostics);
+  free (z->symbols);
+  free_incremental_run (z);
+  free_source_buffers (z);
+}
+
+int
+z80asm_assemble (struct z80asm *z)
+{
+  /* the options and the caches stay, the rest is cleared */
+  int verbose = z->verbose, use_force = z->use_force;
+  int havelist = z->havelist, infilecount = z->infilecount;
+  int capture = z->capture, incremental = z->incremental;
+  int object = z->object, timing = z->timing;
+  unsigned trace_categories = z->trace_categories;
+  struct trace *trace = z->trace;
+  struct include_record **records = z->records;
+  z80asm_read_file *read_file = z->read_file;
+  void *read_file_data = z->read_file_data;
+  struct file_override *overrides = z->overrides;
+  unsigned long run = z->run;
+  struct includedir *firstincludedir = z->firstincludedir;
+  struct infile *infile = z->infile;
+  struct patterns *pattern_cache = z->pattern_cache;
+  int num_pattern_lists = z->num_pattern_lists;
+  struct source_file *source_cache;
+  struct arena_block *spare[MAX_INCLUDE + 1];
+  int i;
+  free_run (z);
+  source_cache = z->source_cache;
+  for (i = 0; i < MAX_INCLUDE; ++i)
+    spare[i] = z->stack[i].arena.spare;
+  spare[MAX_INCLUDE] = z->globalarena.spare;
+  memset (z, 0, sizeof (struct z80asm));
+  for (i = 0; i < MAX_INCLUDE; ++i)
+    z->stack[i].arena.spare = spare[i];
+  z->globalarena.spare = spare[MAX_INCLUDE];
+  z->verbose = verbose;
+  z->use_force = use_force;
+  z->havelist = havelist;
+  z->capture = capture;
+  z->incremental = incremental;
+  z->object = object;
+  z->timing = timing;
+  start_stats (z);
+  z->trace_categories = trace_categories;
+  z->trace = trace;
+  start_trace (z);
+  /* an object starts at a relative address */
+  z->addr_reloc = object;
+  z->records = records;
+  z->read_file = read_file;
+  z->read_file_data = read_file_data;
+  z->overrides = overrides;
+  z->run = run + 1;
+  z->infilecount = infilecount;
+  z->firstincludedir = firstincludedir;
+  z->infile = infile;
+  z->pattern_cache = pattern_cache;
+  z->num_pattern_lists = num_pattern_lists;
+  z->source_cache = source_cache;
+  if (z->havelist && !(z->listing = new_listing ()))
+    {
+      fprintf (stderr, "not enough memory for list file\n");
+      return ++z->errors;
+    }
+  /* the listing must show everything, so nothing is replayed */
+  if (z->havelist)
+    z->incremental = 0;
+  /* the records don't know about relocation */
+  if (z->object)
+    z->incremental = 0;
+  ENTER_PHASE (z, Z80ASM_PHASE_PARSE);
+  assemble (z);
+  if (z->incremental)
+    finish_incremental (z);
+  ENTER_PHASE (z, PHASE_IDLE);
+  z->incremental = incremental;
+  return z->errors;
+}
+
+const unsigned char *
+z80asm_get_image (struct z80asm *z, unsigned long *size)
+{
+  *size = z->image_end;
+  return z->image;
+}
+
+const struct z80asm_symbol *
+z80asm_get_symbols (struct z80asm *z, unsigned *count)
+{
+  struct label **sorted;
+  unsigned i;
+  *count = 0;
+  if (!z->symbols)
+    {
+      if (!(sorted = sort_labels (&z->globallabels)))
+	return NULL;
+      z->symbols = malloc (z->globallabels.count
+			   * sizeof (struct z80asm_symbol));
+      if (!z->symbols)
 	{
-	  compute_ref (l->ref, 0);
+	  free (sorted);
+	  return NULL;
 	}
-      if (label)
+      for (i = 0; i < z->globallabels.count; ++i)
 	{
-	  fprintf (labelfile, "%s%s:\tequ $%04x\n", labelprefix, l->name,
-		   l->value);
+	  z->symbols[i].name = sorted[i]->name;
+	  z->symbols[i].value = sorted[i]->value;
 	}
+      free (sorted);
     }
-  if (label)
-    fclose (labelfile);
-  while (firstlabel)
-    {
-      l = firstlabel->next;
-      free (firstlabel);
-      firstlabel = l;
-    }
-  fclose (outfile);
-  if (outfile != realoutputfile)
-    fclose (realoutputfile);
-  if (havelist)
-    {
-      fclose (listfile);
-      if (listfile != reallistfile && reallistfile != stderr)
-	fclose (reallistfile);
-    }
-  free (infile);
+  *count = z->globallabels.count;
+  return z->symbols;
+}
+
+const struct z80asm_diagnostic *
+z80asm_get_diagnostics (struct z80asm *z, unsigned *count)
+{
+  *count = z->num_diagnostics;
+  return z->diagnostics;
 }
 
 int
-main (int argc, char **argv)
-{
-  /* default include file location */
-  add_include ("/usr/share/z80asm/headers/");
-  parse_commandline (argc, argv);
-  if (verbose >= 1)
-    fprintf (stderr, "Assembling....\n");
-  assemble ();
-  if (errors)
-    {
-      if (errors == 1)
-	fprintf (stderr, "*** 1 error found ***\n");
-      else
-	fprintf (stderr, "*** %d errors found ***\n", errors);
-      if (realoutputfile == outfile && !use_force)
-	{
-	  unlink (realoutputfilename);
-	  unlink (labelfilename);
-	}
-      return 1;
+z80asm_write_image (struct z80asm *z, FILE * f)
+{
+  int phase = ENTER_PHASE (z, Z80ASM_PHASE_OUTPUT), ok;
+  unsigned long done = 0;
+  ssize_t n;
+  /* the image is written to the file descriptor at once, not through
+   * the buffer of f.  A pipe may take less, so it is continued.  */
+  ok = !fflush (f);
+  while (ok && done < z->image_end)
+    {
+      n = write (fileno (f), z->image + done, z->image_end - done);
+      if (n < 0 && errno == EINTR)
+	continue;
+      ok = n > 0;
+      done += ok ? n : 0;
     }
-  else
+  ENTER_PHASE (z, phase);
+  return ok;
+}
+
+int
+z80asm_write_listing (struct z80asm *z, FILE * f)
+{
+  int phase, ret;
+  if (!z->listing)
     {
-      if (verbose >= 1)
-	fprintf (stderr, "Assembly succesful.\n");
+      errno = EINVAL;
       return 0;
     }
+  phase = ENTER_PHASE (z, Z80ASM_PHASE_LIST);
+  ret = write_listing (z->listing, f);
+  ENTER_PHASE (z, phase);
+  return ret;
+}
+
+int
+z80asm_write_labels (struct z80asm *z, FILE * f, const char *prefix)
+{
+  struct label **sorted = sort_labels (&z->globallabels);
+  unsigned i;
+  int phase;
+  if (z->globallabels.count && !sorted)
+    return 0;
+  phase = ENTER_PHASE (z, Z80ASM_PHASE_OUTPUT);
+  for (i = 0; i < z->globallabels.count; ++i)
+    fprintf (f, "%s%s:\tequ $%04x\n", prefix, sorted[i]->name,
+	     sorted[i]->value);
+  free (sorted);
+  ENTER_PHASE (z, phase);
+  return !ferror (f);
+}
+
+void
+z80asm_destroy (struct z80asm *z)
+{
+  int i;
+  if (!z)
+    return;
+  free_run (z);
+  for (i = 0; i < MAX_INCLUDE; ++i)
+    arena_free_all (&z->stack[i].arena);
+  arena_free_all (&z->globalarena);
+  free_sources (z);
+  free_records (z);
+  z80asm_reset (z);
+  free (z->pattern_cache);
+  free (z);
 }
@@ -22,6 +22,11 @@
 #ifndef Z80ASM_H
 #define Z80ASM_H
 
+/* for vsnprintf, and the nanoseconds of file times */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
@@ -29,8 +34,13 @@
 #include <errno.h>
 #include <ctype.h>
 #include <stdarg.h>
-#include <getopt.h>
+#include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "libz80asm.h"
 
 /* defines which are not function-specific */
 #ifndef BUFLEN
@@ -66,28 +76,62 @@ enum reftype
   TYPE_LABEL			/* equ expression */
 };
 
-/* filetypes that can appear on the input. object files are on the todo list */
+/* filetypes that can appear on the input */
 enum filetype
 {
-  FILETYPE_ASM
+  FILETYPE_ASM,
+  FILETYPE_OBJ			/* relocatable object, see object.c */
+};
+
+/* region of memory, see arena.c */
+struct arena
+{
+  struct arena_block *blocks;
+  char *ptr;			/* free space in the current block */
+  size_t left;			/* size of free space */
+  struct arena_block *spare;	/* released blocks, for reuse */
+};
+
+/* a hash of 64 bits, as two halves of 32 bits, see incremental.c */
+struct digest
+{
+  unsigned long a, b;
 };
 
-/* labels (will be malloced) */
+/* the reloc of a value which does not grow with the address of the
+ * object, so only the linker can compute it, see object.c */
+#define RELOC_EXPR 0x7fffffff
+
+/* labels (will be allocated from an arena) */
 struct label
 {
-  struct label *next, *prev;	/* linked list */
-  int value;			/* value */
+  int value;			/* value, change it with set_label() */
   int valid;			/* if it is valid, or not yet computed */
-  int busy;			/* if it is currently being computed */
-  struct reference *ref;	/* mallocced memory to value for computation */
+  int busy;			/* if it is being computed or woken */
+  struct reference *ref;	/* reference to compute value, or NULL */
+  struct label_table *table;	/* table which holds it, or NULL */
+  int reloc;			/* times the address of the object in value */
+  unsigned hash;		/* hash of name, see hash_label() */
+  unsigned len;			/* length of name */
   char name[1];			/* space with name in it */
 };
 
+/* hash table of labels, see labels.c */
+struct label_table
+{
+  struct label **slots;		/* size slots, unused ones are NULL */
+  unsigned size;		/* number of slots, a power of two (or 0) */
+  unsigned count;		/* number of labels in the table */
+  struct digest digest;		/* of all names, values and validity */
+};
+
 /* files that were given on the commandline */
 struct infile
 {
-  const char *name;
+  char *name;
   enum filetype type;
+  const char *data;		/* contents, if given in memory */
+  unsigned long size;
 };
 
 /* filenames must be remembered for references */
@@ -97,6 +141,15 @@ struct name
   char name[1];
 };
 
+/* a file which is given in memory by the library user */
+struct file_override
+{
+  struct file_override *next;
+  const char *data;
+  unsigned long size;
+  char name[1];
+};
+
 /* the include path */
 struct includedir
 {
@@ -104,18 +157,20 @@ struct includedir
   char name[1];
 };
 
-/* macro stuff */
+/* macro stuff.  The body of a macro is stored as lines of text without
+ * the argument names; args says where the arguments are inserted.  */
 struct macro_arg
 {
-  struct macro_arg *next;
-  unsigned pos;
-  unsigned which;
+  unsigned pos;			/* position in line */
+  unsigned which;		/* index of the argument */
 };
 
 struct macro_line
 {
   struct macro_line *next;
   char *line;
+  unsigned len;
+  unsigned numargs;
   struct macro_arg *args;
 };
 
@@ -123,9 +178,39 @@ struct macro
 {
   struct macro *next;
   char *name;
+  unsigned len, hash;		/* length and hash_label() of the name */
   unsigned numargs;
   char **args;
   struct macro_line *lines;
+  struct macro_line **last;	/* where the next line is added */
+};
+
+/* a source file in memory, see source.c */
+struct source_file
+{
+  struct source_file *next;
+  char *path;			/* NULL for standard input */
+  dev_t dev;			/* identity of the file */
+  ino_t ino;
+  struct timespec mtime, ctime;
+  int racy;			/* if it was changed while it was loaded */
+  const char *data;		/* contents */
+  size_t size;
+  char *buffer;			/* mapped or malloced copy of data */
+  int mapped;			/* if buffer is mapped */
+  int borrowed;			/* if data belongs to the caller */
+  unsigned long run;		/* the last run which used this file */
+  struct digest id;		/* digest of data, if have_id is set */
+  int have_id;
+  size_t *lines;		/* start of each line, and the end */
+  size_t num_lines;
+};
+
+/* a source file which is being read */
+struct source
+{
+  struct source_file *file;
+  size_t line;			/* index of the next line */
 };
 
 /* elements on the context stack */
@@ -133,23 +218,104 @@ struct stack
 {
   const char *name;		/* filename (for errors). may be malloced */
   struct includedir *dir;	/* directory where it comes from, if any */
-  FILE *file;			/* the handle */
+  struct source *file;		/* &source, or NULL */
+  struct source source;		/* the contents of the file */
   int line;			/* the current line number (for errors) */
-  int shouldclose;		/* if this file should be closed when done */
-  struct label *labels;		/* local labels for this stack level */
+  struct label_table labels;	/* local labels for this stack level */
+  struct reference *refs;	/* uncomputed references at this level */
+  struct arena arena;		/* memory which is released on pop */
   /* if file is NULL, this is a macro entry */
   struct macro *macro;
   struct macro_line *macro_line;
   char **macro_args;		/* arguments given to the macro */
+  size_t *macro_arg_len;	/* their lengths */
+  char *expansion;		/* buffer for expanded lines, kept over pops */
+  size_t expansion_size;
+};
+
+/* operations of compiled expressions, see expressions.c.  Operands are
+ * on a stack; binary operators pop two and push one.  */
+enum expr_opcode
+{
+  OP_CONST,			/* push arg */
+  OP_ADDR,			/* push the address at the start of the line */
+  OP_LABEL,			/* push value of label in slot arg */
+  OP_EXISTS,			/* push if label in slot arg exists */
+  OP_NEG,
+  OP_NOT,
+  OP_MUL,
+  OP_DIV,
+  OP_ADD,
+  OP_SUB,
+  OP_SHL,
+  OP_SHR,
+  OP_LE,
+  OP_GE,
+  OP_LT,
+  OP_GT,
+  OP_EQ,
+  OP_NE,
+  OP_AND,
+  OP_XOR,
+  OP_OR,
+  OP_SELECT,			/* pop c, a, b; push c ? a : b */
+  /* after the others, so stored code keeps its meaning */
+  OP_MOD
+};
+
+/* maximum stack depth of compiled expressions */
+#define MAX_EXPR_DEPTH 64
+
+struct expr_op
+{
+  enum expr_opcode op;
+  int arg;
 };
 
-/* these structs will be malloced for each reference */
+/* label used by a compiled expression */
+struct expr_slot
+{
+  unsigned offset;		/* position of the name in the input */
+  unsigned len, hash;		/* length and hash_label() of the name */
+  struct label *label;		/* global label, once it is found */
+};
+
+/* an expression compiled by rd_expr_code */
+struct expr_code
+{
+  const char *input;		/* text of the expression (for label names) */
+  int failed;			/* if the expression could not be compiled */
+  int check;			/* if fully enclosed in parenthesis */
+  int depth, max_depth;		/* stack depth (during compilation) */
+  unsigned num_ops, max_ops;
+  struct expr_op *ops;
+  unsigned num_slots, max_slots;
+  struct expr_slot *slots;
+};
+
+struct reference;
+
+/* a reference which waits for a label to be defined, see references.c */
+struct ref_wait
+{
+  struct ref_wait *next, *prev;
+  struct reference *ref;
+  unsigned hash;		/* hash_label() of the label name */
+};
+
+/* these structs will be allocated for each reference */
 struct reference
 {
   struct reference *next, *prev;
+  struct reference *level_next, *level_prev;	/* list in stack[level] */
+  struct reference *next_woken;	/* list of woken references */
+  int woken;			/* if it is in the list of woken references */
+  unsigned long seq;		/* number of references made before it */
+  struct ref_wait *waits;	/* one for every label in code */
+  struct label *label;		/* label of TYPE_LABEL reference */
   enum reftype type;		/* type of reference */
-  long oseekpos;		/* position in outfile for data */
-  long lseekpos;		/* position in listfile for data */
+  long oseekpos;		/* position in output image for data */
+  long lseekpos;		/* position in listing for data, see list_tell */
   char delimiter;		/* delimiter for parser */
   int addr, line;		/* address and line of reference */
   int baseaddr;			/* address at start of line of reference */
@@ -158,90 +324,375 @@ struct reference
   int infile;			/* index in infile[], current infile */
   int done;			/* if this reference has been computed */
   int computed_value;		/* value (only valid if done = true) */
+  int reloc;			/* times the address of the object in it */
+  int addr_reloc;		/* if addr and baseaddr are in the object */
   int level;			/* maximum stack level of labels to use */
   struct includedir *dir;	/* dirname of file (for error reporting) */
   char *file;			/* filename (for error reporting) */
-  char input[1];		/* variable size buffer containing formula */
+  struct expr_code *code;	/* compiled input, or NULL if it failed */
+  const char *input;		/* formula, and the rest of its line */
 };
 
-/* global variables */
-/* mnemonics, used as argument to indx() in assemble */
+/* mnemonics, looked up by readcommand() in assemble */
 extern const char *mnemonics[];
 
-/* linked lists */
-extern struct reference *firstreference;
-extern struct label *firstlabel, *lastlabel;
-extern struct name *firstname;
-extern struct includedir *firstincludedir;
-extern struct macro *firstmacro;
+/* number of lists of waiting references, see references.c.  Must be a
+ * power of two.  */
+#define WAIT_TABLE_SIZE 1024
 
-/* files */
-extern FILE *realoutputfile, *outfile, *reallistfile, *listfile, *labelfile;
-extern const char *realoutputfilename;
-extern const char *labelfilename;
-extern struct infile *infile;
-/* prefix for labels in labelfile */
-extern const char *labelprefix;
-/* bools to see if files are opened */
-extern int havelist, label;
-/* number of infiles in array */
-extern int infilecount;
+/* compiled pattern lists for indx(), see z80asm.c */
+#define MAX_PATTERN_LISTS 64
+struct patterns;
 
-/* number of errors seen so far */
-extern int errors;
+/* the listing, see listing.c */
+struct listing;
 
-/* current line, address and file */
-extern int addr, file;
-/* current number of characters in list file, for indentation */
-extern int listdepth;
+/* the ring buffer of trace points, see trace.c */
+struct trace;
 
-/* use readbyte instead of (hl) if writebyte is true */
-extern int writebyte;
-extern const char *readbyte;
-/* variables which are filled by rd_* functions and used later,
- * like readbyte */
-extern const char *readword, *indexjmp, *bitsetres;
+/* incremental assembly, see incremental.c.  Every include which is
+ * assembled is recorded in a frame; when it ends, its effects are kept in
+ * a record which can replace it in a later run.  */
+#define RECORD_TABLE_SIZE 256
 
-/* 0, 0xdd or 0xfd depening on which index prefix should be given */
-extern int indexed;
+struct include_record;
 
-/* increased for every -v option on the command line */
-extern int verbose;
-
-/* read commas after indx() if comma > 1. increase for every call */
-extern int comma;
+/* a file which an include depends on */
+struct include_dep
+{
+  char *name;			/* name in the include directive */
+  char *dir;			/* include directory where it was found, or
+				   NULL */
+  struct digest id;		/* digest of its contents */
+};
 
-/* address at start of line (for references) */
-extern int baseaddr;
+/* an include which is being recorded */
+struct include_frame
+{
+  int level;			/* stack level of the included file */
+  struct digest key;		/* everything which the result depends on */
+  struct digest globals;	/* digest of the global labels at the start */
+  struct digest locals;		/* and of the local labels of lower levels */
+  int ifcount;
+  int max_sp;			/* max_sp of the enclosing frame */
+  /* counters and log positions at the start */
+  unsigned long references, messages, macros, incbins, unstable;
+  unsigned num_writes, num_labels, num_deps;
+};
 
-/* set by readword and readbyte, used for new_reference */
-extern char mem_delimiter;
+/* a part of the image which was written */
+struct image_write
+{
+  unsigned long pos, size;
+};
 
-/* line currently being parsed */
-extern char *buffer;
+/* where the parts of a line start, as found by one pass of scan_line()
+ * over it.  They point into the line.  */
+struct line_tokens
+{
+  const char *start;		/* the line after delspc() */
+  const char *colon;		/* ':' in its first word, or NULL */
+};
 
-/* if a macro is currently being defined */
-extern int define_macro;
+/* an operand expression of the current line which was read already, so
+ * other patterns and new_reference don't have to read it again.  */
+struct operand
+{
+  const char *start, *end;
+  char delimiter;
+  int valid;			/* it could be computed without relocation */
+  int value;
+  int paren;			/* it starts with a parenthesis */
+};
 
-/* file (and macro) stack */
-extern int sp;
-extern struct stack stack[MAX_INCLUDE];	/* maximum level of includes */
+#define MAX_OPERANDS 8		/* remembered for each line */
 
-/* Produce output even with errors.  */
-extern int use_force;
+/* an assembler context.  All state of an assembly is in here, so several
+ * contexts can be used at the same time.  See libz80asm.h.  */
+struct z80asm
+{
+  /* options */
+  int verbose;			/* increased for every -v option */
+  int use_force;		/* produce output even with errors */
+  int havelist;			/* if a listing is collected */
+  struct includedir *firstincludedir;
+  struct infile *infile;	/* input files */
+  int infilecount;		/* number of infiles in array */
+  z80asm_read_file *read_file;	/* used instead of the file system */
+  void *read_file_data;
+  struct file_override *overrides;	/* used before the file system */
+  int capture;			/* collect diagnostics instead of printing */
+  int incremental;		/* record and replay includes */
+  int object;			/* make a relocatable object, see object.c */
+  int timing;			/* measure the phases, see stats.c */
+  unsigned trace_categories;	/* trace points which are on */
+  struct trace *trace;		/* their records, see trace.c */
+
+  /* statistics of this run, the phase which is timed now, and the
+   * samples of the time of each phase, see stats.c */
+  struct z80asm_stats stats;
+  int phase, phase_timed;
+  double phase_wall, start_wall, start_cpu;
+  double phase_time[Z80ASM_NUM_PHASES];
+  unsigned sample_skip;
+  unsigned long sample_seed;
+
+  /* linked lists */
+  struct reference *firstreference;
+  struct label *lastlabel;
+  /* memory which lives until the end of the assembly */
+  struct arena globalarena;
+  /* global labels */
+  struct label_table globallabels;
+  struct name *firstname;
+  struct macro *firstmacro;
+  /* macros, hashed by name */
+  struct macro **macro_slots;
+  unsigned macro_slots_size, macro_count;
+
+  /* number of errors seen so far */
+  int errors;
+
+  /* current address and file */
+  int addr, file;
+  /* if addr is relative to the start of the object */
+  int addr_reloc;
+  /* addr at the end of the inputs; writing references changes addr */
+  int end_addr;
+  /* use readbyte instead of (hl) if writebyte is true */
+  int writebyte;
+  const char *readbyte;
+  /* variables which are filled by rd_* functions and used later,
+   * like readbyte */
+  const char *readword, *indexjmp, *bitsetres;
+  /* 0, 0xdd or 0xfd depening on which index prefix should be given */
+  int indexed;
+  /* read commas after indx() if comma > 1. increase for every call */
+  int comma;
+  /* address at start of line (for references) */
+  int baseaddr;
+  /* set by readword and readbyte, used for new_reference */
+  char mem_delimiter;
+  /* line currently being parsed, and its length */
+  char *buffer;
+  size_t buffer_len;
+  /* copy of the line for the references which are made in it, and the
+   * value of stats.lines when it was made */
+  char *ref_line;
+  unsigned long ref_line_seq;
+  /* buffer for lines from source files */
+  char *line_buffer;
+  size_t line_size;
+  /* the parts of buffer which scan_line found */
+  struct line_tokens tokens;
+  /* operand expressions of the line which were read */
+  struct operand operands[MAX_OPERANDS];
+  unsigned num_operands;
+  /* if a macro is currently being defined */
+  int define_macro;
+  /* argument positions of the macro line which is being defined */
+  struct macro_arg *macro_def_args;
+  unsigned max_macro_def_args;
+
+  /* file (and macro) stack */
+  int sp;
+  struct stack stack[MAX_INCLUDE];	/* maximum level of includes */
+
+  /* the output */
+  unsigned char *image;
+  unsigned long image_size;	/* allocated size */
+  unsigned long image_pos;	/* current position, like ftell () */
+  unsigned long image_end;	/* high-water mark: size of the output */
+
+  /* compiling expressions for references */
+  struct expr_code scratch_code;
+  unsigned long num_references;
+  /* reloc of the last value of eval_expr_code, in an object */
+  int expr_reloc;
+  /* number of relocatable values which were read as text */
+  unsigned long num_relocs;
+
+  /* references which wait for labels, by hash of the label name */
+  struct ref_wait *wait_table[WAIT_TABLE_SIZE];
+  /* references which are woken, but not tried yet */
+  struct reference *woken;
+  /* references which are tried by resolve_references */
+  struct reference **todo;
+  unsigned max_todo;
+
+  struct patterns *pattern_cache;
+  int num_pattern_lists;
+
+  struct listing *listing;
+  struct source_file *source_cache;
+  unsigned long run;		/* number of runs of this context */
+
+  /* incremental assembly, see incremental.c.  The records stay between
+   * runs, the rest is for one run.  */
+  struct include_record **records;	/* RECORD_TABLE_SIZE lists */
+  struct include_frame *frames;
+  unsigned num_frames, max_frames;
+  int max_sp;			/* deepest stack level in the innermost frame */
+  struct image_write *writes;
+  unsigned num_writes, max_writes;
+  struct label **new_labels;
+  unsigned num_new_labels, max_new_labels;
+  struct include_dep *deps;
+  unsigned num_deps, max_deps;
+  unsigned long num_messages;	/* diagnostics, printed or not */
+  unsigned long macro_generation;	/* changed whenever a macro is */
+  unsigned long num_incbins;
+  unsigned long num_unstable;	/* computations which depend on timing */
+  struct digest macro_digest;	/* valid if macro_digest_generation is */
+  unsigned long macro_digest_generation;
+
+  /* results for the library interface */
+  struct z80asm_diagnostic *diagnostics;
+  unsigned num_diagnostics, max_diagnostics;
+  struct z80asm_symbol *symbols;
+};
 
 /* print an error message, including current line and file */
-void printerr (int error, const char *fmt, ...);
+void printerr (struct z80asm *z, int error, const char *fmt, ...);
 
 /* skip over spaces in string */
 const char *delspc (const char *ptr);
 
-int rd_expr (const char **p, char delimiter, int *valid, int level,
-	     int print_errors);
-int rd_label (const char **p, int *exists, struct label **previous, int level,
+/* classes of characters, filled by the first z80asm_create() */
+#define CHAR_SPACE 1		/* isspace() */
+#define CHAR_WORD_END 2		/* ends the first word of a line */
+#define CHAR_LABEL 4		/* can be part of a label name */
+extern unsigned char char_class[256];
+#define IS_LABEL_CHAR(c) (char_class[(unsigned char) (c)] & CHAR_LABEL)
+
+int rd_expr (struct z80asm *z, const char **p, char delimiter, int *valid,
+	     int level, int print_errors);
+int rd_expr_code (struct z80asm *z, const char **p, char delimiter, int *valid,
+		  int level, int print_errors, struct expr_code *code);
+struct expr_code *copy_expr_code (const struct expr_code *code,
+				  const char *text, struct arena *arena);
+int eval_expr_code (struct z80asm *z, struct expr_code *code, int level,
+		    int *valid, int print_errors);
+void bind_local_labels (struct z80asm *z, struct expr_code *code, int level);
+int rd_label (struct z80asm *z, const char **p, int *exists, int level,
 	      int print_errors);
-int rd_character (const char **p, int *valid, int print_errors);
+int rd_character (struct z80asm *z, const char **p, int *valid,
+		  int print_errors);
 
-int compute_ref (struct reference *ref, int allow_invalid);
+int compute_ref (struct z80asm *z, struct reference *ref, int allow_invalid);
+void write_image (struct z80asm *z, const void *data, unsigned long size);
+int open_include_source (struct z80asm *z, const char *name,
+			 struct includedir **dir, struct source *src);
+
+/* items in a line of the listing */
+enum list_item_type
+{
+  LIST_BYTE,			/* " %02x" */
+  LIST_STRING,			/* " .." */
+  LIST_DS,			/* " 0x%02x..." */
+  LIST_DS0			/* " 00..." */
+};
+
+/* listing */
+struct listing *new_listing (void);
+void list_text (struct listing *l, const char *text);
+void list_line (struct listing *l, int address);
+void list_source (struct listing *l, const char *source);
+void list_item (struct listing *l, enum list_item_type type, int value);
+unsigned long list_tell (struct listing *l);
+void list_seek (struct listing *l, unsigned long pos);
+int write_listing (const struct listing *l, FILE * f);
+void free_listing (struct listing *l);
+
+/* resolving references */
+void wait_for_labels (struct z80asm *z, struct reference *ref,
+		      struct arena *arena);
+void wake_references (struct z80asm *z, unsigned hash);
+void forget_labels (struct z80asm *z, struct label_table *table);
+void resolve_references (struct z80asm *z);
+void forget_reference (struct z80asm *z, struct reference *ref);
+void restore_reference (struct z80asm *z, struct reference *ref,
+			struct arena *arena);
+
+/* source files */
+int open_source (struct z80asm *z, struct source *src, const char *name);
+int find_file (struct z80asm *z, const char *name, const char **data,
+	       unsigned long *size);
+int open_source_buffer (struct z80asm *z, struct source *src,
+			const char *name, const char *data, size_t size);
+int read_source_line (struct source *src, const char **line, size_t *len);
+void close_source (struct source *src);
+void free_sources (struct z80asm *z);
+void free_source_buffers (struct z80asm *z);
+const struct digest *source_digest (struct source_file *f);
+
+/* arenas */
+void *arena_alloc (struct arena *a, size_t size);
+char *arena_strdup (struct arena *a, const char *s);
+void arena_release (struct arena *a);
+void arena_free_all (struct arena *a);
+
+/* label tables */
+unsigned hash_label (const char *name, unsigned len);
+struct label *find_label (struct z80asm *z, struct label_table *table,
+			  const char *name, unsigned len, unsigned hash);
+int add_label (struct label_table *table, struct label *l);
+void remove_label (struct label_table *table, struct label *l);
+void free_labels (struct z80asm *z, struct label_table *table);
+void set_label (struct label *l, int valid, int value);
+void label_digest (const struct label *l, struct digest *d);
+struct label **sort_labels (struct label_table *table);
+
+/* incremental assembly */
+void digest_init (struct digest *d);
+void digest_add (struct digest *d, const void *data, size_t size);
+void digest_add_int (struct digest *d, unsigned long value);
+int begin_include (struct z80asm *z, char *name, int ifcount);
+void end_include (struct z80asm *z, int ifcount, int noifcount);
+void log_write (struct z80asm *z, unsigned long pos, unsigned long size);
+void log_label (struct z80asm *z, struct label *l);
+void finish_incremental (struct z80asm *z);
+void free_incremental_run (struct z80asm *z);
+void free_records (struct z80asm *z);
+void save_string (FILE * f, const char *s);
+int load_string (FILE * f, char **s);
+int load_newline (FILE * f);
+int valid_code (const struct expr_op *ops, unsigned num_ops,
+		const struct expr_slot *slots, unsigned num_slots,
+		const char *input);
+
+/* relocatable objects */
+int relocatable_ref (const struct reference *ref);
+void check_relocatable (struct z80asm *z, struct reference *ref);
+void load_object (struct z80asm *z, const char *name);
+
+/* statistics.  ENTER_PHASE starts timing phase, and returns the phase
+ * which was timed before, so it can be entered again at the end.  */
+#define PHASE_IDLE (-1)
+#define ENTER_PHASE(z, p) ((z)->timing ? enter_phase (z, p) : PHASE_IDLE)
+int enter_phase (struct z80asm *z, int phase);
+void start_stats (struct z80asm *z);
+
+/* trace points, see trace.c.  Without Z80ASM_TRACE they don't exist.  */
+enum trace_event
+{
+  TRACE_LINE, TRACE_MNEMONIC, TRACE_NUMBER, TRACE_CHARACTER,
+  TRACE_EXPRESSION, TRACE_DEFINE, TRACE_LOOKUP, TRACE_EQU, TRACE_IMMEDIATE,
+  TRACE_DEFER, TRACE_COMPUTE, TRACE_MACRO_LINE, TRACE_EXPAND, TRACE_BYTE,
+  TRACE_BYTES, TRACE_NUM_EVENTS
+};
+#ifdef Z80ASM_TRACE
+#define TRACE(z, category, event, a, b, text) \
+  ((z)->trace_categories & (category) \
+   ? trace_point (z, category, event, a, b, text) : (void) 0)
+#else
+/* nothing is evaluated, but the arguments count as used */
+#define TRACE(z, category, event, a, b, text) \
+  ((void) sizeof (trace_point (z, category, event, a, b, text), 0))
+#endif
+void trace_point (struct z80asm *z, int category, int event, int a, int b,
+		  const char *text);
+void start_trace (struct z80asm *z);
+void free_trace (struct z80asm *z);
 
 #endif